@@ -5,6 +5,9 @@
 #include <algorithm>
 #include <fstream>
 #include <filesystem>
+#include <limits>
+#include <atomic>
+#include <unordered_set>
 
 #include <xxhash.h>
 #include <lz4.h>
@@ -19,6 +22,9 @@ using json = nlohmann::json;
 #include "../../VFSLib/include/VFSArchive.h"
 #include "../../VFSLib/include/VFSFile.h"
 #include "../../VFSLib/include/VFSPack.h"
+#include "../../VFSLib/include/VFSPatch.h"
+#include "../../VFSLib/include/AccessTrace.h"
+#include "../../VFSLib/include/CompressionHelper.h"
 using namespace VFS;
 
 typedef struct _PATCH_CONTEXT
@@ -27,6 +33,51 @@ typedef struct _PATCH_CONTEXT
 	std::wstring to;
 } SPatchContext;
 
+typedef struct _COMPRESSION_PATTERN
+{
+	std::wstring		pattern;
+	SCompressionProfile	profile;
+} SCompressionPattern;
+
+enum ECompressionDecision
+{
+	COMPRESSION_DECISION_COMPRESS,
+	COMPRESSION_DECISION_STORE_LISTED,	// Matched the store list
+	COMPRESSION_DECISION_STORE_PROBED,	// Incompressibility probe said no
+	COMPRESSION_DECISION_MAX
+};
+
+typedef struct _DICTIONARY_CONFIG
+{
+	std::vector <std::wstring>	patterns;
+	uint32_t					size;			// Upper bound of the trained dictionary
+	uint32_t					maxfilesize;	// Only files up to this size use the dictionary
+} SDictionaryConfig;
+
+// Dictionaries only pay off when many small entries share content
+static const auto DEFAULT_DICTIONARY_MAX_FILE_SIZE = 64 * 1024;
+static const auto DICTIONARY_MIN_SAMPLES = 8;
+
+static const auto DEFAULT_SOLID_MAX_FILE_SIZE = 16 * 1024;
+static const auto DEFAULT_SOLID_GROUP_SIZE = 1024 * 1024;
+
+static const char* COMPRESSION_DECISION_NAMES[] = { "compressed", "stored(listed)", "stored(probed)" };
+
+// Already compressed formats, stored without trying when the config has no "store" list
+static const std::vector <std::wstring> DEFAULT_STORE_PATTERNS = {
+	L"*.jpg", L"*.jpeg", L"*.png", L"*.ogg", L"*.mp3", L"*.zip", L"*.7z", L"*.gz", L"*.rar", L"*.webp", L"*.bik", L"*.mp4"
+};
+static const auto DEFAULT_PROBE_RATIO = 0.95f;
+// Files below this size are always compressed, probing them costs more than it saves
+static const auto PROBE_MIN_SIZE = 4096;
+// Sources from this size on are streamed into the archive piece by piece instead of read at once
+static const uint64_t STREAM_MIN_SIZE = 256ull * 1024 * 1024;
+static const uint32_t STREAM_READ_SIZE = 4 * 1024 * 1024;
+// Files in flight per worker thread between the scan and the ordered writer
+static const auto PIPELINE_ITEMS_PER_THREAD = 2;
+// Bytes moved per compaction step, the archive lock is released between steps
+static const uint64_t COMPACT_STEP_SIZE = 64ull * 1024 * 1024;
+
 typedef struct _ARCHIVER_CONTEXT
 {
 	std::wstring				strArchiveName;
@@ -37,8 +88,56 @@ typedef struct _ARCHIVER_CONTEXT
 	int32_t						iVersion;
 	std::vector <std::wstring>	vIgnores;
 	std::vector <SPatchContext>	vPatches;
+	SCompressionProfile			stCompression;
+	std::vector <SCompressionPattern> vCompressionPatterns;
+	std::vector <std::wstring>	vStorePatterns;
+	std::vector <std::wstring>	vCompressPatterns;
+	float						fProbeRatio;
+	std::vector <SDictionaryConfig>	vDictionaries;
+	std::vector <std::wstring>	vSolidPatterns;
+	uint32_t					uSolidMaxFileSize;
+	uint32_t					uSolidGroupSize;
+	std::unordered_map <uint32_t, int32_t> mDecisions;
+	bool						bIncremental;
+	uint64_t					ullConfigHash;	// Pack settings the manifest was built with
 } SArchiveContext;
 
+// Source state of one packed entry, unchanged sources are not read again on incremental builds
+typedef struct _MANIFEST_ENTRY
+{
+	std::wstring	path;
+	uint64_t		size;
+	int64_t			mtime;
+	uint64_t		hash;	// xxh64 of the source content
+	int32_t			decision;
+} SManifestEntry;
+
+typedef std::unordered_map <std::wstring, SManifestEntry> TManifest;
+
+static const auto MANIFEST_VERSION = 1;
+
+// One file on its way through the pack pipeline: read -> code -> ordered write
+typedef struct _PACK_WORK_ITEM
+{
+	std::size_t					sequence;
+	std::filesystem::path		path;
+	std::wstring				name;
+	uint64_t					size;
+	bool						skip;
+	bool						failed;
+	bool						streamed;
+	bool						solid;
+	bool						unchanged;
+	int64_t						mtime;
+	uint64_t					contenthash;
+	ECompressionDecision		decision;
+	std::vector <uint8_t>		data;
+	const SCompressionProfile*	profile;
+	SCompressionProfile			storeprofile;
+	SCompressionProfile			dictionaryprofile;
+	SPreparedEntry				prepared;
+} SPackWorkItem;
+
 static inline bool FindAndReplaceString(std::wstring& str, const std::wstring& from, const std::wstring& to)
 {
 	size_t start_pos = str.find(from);
@@ -49,7 +148,88 @@ static inline bool FindAndReplaceString(std::wstring& str, const std::wstring& f
 	return true;
 }
 
-bool InitializeConfigFile(CVFSPack * vfs, const std::wstring & strConfigFile, std::vector <std::shared_ptr <SArchiveContext>> & packs)
+static bool ParseCompressionProfile(CVFSPack * vfs, const json & node, SCompressionProfile & profile)
+{
+	if (node.type() != json::value_t::object)
+	{
+		vfs->Log(1, "Unknown config context(element['compression'])");
+		return false;
+	}
+	if (node.count("level") != 0)
+	{
+		if (node["level"].type() != json::value_t::number_integer && node["level"].type() != json::value_t::number_unsigned)
+		{
+			vfs->Log(1, "Unknown config context(element['compression']['level'])");
+			return false;
+		}
+
+		auto level = node["level"].get<int32_t>();
+		if (level > LZ4HC_CLEVEL_MAX || level < -std::numeric_limits<int16_t>::max())
+		{
+			vfs->Log(1, "Unallowed compression level: %d", level);
+			return false;
+		}
+		profile.level = static_cast<int16_t>(level);
+	}
+	if (node.count("storeratio") != 0)
+	{
+		if (node["storeratio"].is_number() == false)
+		{
+			vfs->Log(1, "Unknown config context(element['compression']['storeratio'])");
+			return false;
+		}
+
+		profile.storeratio = node["storeratio"].get<float>();
+		if (profile.storeratio <= 0.0f)
+		{
+			vfs->Log(1, "Unallowed store ratio: %f", profile.storeratio);
+			return false;
+		}
+	}
+	if (node.count("chunksize") != 0)
+	{
+		if (node["chunksize"].type() != json::value_t::number_integer && node["chunksize"].type() != json::value_t::number_unsigned)
+		{
+			vfs->Log(1, "Unknown config context(element['compression']['chunksize'])");
+			return false;
+		}
+
+		// 0, the default, keeps every entry in one piece, DEFAULT_CHUNK_SIZE is a good size to turn it on with
+		auto chunksize = node["chunksize"].get<int64_t>();
+		if (chunksize < 0 || (chunksize != 0 && chunksize < 4096) || chunksize > std::numeric_limits<uint32_t>::max())
+		{
+			vfs->Log(1, "Unallowed chunk size: %lld", chunksize);
+			return false;
+		}
+		profile.chunksize = static_cast<uint32_t>(chunksize);
+	}
+	return true;
+}
+
+static bool ParsePatternList(CVFSPack * vfs, const json & node, const char* name, std::vector <std::wstring> & patterns)
+{
+	if (node.type() != json::value_t::array)
+	{
+		vfs->Log(1, "Unknown config context(element['compression']['%s'])", name);
+		return false;
+	}
+
+	patterns.clear();
+	for (const auto& pattern : node)
+	{
+		if (pattern.type() != json::value_t::string)
+		{
+			vfs->Log(1, "Unknown config context(element['compression']['%s'])", name);
+			return false;
+		}
+
+		auto curr = pattern.get<std::string>();
+		patterns.emplace_back(curr.begin(), curr.end());
+	}
+	return true;
+}
+
+bool InitializeConfigFile(CVFSPack * vfs, const std::wstring & strConfigFile, std::vector <std::shared_ptr <SArchiveContext>> & packs, bool bExisting = false)
 {
 	if (std::filesystem::exists(strConfigFile) == false)
 	{
@@ -120,6 +300,16 @@ bool InitializeConfigFile(CVFSPack * vfs, const std::wstring & strConfigFile, st
 				vfs->Log(1, "Unknown config context(element['patches'])");
 				return false;
 			}
+			if (group.count("compression") != 0 && group["compression"].type() != json::value_t::object)
+			{
+				vfs->Log(1, "Unknown config context(element['compression'])");
+				return false;
+			}
+			if (group.count("solid") != 0 && group["solid"].type() != json::value_t::object)
+			{
+				vfs->Log(1, "Unknown config context(element['solid'])");
+				return false;
+			}
 
 			auto ctx = std::make_shared<SArchiveContext>();
 			if (!ctx || !ctx.get())
@@ -130,7 +320,7 @@ bool InitializeConfigFile(CVFSPack * vfs, const std::wstring & strConfigFile, st
 
 			auto dir = group["dir"].get<std::string>();
 			ctx->stArchiveDirectory = std::wstring(dir.begin(), dir.end());
-			if (std::filesystem::exists(ctx->stArchiveDirectory) == false)
+			if (bExisting == false && std::filesystem::exists(ctx->stArchiveDirectory) == false)
 			{
 				vfs->Log(1, "Working directory: %ls is NOT exist", ctx->stArchiveDirectory.c_str());
 				return false;
@@ -141,11 +331,27 @@ bool InitializeConfigFile(CVFSPack * vfs, const std::wstring & strConfigFile, st
 
 			auto file = group["file"].get<std::string>();
 			ctx->strArchiveName = std::wstring(file.begin(), file.end());
-			if (std::filesystem::exists(ctx->strArchiveName))
+
+			if (group.count("incremental") != 0 && group["incremental"].type() != json::value_t::boolean)
+			{
+				vfs->Log(1, "Unknown config context(element['incremental'])");
+				return false;
+			}
+			// Any change of the pack settings invalidates the manifest
+			ctx->bIncremental = group.count("incremental") != 0 && group["incremental"].get<bool>();
+			auto settings = group.dump() + std::to_string(ARCHIVE_VERSION);
+			ctx->ullConfigHash = XXH64(settings.data(), settings.size(), 0);
+
+			if (bExisting == false && ctx->bIncremental == false && std::filesystem::exists(ctx->strArchiveName))
 			{
 				vfs->Log(1, "Target file: %ls is already exist", ctx->strArchiveName.c_str());
 				return false;
 			}
+			if (bExisting && std::filesystem::exists(ctx->strArchiveName) == false)
+			{
+				vfs->Log(1, "Target file: %ls is NOT exist", ctx->strArchiveName.c_str());
+				return false;
+			}
 
 #ifdef VFS_PRECOMPILED_LITE
 			std::copy(std::begin(LITE_CRYPT_KEY), std::end(LITE_CRYPT_KEY), std::begin(ctx->arArchiveKey));
@@ -201,6 +407,158 @@ bool InitializeConfigFile(CVFSPack * vfs, const std::wstring & strConfigFile, st
 				ctx->vPatches = patches;
 			}
 
+			ctx->stCompression = DEFAULT_COMPRESSION_PROFILE;
+			ctx->vStorePatterns = DEFAULT_STORE_PATTERNS;
+			ctx->fProbeRatio = DEFAULT_PROBE_RATIO;
+			if (group.count("compression") != 0)
+			{
+				const auto& compression = group["compression"];
+				if (ParseCompressionProfile(vfs, compression, ctx->stCompression) == false)
+					return false;
+
+				if (compression.count("store") != 0 && ParsePatternList(vfs, compression["store"], "store", ctx->vStorePatterns) == false)
+					return false;
+				if (compression.count("compress") != 0 && ParsePatternList(vfs, compression["compress"], "compress", ctx->vCompressPatterns) == false)
+					return false;
+
+				if (compression.count("probe") != 0)
+				{
+					if (compression["probe"].is_number() == false)
+					{
+						vfs->Log(1, "Unknown config context(element['compression']['probe'])");
+						return false;
+					}
+					// 0 disables the probe
+					ctx->fProbeRatio = compression["probe"].get<float>();
+				}
+
+				if (compression.count("dictionaries") != 0)
+				{
+					if (compression["dictionaries"].type() != json::value_t::array || compression["dictionaries"].size() > MAX_DICTIONARY_ID)
+					{
+						vfs->Log(1, "Unknown config context(element['compression']['dictionaries'])");
+						return false;
+					}
+
+					// Dictionary ids follow the config order, first match wins
+					for (const auto& dictionary : compression["dictionaries"])
+					{
+						if (dictionary.type() != json::value_t::object || dictionary.count("match") == 0)
+						{
+							vfs->Log(1, "Unknown config context(element['compression']['dictionaries']['match'])");
+							return false;
+						}
+
+						SDictionaryConfig item{};
+						if (ParsePatternList(vfs, dictionary["match"], "dictionaries", item.patterns) == false)
+							return false;
+
+						item.size = MAX_DICTIONARY_SIZE;
+						if (dictionary.count("size") != 0)
+						{
+							if (dictionary["size"].type() != json::value_t::number_unsigned && dictionary["size"].type() != json::value_t::number_integer)
+							{
+								vfs->Log(1, "Unknown config context(element['compression']['dictionaries']['size'])");
+								return false;
+							}
+
+							auto size = dictionary["size"].get<int64_t>();
+							if (size <= 0 || size > MAX_DICTIONARY_SIZE)
+							{
+								vfs->Log(1, "Unallowed dictionary size: %lld", size);
+								return false;
+							}
+							item.size = static_cast<uint32_t>(size);
+						}
+
+						item.maxfilesize = DEFAULT_DICTIONARY_MAX_FILE_SIZE;
+						if (dictionary.count("maxfilesize") != 0)
+						{
+							if (dictionary["maxfilesize"].type() != json::value_t::number_unsigned && dictionary["maxfilesize"].type() != json::value_t::number_integer)
+							{
+								vfs->Log(1, "Unknown config context(element['compression']['dictionaries']['maxfilesize'])");
+								return false;
+							}
+
+							auto maxfilesize = dictionary["maxfilesize"].get<int64_t>();
+							if (maxfilesize <= 0 || maxfilesize > std::numeric_limits<uint32_t>::max())
+							{
+								vfs->Log(1, "Unallowed dictionary max file size: %lld", maxfilesize);
+								return false;
+							}
+							item.maxfilesize = static_cast<uint32_t>(maxfilesize);
+						}
+
+						ctx->vDictionaries.push_back(item);
+					}
+				}
+
+				if (compression.count("patterns") != 0)
+				{
+					if (compression["patterns"].type() != json::value_t::array)
+					{
+						vfs->Log(1, "Unknown config context(element['compression']['patterns'])");
+						return false;
+					}
+
+					// First matching pattern wins, unset values fall back to the archive profile
+					for (const auto& pattern : compression["patterns"])
+					{
+						if (pattern.type() != json::value_t::object || pattern.count("match") == 0 || pattern["match"].type() != json::value_t::string)
+						{
+							vfs->Log(1, "Unknown config context(element['compression']['patterns']['match'])");
+							return false;
+						}
+
+						SCompressionPattern item{};
+						auto match = pattern["match"].get<std::string>();
+						item.pattern = std::wstring(match.begin(), match.end());
+						item.profile = ctx->stCompression;
+						if (ParseCompressionProfile(vfs, pattern, item.profile) == false)
+							return false;
+
+						ctx->vCompressionPatterns.push_back(item);
+					}
+				}
+			}
+
+			ctx->uSolidMaxFileSize = DEFAULT_SOLID_MAX_FILE_SIZE;
+			ctx->uSolidGroupSize = DEFAULT_SOLID_GROUP_SIZE;
+			if (group.count("solid") != 0)
+			{
+				const auto& solid = group["solid"];
+				if (solid.count("match") == 0 || ParsePatternList(vfs, solid["match"], "match", ctx->vSolidPatterns) == false)
+				{
+					vfs->Log(1, "Unknown config context(element['solid']['match'])");
+					return false;
+				}
+
+				if (solid.count("maxfilesize") != 0)
+				{
+					if (solid["maxfilesize"].type() != json::value_t::number_unsigned && solid["maxfilesize"].type() != json::value_t::number_integer)
+					{
+						vfs->Log(1, "Unknown config context(element['solid']['maxfilesize'])");
+						return false;
+					}
+					ctx->uSolidMaxFileSize = solid["maxfilesize"].get<uint32_t>();
+				}
+				if (solid.count("groupsize") != 0)
+				{
+					if (solid["groupsize"].type() != json::value_t::number_unsigned && solid["groupsize"].type() != json::value_t::number_integer)
+					{
+						vfs->Log(1, "Unknown config context(element['solid']['groupsize'])");
+						return false;
+					}
+					ctx->uSolidGroupSize = solid["groupsize"].get<uint32_t>();
+				}
+
+				if (ctx->uSolidGroupSize == 0 || ctx->uSolidGroupSize > MAX_SOLID_GROUP_SIZE || ctx->uSolidMaxFileSize > ctx->uSolidGroupSize)
+				{
+					vfs->Log(1, "Unallowed solid sizes: %u-%u", ctx->uSolidMaxFileSize, ctx->uSolidGroupSize);
+					return false;
+				}
+			}
+
 			vfs->Log(0, "%ls: %ls(%ls)", ctx->strArchiveName.c_str(), ctx->stArchiveDirectory.c_str(), ctx->strVisualDirectory.c_str());
 			packs.push_back(ctx);
 		}
@@ -228,6 +586,96 @@ bool InitializeConfigFile(CVFSPack * vfs, const std::wstring & strConfigFile, st
 	return true;
 }
 
+static bool LoadManifest(CVFSPack * vfs, const std::shared_ptr <SArchiveContext> & pack, TManifest & manifest)
+{
+	auto manifestfile = pack->strArchiveName + L".manifest";
+	if (std::filesystem::exists(manifestfile) == false)
+		return false;
+
+	try
+	{
+		std::ifstream is{ std::filesystem::path(manifestfile) };
+
+		json root;
+		is >> root;
+
+		if (root["version"].get<int32_t>() != MANIFEST_VERSION || root["config"].get<uint64_t>() != pack->ullConfigHash)
+		{
+			vfs->Log(0, "Manifest: %ls is outdated, full rebuild", manifestfile.c_str());
+			return false;
+		}
+
+		for (const auto& item : root["files"])
+		{
+			SManifestEntry entry{};
+			entry.path = std::filesystem::u8path(item["path"].get<std::string>()).wstring();
+			entry.size = item["size"].get<uint64_t>();
+			entry.mtime = item["mtime"].get<int64_t>();
+			entry.hash = item["hash"].get<uint64_t>();
+			entry.decision = item["decision"].get<int32_t>();
+
+			manifest.emplace(std::filesystem::u8path(item["name"].get<std::string>()).wstring(), entry);
+		}
+	}
+	catch (std::exception & e)
+	{
+		vfs->Log(1, "Manifest: %ls can NOT parsed: %s", manifestfile.c_str(), e.what());
+		manifest.clear();
+		return false;
+	}
+	return true;
+}
+
+static bool SaveManifest(CVFSPack * vfs, const std::shared_ptr <SArchiveContext> & pack, const TManifest & manifest)
+{
+	auto manifestfile = pack->strArchiveName + L".manifest";
+
+	json root;
+	root["version"] = MANIFEST_VERSION;
+	root["config"] = pack->ullConfigHash;
+	root["files"] = json::array();
+
+	// Sorted so the manifest diffs cleanly between builds
+	std::vector <TManifest::const_iterator> items;
+	for (auto it = manifest.begin(); it != manifest.end(); ++it)
+		items.push_back(it);
+	std::sort(items.begin(), items.end(), [](const TManifest::const_iterator& a, const TManifest::const_iterator& b) {
+		return a->first < b->first;
+	});
+
+	for (const auto& it : items)
+	{
+		json item;
+		item["name"] = std::filesystem::path(it->first).u8string();
+		item["path"] = std::filesystem::path(it->second.path).u8string();
+		item["size"] = it->second.size;
+		item["mtime"] = it->second.mtime;
+		item["hash"] = it->second.hash;
+		item["decision"] = it->second.decision;
+		root["files"].push_back(item);
+	}
+
+	// Written aside first, a broken build must not leave a half manifest behind
+	auto tempfile = manifestfile + L".tmp";
+	{
+		std::ofstream os(std::filesystem::path(tempfile), std::ofstream::out | std::ofstream::trunc);
+		if (!os)
+		{
+			vfs->Log(1, "Manifest: %ls can NOT created", tempfile.c_str());
+			return false;
+		}
+		os << root.dump(1, '\t');
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tempfile, manifestfile, ec);
+	if (ec)
+	{
+		vfs->Log(1, "Manifest: %ls can NOT replaced: %s", manifestfile.c_str(), ec.message().c_str());
+		return false;
+	}
+	return true;
+}
 
 bool ProcessArchiveFile(CVFSPack * vfs, const std::shared_ptr <SArchiveContext> & pack)
 {
@@ -240,7 +688,11 @@ bool ProcessArchiveFile(CVFSPack * vfs, const std::shared_ptr <SArchiveContext>
 		return false;
 	}
 
-	if (file->Create(pack->strArchiveName) == false)
+	// Incremental builds reopen the archive of the previous run, anything doubtful falls back to a full build
+	TManifest manifest;
+	auto incremental = pack->bIncremental && std::filesystem::exists(pack->strArchiveName) && LoadManifest(vfs, pack, manifest);
+
+	if (file->Create(pack->strArchiveName, incremental) == false)
 	{
 		vfs->Log(1, "File can NOT created");
 		return false;
@@ -255,19 +707,46 @@ bool ProcessArchiveFile(CVFSPack * vfs, const std::shared_ptr <SArchiveContext>
 
 	vfs->SetArchiveKey(pack->strArchiveName, pack->arArchiveKey.data());
 
+	if (incremental && archive->Load(file, pack->arArchiveKey.data()) == false)
+	{
+		vfs->Log(0, "Archive: %ls can NOT loaded, full rebuild", pack->strArchiveName.c_str());
+
+		incremental = false;
+		manifest.clear();
+		if (file->Create(pack->strArchiveName) == false)
+		{
+			vfs->Log(1, "File can NOT created");
+			return false;
+		}
+	}
+
 	if (archive->Create(file, pack->arArchiveKey.data()) == false)
 	{
 		vfs->Log(1, "Archive can NOT created");
 		return false;
 	}
+	archive->SetCompressionProfile(pack->stCompression);
 
 	auto workingdirectory = vfs->GetWorkingDirectory();
-	for (const auto& entry : std::filesystem::recursive_directory_iterator(pack->stArchiveDirectory))
+
+	if (pack->strVisualDirectory.length() && pack->strVisualDirectory[pack->strVisualDirectory.length() - 1] != L'\\' && pack->strVisualDirectory[pack->strVisualDirectory.length() - 1] != L'/')
 	{
+		for (size_t i = 0; i < pack->strVisualDirectory.length(); ++i)
+		{
+			if (pack->strVisualDirectory[i] == L'\\')
+			{
+				pack->strVisualDirectory[i] = L'/';
+			}
+		}
+	}
+
+	// Resolve the entry names first, the dictionary pass and the write pass both walk this list
+	tbb::concurrent_vector <std::pair <std::filesystem::path, std::wstring>> scanned;
+	auto resolveentry = [&](const std::filesystem::directory_entry& entry) {
 //		vfs->Log(0, "%ls", entry.path().c_str());
 
 		if (entry.is_directory())
-			continue;
+			return;
 
 		auto namewithoutpath = entry.path().wstring();
 		auto wstrdirectory = std::wstring(pack->stArchiveDirectory.begin(), pack->stArchiveDirectory.end());
@@ -286,17 +765,6 @@ bool ProcessArchiveFile(CVFSPack * vfs, const std::shared_ptr <SArchiveContext>
 
 		vfs->Log(0, "%ls", namewithoutpath.c_str());
 
-		if (pack->strVisualDirectory.length() && pack->strVisualDirectory[pack->strVisualDirectory.length() - 1] != L'\\' && pack->strVisualDirectory[pack->strVisualDirectory.length() - 1] != L'/')
-		{
-			for (size_t i = 0; i < pack->strVisualDirectory.length(); ++i)
-			{
-				if (pack->strVisualDirectory[i] == L'\\')
-				{
-					pack->strVisualDirectory[i] = L'/';
-				}
-			}
-		}
-
 		for (size_t i = 0; i < namewithoutpath.length(); ++i)
 		{
 			if (namewithoutpath[i] == L'\\')
@@ -305,58 +773,708 @@ bool ProcessArchiveFile(CVFSPack * vfs, const std::shared_ptr <SArchiveContext>
 			}
 		}
 
-		auto skipfile = false;
 		for (const auto & ignore : pack->vIgnores)
 		{
 			if (vfs->WildcardMatch(namewithoutpath.c_str(), ignore.c_str()))
 			{
-				skipfile = true;
-				break;
+				vfs->Log(0, "Content skipped: %ls", entry.path().c_str());
+				return;
+			}
+		}
+
+		vfs->Log(0, "'%ls'->'%ls'", pack->strVisualDirectory.c_str(), namewithoutpath.c_str());
+
+		if (pack->strVisualDirectory.empty() == false)
+			namewithoutpath = pack->strVisualDirectory + namewithoutpath;
+
+		scanned.emplace_back(entry.path(), namewithoutpath);
+	};
+
+	// Top level subdirectories are walked in parallel
+	std::vector <std::filesystem::directory_entry> roots;
+	for (const auto& entry : std::filesystem::directory_iterator(pack->stArchiveDirectory))
+	{
+		if (entry.is_directory())
+			roots.push_back(entry);
+		else
+			resolveentry(entry);
+	}
+	tbb::parallel_for_each(roots.begin(), roots.end(), [&](const std::filesystem::directory_entry& root) {
+		for (const auto& entry : std::filesystem::recursive_directory_iterator(root.path()))
+		{
+			resolveentry(entry);
+		}
+	});
+	std::vector <std::pair <std::filesystem::path, std::wstring>> entries(scanned.begin(), scanned.end());
+
+	// Keeps directories together, solid groups are filled in this order
+	std::sort(entries.begin(), entries.end(), [](const std::pair <std::filesystem::path, std::wstring>& a, const std::pair <std::filesystem::path, std::wstring>& b) {
+		return a.second < b.second;
+	});
+
+	// Entries gone from the source tree are dropped before anything new takes their space. The archive's own entry list is
+	// reconciled, not the manifest, which misses entries a run that failed before saving it left behind.
+	TManifest nextmanifest;
+	uint32_t unchangedcount = 0, writtencount = 0, removedcount = 0;
+	if (incremental)
+	{
+		std::unordered_set <uint32_t> indexes;
+		for (const auto& entry : entries)
+			indexes.insert(CVFSArchive::GenerateNameIndex(entry.second));
+
+		for (const auto& information : archive->EnumerateFiles())
+		{
+			if (indexes.count(information.index) != 0)
+				continue;
+
+			if (archive->Delete(information.index) == false)
+			{
+				vfs->Log(1, "Stale entry: %u can NOT deleted", information.index);
+				return false;
 			}
+			++removedcount;
 		}
-		if (skipfile)
+	}
+
+	auto issolid = [&](const std::wstring& name, uint64_t size) {
+		if (size > pack->uSolidMaxFileSize)
+			return false;
+
+		for (const auto& pattern : pack->vSolidPatterns)
 		{
-			vfs->Log(0, "Content skipped: %ls", entry.path().c_str());
-			continue;
+			if (vfs->WildcardMatch(name, pattern))
+				return true;
 		}
+		return false;
+	};
 
-		vfs->Log(0, "'%ls'->'%ls'", pack->strVisualDirectory.c_str(), namewithoutpath.c_str());
+	// Entries listed for a dictionary are only compressed against it when it could be trained
+	std::vector <bool> dictionaryready(pack->vDictionaries.size(), false);
+	auto finddictionary = [&](const std::wstring& name, uint64_t size) -> uint8_t {
+		for (size_t i = 0; i < pack->vDictionaries.size(); ++i)
+		{
+			const auto& dictionary = pack->vDictionaries[i];
+			if (size > dictionary.maxfilesize)
+				continue;
+
+			for (const auto& pattern : dictionary.patterns)
+			{
+				if (vfs->WildcardMatch(name, pattern))
+					return static_cast<uint8_t>(i + 1);
+			}
+		}
+		return 0;
+	};
+
+	if ((pack->iType & FLAG_COMPRESSED_LZ4) && !pack->vDictionaries.empty())
+	{
+		// Retraining would invalidate every unchanged entry coded against the old dictionary
+		for (size_t i = 0; incremental && i < dictionaryready.size(); ++i)
+		{
+			dictionaryready[i] = archive->HasDictionary(static_cast<uint8_t>(i + 1));
+		}
+
+		std::vector <CVFSDictionaryTrainer> trainers(pack->vDictionaries.size());
+		for (const auto& [path, name] : entries)
+		{
+			auto filesize = std::filesystem::file_size(path);
+			auto id = finddictionary(name, filesize);
+			if (id == 0 || dictionaryready[id - 1] || filesize == 0 || issolid(name, filesize))
+				continue;
+
+			CVFSFile sample;
+			if (sample.Open(path.wstring()) == false)
+				continue;
+
+			auto vSampleData = std::vector<uint8_t>(static_cast<uint32_t>(filesize));
+			if (sample.Read(&vSampleData[0], static_cast<uint32_t>(filesize)) == filesize)
+				trainers[id - 1].AddSample(vSampleData.data(), static_cast<uint32_t>(filesize));
+		}
+
+		for (size_t i = 0; i < trainers.size(); ++i)
+		{
+			auto id = static_cast<uint8_t>(i + 1);
+			if (dictionaryready[i])
+				continue;
+			if (trainers[i].GetSampleCount() < DICTIONARY_MIN_SAMPLES)
+			{
+				vfs->Log(0, "Dictionary: %u skipped, samples: %u", id, trainers[i].GetSampleCount());
+				continue;
+			}
+
+			auto dictionary = trainers[i].Train(pack->vDictionaries[i].size);
+			if (archive->SetDictionary(id, dictionary.data(), static_cast<uint32_t>(dictionary.size()), pack->iType) == false)
+			{
+				vfs->Log(1, "Dictionary: %u can NOT writed", id);
+				return false;
+			}
+
+			vfs->Log(0, "Dictionary: %u trained from %u samples, size: %u", id, trainers[i].GetSampleCount(), dictionary.size());
+			dictionaryready[i] = true;
+		}
+	}
+
+	std::vector <std::pair <std::wstring, std::vector <uint8_t>>> solidpending;
+	uint32_t solidpendingsize = 0;
+	auto flushsolid = [&]() {
+		if (solidpending.empty())
+			return true;
+
+		std::vector <SSolidInput> inputs;
+		inputs.reserve(solidpending.size());
+		for (const auto& [name, data] : solidpending)
+		{
+			inputs.push_back({ name, data.data(), static_cast<uint32_t>(data.size()) });
+		}
+
+		auto ret = archive->WriteSolid(inputs, pack->iType, pack->iVersion);
+		vfs->Log(0, "Solid group: %u files, %u bytes", solidpending.size(), solidpendingsize);
+
+		solidpending.clear();
+		solidpendingsize = 0;
+		return ret;
+	};
+
+	// Full builds lay the archive out as one sequential run, incremental ones reuse the space of replaced entries
+	if (incremental == false)
+	{
+		uint64_t expectedsize = 0;
+		for (const auto& entry : entries)
+		{
+			std::error_code ec;
+			auto size = std::filesystem::file_size(entry.first, ec);
+			if (!ec)
+				expectedsize += size;
+		}
+
+		if (archive->BeginBulk(expectedsize) == false)
+		{
+			vfs->Log(1, "Bulk build can NOT started");
+			return false;
+		}
+	}
+
+	typedef std::shared_ptr <SPackWorkItem> TPackWorkItem;
+
+	const auto inflight = std::max(4, tbb::task_scheduler_init::default_num_threads() * PIPELINE_ITEMS_PER_THREAD);
+	std::atomic <bool> failed(false);
+	std::size_t next = 0;
+
+	tbb::flow::graph graph;
+
+	tbb::flow::source_node <TPackWorkItem> scanner(graph, [&](TPackWorkItem& item) {
+		if (next >= entries.size() || failed)
+			return false;
+
+		item = std::make_shared<SPackWorkItem>();
+		item->sequence = next;
+		item->path = entries[next].first;
+		item->name = entries[next].second;
+		item->skip = false;
+		item->failed = false;
+		item->streamed = false;
+		item->solid = false;
+		item->unchanged = false;
+		item->mtime = 0;
+		item->contenthash = 0;
+		item->decision = COMPRESSION_DECISION_COMPRESS;
+		item->profile = nullptr;
+		++next;
+		return true;
+	}, false);
+
+	// Bounds the memory held by files read ahead of the writer
+	tbb::flow::limiter_node <TPackWorkItem> limiter(graph, inflight);
+
+	tbb::flow::function_node <TPackWorkItem, TPackWorkItem> reader(graph, tbb::flow::unlimited, [&](TPackWorkItem item) {
+		if (failed)
+			return item;
 
 		auto entryfile = std::make_unique<CVFSFile>();
 		if (!entryfile || !entryfile.get())
 		{
 			vfs->Log(1, "Entry file container can NOT allocated");
-			return false;
+			item->failed = true;
+			return item;
 		}
-		if (entryfile->Open(entry.path().wstring()) == false)
+		if (entryfile->Open(item->path.wstring()) == false)
 		{
 			vfs->Log(1, "Entry file can NOT opened");
-			return false;
+			item->failed = true;
+			return item;
 		}
-		auto entryfilesize = entryfile->GetSize();
-		if (entryfilesize == 0)
+		item->size = entryfile->GetSize();
+		if (item->size == 0)
 		{
 			vfs->Log(1, "Entry file is null");
-			continue;
+			item->skip = true;
+			return item;
 		}
 
-		auto vEntryData = std::vector<uint8_t>(static_cast<uint32_t>(entryfilesize));
-		if (entryfile->Read(&vEntryData[0], static_cast<uint32_t>(entryfilesize)) != entryfilesize)
+		std::error_code ec;
+		item->mtime = static_cast<int64_t>(std::filesystem::last_write_time(item->path, ec).time_since_epoch().count());
+
+		auto previous = incremental ? manifest.find(item->name) : manifest.end();
+		if (previous != manifest.end() && !archive->Exists(item->name))
+			previous = manifest.end();
+		if (previous != manifest.end() && previous->second.size == item->size && previous->second.mtime == item->mtime)
 		{
-			vfs->Log(1, "Entry file can NOT readed");
-			return false;
+			item->contenthash = previous->second.hash;
+			item->unchanged = true;
+			return item;
 		}
 
-		if (pack->strVisualDirectory.empty() == false)
-			namewithoutpath = pack->strVisualDirectory + namewithoutpath;
+		// Streamed sources are read piece by piece by the writer
+		item->streamed = item->size >= STREAM_MIN_SIZE;
+		if (!item->streamed)
+		{
+			item->data.resize(static_cast<uint32_t>(item->size));
+			if (entryfile->Read(&item->data[0], static_cast<uint32_t>(item->size)) != item->size)
+			{
+				vfs->Log(1, "Entry file can NOT readed");
+				item->failed = true;
+				return item;
+			}
+
+			// Touched but not modified
+			item->contenthash = XXH64(item->data.data(), item->data.size(), 0);
+			if (previous != manifest.end() && previous->second.size == item->size && previous->second.hash == item->contenthash)
+			{
+				item->unchanged = true;
+				item->data.clear();
+			}
+		}
+		return item;
+	});
+
+	tbb::flow::function_node <TPackWorkItem, TPackWorkItem> coder(graph, tbb::flow::unlimited, [&](TPackWorkItem item) {
+		if (failed || item->failed || item->skip || item->unchanged)
+			return item;
+
+		const auto& namewithoutpath = item->name;
+		const auto& vEntryData = item->data;
+		const auto streamed = item->streamed;
+
+		const SCompressionProfile* profile = nullptr;
+		for (const auto& pattern : pack->vCompressionPatterns)
+		{
+			if (vfs->WildcardMatch(namewithoutpath, pattern.pattern))
+			{
+				profile = &pattern.profile;
+				break;
+			}
+		}
+
+		// Decide about pointless compression before paying for the full pass
+		auto& storeprofile = item->storeprofile;
+		storeprofile = profile ? *profile : pack->stCompression;
+		storeprofile.level = 0;
+		storeprofile.dictionary = 0;
+		auto decision = COMPRESSION_DECISION_COMPRESS;
+		if ((pack->iType & FLAG_COMPRESSED_LZ4) && (!profile || profile->level != 0))
+		{
+			auto forcecompress = false;
+			for (const auto& pattern : pack->vCompressPatterns)
+			{
+				if (vfs->WildcardMatch(namewithoutpath, pattern))
+				{
+					forcecompress = true;
+					break;
+				}
+			}
+
+			if (!forcecompress)
+			{
+				for (const auto& pattern : pack->vStorePatterns)
+				{
+					if (vfs->WildcardMatch(namewithoutpath, pattern))
+					{
+						decision = COMPRESSION_DECISION_STORE_LISTED;
+						break;
+					}
+				}
+
+				if (decision == COMPRESSION_DECISION_COMPRESS && !streamed && pack->fProbeRatio > 0.0f && vEntryData.size() >= PROBE_MIN_SIZE)
+				{
+					auto ratio = CVFSCompressionPool::ThreadContext().EstimateRatio(reinterpret_cast<const char*>(vEntryData.data()), static_cast<uint32_t>(vEntryData.size()));
+					if (ratio > pack->fProbeRatio)
+					{
+						decision = COMPRESSION_DECISION_STORE_PROBED;
+					}
+				}
+			}
+
+			if (decision != COMPRESSION_DECISION_COMPRESS)
+			{
+				vfs->Log(0, "Content stored as raw (%s): %ls", COMPRESSION_DECISION_NAMES[decision], namewithoutpath.c_str());
+				profile = &storeprofile;
+			}
+		}
+		item->decision = decision;
+		item->profile = profile;
+
+		if (streamed)
+			return item;
+
+		if (decision == COMPRESSION_DECISION_COMPRESS && issolid(namewithoutpath, vEntryData.size()))
+		{
+			item->solid = true;
+			return item;
+		}
+
+		if (decision == COMPRESSION_DECISION_COMPRESS && (pack->iType & FLAG_COMPRESSED_LZ4))
+		{
+			auto id = finddictionary(namewithoutpath, vEntryData.size());
+			if (id != 0 && dictionaryready[id - 1])
+			{
+				item->dictionaryprofile = profile ? *profile : pack->stCompression;
+				item->dictionaryprofile.dictionary = id;
+				item->profile = &item->dictionaryprofile;
+			}
+		}
+
+		if (archive->Prepare(namewithoutpath, &vEntryData[0], static_cast<uint32_t>(vEntryData.size()), pack->iType, pack->iVersion, item->profile, item->prepared) == false)
+		{
+			vfs->Log(1, "Entry file can NOT coded");
+			item->failed = true;
+		}
+		return item;
+	});
+
+	// Restores the scan order so the archive layout does not depend on thread timing
+	tbb::flow::sequencer_node <TPackWorkItem> sequencer(graph, [](const TPackWorkItem& item) {
+		return item->sequence;
+	});
+
+	tbb::flow::function_node <TPackWorkItem, tbb::flow::continue_msg> writer(graph, tbb::flow::serial, [&](TPackWorkItem item) {
+		if (item->failed)
+			failed = true;
+		if (failed || item->skip)
+			return tbb::flow::continue_msg();
 
-		if (archive->Write(namewithoutpath, &vEntryData[0], vEntryData.size(), pack->iType, pack->iVersion) == false)
+		const auto& namewithoutpath = item->name;
+
+		if (item->unchanged)
+		{
+			auto& source = nextmanifest[namewithoutpath];
+			source = manifest.find(namewithoutpath)->second;
+			source.path = item->path.wstring();
+			source.mtime = item->mtime;
+			pack->mDecisions[archive->GenerateNameIndex(namewithoutpath)] = source.decision;
+			++unchangedcount;
+			return tbb::flow::continue_msg();
+		}
+
+		pack->mDecisions[archive->GenerateNameIndex(namewithoutpath)] = item->decision;
+		nextmanifest[namewithoutpath] = { item->path.wstring(), item->size, item->mtime, item->contenthash, item->decision };
+		++writtencount;
+
+		if (item->streamed)
+		{
+			auto entryfile = std::make_unique<CVFSFile>();
+			if (!entryfile || !entryfile.get() || entryfile->Open(item->path.wstring()) == false)
+			{
+				vfs->Log(1, "Entry file can NOT opened");
+				failed = true;
+				return tbb::flow::continue_msg();
+			}
+
+			auto stream = archive->BeginWrite(namewithoutpath, pack->iType, pack->iVersion, item->profile);
+			if (!stream)
+			{
+				vfs->Log(1, "Entry file stream can NOT started");
+				failed = true;
+				return tbb::flow::continue_msg();
+			}
+
+			auto hashstate = std::unique_ptr<XXH64_state_t, decltype(&XXH64_freeState)>(XXH64_createState(), &XXH64_freeState);
+			XXH64_reset(hashstate.get(), 0);
+
+			auto vReadBuffer = std::vector<uint8_t>(STREAM_READ_SIZE);
+			for (uint64_t position = 0; position < item->size;)
+			{
+				auto readsize = static_cast<uint32_t>(std::min<uint64_t>(STREAM_READ_SIZE, item->size - position));
+				if (entryfile->Read(&vReadBuffer[0], readsize) != readsize || stream->Append(&vReadBuffer[0], readsize) == false)
+				{
+					vfs->Log(1, "Entry file can NOT streamed");
+					failed = true;
+					return tbb::flow::continue_msg();
+				}
+				XXH64_update(hashstate.get(), &vReadBuffer[0], readsize);
+				position += readsize;
+			}
+			nextmanifest[namewithoutpath].hash = XXH64_digest(hashstate.get());
+
+			if (stream->Commit() == false)
+			{
+				vfs->Log(1, "Entry file can NOT writed");
+				failed = true;
+				return tbb::flow::continue_msg();
+			}
+			vfs->Log(0, "Entry file streamed: %ls (%llu bytes)", namewithoutpath.c_str(), item->size);
+			return tbb::flow::continue_msg();
+		}
+
+		if (item->solid)
+		{
+			if (solidpendingsize + item->data.size() > pack->uSolidGroupSize && flushsolid() == false)
+			{
+				vfs->Log(1, "Solid group can NOT writed");
+				failed = true;
+				return tbb::flow::continue_msg();
+			}
+
+			solidpendingsize += static_cast<uint32_t>(item->data.size());
+			solidpending.emplace_back(namewithoutpath, std::move(item->data));
+			return tbb::flow::continue_msg();
+		}
+
+		// A payload shared at coding time may have been replaced by an earlier write, the entry is coded again then
+		auto written = archive->WritePrepared(item->prepared);
+		if (written == false && item->prepared.info.owner)
+			written = archive->Write(namewithoutpath, item->data.data(), static_cast<uint32_t>(item->data.size()), pack->iType, pack->iVersion, item->profile);
+		if (written == false)
 		{
 			vfs->Log(1, "Entry file can NOT writed");
+			failed = true;
+		}
+		return tbb::flow::continue_msg();
+	});
+
+	tbb::flow::make_edge(scanner, limiter);
+	tbb::flow::make_edge(limiter, reader);
+	tbb::flow::make_edge(reader, coder);
+	tbb::flow::make_edge(coder, sequencer);
+	tbb::flow::make_edge(sequencer, writer);
+	tbb::flow::make_edge(writer, limiter.decrement);
+
+	scanner.activate();
+	graph.wait_for_all();
+
+	if (failed)
+	{
+		return false;
+	}
+
+	if (flushsolid() == false)
+	{
+		vfs->Log(1, "Solid group can NOT writed");
+		return false;
+	}
+
+	if (archive->EndBulk() == false)
+	{
+		vfs->Log(1, "Bulk build can NOT completed");
+		return false;
+	}
+
+	vfs->Log(0, "%ls %s build: written: %u unchanged: %u removed: %u", pack->strArchiveName.c_str(), incremental ? "incremental" : "full",
+		writtencount, unchangedcount, removedcount);
+
+	if (pack->bIncremental && SaveManifest(vfs, pack, nextmanifest) == false)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+static std::shared_ptr <CVFSArchive> LoadArchiveFile(CVFSPack * vfs, const std::wstring & strArchiveName, const std::array <uint8_t, 32> & key, bool bWriteable)
+{
+	auto file = std::make_shared<CVFSFile>();
+	if (!file || !file.get() || (bWriteable ? file->Create(strArchiveName, true) : file->Open(strArchiveName)) == false)
+	{
+		vfs->Log(1, "File: %ls can NOT opened", strArchiveName.c_str());
+		return nullptr;
+	}
+
+	auto archive = std::make_shared<CVFSArchive>();
+	if (!archive || !archive.get() || archive->Load(file, key.data()) == false)
+	{
+		vfs->Log(1, "Archive: %ls can NOT loaded", strArchiveName.c_str());
+		return nullptr;
+	}
+	return archive;
+}
+
+static bool CompactArchive(CVFSPack * vfs, const std::shared_ptr <SArchiveContext> & pack, std::shared_ptr <CVFSArchive> archive, const std::vector <uint32_t> & indexes)
+{
+	auto file = archive->GetFileStream();
+	auto before = file->GetSize();
+	if (archive->BeginCompact(indexes) == false)
+	{
+		vfs->Log(1, "Compaction can NOT started");
+		return false;
+	}
+
+	auto completed = false;
+	while (completed == false)
+	{
+		if (archive->CompactStep(COMPACT_STEP_SIZE, completed) == false)
+		{
+			vfs->Log(1, "Compaction can NOT completed");
+			return false;
+		}
+	}
+
+	vfs->Log(0, "%ls compacted: %llu->%llu", pack->strArchiveName.c_str(), before, file->GetSize());
+	return true;
+}
+
+// Without an order file the manifest names give the directory order, archives built without one keep their offset order
+bool CompactArchiveFile(CVFSPack * vfs, const std::shared_ptr <SArchiveContext> & pack, const std::vector <std::wstring> & order)
+{
+	vfs->Log(0, "Compact archive %ls", pack->strArchiveName.c_str());
+
+	auto archive = LoadArchiveFile(vfs, pack->strArchiveName, pack->arArchiveKey, true);
+	if (!archive)
+		return false;
+
+	auto names = order;
+	TManifest manifest;
+	if (names.empty() && LoadManifest(vfs, pack, manifest))
+	{
+		for (const auto& entry : manifest)
+		{
+			names.push_back(entry.first);
+		}
+		std::sort(names.begin(), names.end());
+	}
+
+	std::vector <uint32_t> indexes;
+	indexes.reserve(names.size());
+	for (const auto& name : names)
+	{
+		indexes.push_back(archive->GenerateNameIndex(name));
+	}
+
+	return CompactArchive(vfs, pack, archive, indexes);
+}
+
+static std::wstring GetTraceArchiveKey(const std::wstring & strArchiveName)
+{
+	auto name = std::filesystem::path(strArchiveName).filename().wstring();
+	std::transform(name.begin(), name.end(), name.begin(), ::towlower);
+	return name;
+}
+
+// Entries of each archive in the order the traces first touched them, archives are matched by file name.
+// Traces are taken in the given order, entries first seen in a later one follow those of the earlier ones.
+static bool LoadTraceFiles(CVFSPack * vfs, const std::vector <std::wstring> & traces, std::unordered_map <std::wstring, std::vector <uint32_t>> & orders)
+{
+	std::unordered_map <std::wstring, std::unordered_set <uint32_t>> seen;
+	for (const auto& trace : traces)
+	{
+		std::vector <std::wstring> archives;
+		std::vector <STraceAccess> accesses;
+		if (CVFSAccessTrace::Load(trace, archives, accesses) == false)
+		{
+			vfs->Log(1, "Trace file: %ls can NOT loaded", trace.c_str());
 			return false;
 		}
+
+		// Records of concurrent threads can land slightly out of time order
+		std::stable_sort(accesses.begin(), accesses.end(), [](const STraceAccess& lhs, const STraceAccess& rhs) {
+			return lhs.time < rhs.time;
+		});
+
+		for (const auto& access : accesses)
+		{
+			auto key = GetTraceArchiveKey(archives[access.archive]);
+			if (seen[key].insert(access.entry).second)
+				orders[key].push_back(access.entry);
+		}
+
+		vfs->Log(0, "Trace file: %ls archives: %u accesses: %u", trace.c_str(), archives.size(), accesses.size());
+	}
+	return true;
+}
+
+// First touched entries lead, the rest keep their offset order behind them
+bool ReorderArchiveFile(CVFSPack * vfs, const std::shared_ptr <SArchiveContext> & pack, const std::unordered_map <std::wstring, std::vector <uint32_t>> & orders)
+{
+	auto order = orders.find(GetTraceArchiveKey(pack->strArchiveName));
+	if (order == orders.end())
+	{
+		vfs->Log(0, "%ls is not in the traces, skipped", pack->strArchiveName.c_str());
+		return true;
+	}
+	vfs->Log(0, "Reorder archive %ls traced entries: %u", pack->strArchiveName.c_str(), order->second.size());
+
+	auto archive = LoadArchiveFile(vfs, pack->strArchiveName, pack->arArchiveKey, true);
+	if (!archive)
+		return false;
+
+	return CompactArchive(vfs, pack, archive, order->second);
+}
+
+// The old version of each archive is looked up by its file name in the given directory, the patch is written next to the new one
+bool DiffArchiveFile(CVFSPack * vfs, const std::shared_ptr <SArchiveContext> & pack, const std::wstring & strOldDirectory)
+{
+	auto oldname = (std::filesystem::path(strOldDirectory) / std::filesystem::path(pack->strArchiveName).filename()).wstring();
+	auto patchname = pack->strArchiveName + L".patch";
+	vfs->Log(0, "Diff archive %ls against %ls", pack->strArchiveName.c_str(), oldname.c_str());
+
+	auto from = LoadArchiveFile(vfs, oldname, pack->arArchiveKey, false);
+	auto to = LoadArchiveFile(vfs, pack->strArchiveName, pack->arArchiveKey, false);
+	if (!from || !to)
+		return false;
+
+	SPatchStatistics stats;
+	if (CVFSPatch::Create(from, to, patchname, &stats) == false)
+	{
+		vfs->Log(1, "Patch: %ls can NOT created", patchname.c_str());
+		return false;
 	}
 
+	vfs->Log(0, "%ls added: %u changed: %u removed: %u size: %llu", patchname.c_str(), stats.added, stats.changed, stats.removed, stats.size);
+	return true;
+}
+
+bool ApplyArchivePatch(CVFSPack * vfs, const std::shared_ptr <SArchiveContext> & pack)
+{
+	auto patchname = pack->strArchiveName + L".patch";
+	if (std::filesystem::exists(patchname) == false)
+	{
+		vfs->Log(0, "%ls has no patch", pack->strArchiveName.c_str());
+		return true;
+	}
+
+	auto archive = LoadArchiveFile(vfs, pack->strArchiveName, pack->arArchiveKey, true);
+	if (!archive)
+		return false;
+
+	SPatchStatistics stats;
+	if (CVFSPatch::Apply(archive, patchname, &stats) == false)
+	{
+		vfs->Log(1, "Patch: %ls can NOT applied", patchname.c_str());
+		return false;
+	}
+
+	vfs->Log(0, "%ls patched, added: %u changed: %u removed: %u", pack->strArchiveName.c_str(), stats.added, stats.changed, stats.removed);
+	return true;
+}
+
+static bool LoadOrderFile(CVFSPack * vfs, const std::wstring & strOrderFile, std::vector <std::wstring> & order)
+{
+	std::ifstream is{ std::filesystem::path(strOrderFile) };
+	if (!is)
+	{
+		vfs->Log(1, "Order file: %ls is not exist!", strOrderFile.c_str());
+		return false;
+	}
+
+	// One entry name per line, as the archive was given it
+	std::string line;
+	while (std::getline(is, line))
+	{
+		if (line.empty() == false && line.back() == '\r')
+			line.pop_back();
+		if (line.empty() == false)
+			order.push_back(std::filesystem::u8path(line).wstring());
+	}
+
+	vfs->Log(0, "Order file: %ls entries: %u", strOrderFile.c_str(), static_cast<uint32_t>(order.size()));
 	return true;
 }
 
@@ -393,17 +1511,90 @@ int main(int argc, wchar_t* argv[])
 	vfs->Log(0, "VFS Archiver started! Koray/(c)2019");
 	Sleep(2000);
 
+	// VFSArchiver [config.json] or VFSArchiver --compact [config.json] [orderfile]
+	// VFSArchiver --diff config.json olddir or VFSArchiver --apply [config.json]
+	// VFSArchiver --reorder config.json tracefile [tracefile ...]
+	auto compact = argc >= 2 && wcscmp(argv[1], L"--compact") == 0;
+	auto diff = argc >= 2 && wcscmp(argv[1], L"--diff") == 0;
+	auto apply = argc >= 2 && wcscmp(argv[1], L"--apply") == 0;
+	auto reorder = argc >= 2 && wcscmp(argv[1], L"--reorder") == 0;
+	auto argbase = compact || diff || apply || reorder ? 2 : 1;
+
 	auto configfile = L"config.json";
-	if (argc == 2)
-		configfile = argv[1];
+	if (argc > argbase)
+		configfile = argv[argbase];
 
 	auto packs = std::vector<std::shared_ptr<SArchiveContext>>();
 
-	if (InitializeConfigFile(vfs, configfile, packs) == false)
+	if (InitializeConfigFile(vfs, configfile, packs, compact || diff || apply || reorder) == false)
 	{
 		return EXIT_FAILURE;
 	}
 
+	if (reorder)
+	{
+		std::vector <std::wstring> traces;
+		for (auto i = argbase + 1; i < argc; ++i)
+		{
+			traces.push_back(argv[i]);
+		}
+
+		std::unordered_map <std::wstring, std::vector <uint32_t>> orders;
+		if (traces.empty() || LoadTraceFiles(vfs, traces, orders) == false)
+		{
+			vfs->Log(1, "Trace files can NOT loaded");
+			return EXIT_FAILURE;
+		}
+
+		std::atomic <bool> failed = false;
+		tbb::parallel_for_each(packs.begin(), packs.end(), [&](const std::shared_ptr <SArchiveContext>& pack) {
+			if (ReorderArchiveFile(vfs, pack, orders) == false)
+				failed = true;
+		});
+
+		vfs->Log(0, "VFS reorder %s!", failed ? "failed" : "completed");
+		vfs->FinalizeVFSPack();
+		return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (diff || apply)
+	{
+		if (diff && argc <= argbase + 1)
+		{
+			vfs->Log(1, "Old archive directory is not given");
+			return EXIT_FAILURE;
+		}
+
+		std::atomic <bool> failed = false;
+		tbb::parallel_for_each(packs.begin(), packs.end(), [&](const std::shared_ptr <SArchiveContext>& pack) {
+			if ((diff ? DiffArchiveFile(vfs, pack, argv[argbase + 1]) : ApplyArchivePatch(vfs, pack)) == false)
+				failed = true;
+		});
+
+		vfs->Log(0, "VFS %s %s!", diff ? "diff" : "patch", failed ? "failed" : "completed");
+		vfs->FinalizeVFSPack();
+		return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (compact)
+	{
+		std::vector <std::wstring> order;
+		if (argc > argbase + 1 && LoadOrderFile(vfs, argv[argbase + 1], order) == false)
+		{
+			return EXIT_FAILURE;
+		}
+
+		std::atomic <bool> failed = false;
+		tbb::parallel_for_each(packs.begin(), packs.end(), [&](const std::shared_ptr <SArchiveContext>& pack) {
+			if (CompactArchiveFile(vfs, pack, order) == false)
+				failed = true;
+		});
+
+		vfs->Log(0, "VFS compaction %s!", failed ? "failed" : "completed");
+		vfs->FinalizeVFSPack();
+		return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
 	// ------------------------------------------------------
 
 #ifdef VFS_PRECOMPILED_LITE
@@ -450,14 +1641,50 @@ int main(int argc, wchar_t* argv[])
 			vfs->Log(0, "files: %u", files.size());
 
 			std::wofstream f(pack->strArchiveName + L".log", std::ofstream::out | std::ofstream::app);
+
+			uint32_t counts[COMPRESSION_DECISION_MAX + 1] = { 0 };
+			uint32_t solidcount = 0, sharedcount = 0;
+			uint64_t rawbytes = 0, storedbytes = 0, savedbytes = 0;
 			for (const auto& file : files)
 			{
+				auto decision = COMPRESSION_DECISION_COMPRESS;
+				auto it = pack->mDecisions.find(file.index);
+				if (it != pack->mDecisions.end())
+					decision = static_cast<ECompressionDecision>(it->second);
+
+				// Compressed on request but the ratio check in Write fell back to raw
+				auto solid = (file.flags & FLAG_SOLID_MEMBER) != 0;
+				auto ratiofallback = !solid && decision == COMPRESSION_DECISION_COMPRESS && (pack->iType & FLAG_COMPRESSED_LZ4) && !(file.flags & FLAG_COMPRESSED_LZ4);
+				if (solid)
+					++solidcount;
+				else
+					++counts[ratiofallback ? COMPRESSION_DECISION_MAX : decision];
+				rawbytes += file.rawsize;
+				storedbytes += file.cryptedsize;
+
+				// Sharers point at the payload of an identical file, their stored size is not on disk a second time
+				if (file.owner)
+				{
+					++sharedcount;
+					savedbytes += file.cryptedsize;
+				}
+
                 char fileinfo[512];
-                sprintf_s(fileinfo, "%ls: %p", file.filename, (void*)file.hash);
+                sprintf_s(fileinfo, "%ls: %p level: %d dictionary: %u %s %llu->%llu%s", file.filename, (void*)file.hash, file.level, file.dictionary,
+					solid ? "solid" : ratiofallback ? "stored(ratio)" : COMPRESSION_DECISION_NAMES[decision], file.rawsize, file.cryptedsize, file.owner ? " shared" : "");
                 
 				f << fileinfo << std::endl;
 //				vfs->Log(0, "File: %s", fileinfo);
 			}
+
+			char summary[512];
+			// Solid members report their raw size, the archive size shows the real footprint
+			sprintf_s(summary, "Summary: compressed: %u stored(listed): %u stored(probed): %u stored(ratio): %u solid: %u shared: %u bytes: %llu->%llu saved: %llu archive: %llu",
+				counts[COMPRESSION_DECISION_COMPRESS], counts[COMPRESSION_DECISION_STORE_LISTED], counts[COMPRESSION_DECISION_STORE_PROBED],
+				counts[COMPRESSION_DECISION_MAX], solidcount, sharedcount, rawbytes, storedbytes, savedbytes, archive->GetFileStream()->GetSize());
+			f << summary << std::endl;
+			vfs->Log(0, "%ls %s", pack->strArchiveName.c_str(), summary);
+
 			f.close();
 		}
 	}
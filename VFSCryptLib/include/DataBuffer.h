@@ -24,23 +24,33 @@
 **  File Author(s):
 **
 **    Magnus Norddahl
+**
+**  Altered for VFSPro: the buffer owns its storage directly (no shared impl),
+**  is movable, does not zero on resize, is 64-byte aligned and can be backed
+**  by a thread-local size-class pool.
 */
 
 #pragma once
 
-#include <memory>
-
-class DataBuffer_Impl;
+#include <cstddef>
 
 /// \brief General purpose data buffer.
+///
+/// The buffer has value semantics: copies are deep, moves are free.
+/// Newly grown space is left uninitialised.
 class DataBuffer
 {
 public:
+	/// \brief Alignment of the buffer storage in bytes.
+	static const unsigned int alignment = 64;
+
 	/// \brief Constructs a data buffer of 0 size.
 	DataBuffer();
 	DataBuffer(unsigned int size);
 	DataBuffer(const void *data, unsigned int size);
 	DataBuffer(const DataBuffer &data, unsigned int pos, unsigned int size);
+	DataBuffer(const DataBuffer &copy);
+	DataBuffer(DataBuffer &&other) noexcept;
 	~DataBuffer();
 
 	/// \brief Returns a pointer to the data.
@@ -70,14 +80,36 @@ public:
 	bool is_null() const;
 
 	DataBuffer &operator =(const DataBuffer &copy);
+	DataBuffer &operator =(DataBuffer &&other) noexcept;
 
-	/// \brief Resize the buffer.
+	/// \brief Resize the buffer. New space is not initialised.
 	void set_size(unsigned int size);
 
 	/// \brief Preallocate enough memory.
 	void set_capacity(unsigned int capacity);
 
+	/// \brief Appends data to the end of the buffer, growing it geometrically.
+	void append(const void *data, unsigned int size);
+
+	/// \brief Releases the storage and sets the size to 0.
+	void clear();
+
+	void swap(DataBuffer &other) noexcept;
+
+	/// \brief Enables or disables the thread-local size-class pool for new allocations.
+	///
+	/// Buffers remember where their storage came from, so toggling is safe at any time.
+	static void set_pooling(bool enable);
+	static bool is_pooling();
+
+	/// \brief Frees every block cached by the calling thread's pool.
+	static void trim_pool();
+
 private:
-	std::shared_ptr<DataBuffer_Impl> impl;
-};
+	void reallocate(unsigned int capacity, unsigned int preserve);
 
+	char *data;
+	unsigned int size;
+	unsigned int allocated_size;
+	bool pooled;
+};
@@ -45,6 +45,9 @@ public:
 	/// You may call "set_capacity()" to optimise storage requirements before the add() call
 	DataBuffer get_data() const;
 
+	/// \brief Moves the decrypted data out, leaving the internal databuffer empty
+	DataBuffer take_data();
+
 	/// \brief Resets the decryption
 	void reset();
 
@@ -117,6 +120,9 @@ public:
 	/// You may call "set_capacity()" to optimise storage requirements before the add() call
 	DataBuffer get_data() const;
 
+	/// \brief Moves the decrypted data out, leaving the internal databuffer empty
+	DataBuffer take_data();
+
 	static const int iv_size = 16;
 	static const int key_size = 32;
 
@@ -24,136 +24,355 @@
 **  File Author(s):
 **
 **    Magnus Norddahl
+**
+**  Altered for VFSPro, see DataBuffer.h
 */
 
 #include "../include/DataBuffer.h"
 #include <string.h>
+#include <atomic>
+#include <new>
+#include <utility>
 
-class DataBuffer_Impl
+namespace
 {
-public:
-	DataBuffer_Impl() : data(nullptr), size(0), allocated_size(0)
+	// Size classes are powers of two from 64 bytes up to 1 MB, larger blocks bypass the pool
+	const unsigned int pool_min_shift = 6;
+	const unsigned int pool_max_shift = 20;
+	const unsigned int pool_num_classes = pool_max_shift - pool_min_shift + 1;
+	// Upper bound of memory one thread keeps cached per size class
+	const unsigned int pool_bytes_per_class = 4 * 1024 * 1024;
+	const unsigned int pool_max_blocks_per_class = 32;
+
+	std::atomic<bool> pooling_enabled(true);
+
+	char *allocate_aligned(unsigned int size)
+	{
+		return static_cast<char *>(::operator new(size, std::align_val_t(DataBuffer::alignment)));
+	}
+
+	void free_aligned(char *ptr)
+	{
+		::operator delete(ptr, std::align_val_t(DataBuffer::alignment));
+	}
+
+	unsigned int size_class(unsigned int size)
+	{
+		unsigned int cls = 0;
+		while ((1u << (cls + pool_min_shift)) < size)
+			++cls;
+		return cls;
+	}
+
+	class DataBufferPool
+	{
+	public:
+		DataBufferPool()
+		{
+			for (unsigned int i = 0; i < pool_num_classes; ++i)
+			{
+				heads[i] = nullptr;
+				counts[i] = 0;
+			}
+		}
+
+		~DataBufferPool();
+
+		char *acquire(unsigned int cls)
+		{
+			FreeBlock *block = heads[cls];
+			if (!block)
+				return allocate_aligned(1u << (cls + pool_min_shift));
+
+			heads[cls] = block->next;
+			--counts[cls];
+			return reinterpret_cast<char *>(block);
+		}
+
+		void release(char *ptr, unsigned int cls)
+		{
+			unsigned int block_size = 1u << (cls + pool_min_shift);
+			unsigned int limit = pool_bytes_per_class / block_size;
+			if (limit > pool_max_blocks_per_class)
+				limit = pool_max_blocks_per_class;
+			if (limit == 0)
+				limit = 1;
+
+			if (counts[cls] >= limit)
+			{
+				free_aligned(ptr);
+				return;
+			}
+
+			FreeBlock *block = reinterpret_cast<FreeBlock *>(ptr);
+			block->next = heads[cls];
+			heads[cls] = block;
+			++counts[cls];
+		}
+
+		void trim()
+		{
+			for (unsigned int i = 0; i < pool_num_classes; ++i)
+			{
+				while (heads[i])
+				{
+					FreeBlock *next = heads[i]->next;
+					free_aligned(reinterpret_cast<char *>(heads[i]));
+					heads[i] = next;
+				}
+				counts[i] = 0;
+			}
+		}
+
+	private:
+		struct FreeBlock
+		{
+			FreeBlock *next;
+		};
+
+		FreeBlock *heads[pool_num_classes];
+		unsigned int counts[pool_num_classes];
+	};
+
+	// Buffers living in other thread_local or static objects may be destroyed after the pool
+	thread_local bool pool_destroyed = false;
+
+	DataBufferPool::~DataBufferPool()
+	{
+		trim();
+		pool_destroyed = true;
+	}
+
+	DataBufferPool *get_pool()
 	{
+		if (pool_destroyed)
+			return nullptr;
+
+		thread_local DataBufferPool pool;
+		return &pool;
 	}
 
-	~DataBuffer_Impl()
+	char *allocate_block(unsigned int &capacity, bool &pooled)
 	{
-		delete[] data;
+		pooled = false;
+		if (pooling_enabled.load(std::memory_order_relaxed) && capacity <= (1u << pool_max_shift))
+		{
+			DataBufferPool *pool = get_pool();
+			if (pool)
+			{
+				unsigned int cls = size_class(capacity);
+				capacity = 1u << (cls + pool_min_shift);
+				pooled = true;
+				return pool->acquire(cls);
+			}
+		}
+		return allocate_aligned(capacity);
 	}
 
-public:
-	char *data;
-	unsigned int size;
-	unsigned int allocated_size;
-};
+	void free_block(char *ptr, unsigned int capacity, bool pooled)
+	{
+		if (!ptr)
+			return;
+
+		if (pooled)
+		{
+			DataBufferPool *pool = get_pool();
+			if (pool)
+			{
+				pool->release(ptr, size_class(capacity));
+				return;
+			}
+		}
+		free_aligned(ptr);
+	}
+}
 
 DataBuffer::DataBuffer()
-	: impl(std::make_shared<DataBuffer_Impl>())
+	: data(nullptr), size(0), allocated_size(0), pooled(false)
 {
 }
 
 DataBuffer::DataBuffer(unsigned int new_size)
-	: impl(std::make_shared<DataBuffer_Impl>())
+	: data(nullptr), size(0), allocated_size(0), pooled(false)
 {
 	set_size(new_size);
 }
 
 DataBuffer::DataBuffer(const void *new_data, unsigned int new_size)
-	: impl(std::make_shared<DataBuffer_Impl>())
+	: data(nullptr), size(0), allocated_size(0), pooled(false)
+{
+	set_size(new_size);
+	if (new_size)
+		memcpy(data, new_data, new_size);
+}
+
+DataBuffer::DataBuffer(const DataBuffer &new_data, unsigned int pos, unsigned int new_size)
+	: data(nullptr), size(0), allocated_size(0), pooled(false)
 {
 	set_size(new_size);
-	memcpy(impl->data, new_data, new_size);
+	if (new_size)
+		memcpy(data, new_data.get_data() + pos, new_size);
 }
 
-DataBuffer::DataBuffer(const DataBuffer &new_data, unsigned int pos, unsigned int size)
-	: impl(std::make_shared<DataBuffer_Impl>())
+DataBuffer::DataBuffer(const DataBuffer &copy)
+	: data(nullptr), size(0), allocated_size(0), pooled(false)
 {
-	set_size(size);
-	memcpy(impl->data, new_data.get_data() + pos, size);
+	set_size(copy.size);
+	if (copy.size)
+		memcpy(data, copy.data, copy.size);
+}
+
+DataBuffer::DataBuffer(DataBuffer &&other) noexcept
+	: data(other.data), size(other.size), allocated_size(other.allocated_size), pooled(other.pooled)
+{
+	other.data = nullptr;
+	other.size = 0;
+	other.allocated_size = 0;
+	other.pooled = false;
 }
 
 DataBuffer::~DataBuffer()
 {
+	free_block(data, allocated_size, pooled);
 }
 
 char *DataBuffer::get_data()
 {
-	return impl->data;
+	return data;
 }
 
 const char *DataBuffer::get_data() const
 {
-	return impl->data;
+	return data;
 }
 
 unsigned int DataBuffer::get_size() const
 {
-	return impl->size;
+	return size;
 }
 
 unsigned int DataBuffer::get_capacity() const
 {
-	return impl->allocated_size;
+	return allocated_size;
 }
 
 char &DataBuffer::operator[](int i)
 {
-	return impl->data[i];
+	return data[i];
 }
 
 const char &DataBuffer::operator[](int i) const
 {
-	return impl->data[i];
+	return data[i];
 }
 
 char &DataBuffer::operator[](unsigned int i)
 {
-	return impl->data[i];
+	return data[i];
 }
 
 const char &DataBuffer::operator[](unsigned int i) const
 {
-	return impl->data[i];
+	return data[i];
 }
 
 DataBuffer &DataBuffer::operator =(const DataBuffer &copy)
 {
-	impl = copy.impl;
+	if (this != &copy)
+	{
+		size = 0;
+		set_size(copy.size);
+		if (copy.size)
+			memcpy(data, copy.data, copy.size);
+	}
 	return *this;
 }
 
-void DataBuffer::set_size(unsigned int new_size)
+DataBuffer &DataBuffer::operator =(DataBuffer &&other) noexcept
 {
-	if (new_size > impl->allocated_size)
-	{
-		char *old_data = impl->data;
-		impl->data = new char[new_size];
-		memcpy(impl->data, old_data, impl->size);
-		delete[] old_data;
-		memset(impl->data + impl->size, 0, new_size - impl->size);
-		impl->size = new_size;
-		impl->allocated_size = new_size;
-	}
-	else
+	if (this != &other)
 	{
-		impl->size = new_size;
+		DataBuffer tmp(std::move(other));
+		swap(tmp);
 	}
+	return *this;
+}
+
+void DataBuffer::reallocate(unsigned int capacity, unsigned int preserve)
+{
+	bool new_pooled;
+	char *new_data = allocate_block(capacity, new_pooled);
+	if (preserve)
+		memcpy(new_data, data, preserve);
+
+	free_block(data, allocated_size, pooled);
+	data = new_data;
+	allocated_size = capacity;
+	pooled = new_pooled;
+}
+
+void DataBuffer::set_size(unsigned int new_size)
+{
+	if (new_size > allocated_size)
+		reallocate(new_size, size);
+	size = new_size;
 }
 
 void DataBuffer::set_capacity(unsigned int new_capacity)
 {
-	if (new_capacity > impl->allocated_size)
+	if (new_capacity > allocated_size)
+		reallocate(new_capacity, size);
+}
+
+void DataBuffer::append(const void *new_data, unsigned int new_size)
+{
+	if (new_size == 0)
+		return;
+
+	if (size + new_size > allocated_size)
 	{
-		char *old_data = impl->data;
-		impl->data = new char[new_capacity];
-		memcpy(impl->data, old_data, impl->size);
-		delete[] old_data;
-		memset(impl->data + impl->size, 0, new_capacity - impl->size);
-		impl->allocated_size = new_capacity;
+		unsigned int grown = allocated_size + allocated_size / 2;
+		reallocate(grown > size + new_size ? grown : size + new_size, size);
 	}
+	memcpy(data + size, new_data, new_size);
+	size += new_size;
+}
+
+void DataBuffer::clear()
+{
+	free_block(data, allocated_size, pooled);
+	data = nullptr;
+	size = 0;
+	allocated_size = 0;
+	pooled = false;
+}
+
+void DataBuffer::swap(DataBuffer &other) noexcept
+{
+	std::swap(data, other.data);
+	std::swap(size, other.size);
+	std::swap(allocated_size, other.allocated_size);
+	std::swap(pooled, other.pooled);
+}
+
+void DataBuffer::set_pooling(bool enable)
+{
+	pooling_enabled.store(enable, std::memory_order_relaxed);
+}
+
+bool DataBuffer::is_pooling()
+{
+	return pooling_enabled.load(std::memory_order_relaxed);
+}
+
+void DataBuffer::trim_pool()
+{
+	DataBufferPool *pool = get_pool();
+	if (pool)
+		pool->trim();
 }
 
 bool DataBuffer::is_null() const
 {
-	return impl->size == 0;
+	return size == 0;
 }
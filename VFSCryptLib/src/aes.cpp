@@ -163,7 +163,7 @@ void AES_Impl::store_block(uint32_t s0, uint32_t s1, uint32_t s2, uint32_t s3, D
 	int available = current_capacity - current_size;
 	if (available < aes128_block_size_bytes)	// Increase capacity required
 	{
-		databuffer.set_capacity(current_capacity + 1024);	// Increase in blocks of 1K
+		databuffer.set_capacity(current_capacity + current_capacity / 2 + 1024);	// Grow geometrically, at least 1K
 	}
 	databuffer.set_size(current_size + aes128_block_size_bytes);
 	unsigned char *dest_ptr = (unsigned char *)databuffer.get_data();
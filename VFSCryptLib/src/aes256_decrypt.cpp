@@ -36,6 +36,7 @@
 
 #include <exception>
 #include <algorithm>
+#include <utility>
 
 AES256_Decrypt_Impl::AES256_Decrypt_Impl() : initialisation_vector_set(false), cipher_key_set(false), padding_enabled(true), padding_pkcs7(true)
 {
@@ -47,6 +48,11 @@ DataBuffer AES256_Decrypt_Impl::get_data() const
 	return databuffer;
 }
 
+DataBuffer AES256_Decrypt_Impl::take_data()
+{
+	return std::move(databuffer);
+}
+
 void AES256_Decrypt_Impl::reset()
 {
 	calculated = false;
@@ -296,6 +302,11 @@ DataBuffer AES256_Decrypt::get_data() const
 	return impl->get_data();
 }
 
+DataBuffer AES256_Decrypt::take_data()
+{
+	return impl->take_data();
+}
+
 void AES256_Decrypt::reset()
 {
 	impl->reset();
@@ -36,6 +36,7 @@
 
 #include <exception>
 #include <algorithm>
+#include <utility>
 #include <vector>
 
 AES256_Encrypt_Impl::AES256_Encrypt_Impl() : initialisation_vector_set(false), cipher_key_set(false), padding_enabled(true), padding_pkcs7(true), padding_num_additional_padded_blocks(0)
@@ -48,6 +49,11 @@ DataBuffer AES256_Encrypt_Impl::get_data() const
 	return databuffer;
 }
 
+DataBuffer AES256_Encrypt_Impl::take_data()
+{
+	return std::move(databuffer);
+}
+
 void AES256_Encrypt_Impl::reset()
 {
 	calculated = false;
@@ -264,6 +270,11 @@ DataBuffer AES256_Encrypt::get_data() const
 	return impl->get_data();
 }
 
+DataBuffer AES256_Encrypt::take_data()
+{
+	return impl->take_data();
+}
+
 void AES256_Encrypt::reset()
 {
 	impl->reset();
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <unordered_map>
+
+#include "VFSFile.h"
+
+namespace VFS
+{
+	class CVFSArchive;
+
+	typedef struct _TRACE_ACCESS
+	{
+		uint16_t	archive;	// Position in the archive list of the trace
+		uint32_t	entry;		// Name index
+		uint32_t	thread;
+		uint64_t	time;		// Microseconds since the trace began
+	} STraceAccess;
+
+	// Records entry reads to a binary trace, CVFSArchive::BeginCompact lays entries out in the order a trace first touched them
+	class CVFSAccessTrace
+	{
+		public:
+			virtual ~CVFSAccessTrace() noexcept;
+			CVFSAccessTrace(const CVFSAccessTrace&) = delete;
+			CVFSAccessTrace(CVFSAccessTrace&&) noexcept = delete;
+			CVFSAccessTrace& operator=(const CVFSAccessTrace&) = delete;
+			CVFSAccessTrace& operator=(CVFSAccessTrace&&) noexcept = delete;
+
+		public:
+			CVFSAccessTrace();
+
+			bool Begin(const std::wstring& filename);
+			bool End();
+			bool IsActive() const;
+
+			void Record(const CVFSArchive* archive, uint32_t entry);
+
+			// Accesses come back in the order they were recorded
+			static bool Load(const std::wstring& filename, std::vector <std::wstring>& archives, std::vector <STraceAccess>& accesses);
+
+		private:
+			bool Flush();
+
+		private:
+			mutable std::mutex									m_traceMutex;
+			CVFSFile											m_file;
+			DataBuffer											m_buffer;
+			// By archive file name, an archive unloaded and another loaded at its address keep apart
+			std::unordered_map <std::wstring, uint16_t>			m_archives;
+			std::chrono::steady_clock::time_point				m_start;
+			std::atomic <bool>									m_active;
+	};
+}
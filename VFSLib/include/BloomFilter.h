@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace VFS
+{
+	// Name indexes a set may contain. All bits of a key sit in one 64 bit word, a check reads a single word.
+	class CVFSBloomFilter
+	{
+		public:
+			CVFSBloomFilter();
+
+			// Sized for about 1% false positives at the expected count
+			void Reset(std::size_t expected);
+			void Insert(uint32_t key);
+
+			// False only when the key was never inserted
+			bool MayContain(uint32_t key) const;
+
+		private:
+			static uint64_t Mix(uint32_t key);
+
+		private:
+			std::vector <uint64_t>	m_words;
+			uint64_t				m_mask;
+	};
+}
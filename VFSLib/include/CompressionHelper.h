@@ -0,0 +1,90 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+typedef union LZ4_stream_u LZ4_stream_t;
+typedef union LZ4_streamHC_u LZ4_streamHC_t;
+
+namespace VFS
+{
+	// Reusable LZ4 compression states, the HC state alone is ~256KB so it is never set up per call
+	class CVFSCompressionContext
+	{
+		public:
+			virtual ~CVFSCompressionContext() noexcept;
+			CVFSCompressionContext(const CVFSCompressionContext&) = delete;
+			CVFSCompressionContext(CVFSCompressionContext&&) noexcept = delete;
+			CVFSCompressionContext& operator=(const CVFSCompressionContext&) = delete;
+			CVFSCompressionContext& operator=(CVFSCompressionContext&&) noexcept = delete;
+
+		public:
+			CVFSCompressionContext();
+
+			int32_t CompressHC(const char* src, char* dst, int32_t srcsize, int32_t dstcapacity, int32_t level);
+			int32_t CompressFast(const char* src, char* dst, int32_t srcsize, int32_t dstcapacity, int32_t acceleration);
+
+			// Level > 0 is LZ4HC, < 0 LZ4 fast with acceleration -level, optionally against a dictionary
+			int32_t Compress(const char* src, char* dst, int32_t srcsize, int32_t dstcapacity, int32_t level, const char* dict = nullptr, uint32_t dictsize = 0);
+
+			// Cheap estimate of compressed/raw size from a byte histogram and fast LZ4 passes over a few samples
+			double EstimateRatio(const char* src, uint32_t srcsize);
+
+			// Bounds checked, returns the decompressed size or a negative value on malformed input
+			static int32_t Decompress(const char* src, char* dst, int32_t srcsize, int32_t dstcapacity, const char* dict = nullptr, uint32_t dictsize = 0);
+
+		private:
+			LZ4_streamHC_t*	m_hcState;
+			LZ4_stream_t*	m_fastState;
+			std::vector <char>	m_probeBuffer;
+	};
+
+	// Builds a shared LZ4 dictionary from sample content (simplified COVER: picks the segments whose
+	// 8 byte sequences occur in the most samples), best segments last where LZ4 offsets are cheapest
+	class CVFSDictionaryTrainer
+	{
+		public:
+			static const uint32_t MAX_DICTIONARY_SIZE = 64 * 1024;
+
+		public:
+			explicit CVFSDictionaryTrainer(uint32_t samplebudget = 8 * 1024 * 1024);
+
+			// Copies the sample, returns false once the sample budget is exhausted
+			bool AddSample(const void* data, uint32_t size);
+			uint32_t GetSampleCount() const;
+
+			std::vector <uint8_t> Train(uint32_t dictsize = MAX_DICTIONARY_SIZE) const;
+
+		private:
+			uint32_t				m_sampleBudget;
+			std::vector <uint8_t>	m_samples;
+			std::vector <uint32_t>	m_sampleSizes;
+	};
+
+	class CVFSCompressionPool
+	{
+		public:
+			virtual ~CVFSCompressionPool() noexcept = default;
+			CVFSCompressionPool(const CVFSCompressionPool&) = delete;
+			CVFSCompressionPool(CVFSCompressionPool&&) noexcept = delete;
+			CVFSCompressionPool& operator=(const CVFSCompressionPool&) = delete;
+			CVFSCompressionPool& operator=(CVFSCompressionPool&&) noexcept = delete;
+
+		public:
+			CVFSCompressionPool() = default;
+
+			static CVFSCompressionPool& Instance();
+
+			// Context cached for the calling thread, handed back to the pool when the thread exits
+			static CVFSCompressionContext& ThreadContext();
+
+			std::unique_ptr <CVFSCompressionContext> Acquire();
+			void Release(std::unique_ptr <CVFSCompressionContext> context);
+			void Trim();
+
+		private:
+			std::mutex												m_poolMutex;
+			std::vector <std::unique_ptr <CVFSCompressionContext> >	m_contexts;
+	};
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <set>
+
+namespace VFS
+{
+	typedef struct _FREE_EXTENT
+	{
+		uint64_t	start;	// File offset of the entry header opening the extent
+		uint32_t	blocks;
+	} SFreeExtent;
+
+	// Free blocks of an archive. Extents are kept by offset to merge neighbours and by block count for best fit.
+	class CVFSFreeSpace
+	{
+		public:
+			CVFSFreeSpace();
+
+			void Reset(uint32_t bytesPerBlock);
+
+			// Adds the extent merged with its free neighbours, returns the merged extent
+			SFreeExtent Release(uint64_t start, uint32_t blocks);
+			// Takes the smallest extent of at least blocks, a larger one is split and its tail stays free as remainder
+			bool Allocate(uint32_t blocks, SFreeExtent& output, SFreeExtent& remainder);
+
+			std::size_t GetCount() const;
+			uint64_t GetFreeBlocks() const;
+
+		private:
+			void Insert(uint64_t start, uint32_t blocks);
+			void Erase(std::map <uint64_t, uint32_t>::iterator it);
+
+		private:
+			uint32_t									m_bytesPerBlock;
+			std::map <uint64_t, uint32_t>				m_byOffset;
+			std::set <std::pair <uint32_t, uint64_t>>	m_bySize;
+			uint64_t									m_freeBlocks;
+	};
+}
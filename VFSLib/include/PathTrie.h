@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace VFS
+{
+	// Path prefixes to the values registered for them, case and separator insensitive like archive names
+	class CVFSPathTrie
+	{
+		public:
+			CVFSPathTrie();
+
+			void Insert(const std::wstring& prefix, const std::wstring& value);
+			void Erase(const std::wstring& value);
+			void Clear();
+
+			// Values of the longest prefix of the path, in insertion order, nullptr when no prefix matches
+			const std::vector <std::wstring>* Find(const std::wstring& path) const;
+
+		private:
+			struct SNode
+			{
+				std::vector <std::pair <wchar_t, uint32_t>>	children;	// Sorted by character
+				std::vector <std::wstring>					values;
+			};
+
+			uint32_t FindChild(uint32_t node, wchar_t c) const;
+
+		private:
+			std::vector <SNode> m_nodes;
+	};
+}
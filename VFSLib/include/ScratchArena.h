@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace VFS
+{
+	// Per-thread bump allocator for the temporaries of a single archive operation.
+	// Memory handed out is uninitialised and only valid until the enclosing CVFSScratchScope ends.
+	class CVFSScratchArena
+	{
+		public:
+			struct SMarker
+			{
+				std::size_t chunk;
+				std::size_t used;
+			};
+
+		public:
+			virtual ~CVFSScratchArena() noexcept;
+			CVFSScratchArena(const CVFSScratchArena&) = delete;
+			CVFSScratchArena(CVFSScratchArena&&) noexcept = delete;
+			CVFSScratchArena& operator=(const CVFSScratchArena&) = delete;
+			CVFSScratchArena& operator=(CVFSScratchArena&&) noexcept = delete;
+
+		public:
+			CVFSScratchArena();
+
+			static CVFSScratchArena& ThreadInstance();
+
+			void* Allocate(std::size_t size, std::size_t alignment = 64);
+			template <typename T>
+			T* AllocateArray(std::size_t count) { return static_cast<T*>(Allocate(count * sizeof(T), alignof(T) > 64 ? alignof(T) : 64)); }
+
+			SMarker GetMarker() const;
+			void Rewind(const SMarker& marker);
+			void Reset();
+
+			std::size_t GetReservedSize() const;
+
+		private:
+			struct SChunk
+			{
+				uint8_t*	data;
+				std::size_t	size;
+				std::size_t	used;
+			};
+
+			std::vector <SChunk>	m_chunks;
+			std::size_t				m_current;
+			uint32_t				m_depth;
+
+			friend class CVFSScratchScope;
+	};
+
+	// Rewinds the thread arena on scope exit, the outermost scope also compacts it
+	class CVFSScratchScope
+	{
+		public:
+			CVFSScratchScope();
+			~CVFSScratchScope();
+			CVFSScratchScope(const CVFSScratchScope&) = delete;
+			CVFSScratchScope& operator=(const CVFSScratchScope&) = delete;
+
+			CVFSScratchArena& Arena() const { return m_arena; }
+
+		private:
+			CVFSScratchArena&			m_arena;
+			CVFSScratchArena::SMarker	m_marker;
+	};
+}
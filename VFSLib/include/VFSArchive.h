@@ -4,6 +4,7 @@
 #include <string>
 #include <mutex>
 #include <vector>
+#include <atomic>
 
 namespace VFS
 {
@@ -13,6 +14,13 @@ namespace VFS
 		FLAG_COMPRESSED_LZ4 = 1, // Compressed with lz4
 		FLAG_CRYPTED_AES256 = 2, // Crypted with AES256
 		FLAG_MAX = 4,
+
+		// Internal entry flags, not valid as archive types
+		FLAG_STREAMED = 0x08, // Written by CVFSArchiveWriter, coded segments of one LZ4 frame
+		FLAG_CHUNKED = 0x10, // Split into independently coded chunks
+		FLAG_SOLID_GROUP = 0x20, // Decoded blob of a solid group
+		FLAG_SOLID_INDEX = 0x40, // Member table of a solid group
+		FLAG_SOLID_MEMBER = 0x80, // Entry stored inside a solid group
 	};
 
 	#pragma pack(push, 1)
@@ -22,13 +30,93 @@ namespace VFS
 		uint32_t hash;
 		uint32_t version;
 		uint8_t flags;
-		uint32_t rawsize;
-		uint32_t compressedsize;
-		uint32_t cryptedsize;
+		uint64_t rawsize;
+		uint64_t compressedsize;
+		uint64_t cryptedsize;
+		int16_t level; // Compression level used, see SCompressionProfile
+		uint8_t dictionary; // Id of the archive dictionary compressed against, 0 if none
+		uint64_t contenthash; // xxh64 of the raw content, 0 if not known
+		uint32_t owner; // Index of the entry whose payload this one shares, 0 if it holds its own
 		wchar_t filename[255];
 	} SFileInformation;
 	#pragma pack(pop)
 
+	// Entry header leading every ReadRawData / WriteRawData blob, the coded payload follows it
+	static const uint32_t RAW_ENTRY_HEADER_SIZE = sizeof(SFileInformation) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t);
+
+	typedef struct _COMPRESSION_PROFILE
+	{
+		int16_t level;		// > 0: LZ4HC level, < 0: LZ4 fast with acceleration -level, 0: store
+		float storeratio;	// Store as raw when compressed/raw size is above this ratio
+		uint8_t dictionary;	// Archive dictionary id to compress against, 0: none
+		uint32_t chunksize;	// Coded entries of at least CHUNKED_MIN_CHUNKS chunks are split, 0: never
+	} SCompressionProfile;
+
+	// Chunking changes how large entries are laid out on disk, it is opt in through chunksize, this is the size to pick
+	static const uint32_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+	static const uint32_t CHUNKED_MIN_CHUNKS = 4;
+
+	static const SCompressionProfile DEFAULT_COMPRESSION_PROFILE = { 12 /* LZ4HC_CLEVEL_MAX */, 1.0f, 0, 0 };
+
+	// Dictionaries are stored as reserved entries of the archive itself, ids are 1..MAX_DICTIONARY_ID
+	static const uint8_t MAX_DICTIONARY_ID = 16;
+	static const uint32_t MAX_DICTIONARY_SIZE = 64 * 1024;
+
+	typedef struct _SOLID_INPUT
+	{
+		std::wstring	filename;
+		const void*		data;
+		uint32_t		length;
+	} SSolidInput;
+
+	static const uint32_t MAX_SOLID_GROUP_SIZE = 16 * 1024 * 1024;
+
+	// Coded but not yet placed entry, see CVFSArchive::Prepare.
+	// Content the archive already holds under another name is not coded, info.owner names that entry and the payload stays empty.
+	typedef struct _PREPARED_ENTRY
+	{
+		std::wstring		filename;
+		SFileInformation	info;
+		bool				unchanged;	// Same content already in the archive, nothing to write
+		DataBuffer			buffer;		// Owns the payload when it was coded
+		const char*			data;		// Payload, points into the source when stored as raw
+		uint32_t			size;
+	} SPreparedEntry;
+
+	class CVFSArchive;
+
+	// Streams one entry of unbounded size into the archive, see CVFSArchive::BeginWrite.
+	// The archive stays locked for the thread that began the write until Commit or Abort.
+	class CVFSArchiveWriter
+	{
+		friend class CVFSArchive;
+
+		public:
+			virtual ~CVFSArchiveWriter() noexcept;
+			CVFSArchiveWriter(const CVFSArchiveWriter&) = delete;
+			CVFSArchiveWriter(CVFSArchiveWriter&&) noexcept = delete;
+			CVFSArchiveWriter& operator=(const CVFSArchiveWriter&) = delete;
+			CVFSArchiveWriter& operator=(CVFSArchiveWriter&&) noexcept = delete;
+
+		public:
+			bool Append(const void* data, uint32_t size);
+			bool Commit();
+			void Abort();
+
+			uint64_t GetRawSize() const;
+
+		private:
+			CVFSArchiveWriter(std::shared_ptr <CVFSArchive> archive, void* state);
+
+			bool IsOwner();
+			bool Flush();
+			void Release();
+
+		private:
+			std::shared_ptr <CVFSArchive> m_archive;
+			void* m_writeState;
+	};
+
 	class CVFSArchive : public std::enable_shared_from_this <CVFSArchive>
 	{
 		typedef bool (__stdcall* TEnumFiles)(std::shared_ptr <CVFSFile> pcPack, const SFileInformation& pcFileInformations, void* pvUserContext);
@@ -43,22 +131,67 @@ namespace VFS
 		public:
 			CVFSArchive();
 			
+			// Replaces every entry of to with those of from. The copy is built next to the archive file of to and renamed over it,
+			// one that fails leaves to as it was. On Windows the rename fails while streams opened from to are still open.
 			static bool CopyArchive(std::shared_ptr <CVFSArchive> from, std::shared_ptr <CVFSArchive> to);
 		 
 			bool Create(std::shared_ptr <CVFSFile> file, const uint8_t* key);
 			bool Load(std::shared_ptr <CVFSFile> file, const uint8_t* key);
+			// Loads the archive file again, for changes made to entries the archive keeps tables of (dictionaries, solid groups)
+			bool Reload();
 			void Unload();
+			// Reads only the header of an archive file, for archives mounted on first use.
+			// startup is set when a startup set was saved next to it, names to the name table saved next to it, empty when
+			// there is none or the archive changed since.
+			static bool Probe(const std::wstring& filename, bool* startup = nullptr, std::vector <uint32_t>* names = nullptr);
+			// Saves the name indexes of the entries next to the archive, for Probe to hand out without loading it.
+			// Unload saves it for an archive written to since it was loaded.
+			bool SaveNameTable() const;
 
 			std::shared_ptr <CVFSFile> Open(uint32_t index, const std::wstring& filename = L"") const;
 			std::shared_ptr <CVFSFile> Open(const std::wstring& filename) const;
-			bool Write(const std::wstring& filename, const void* data, uint32_t length, uint8_t flags = FLAG_RAW_DATA, uint32_t version = 0);
+			bool Write(const std::wstring& filename, const void* data, uint32_t length, uint8_t flags = FLAG_RAW_DATA, uint32_t version = 0, const SCompressionProfile* profile = nullptr);
+			// Write split in two: Prepare codes without holding the archive and may run on many threads at once,
+			// WritePrepared places the result. A raw payload points into the source data, keep it alive until then.
+			bool Prepare(const std::wstring& filename, const void* data, uint32_t length, uint8_t flags, uint32_t version, const SCompressionProfile* profile, SPreparedEntry& output) const;
+			// Entries of identical content share one payload, Delete hands it to a remaining sharer
+			bool WritePrepared(const SPreparedEntry& entry);
+			// Bulk builds append every entry in call order through one large write buffer, free space is not reused meanwhile
+			bool BeginBulk(uint64_t expectedsize = 0);
+			bool EndBulk();
+			// Writes and deletes up to Commit are staged in memory, reads see the committed entries meanwhile.
+			// Commit appends the staged entries as one run and frees the replaced ones through a journal next to the archive,
+			// an archive closed before Commit, or before the journal is complete, loads as it was.
+			bool BeginBatch();
+			bool Commit();
+			void AbortBatch();
+			// Entries written piece by piece, Write keeps working on whole buffers
+			std::shared_ptr <CVFSArchiveWriter> BeginWrite(const std::wstring& filename, uint8_t flags = FLAG_RAW_DATA, uint32_t version = 0, const SCompressionProfile* profile = nullptr);
+			// Packs the files into one solid group, compressed and crypted as a single unit
+			bool WriteSolid(const std::vector <SSolidInput>& files, uint8_t flags = FLAG_RAW_DATA, uint32_t version = 0, const SCompressionProfile* profile = nullptr);
 			bool Delete(uint32_t index);
 			bool Delete(const std::wstring& filename);				
 
 			uint32_t ReadRawData(uint32_t index, void* buffer, uint32_t maxlength) const;
 			bool WriteRawData(const void* buffer, uint32_t length);			
+			// Entries opened in the given seconds are recorded as the startup set of the archive, opening them writes nothing.
+			// SaveStartupSet ends the recording and saves them next to the archive, Unload saves what was recorded so far.
+			void RecordStartupSet(uint32_t seconds);
+			bool SaveStartupSet();
+			std::vector <uint32_t> LoadStartupSet() const;
+			// File ranges holding the entries, in file order with neighbours closer than gap bytes merged
+			std::vector <std::pair <uint64_t, uint64_t>> GetEntryRanges(const std::vector <uint32_t>& indexes, uint64_t gap = 0) const;
+
+			// Every entry ReadRawData hands out, the reserved ones included
+			std::vector <SFileInformation> EnumerateRawEntries() const;
+			// Copies entries of another archive over as they are stored, nothing is decoded or coded again, so both need the same key.
+			// No indexes copies every entry, a solid member brings its whole group and an entry its dictionary along.
+			// Entries of the same index are replaced, rejected inside a batch. Solid groups and dictionaries whose number the
+			// target already uses for another one are renumbered, it fails only when no dictionary id is left.
+			bool Merge(std::shared_ptr <CVFSArchive> from, const std::vector <uint32_t>& indexes = {});
 			
-			uint32_t GenerateNameIndex(std::wstring filename) const;
+			// Case and separator insensitive, the same name gives the same index in every archive
+			static uint32_t GenerateNameIndex(std::wstring filename);
 
 			bool Exists(uint32_t index) const;
 			bool Exists(const std::wstring& filename) const;
@@ -67,11 +200,45 @@ namespace VFS
 			std::vector <SFileInformation> EnumerateFiles() const;
 			bool EnumerateFiles(TEnumFiles pfnEnumFiles, LPVOID pvUserContext);
 			std::shared_ptr <CVFSFile> GetFileStream() const;
+
+			void SetCompressionProfile(const SCompressionProfile& profile);
+			const SCompressionProfile& GetCompressionProfile() const;
+
+			// Moves on with every write, delete or load, whoever keeps a copy of the names compares it
+			uint64_t GetGeneration() const;
+
+			// Compaction moves the live entries down over the free blocks as raw bytes and cuts the tail off.
+			// Entries named in order (name indexes) lead in that order, the rest follow by their offset.
+			// A step moves whole entries until budget bytes are copied, writes and deletes are rejected until it completes.
+			// Chunked and streamed files opened before a step read from the old offsets, reopen them afterwards.
+			bool BeginCompact(const std::vector <uint32_t>& order = {});
+			bool CompactStep(uint64_t budget, bool& completed);
+			void AbortCompact();
+			bool Compact(const std::vector <uint32_t>& order = {});
+
+			bool SetDictionary(uint8_t id, const void* data, uint32_t size, uint8_t flags = FLAG_RAW_DATA);
+			bool HasDictionary(uint8_t id) const;
+			static std::wstring GetDictionaryName(uint8_t id);
+
+		protected:
+			const DataBuffer* GetDictionary(uint8_t id) const;
+			bool IsReserved(uint32_t index) const;
+
+			bool WriteRawEntry(const void* header, const void* payload);
+
+			bool LoadSolidIndex(uint32_t index);
+			bool WriteSolidIndex(uint32_t group);
+			std::shared_ptr <CVFSFile> OpenSolidGroup(uint32_t group) const;
+			std::shared_ptr <CVFSFile> OpenSolidMember(const SFileInformation& info) const;
 			
 		private:
+			friend class CVFSArchiveWriter;
+
 			mutable std::recursive_mutex m_archiveMutex;
 			std::shared_ptr <CVFSFile> m_vfsFile;
 			uint8_t m_archiveKey[32];
 			void* m_archiveData;
+			SCompressionProfile m_compressionProfile;
+			std::atomic <uint64_t> m_generation;
 	};
 }
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include <string>
 #include <mutex>
 
+#include "../../VFSCryptLib/include/DataBuffer.h"
+
 namespace VFS
 {
 	enum EFileType : int32_t
@@ -14,9 +16,23 @@ namespace VFS
 		FILE_TYPE_INPUT,  // WRITE ONLY (disk)
 		FILE_TYPE_MAPPED, // READ ONLY (mapped)
 		FILE_TYPE_MEMORY, // READ ONLY (memory)
+		FILE_TYPE_STREAM, // READ ONLY (chunks decoded on demand)
 		FILE_TYPE_MAX
 	};
 
+	// Backing of a stream file, serves independently decodable chunks of a fixed raw size
+	class CVFSChunkSource
+	{
+		public:
+			virtual ~CVFSChunkSource() = default;
+
+			virtual uint64_t GetSize() const = 0;
+			virtual uint32_t GetChunkSize() const = 0;
+			virtual bool ReadChunk(uint32_t chunk, DataBuffer& output) = 0;
+			// Whole content at once, sources may decode the chunks in parallel
+			virtual bool ReadAll(DataBuffer& output);
+	};
+
 	class CVFSFile : public std::enable_shared_from_this <CVFSFile>
 	{
 		public:	
@@ -34,11 +50,27 @@ namespace VFS
 			void Close();
 			bool Map(const std::wstring& filename, uint64_t offset = 0, uint32_t size = 0);
 			bool Assign(const std::wstring& filename, const void* memory, uint32_t length, bool copy = true);
+			bool Assign(const std::wstring& filename, DataBuffer&& buffer);
+			bool AssignStream(const std::wstring& filename, std::shared_ptr <CVFSChunkSource> source);
 
 			uint32_t Read(void* buffer, uint32_t size);
 			uint32_t Write(const void* buffer, uint32_t size);
 			
-			void SetPosition(int64_t offet, bool relative = false);
+			// Fails when buffered writes could not be flushed before moving away from them
+			bool SetPosition(int64_t offet, bool relative = false);
+
+			// Sequential writes of output files are collected in an aligned buffer of this size, 0 flushes and disables it.
+			// Reads and seeks away from the end of the buffered data flush it first.
+			bool SetWriteBuffer(uint32_t size);
+			bool Flush();
+			// Flushes and waits until the written data reached the disk
+			bool Sync();
+			// Allocates disk space up to size without changing the file size
+			bool Reserve(uint64_t size);
+			// Grows the file to size with zeros without writing them where possible, the position moves to the new end
+			bool Extend(uint64_t size);
+			// Cuts the file at size, the position moves to the new end
+			bool Truncate(uint64_t size);
 
 			bool IsValid() const;
 			bool IsReadable() const;
@@ -61,8 +93,19 @@ namespace VFS
 			uint8_t* m_mappedData;
 			uint64_t m_mappedSize;
 
-			uint8_t* m_rawData;
+			mutable uint8_t* m_rawData;
 			uint64_t m_rawSize;
+			mutable DataBuffer m_ownedBuffer;
+
+			std::shared_ptr <CVFSChunkSource> m_chunkSource;
+			DataBuffer m_chunkBuffer;
+			uint32_t m_chunkIndex;
+
+			uint8_t* m_writeBuffer;
+			uint32_t m_writeCapacity;
+			uint32_t m_writeUsed;
+			uint64_t m_writeStart;	// File offset of the buffered data
+			bool m_writeAppend;		// Buffered data starts at the end of the file
 
 			uint64_t m_currPos;
 			bool m_memOwner;
@@ -4,10 +4,18 @@
 #include <mutex>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
 #include <array>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 #include "VFSArchive.h"
 #include "VFSFile.h"
+#include "AccessTrace.h"
+#include "PathTrie.h"
+#include "BloomFilter.h"
 
 namespace VFS
 {
@@ -18,6 +26,20 @@ namespace VFS
 	};
 	static const auto ARCHIVE_IV = "000102030405060708090A0B0C0D0E0F";
 	static const auto ARCHIVE_MAGIC = 0x00003169;
+	// Layout version, kept in the upper half of the magic. Archives of the first layout have none there and load read only.
+	static const auto ARCHIVE_VERSION = 2;
+
+	typedef struct _LAZY_MOUNT
+	{
+		std::wstring							name;
+		std::chrono::steady_clock::time_point	access;
+	} SLazyMount;
+
+	typedef struct _INDEXED_ARCHIVE
+	{
+		uint64_t				generation;	// See CVFSArchive::GetGeneration
+		std::vector <uint32_t>	names;		// Sorted name indexes it was indexed with
+	} SIndexedArchive;
 
 	class CVFSPack
 	{
@@ -45,6 +67,15 @@ namespace VFS
 			static CVFSPack& Instance();
 
 			// Archive methods
+			// Entries each archive serves in the startup window after loading are saved as its startup set by a background thread
+			// once the window is over, the next run reads them ahead in the background. Off by default, 0 disables both.
+			void SetStartupWindow(uint32_t seconds);
+			// LoadRegistiredArchives only checks the headers, an archive is loaded on the first lookup of a name in its name table
+			// above the archive holding it now, and under its path when registered for one. Archives with a startup set, or without
+			// a current name table (see CVFSArchive::SaveNameTable), are loaded right away and the missing table saved.
+			// Lazily loaded archives idle for idleSeconds are unloaded again and keep their names meanwhile, 0 keeps them loaded.
+			void SetLazyMounting(bool enable, uint32_t idleSeconds = 0);
+			void UnloadIdleArchives();
             void LoadRegistiredArchives();
 
 			void RegisterArchive(std::wstring name, std::wstring path = L"*");
@@ -58,6 +89,15 @@ namespace VFS
 			std::shared_ptr <CVFSFile> Create(const std::wstring & name, bool append = false);
 			std::shared_ptr <CVFSFile> Open(std::wstring name);
 
+			// Entries opened from archives are recorded to the trace file until EndAccessTrace, see CVFSAccessTrace
+			bool BeginAccessTrace(const std::wstring & filename);
+			bool EndAccessTrace();
+
+			// Names not found on disk are remembered and not looked up again until forgotten. Off by default, files
+			// written to disk by anything but Create stay missing until forgotten. An empty name forgets all of them.
+			void SetMissingFileCache(bool enable);
+			void ForgetMissingFiles(std::wstring name = L"");
+
 			// Utilities
 			void SetWorkingDirectory(const std::wstring & dir);
 			void SetArchiveKey(const std::wstring & name, const uint8_t * key);
@@ -78,6 +118,26 @@ namespace VFS
 			std::string ToString(const std::wstring& wstInput);
 			std::wstring ToWstring(const std::string& stInput);
 
+		private:
+			void StopPrefetch() const;
+			void SaveStartupSets(std::chrono::steady_clock::time_point deadline) const;
+
+			std::shared_ptr <CVFSArchive> MountArchive(const std::wstring& name);
+			// Both take the pack lock only around the bookkeeping, archives are read without it
+			std::shared_ptr <CVFSArchive> MountPending(uint32_t index, const std::wstring& filename, std::shared_ptr <CVFSArchive> holder);
+			void AddPending(const std::wstring& name);
+			void RemovePending(const std::wstring& name);
+			// Loading split in two, reading the index holds no pack lock and publishing only a short one
+			std::shared_ptr <CVFSArchive> ReadArchive(const std::wstring& filename);
+			std::shared_ptr <CVFSArchive> PublishArchive(const std::wstring& filename, std::shared_ptr <CVFSArchive> archive);
+
+			int64_t GetRegisteredRank(const std::wstring& filename) const;
+			void IndexArchive(const std::shared_ptr <CVFSArchive>& archive);
+			void UnindexArchive(const CVFSArchive* archive);
+			void RefreshIndex();
+			void ReleaseName(uint32_t index, const CVFSArchive* archive);
+			CVFSArchive* FindHolder(uint32_t index, const CVFSArchive* except);
+
 		private:
 			mutable std::recursive_mutex m_packMutex;
 
@@ -85,5 +145,34 @@ namespace VFS
 			std::unordered_map <std::wstring, std::wstring>			    m_registiredArchives;
 			std::list <std::wstring>									m_archiveNames;
 			std::list <std::shared_ptr <CVFSArchive> >					m_archives;
+			// Loaded archives by lowercased load name and by lowercased file name
+			std::unordered_map <std::wstring, std::shared_ptr <CVFSArchive> >	m_archivesByName;
+			// Registered paths other than "*" to the archives registered for them, Open loads those archives for names under it
+			CVFSPathTrie												m_pathRoutes;
+			// Name indexes each loaded archive holds, handing a name over skips archives that can not have it
+			std::unordered_map <const CVFSArchive*, CVFSBloomFilter>	m_archiveFilters;
+			bool														m_missingFileCache;
+			// Registered archives not loaded yet by rank, highest first, the names each of them has and the archives routed by path
+			bool														m_lazyMounting;
+			uint32_t													m_idleTimeout;
+			std::map <int64_t, std::wstring, std::greater <int64_t>>	m_pendingArchives;
+			std::unordered_map <std::wstring, CVFSBloomFilter>			m_pendingFilters;
+			std::unordered_set <std::wstring>							m_routedArchives;
+			std::unordered_map <const CVFSArchive*, SLazyMount>		m_lazyMounts;
+			std::chrono::steady_clock::time_point						m_mountBegin;
+			std::chrono::steady_clock::time_point						m_idleCheck;
+			std::unordered_set <std::wstring>							m_missingFiles;
+			// Every file of the loaded archives by name index, held by the archive of the highest rank.
+			// Later registered archives rank above earlier ones, archives loaded unregistered below all of them in load order.
+			std::unordered_map <uint32_t, CVFSArchive*>				m_nameIndex;
+			std::unordered_map <const CVFSArchive*, int64_t>			m_archiveRanks;
+			int64_t														m_loadSequence;
+			// What each archive was indexed with, a lookup indexes again those whose generation moved on
+			std::unordered_map <const CVFSArchive*, SIndexedArchive>	m_indexedArchives;
+			CVFSAccessTrace												m_accessTrace;
+
+			uint32_t													m_startupWindow;
+			mutable std::thread											m_prefetchThread;
+			mutable std::atomic <bool>									m_prefetchStop;
 	};
 }
@@ -0,0 +1,29 @@
+#pragma once
+#include "VFSArchive.h"
+#include <memory>
+#include <string>
+
+namespace VFS
+{
+	typedef struct _PATCH_STATISTICS
+	{
+		uint32_t	added;
+		uint32_t	changed;
+		uint32_t	removed;
+		uint64_t	size;		// Of the patch file
+	} SPatchStatistics;
+
+	// Patches carry the raw entries (see CVFSArchive::ReadRawData) that differ between two versions of an archive.
+	// Entries are compared by their information only, nothing is decoded, so both versions have to use the same key.
+	// Changed entries go in whole, a coded payload differs all the way through for small changes of its content.
+	class CVFSPatch
+	{
+		public:
+			// Fails for entries of 4 GB and above, which raw entries can not carry
+			static bool Create(std::shared_ptr <CVFSArchive> from, std::shared_ptr <CVFSArchive> to, const std::wstring& filename, SPatchStatistics* statistics = nullptr);
+			// The archive has to hold the version the patch was made from, that is checked before anything is written.
+			// The records are applied as one batch (see CVFSArchive::BeginBatch), a patch that fails half way leaves the archive as it was.
+			// A batch already open on the archive is committed along with the patch.
+			static bool Apply(std::shared_ptr <CVFSArchive> archive, const std::wstring& filename, SPatchStatistics* statistics = nullptr);
+	};
+}
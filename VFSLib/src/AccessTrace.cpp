@@ -0,0 +1,197 @@
+#include "../include/AccessTrace.h"
+#include "../include/VFSArchive.h"
+#include "../include/LogHelper.h"
+
+#include <Windows.h>
+
+namespace VFS
+{
+	extern CVFSLog* gs_pVFSLogInstance;
+
+#pragma pack(push, 1)
+	typedef struct _TRACE_HEADER
+	{
+		uint32_t	magic;
+		uint32_t	version;
+	} STraceHeader;
+
+	typedef struct _TRACE_RECORD
+	{
+		uint8_t		type;
+		uint16_t	archive;
+		uint32_t	entry;		// Name length in characters for archive records, the name follows the record
+		uint32_t	thread;
+		uint64_t	time;
+	} STraceRecord;
+#pragma pack(pop)
+
+	static const uint32_t TRACE_MAGIC = 0x54534656; // VFST
+	static const uint32_t TRACE_VERSION = 1;
+	// Records are written out in batches of about this size
+	static const uint32_t TRACE_FLUSH_SIZE = 64 * 1024;
+
+	enum ETraceRecordType
+	{
+		TRACE_RECORD_ARCHIVE,
+		TRACE_RECORD_ACCESS
+	};
+
+	CVFSAccessTrace::CVFSAccessTrace() :
+		m_active(false)
+	{
+	}
+	CVFSAccessTrace::~CVFSAccessTrace()
+	{
+		End();
+	}
+
+	bool CVFSAccessTrace::Begin(const std::wstring& filename)
+	{
+		std::lock_guard <std::mutex> __lock(m_traceMutex);
+
+		if (m_active)
+		{
+			return false;
+		}
+
+		if (!m_file.Create(filename))
+		{
+			return false;
+		}
+
+		STraceHeader header{ TRACE_MAGIC, TRACE_VERSION };
+		m_buffer.set_size(0);
+		m_buffer.append(&header, sizeof(STraceHeader));
+		m_archives.clear();
+		m_start = std::chrono::steady_clock::now();
+		m_active = true;
+
+		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Access trace: %ls started", filename.c_str());
+		return true;
+	}
+
+	bool CVFSAccessTrace::End()
+	{
+		std::lock_guard <std::mutex> __lock(m_traceMutex);
+
+		if (!m_active)
+		{
+			return true;
+		}
+
+		m_active = false;
+		auto result = Flush();
+		m_file.Close();
+		m_archives.clear();
+		return result;
+	}
+
+	// Checked on every open, without the trace lock
+	bool CVFSAccessTrace::IsActive() const
+	{
+		return m_active;
+	}
+
+	void CVFSAccessTrace::Record(const CVFSArchive* archive, uint32_t entry)
+	{
+		std::lock_guard <std::mutex> __lock(m_traceMutex);
+
+		if (!m_active || !archive)
+		{
+			return;
+		}
+
+		auto time = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count());
+		auto thread = static_cast<uint32_t>(GetCurrentThreadId());
+
+		auto stream = archive->GetFileStream();
+		auto name = stream ? stream->GetFileName() : std::wstring();
+
+		auto iter = m_archives.find(name);
+		if (iter == m_archives.end())
+		{
+			if (m_archives.size() > 0xffff)
+				return;
+
+			// Named once on first use, accesses refer to the id afterwards
+			iter = m_archives.emplace(name, static_cast<uint16_t>(m_archives.size())).first;
+
+			STraceRecord record{ TRACE_RECORD_ARCHIVE, iter->second, static_cast<uint32_t>(name.size()), thread, time };
+			m_buffer.append(&record, sizeof(STraceRecord));
+			m_buffer.append(name.data(), static_cast<uint32_t>(name.size() * sizeof(wchar_t)));
+		}
+
+		STraceRecord record{ TRACE_RECORD_ACCESS, iter->second, entry, thread, time };
+		m_buffer.append(&record, sizeof(STraceRecord));
+
+		if (m_buffer.get_size() >= TRACE_FLUSH_SIZE)
+			Flush();
+	}
+
+	bool CVFSAccessTrace::Flush()
+	{
+		if (m_buffer.get_size() == 0)
+		{
+			return true;
+		}
+
+		auto result = m_file.Write(m_buffer.get_data(), m_buffer.get_size()) == m_buffer.get_size();
+		m_buffer.set_size(0);
+		if (!result && gs_pVFSLogInstance)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Access trace: %ls can not written", m_file.GetFileName().c_str());
+		}
+		return result;
+	}
+
+	bool CVFSAccessTrace::Load(const std::wstring& filename, std::vector <std::wstring>& archives, std::vector <STraceAccess>& accesses)
+	{
+		CVFSFile file;
+		if (!file.Open(filename) || file.GetSize() < sizeof(STraceHeader) || file.GetSize() > 0xffffffff)
+		{
+			return false;
+		}
+
+		DataBuffer data(static_cast<uint32_t>(file.GetSize()));
+		if (file.Read(data.get_data(), data.get_size()) != data.get_size())
+		{
+			return false;
+		}
+
+		STraceHeader header;
+		memcpy(&header, data.get_data(), sizeof(STraceHeader));
+		if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Access trace: %ls is not a valid trace", filename.c_str());
+			return false;
+		}
+
+		// A trace cut short by a crash keeps its complete records
+		uint32_t position = sizeof(STraceHeader);
+		while (data.get_size() - position >= sizeof(STraceRecord))
+		{
+			STraceRecord record;
+			memcpy(&record, data.get_data() + position, sizeof(STraceRecord));
+			position += sizeof(STraceRecord);
+
+			if (record.type == TRACE_RECORD_ARCHIVE)
+			{
+				auto length = static_cast<uint64_t>(record.entry) * sizeof(wchar_t);
+				if (data.get_size() - position < length || record.archive != archives.size())
+					break;
+
+				archives.emplace_back(reinterpret_cast<const wchar_t*>(data.get_data() + position), record.entry);
+				position += static_cast<uint32_t>(length);
+			}
+			else if (record.type == TRACE_RECORD_ACCESS && record.archive < archives.size())
+			{
+				accesses.push_back({ record.archive, record.entry, record.thread, record.time });
+			}
+			else
+			{
+				break;
+			}
+		}
+		return true;
+	}
+}
@@ -0,0 +1,53 @@
+#include "../include/BloomFilter.h"
+
+namespace VFS
+{
+	static const uint32_t BLOOM_PROBES = 4;
+	// Bits per key, 4 probes into a 64 bit block keep this near 1% false positives
+	static const std::size_t BLOOM_BITS_PER_KEY = 12;
+
+	CVFSBloomFilter::CVFSBloomFilter() :
+		m_mask(0)
+	{
+		Reset(0);
+	}
+
+	void CVFSBloomFilter::Reset(std::size_t expected)
+	{
+		std::size_t words = 1;
+		while (words * 64 < expected * BLOOM_BITS_PER_KEY)
+			words <<= 1;
+
+		m_words.assign(words, 0);
+		m_mask = words - 1;
+	}
+
+	// Name indexes are hashes already, the mix spreads them over word and bit selection
+	uint64_t CVFSBloomFilter::Mix(uint32_t key)
+	{
+		auto hash = static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ULL;
+		return hash ^ (hash >> 29);
+	}
+
+	void CVFSBloomFilter::Insert(uint32_t key)
+	{
+		auto hash = Mix(key);
+		auto& word = m_words[static_cast<std::size_t>(hash & m_mask)];
+
+		for (uint32_t i = 0; i < BLOOM_PROBES; ++i)
+			word |= 1ULL << ((hash >> (40 + i * 6)) & 63);
+	}
+
+	bool CVFSBloomFilter::MayContain(uint32_t key) const
+	{
+		auto hash = Mix(key);
+		auto word = m_words[static_cast<std::size_t>(hash & m_mask)];
+
+		for (uint32_t i = 0; i < BLOOM_PROBES; ++i)
+		{
+			if (!(word & (1ULL << ((hash >> (40 + i * 6)) & 63))))
+				return false;
+		}
+		return true;
+	}
+}
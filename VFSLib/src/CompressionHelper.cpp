@@ -0,0 +1,365 @@
+#include "../include/CompressionHelper.h"
+
+#include <lz4.h>
+#include <lz4hc.h>
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+namespace VFS
+{
+	// Idle contexts kept around for worker threads that come and go
+	static const size_t MAX_POOLED_CONTEXTS = 16;
+
+	// Incompressibility probe: inputs up to PROBE_WHOLE_LIMIT are probed whole,
+	// larger ones through PROBE_SAMPLE_COUNT evenly spaced samples of PROBE_SAMPLE_SIZE
+	static const uint32_t PROBE_WHOLE_LIMIT = 64 * 1024;
+	static const uint32_t PROBE_SAMPLE_SIZE = 16 * 1024;
+	static const uint32_t PROBE_SAMPLE_COUNT = 4;
+	// Byte entropy (bits per byte) above which data is treated as random, below which as compressible
+	static const double PROBE_ENTROPY_RANDOM = 7.95;
+	static const double PROBE_ENTROPY_COMPRESSIBLE = 6.0;
+
+	// Dictionary trainer: sequence length, segment length and size (log2) of the approximate frequency table
+	static const uint32_t TRAIN_DMER_SIZE = 8;
+	static const uint32_t TRAIN_SEGMENT_SIZE = 256;
+	static const uint32_t TRAIN_TABLE_LOG = 22;
+
+	CVFSCompressionContext::CVFSCompressionContext() :
+		m_hcState(nullptr), m_fastState(nullptr)
+	{
+	}
+	CVFSCompressionContext::~CVFSCompressionContext()
+	{
+		if (m_hcState)
+		{
+			LZ4_freeStreamHC(m_hcState);
+			m_hcState = nullptr;
+		}
+		if (m_fastState)
+		{
+			LZ4_freeStream(m_fastState);
+			m_fastState = nullptr;
+		}
+	}
+
+	int32_t CVFSCompressionContext::CompressHC(const char* src, char* dst, int32_t srcsize, int32_t dstcapacity, int32_t level)
+	{
+		if (!m_hcState)
+		{
+			m_hcState = LZ4_createStreamHC();
+			if (!m_hcState)
+				return 0;
+		}
+
+		return LZ4_compress_HC_extStateHC(m_hcState, src, dst, srcsize, dstcapacity, level);
+	}
+
+	int32_t CVFSCompressionContext::CompressFast(const char* src, char* dst, int32_t srcsize, int32_t dstcapacity, int32_t acceleration)
+	{
+		if (!m_fastState)
+		{
+			m_fastState = LZ4_createStream();
+			if (!m_fastState)
+				return 0;
+		}
+
+		return LZ4_compress_fast_extState(m_fastState, src, dst, srcsize, dstcapacity, acceleration);
+	}
+
+	int32_t CVFSCompressionContext::Compress(const char* src, char* dst, int32_t srcsize, int32_t dstcapacity, int32_t level, const char* dict, uint32_t dictsize)
+	{
+		if (level == 0)
+			return 0;
+
+		if (!dict || dictsize == 0)
+		{
+			if (level > 0)
+				return CompressHC(src, dst, srcsize, dstcapacity, level);
+			return CompressFast(src, dst, srcsize, dstcapacity, -level);
+		}
+
+		if (level > 0)
+		{
+			if (!m_hcState)
+			{
+				m_hcState = LZ4_createStreamHC();
+				if (!m_hcState)
+					return 0;
+			}
+
+			LZ4_resetStreamHC(m_hcState, level);
+			LZ4_loadDictHC(m_hcState, dict, static_cast<int>(dictsize));
+			return LZ4_compress_HC_continue(m_hcState, src, dst, srcsize, dstcapacity);
+		}
+
+		if (!m_fastState)
+		{
+			m_fastState = LZ4_createStream();
+			if (!m_fastState)
+				return 0;
+		}
+
+		LZ4_loadDict(m_fastState, dict, static_cast<int>(dictsize));
+		return LZ4_compress_fast_continue(m_fastState, src, dst, srcsize, dstcapacity, -level);
+	}
+
+	double CVFSCompressionContext::EstimateRatio(const char* src, uint32_t srcsize)
+	{
+		if (!src || srcsize == 0)
+			return 1.0;
+
+		uint32_t samplesize = srcsize <= PROBE_WHOLE_LIMIT ? srcsize : PROBE_SAMPLE_SIZE;
+		uint32_t samplecount = srcsize <= PROBE_WHOLE_LIMIT ? 1 : PROBE_SAMPLE_COUNT;
+		uint32_t stride = samplecount > 1 ? (srcsize - samplesize) / (samplecount - 1) : 0;
+
+		uint32_t histogram[256] = { 0 };
+		for (uint32_t i = 0; i < samplecount; ++i)
+		{
+			auto sample = reinterpret_cast<const uint8_t*>(src) + i * stride;
+			for (uint32_t j = 0; j < samplesize; ++j)
+			{
+				++histogram[sample[j]];
+			}
+		}
+
+		double total = static_cast<double>(samplesize) * samplecount;
+		double entropy = 0.0;
+		for (auto count : histogram)
+		{
+			if (count)
+			{
+				auto p = count / total;
+				entropy -= p * std::log2(p);
+			}
+		}
+
+		if (entropy >= PROBE_ENTROPY_RANDOM)
+			return 1.0;
+		if (entropy <= PROBE_ENTROPY_COMPRESSIBLE)
+			return entropy / 8.0;
+
+		// Ambiguous range, structure (not byte frequency) decides, so let LZ4 have a look
+		m_probeBuffer.resize(LZ4_compressBound(samplesize));
+
+		uint64_t compressed = 0;
+		for (uint32_t i = 0; i < samplecount; ++i)
+		{
+			auto size = CompressFast(src + i * stride, m_probeBuffer.data(), samplesize, static_cast<int32_t>(m_probeBuffer.size()), 1);
+			compressed += size > 0 ? static_cast<uint32_t>(size) : samplesize;
+		}
+
+		return std::min(1.0, compressed / total);
+	}
+
+	int32_t CVFSCompressionContext::Decompress(const char* src, char* dst, int32_t srcsize, int32_t dstcapacity, const char* dict, uint32_t dictsize)
+	{
+		if (!src || !dst || srcsize <= 0 || dstcapacity < 0)
+			return -1;
+
+		if (dict && dictsize)
+			return LZ4_decompress_safe_usingDict(src, dst, srcsize, dstcapacity, dict, static_cast<int>(dictsize));
+
+		return LZ4_decompress_safe(src, dst, srcsize, dstcapacity);
+	}
+
+
+	CVFSDictionaryTrainer::CVFSDictionaryTrainer(uint32_t samplebudget) :
+		m_sampleBudget(samplebudget)
+	{
+	}
+
+	bool CVFSDictionaryTrainer::AddSample(const void* data, uint32_t size)
+	{
+		if (!data || size == 0)
+			return true;
+
+		auto left = m_sampleBudget - static_cast<uint32_t>(m_samples.size());
+		if (left == 0)
+			return false;
+
+		size = std::min(size, left);
+
+		auto begin = reinterpret_cast<const uint8_t*>(data);
+		m_samples.insert(m_samples.end(), begin, begin + size);
+		m_sampleSizes.push_back(size);
+		return m_samples.size() < m_sampleBudget;
+	}
+
+	uint32_t CVFSDictionaryTrainer::GetSampleCount() const
+	{
+		return static_cast<uint32_t>(m_sampleSizes.size());
+	}
+
+	std::vector <uint8_t> CVFSDictionaryTrainer::Train(uint32_t dictsize) const
+	{
+		dictsize = std::min(dictsize, MAX_DICTIONARY_SIZE);
+
+		if (m_samples.size() <= dictsize)
+			return m_samples;
+
+		const auto tablesize = 1u << TRAIN_TABLE_LOG;
+		auto hashdmer = [](const uint8_t* ptr) {
+			uint64_t value;
+			memcpy(&value, ptr, sizeof(value));
+			return static_cast<uint32_t>((value * 0x9E3779B185EBCA87ULL) >> (64 - TRAIN_TABLE_LOG));
+		};
+
+		// Number of samples each sequence appears in, sequences never cross sample boundaries
+		std::vector <uint32_t> frequency(tablesize, 0);
+		std::vector <uint32_t> lastsample(tablesize, 0xffffffff);
+		std::vector <uint32_t> dmers(m_samples.size(), 0xffffffff);
+		{
+			size_t offset = 0;
+			for (uint32_t sample = 0; sample < m_sampleSizes.size(); ++sample)
+			{
+				auto size = m_sampleSizes[sample];
+				for (size_t i = 0; i + TRAIN_DMER_SIZE <= size; ++i)
+				{
+					auto hash = hashdmer(&m_samples[offset + i]);
+					dmers[offset + i] = hash;
+					if (lastsample[hash] != sample)
+					{
+						lastsample[hash] = sample;
+						++frequency[hash];
+					}
+				}
+				offset += size;
+			}
+		}
+		// Sequences unique to one sample do not help other entries
+		for (auto& count : frequency)
+		{
+			if (count < 2)
+				count = 0;
+		}
+
+		typedef struct _SEGMENT
+		{
+			size_t		begin;
+			uint64_t	score;
+		} SSegment;
+		std::vector <SSegment> segments;
+
+		auto segmentsize = static_cast<size_t>(TRAIN_SEGMENT_SIZE);
+		auto epochs = std::max<size_t>(1, dictsize / segmentsize);
+		auto epochsize = std::max<size_t>(segmentsize, m_samples.size() / epochs);
+
+		for (size_t epochbegin = 0; epochbegin + segmentsize <= m_samples.size() && segments.size() * segmentsize < dictsize; epochbegin += epochsize)
+		{
+			auto epochend = std::min(m_samples.size(), epochbegin + epochsize);
+
+			// Sliding window over the epoch, score is the summed frequency of the sequences it contains
+			uint64_t score = 0;
+			for (size_t i = epochbegin; i < epochbegin + segmentsize; ++i)
+			{
+				if (dmers[i] != 0xffffffff)
+					score += frequency[dmers[i]];
+			}
+
+			SSegment best{ epochbegin, score };
+			for (size_t i = epochbegin + segmentsize; i < epochend; ++i)
+			{
+				if (dmers[i] != 0xffffffff)
+					score += frequency[dmers[i]];
+				if (dmers[i - segmentsize] != 0xffffffff)
+					score -= frequency[dmers[i - segmentsize]];
+
+				if (score > best.score)
+				{
+					best.begin = i - segmentsize + 1;
+					best.score = score;
+				}
+			}
+
+			if (best.score == 0)
+				continue;
+
+			// Already covered sequences are worth nothing to later segments
+			for (size_t i = best.begin; i < best.begin + segmentsize; ++i)
+			{
+				if (dmers[i] != 0xffffffff)
+					frequency[dmers[i]] = 0;
+			}
+			segments.push_back(best);
+		}
+
+		std::sort(segments.begin(), segments.end(), [](const SSegment& a, const SSegment& b) {
+			return a.score < b.score;
+		});
+
+		std::vector <uint8_t> dictionary;
+		dictionary.reserve(dictsize);
+		for (const auto& segment : segments)
+		{
+			dictionary.insert(dictionary.end(), m_samples.begin() + segment.begin, m_samples.begin() + segment.begin + segmentsize);
+		}
+
+		if (dictionary.size() > dictsize)
+			dictionary.erase(dictionary.begin(), dictionary.begin() + (dictionary.size() - dictsize));
+
+		return dictionary;
+	}
+
+
+	CVFSCompressionPool& CVFSCompressionPool::Instance()
+	{
+		static CVFSCompressionPool pool;
+		return pool;
+	}
+
+	CVFSCompressionContext& CVFSCompressionPool::ThreadContext()
+	{
+		struct SThreadContext
+		{
+			std::unique_ptr <CVFSCompressionContext> context;
+
+			SThreadContext() :
+				context(CVFSCompressionPool::Instance().Acquire())
+			{
+			}
+			~SThreadContext()
+			{
+				CVFSCompressionPool::Instance().Release(std::move(context));
+			}
+		};
+
+		thread_local SThreadContext threadcontext;
+		return *threadcontext.context;
+	}
+
+	std::unique_ptr <CVFSCompressionContext> CVFSCompressionPool::Acquire()
+	{
+		{
+			std::lock_guard <std::mutex> __lock(m_poolMutex);
+
+			if (!m_contexts.empty())
+			{
+				auto context = std::move(m_contexts.back());
+				m_contexts.pop_back();
+				return context;
+			}
+		}
+
+		return std::make_unique<CVFSCompressionContext>();
+	}
+
+	void CVFSCompressionPool::Release(std::unique_ptr <CVFSCompressionContext> context)
+	{
+		if (!context)
+			return;
+
+		std::lock_guard <std::mutex> __lock(m_poolMutex);
+
+		if (m_contexts.size() < MAX_POOLED_CONTEXTS)
+			m_contexts.emplace_back(std::move(context));
+	}
+
+	void CVFSCompressionPool::Trim()
+	{
+		std::lock_guard <std::mutex> __lock(m_poolMutex);
+
+		m_contexts.clear();
+	}
+}
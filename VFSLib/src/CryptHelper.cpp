@@ -47,7 +47,7 @@ namespace VFS
 			aes256_encrypt.add(data, size);
 			aes256_encrypt.calculate();
 
-			pBuffer = aes256_encrypt.get_data();
+			pBuffer = aes256_encrypt.take_data();
 		}
 		catch (Exception & e)
 		{
@@ -81,7 +81,7 @@ namespace VFS
 
 			bool result = aes256_decrypt.calculate();
 			if (result)
-				pBuffer = aes256_decrypt.get_data();
+				pBuffer = aes256_decrypt.take_data();
 		}
 		catch (Exception & e)
 		{
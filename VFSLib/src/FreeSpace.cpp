@@ -0,0 +1,91 @@
+#include "../include/FreeSpace.h"
+
+namespace VFS
+{
+	static const uint32_t MAX_EXTENT_BLOCKS = 0xffffffff;
+
+	CVFSFreeSpace::CVFSFreeSpace() :
+		m_bytesPerBlock(0), m_freeBlocks(0)
+	{
+	}
+
+	void CVFSFreeSpace::Reset(uint32_t bytesPerBlock)
+	{
+		m_bytesPerBlock = bytesPerBlock;
+		m_byOffset.clear();
+		m_bySize.clear();
+		m_freeBlocks = 0;
+	}
+
+	void CVFSFreeSpace::Insert(uint64_t start, uint32_t blocks)
+	{
+		m_byOffset.emplace(start, blocks);
+		m_bySize.emplace(blocks, start);
+		m_freeBlocks += blocks;
+	}
+	void CVFSFreeSpace::Erase(std::map <uint64_t, uint32_t>::iterator it)
+	{
+		m_bySize.erase({ it->second, it->first });
+		m_freeBlocks -= it->second;
+		m_byOffset.erase(it);
+	}
+
+	SFreeExtent CVFSFreeSpace::Release(uint64_t start, uint32_t blocks)
+	{
+		SFreeExtent extent{ start, blocks };
+
+		auto next = m_byOffset.lower_bound(start);
+		if (next != m_byOffset.end() && next->first == extent.start + static_cast<uint64_t>(extent.blocks) * m_bytesPerBlock &&
+			static_cast<uint64_t>(extent.blocks) + next->second <= MAX_EXTENT_BLOCKS)
+		{
+			extent.blocks += next->second;
+			Erase(next);
+		}
+
+		next = m_byOffset.lower_bound(start);
+		if (next != m_byOffset.begin())
+		{
+			auto prev = std::prev(next);
+			if (prev->first + static_cast<uint64_t>(prev->second) * m_bytesPerBlock == extent.start &&
+				static_cast<uint64_t>(extent.blocks) + prev->second <= MAX_EXTENT_BLOCKS)
+			{
+				extent.start = prev->first;
+				extent.blocks += prev->second;
+				Erase(prev);
+			}
+		}
+
+		Insert(extent.start, extent.blocks);
+		return extent;
+	}
+
+	bool CVFSFreeSpace::Allocate(uint32_t blocks, SFreeExtent& output, SFreeExtent& remainder)
+	{
+		remainder = { 0, 0 };
+
+		auto fit = m_bySize.lower_bound({ blocks, 0 });
+		if (fit == m_bySize.end())
+			return false;
+
+		auto start = fit->second;
+		auto available = fit->first;
+		Erase(m_byOffset.find(start));
+
+		output = { start, blocks };
+		if (available > blocks)
+		{
+			remainder = { start + static_cast<uint64_t>(blocks) * m_bytesPerBlock, available - blocks };
+			Insert(remainder.start, remainder.blocks);
+		}
+		return true;
+	}
+
+	std::size_t CVFSFreeSpace::GetCount() const
+	{
+		return m_byOffset.size();
+	}
+	uint64_t CVFSFreeSpace::GetFreeBlocks() const
+	{
+		return m_freeBlocks;
+	}
+}
@@ -0,0 +1,87 @@
+#include "../include/PathTrie.h"
+
+#include <cwctype>
+#include <algorithm>
+
+namespace VFS
+{
+	static const uint32_t NO_NODE = 0xffffffff;
+
+	static wchar_t NormalizePathChar(wchar_t c)
+	{
+		return c == L'\\' ? L'/' : static_cast<wchar_t>(towlower(c));
+	}
+
+	CVFSPathTrie::CVFSPathTrie()
+	{
+		Clear();
+	}
+
+	void CVFSPathTrie::Clear()
+	{
+		m_nodes.clear();
+		m_nodes.emplace_back();
+	}
+
+	uint32_t CVFSPathTrie::FindChild(uint32_t node, wchar_t c) const
+	{
+		const auto& children = m_nodes[node].children;
+		auto iter = std::lower_bound(children.begin(), children.end(), c, [](const std::pair <wchar_t, uint32_t>& child, wchar_t key) {
+			return child.first < key;
+		});
+		return iter != children.end() && iter->first == c ? iter->second : NO_NODE;
+	}
+
+	void CVFSPathTrie::Insert(const std::wstring& prefix, const std::wstring& value)
+	{
+		uint32_t node = 0;
+		for (auto raw : prefix)
+		{
+			auto c = NormalizePathChar(raw);
+
+			auto child = FindChild(node, c);
+			if (child == NO_NODE)
+			{
+				child = static_cast<uint32_t>(m_nodes.size());
+				m_nodes.emplace_back();
+
+				auto& children = m_nodes[node].children;
+				auto iter = std::lower_bound(children.begin(), children.end(), c, [](const std::pair <wchar_t, uint32_t>& entry, wchar_t key) {
+					return entry.first < key;
+				});
+				children.emplace(iter, c, child);
+			}
+			node = child;
+		}
+
+		auto& values = m_nodes[node].values;
+		if (std::find(values.begin(), values.end(), value) == values.end())
+			values.push_back(value);
+	}
+
+	// Nodes stay allocated, registrations are few and rarely removed
+	void CVFSPathTrie::Erase(const std::wstring& value)
+	{
+		for (auto& node : m_nodes)
+		{
+			node.values.erase(std::remove(node.values.begin(), node.values.end(), value), node.values.end());
+		}
+	}
+
+	const std::vector <std::wstring>* CVFSPathTrie::Find(const std::wstring& path) const
+	{
+		const std::vector <std::wstring>* result = m_nodes[0].values.empty() ? nullptr : &m_nodes[0].values;
+
+		uint32_t node = 0;
+		for (auto raw : path)
+		{
+			node = FindChild(node, NormalizePathChar(raw));
+			if (node == NO_NODE)
+				break;
+
+			if (!m_nodes[node].values.empty())
+				result = &m_nodes[node].values;
+		}
+		return result;
+	}
+}
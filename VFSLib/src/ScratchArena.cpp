@@ -0,0 +1,147 @@
+#include "../include/ScratchArena.h"
+
+#include <new>
+#include <algorithm>
+
+namespace VFS
+{
+	static const std::size_t SCRATCH_MIN_CHUNK_SIZE = 256 * 1024;
+	static const std::size_t SCRATCH_MAX_RETAINED_SIZE = 64 * 1024 * 1024;
+	static const std::size_t SCRATCH_CHUNK_ALIGNMENT = 64;
+
+	static uint8_t* AllocateChunk(std::size_t size)
+	{
+		return static_cast<uint8_t*>(::operator new(size, std::align_val_t(SCRATCH_CHUNK_ALIGNMENT)));
+	}
+	static void FreeChunk(uint8_t* data)
+	{
+		::operator delete(data, std::align_val_t(SCRATCH_CHUNK_ALIGNMENT));
+	}
+
+
+	CVFSScratchArena::CVFSScratchArena() :
+		m_current(0), m_depth(0)
+	{
+	}
+	CVFSScratchArena::~CVFSScratchArena()
+	{
+		for (auto& chunk : m_chunks)
+		{
+			FreeChunk(chunk.data);
+		}
+		m_chunks.clear();
+	}
+
+	CVFSScratchArena& CVFSScratchArena::ThreadInstance()
+	{
+		thread_local CVFSScratchArena arena;
+		return arena;
+	}
+
+	void* CVFSScratchArena::Allocate(std::size_t size, std::size_t alignment)
+	{
+		if (size == 0)
+			size = 1;
+
+		for (; m_current < m_chunks.size(); ++m_current)
+		{
+			auto& chunk = m_chunks[m_current];
+
+			auto base = reinterpret_cast<std::uintptr_t>(chunk.data);
+			auto start = (base + chunk.used + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1);
+			if (start + size <= base + chunk.size)
+			{
+				chunk.used = start + size - base;
+				return reinterpret_cast<void*>(start);
+			}
+		}
+
+		auto last = m_chunks.empty() ? 0 : m_chunks.back().size;
+		auto chunksize = std::max<std::size_t>({ size + alignment, SCRATCH_MIN_CHUNK_SIZE, last * 2 });
+
+		SChunk chunk{};
+		chunk.data = AllocateChunk(chunksize);
+		chunk.size = chunksize;
+		chunk.used = 0;
+		m_chunks.push_back(chunk);
+		m_current = m_chunks.size() - 1;
+
+		return Allocate(size, alignment);
+	}
+
+	CVFSScratchArena::SMarker CVFSScratchArena::GetMarker() const
+	{
+		SMarker marker{};
+		marker.chunk = m_current;
+		marker.used = m_current < m_chunks.size() ? m_chunks[m_current].used : 0;
+		return marker;
+	}
+
+	void CVFSScratchArena::Rewind(const SMarker& marker)
+	{
+		if (marker.chunk >= m_chunks.size())
+		{
+			Reset();
+			return;
+		}
+
+		for (auto i = marker.chunk + 1; i < m_chunks.size(); ++i)
+		{
+			m_chunks[i].used = 0;
+		}
+		m_chunks[marker.chunk].used = marker.used;
+		m_current = marker.chunk;
+	}
+
+	void CVFSScratchArena::Reset()
+	{
+		// Merge the chunks of a grown arena into one so the next operation is served from a single block
+		if (m_chunks.size() > 1 || (m_chunks.size() == 1 && m_chunks[0].size > SCRATCH_MAX_RETAINED_SIZE))
+		{
+			auto total = GetReservedSize();
+			for (auto& chunk : m_chunks)
+			{
+				FreeChunk(chunk.data);
+			}
+			m_chunks.clear();
+
+			if (total <= SCRATCH_MAX_RETAINED_SIZE)
+			{
+				SChunk chunk{};
+				chunk.data = AllocateChunk(total);
+				chunk.size = total;
+				chunk.used = 0;
+				m_chunks.push_back(chunk);
+			}
+		}
+		else if (!m_chunks.empty())
+		{
+			m_chunks[0].used = 0;
+		}
+		m_current = 0;
+	}
+
+	std::size_t CVFSScratchArena::GetReservedSize() const
+	{
+		std::size_t total = 0;
+		for (const auto& chunk : m_chunks)
+		{
+			total += chunk.size;
+		}
+		return total;
+	}
+
+
+	CVFSScratchScope::CVFSScratchScope() :
+		m_arena(CVFSScratchArena::ThreadInstance()), m_marker(m_arena.GetMarker())
+	{
+		++m_arena.m_depth;
+	}
+	CVFSScratchScope::~CVFSScratchScope()
+	{
+		if (--m_arena.m_depth == 0)
+			m_arena.Reset();
+		else
+			m_arena.Rewind(m_marker);
+	}
+}
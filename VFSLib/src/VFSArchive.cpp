@@ -3,11 +3,22 @@
 #include "../include/VFSPack.h"
 #include "../include/LogHelper.h"
 #include "../include/CryptHelper.h"
+#include "../include/CompressionHelper.h"
+#include "../include/ScratchArena.h"
+#include "../include/FreeSpace.h"
 #include "../include/config.h"
 
 #include <lz4.h>
 #include <lz4hc.h>
+#include <lz4frame.h>
 #include <xxhash.h>
+#include <map>
+#include <list>
+#include <unordered_set>
+#include <atomic>
+#include <ppl.h>
+#include <filesystem>
+#include <chrono>
 
 #ifndef ALIGNTO
 	#define ALIGNTO(x, a) ((x) + ((a) - ((x) % (a))))
@@ -17,6 +28,8 @@ namespace VFS
 {
 	extern CVFSLog* gs_pVFSLogInstance;
 
+	static std::atomic <uint64_t> gs_archiveGenerations(0);
+
 #pragma pack(push, 1)
 	typedef struct _ARCHIVE_HEADER
 	{
@@ -28,455 +41,3229 @@ namespace VFS
 	typedef struct _m_vfsFileENTRY
 	{
 		SFileInformation	info;
-		uint32_t			finalSize;
+		uint64_t			finalSize;
 		uint32_t			numBlocks;
 		uint64_t			offset;
 	} SFileEntry;
+	static_assert(sizeof(SFileEntry) == RAW_ENTRY_HEADER_SIZE, "Raw entry header size mismatch");
+
+	// Entry header of the first layout, before the version was kept in the magic
+	typedef struct _LEGACY_FILE_ENTRY
+	{
+		uint32_t	index;
+		uint32_t	hash;
+		uint32_t	version;
+		uint8_t		flags;
+		uint32_t	rawsize;
+		uint32_t	compressedsize;
+		uint32_t	cryptedsize;
+		wchar_t		filename[255];
+		uint32_t	finalSize;
+		uint32_t	numBlocks;
+		uint64_t	offset;
+	} SLegacyFileEntry;
+
+	typedef struct _SOLID_INDEX_HEADER
+	{
+		uint32_t	group;
+		uint32_t	count;
+	} SSolidIndexHeader;
+
+	// Names, when kept, follow the records as a length and the characters each
+	typedef struct _SOLID_MEMBER
+	{
+		uint32_t	index;
+		uint32_t	hash;
+		uint32_t	rawsize;
+		uint32_t	offset; // In the decoded group blob
+	} SSolidMember;
+
+	typedef struct _CHUNK_TABLE_HEADER
+	{
+		uint32_t	chunkSize;
+		uint32_t	count;
+	} SChunkTableHeader;
+
+	typedef struct _CHUNK_RECORD
+	{
+		uint64_t	offset; // From the start of the entry payload
+		uint32_t	size;	// Coded size, equal to the raw chunk size when stored as raw
+		uint32_t	hash;	// Of the raw chunk
+	} SChunkRecord;
+#pragma pack(pop)
+
+	typedef struct _SOLID_LOCATION
+	{
+		uint32_t	group;
+		uint32_t	offset;
+	} SSolidLocation;
+
+	// Decoded solid groups kept around for the following member reads
+	static const uint64_t SOLID_CACHE_SIZE = 32 * 1024 * 1024;
+
+	// A member keeps what tells it apart from the others, the rest is the coding of its group
+	static SFileEntry GetSolidMemberEntry(const SFileInformation& group, const SSolidMember& member)
+	{
+		SFileEntry entry;
+		memset(&entry, 0, sizeof(SFileEntry));
+		entry.info.index = member.index;
+		entry.info.hash = member.hash;
+		entry.info.version = group.version;
+		entry.info.flags = FLAG_SOLID_MEMBER | (group.flags & (FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256));
+		entry.info.rawsize = member.rawsize;
+		entry.info.compressedsize = member.rawsize;
+		entry.info.cryptedsize = member.rawsize;
+		return entry;
+	}
+
+	static std::wstring GetSolidGroupName(uint32_t group)
+	{
+		return L"$vfs/solid/" + std::to_wstring(group);
+	}
+	static std::wstring GetSolidIndexName(uint32_t group)
+	{
+		return L"$vfs/solid/" + std::to_wstring(group) + L"/index";
+	}
+
+	static bool DecodeChunk(const char* coded, uint32_t codedsize, char* output, uint32_t rawsize, const SChunkRecord& record, uint8_t flags, const uint8_t* key, const DataBuffer* dictionary)
+	{
+		const char* source = coded;
+		uint32_t sourcesize = codedsize;
+		DataBuffer decrypted;
+		if (flags & FLAG_CRYPTED_AES256)
+		{
+			CAes256 aeshelper;
+			decrypted = aeshelper.Decrypt(reinterpret_cast<const uint8_t*>(coded), codedsize, ARCHIVE_IV, key);
+			source = decrypted.get_data();
+			sourcesize = decrypted.get_size();
+		}
+
+		// Chunks are only kept compressed when that made them smaller
+		if (sourcesize == rawsize)
+		{
+			memcpy(output, source, rawsize);
+		}
+		else
+		{
+			if (!(flags & FLAG_COMPRESSED_LZ4))
+				return false;
+
+			auto decompressedsize = CVFSCompressionContext::Decompress(source, output, sourcesize, rawsize,
+				dictionary ? dictionary->get_data() : nullptr, dictionary ? dictionary->get_size() : 0);
+			if (decompressedsize < 0 || static_cast<uint32_t>(decompressedsize) != rawsize)
+				return false;
+		}
+
+		return XXH32(output, rawsize, 0) == record.hash;
+	}
+
+	// Decodes the chunks of one entry straight from the archive file, owns its own handle
+	class CVFSArchiveChunkSource : public CVFSChunkSource
+	{
+		public:
+			CVFSArchiveChunkSource() :
+				m_offset(0), m_size(0), m_chunkSize(0), m_flags(0)
+			{
+				memset(m_key, 0, sizeof(m_key));
+			}
+			virtual ~CVFSArchiveChunkSource()
+			{
+				memset(m_key, 0, sizeof(m_key));
+			}
+
+			bool Initialize(const std::wstring& archivefile, const SFileEntry& entry, const uint8_t* key, const DataBuffer* dictionary)
+			{
+				if (!m_file.Open(archivefile))
+					return false;
+
+				m_offset = entry.offset;
+				m_size = entry.info.rawsize;
+				m_flags = entry.info.flags;
+				memcpy(m_key, key, sizeof(m_key));
+				if (dictionary)
+					m_dictionary = *dictionary;
+
+				SChunkTableHeader header;
+				m_file.SetPosition(m_offset, false);
+				if (m_file.Read(&header, sizeof(SChunkTableHeader)) != sizeof(SChunkTableHeader) || header.chunkSize == 0 ||
+					header.count != (m_size + header.chunkSize - 1) / header.chunkSize)
+					return false;
+
+				m_chunkSize = header.chunkSize;
+				m_records.resize(header.count);
+
+				auto tablesize = static_cast<uint32_t>(header.count * sizeof(SChunkRecord));
+				if (m_file.Read(m_records.data(), tablesize) != tablesize)
+					return false;
+
+				for (const auto& record : m_records)
+				{
+					if (record.offset < sizeof(SChunkTableHeader) + tablesize || record.offset + record.size > entry.finalSize)
+						return false;
+				}
+				return true;
+			}
+
+			uint64_t GetSize() const override
+			{
+				return m_size;
+			}
+			uint32_t GetChunkSize() const override
+			{
+				return m_chunkSize;
+			}
+
+			bool ReadChunk(uint32_t chunk, DataBuffer& output) override
+			{
+				std::lock_guard <std::mutex> __lock(m_mutex);
+
+				if (chunk >= m_records.size())
+					return false;
+
+				const auto& record = m_records[chunk];
+				auto rawsize = GetRawChunkSize(chunk);
+
+				CVFSScratchScope scratch;
+
+				auto coded = scratch.Arena().AllocateArray<char>(record.size);
+				m_file.SetPosition(m_offset + record.offset, false);
+				if (m_file.Read(coded, record.size) != record.size)
+					return false;
+
+				output.set_size(rawsize);
+				return DecodeChunk(coded, record.size, output.get_data(), rawsize, record, m_flags, m_key, m_dictionary.get_size() ? &m_dictionary : nullptr);
+			}
+
+			bool ReadAll(DataBuffer& output) override
+			{
+				std::lock_guard <std::mutex> __lock(m_mutex);
+
+				if (m_records.empty() || m_size > 0xffffffff)
+					return false;
+
+				// One read for the whole payload, the chunks are decoded in parallel
+				auto begin = m_records.front().offset;
+				auto end = m_records.back().offset + m_records.back().size;
+
+				DataBuffer payload(static_cast<uint32_t>(end - begin));
+				m_file.SetPosition(m_offset + begin, false);
+				if (m_file.Read(payload.get_data(), payload.get_size()) != payload.get_size())
+					return false;
+
+				output.set_size(static_cast<uint32_t>(m_size));
+
+				std::atomic <bool> failed(false);
+				concurrency::parallel_for(static_cast<uint32_t>(0), static_cast<uint32_t>(m_records.size()), [&](uint32_t chunk) {
+					const auto& record = m_records[chunk];
+					if (!DecodeChunk(payload.get_data() + (record.offset - begin), record.size, output.get_data() + static_cast<uint64_t>(chunk) * m_chunkSize,
+						GetRawChunkSize(chunk), record, m_flags, m_key, m_dictionary.get_size() ? &m_dictionary : nullptr))
+					{
+						failed = true;
+					}
+				});
+				return !failed;
+			}
+
+		private:
+			uint32_t GetRawChunkSize(uint32_t chunk) const
+			{
+				return static_cast<uint32_t>(std::min<uint64_t>(m_chunkSize, m_size - static_cast<uint64_t>(chunk) * m_chunkSize));
+			}
+
+		private:
+			std::mutex m_mutex;
+			CVFSFile m_file;
+			uint64_t m_offset;
+			uint64_t m_size;
+			uint32_t m_chunkSize;
+			uint8_t m_flags;
+			uint8_t m_key[32];
+			DataBuffer m_dictionary;
+			std::vector <SChunkRecord> m_records;
+	};
+
+	static const uint32_t BULK_WRITE_BUFFER_SIZE = 8 * 1024 * 1024;
+	static const uint32_t COMPACT_COPY_SIZE = 1024 * 1024;
+
+	// Streamed entries: coded segments of up to STREAM_SEGMENT_SIZE, raw output served in STREAM_CHUNK_SIZE chunks
+	static const uint32_t STREAM_SEGMENT_SIZE = 1024 * 1024;
+	static const uint32_t STREAM_SLICE_SIZE = 64 * 1024;
+	static const uint32_t STREAM_CHUNK_SIZE = 64 * 1024;
+
+	typedef struct _STREAM_WRITE_STATE
+	{
+		std::wstring		filename;
+		uint32_t			index;
+		uint8_t				flags;
+		uint32_t			version;
+		int16_t				level;
+		uint64_t			entryPosition;
+		uint32_t			claimedBlocks;	// Blocks the free entry heading the stream spans, ahead of the data
+		uint64_t			rawSize;
+		uint64_t			codedSize;
+		uint64_t			finalSize;	// Segments written so far
+		XXH32_state_t*		hash;
+		LZ4F_cctx*			context;
+		LZ4F_preferences_t	preferences;
+		DataBuffer			pending;	// Coded bytes of the current segment
+	} SStreamWriteState;
+
+	// Decodes a streamed entry sequentially, seeking backwards restarts the frame
+	class CVFSArchiveFrameSource : public CVFSChunkSource
+	{
+		public:
+			CVFSArchiveFrameSource() :
+				m_begin(0), m_end(0), m_size(0), m_expectedHash(0), m_flags(0),
+				m_context(nullptr), m_hash(nullptr), m_filePosition(0), m_segmentPosition(0), m_nextChunk(0)
+			{
+				memset(m_key, 0, sizeof(m_key));
+			}
+			virtual ~CVFSArchiveFrameSource()
+			{
+				if (m_context)
+					LZ4F_freeDecompressionContext(m_context);
+				if (m_hash)
+					XXH32_freeState(m_hash);
+				memset(m_key, 0, sizeof(m_key));
+			}
+
+			bool Initialize(const std::wstring& archivefile, const SFileEntry& entry, const uint8_t* key)
+			{
+				if (!m_file.Open(archivefile))
+					return false;
+
+				m_begin = entry.offset;
+				m_end = entry.offset + entry.finalSize;
+				m_size = entry.info.rawsize;
+				m_expectedHash = entry.info.hash;
+				m_flags = entry.info.flags;
+				memcpy(m_key, key, sizeof(m_key));
+
+				m_hash = XXH32_createState();
+				return m_hash && Reset();
+			}
+
+			uint64_t GetSize() const override
+			{
+				return m_size;
+			}
+			uint32_t GetChunkSize() const override
+			{
+				return STREAM_CHUNK_SIZE;
+			}
+
+			bool ReadChunk(uint32_t chunk, DataBuffer& output) override
+			{
+				std::lock_guard <std::mutex> __lock(m_mutex);
+
+				auto count = static_cast<uint32_t>((m_size + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE);
+				if (chunk >= count)
+					return false;
+
+				if (chunk < m_nextChunk && !Reset())
+					return false;
+
+				output.set_capacity(STREAM_CHUNK_SIZE);
+				while (m_nextChunk <= chunk)
+				{
+					auto rawsize = static_cast<uint32_t>(std::min<uint64_t>(STREAM_CHUNK_SIZE, m_size - static_cast<uint64_t>(m_nextChunk) * STREAM_CHUNK_SIZE));
+					output.set_size(rawsize);
+					if (!Decode(output.get_data(), rawsize))
+					{
+						m_nextChunk = count;
+						return false;
+					}
+
+					XXH32_update(m_hash, output.get_data(), rawsize);
+					if (++m_nextChunk == count && XXH32_digest(m_hash) != m_expectedHash)
+						return false;
+				}
+				return true;
+			}
+
+		private:
+			bool Reset()
+			{
+				if (m_context)
+					LZ4F_freeDecompressionContext(m_context);
+				m_context = nullptr;
+
+				if ((m_flags & FLAG_COMPRESSED_LZ4) && LZ4F_isError(LZ4F_createDecompressionContext(&m_context, LZ4F_VERSION)))
+					return false;
+
+				XXH32_reset(m_hash, 0);
+				m_filePosition = m_begin;
+				m_segment.set_size(0);
+				m_segmentPosition = 0;
+				m_nextChunk = 0;
+				return true;
+			}
+
+			bool NextSegment()
+			{
+				uint32_t size = 0;
+				m_file.SetPosition(m_filePosition, false);
+				if (m_filePosition + sizeof(size) > m_end || m_file.Read(&size, sizeof(size)) != sizeof(size) || size == 0 ||
+					m_filePosition + sizeof(size) + size > m_end)
+					return false;
+
+				m_segment.set_size(size);
+				if (m_file.Read(m_segment.get_data(), size) != size)
+					return false;
+
+				if (m_flags & FLAG_CRYPTED_AES256)
+				{
+					CAes256 aeshelper;
+					m_segment = aeshelper.Decrypt(reinterpret_cast<const uint8_t*>(m_segment.get_data()), size, ARCHIVE_IV, m_key);
+				}
+
+				m_filePosition += sizeof(size) + size;
+				m_segmentPosition = 0;
+				return true;
+			}
+
+			bool Decode(char* output, uint32_t size)
+			{
+				uint32_t produced = 0;
+				while (produced < size)
+				{
+					if (m_segmentPosition >= m_segment.get_size() && !NextSegment())
+						return false;
+
+					auto available = m_segment.get_size() - m_segmentPosition;
+					if (m_flags & FLAG_COMPRESSED_LZ4)
+					{
+						size_t dstsize = size - produced;
+						size_t srcsize = available;
+						if (LZ4F_isError(LZ4F_decompress(m_context, output + produced, &dstsize, m_segment.get_data() + m_segmentPosition, &srcsize, nullptr)))
+							return false;
+
+						m_segmentPosition += static_cast<uint32_t>(srcsize);
+						produced += static_cast<uint32_t>(dstsize);
+					}
+					else
+					{
+						auto part = std::min<uint32_t>(available, size - produced);
+						memcpy(output + produced, m_segment.get_data() + m_segmentPosition, part);
+						m_segmentPosition += part;
+						produced += part;
+					}
+				}
+				return true;
+			}
+
+		private:
+			std::mutex m_mutex;
+			CVFSFile m_file;
+			uint64_t m_begin;
+			uint64_t m_end;
+			uint64_t m_size;
+			uint32_t m_expectedHash;
+			uint8_t m_flags;
+			uint8_t m_key[32];
+
+			LZ4F_dctx* m_context;
+			XXH32_state_t* m_hash;
+			uint64_t m_filePosition;
+			DataBuffer m_segment;
+			uint32_t m_segmentPosition;
+			uint32_t m_nextChunk;
+	};
+
+	typedef struct _COMPACT_STATE
+	{
+		bool					active;
+		bool					relocating;	// Ordered compaction appends the entries out of order once, the slide keeps that order
+		std::vector <uint32_t>	pending;	// Entry indexes of the current phase
+		std::size_t				next;
+		uint64_t				cursor;		// Where the next slid entry starts
+		std::unordered_set <uint32_t>	moved;	// Appended by the slide because the way down overlapped them
+	} SCompactState;
+
+	// An entry written inside a batch, its blocks are taken at Commit
+	typedef struct _BATCH_ENTRY
+	{
+		SFileEntry	entry;
+		DataBuffer	payload;
+	} SBatchEntry;
+
+	typedef struct _BATCH_STATE
+	{
+		bool										active;
+		std::vector <SBatchEntry>					writes;		// Laid out in this order
+		std::unordered_map <uint32_t, std::size_t>	positions;	// index -> slot in writes
+		std::unordered_set <uint32_t>				releases;	// Committed entries the batch replaces or deletes
+	} SBatchState;
+
+	// Entries opened in the first seconds after RecordStartupSet, saved next to the archive by SaveStartupSet
+	typedef struct _STARTUP_STATE
+	{
+		bool									active;
+		std::chrono::steady_clock::time_point	deadline;
+		std::vector <uint32_t>					indexes;	// In first open order
+		std::unordered_set <uint32_t>			seen;
+	} SStartupState;
+
+	static const uint32_t STARTUP_SET_MAGIC = 0x54525453; // STRT
+	static const wchar_t* STARTUP_SET_EXTENSION = L".startup";
+
+	static const uint32_t NAME_TABLE_MAGIC = 0x454D414E; // NAME
+	static const wchar_t* NAME_TABLE_EXTENSION = L".names";
+
+	static const uint32_t BATCH_JOURNAL_MAGIC = 0x4C4E524A; // JRNL
+	static const wchar_t* BATCH_JOURNAL_EXTENSION = L".journal";
+
+	// CopyArchive builds the new content here and renames it over the output
+	static const wchar_t* ARCHIVE_COPY_EXTENSION = L".copy";
+
+	// Entry headers a change rewrites, by file offset
+	typedef std::map <uint64_t, SFileEntry> THeaderWrites;
+
+#pragma pack(push, 1)
+	// Commit record of a batch, every header the commit rewrites follows it. The first one opens the batch run,
+	// until the record is complete the run stays one free extent.
+	typedef struct _BATCH_JOURNAL
+	{
+		uint32_t	magic;
+		uint32_t	count;	// SJournalHeader records
+		uint32_t	hash;	// xxh32 of the record with hash 0 and the headers
+		uint64_t	size;	// Archive size the commit left, a journal next to another size is stale
+	} SBatchJournal;
+
+	typedef struct _JOURNAL_HEADER
+	{
+		uint64_t	position;
+		SFileEntry	entry;
+		SFileEntry	previous;	// Header the commit replaces, until the journal is gone one of the two is found there
+	} SJournalHeader;
+
+	typedef struct _STARTUP_SET_HEADER
+	{
+		uint32_t	magic;
+		uint32_t	count;	// Entry indexes following the header
+		uint32_t	hash;	// xxh32 of the indexes
+	} SStartupSetHeader;
+
+	typedef struct _NAME_TABLE_HEADER
+	{
+		uint32_t	magic;
+		uint32_t	count;	// Name indexes following the header, sorted
+		uint32_t	hash;	// xxh32 of the indexes
+		uint64_t	size;	// Archive size and write time the names were taken at, a table next to another archive is stale
+		int64_t		time;
+	} SNameTableHeader;
 #pragma pack(pop)
 
 	typedef struct _ARCHIVE_DATA
 	{
 		std::unordered_map <uint32_t, SFileEntry>	files;
-		std::list <SFileEntry>	entries;
+		CVFSFreeSpace			freeSpace;
 		SArchiveHeader			header;
+		std::unordered_map <uint32_t, uint8_t>		dictionaryIndexes;	// name index -> dictionary id
+		std::unordered_map <uint8_t, DataBuffer>	dictionaries;		// decoded on first use
+		std::map <uint32_t, std::vector <SSolidMember>>	solidGroups;	// group id -> live members
+		std::unordered_map <uint32_t, SSolidLocation>	solidMembers;	// member index -> location
+		std::list <std::pair <uint32_t, std::shared_ptr <CVFSFile>>>	solidCache; // most recently used first
+		uint64_t									solidCacheSize;
+		const void*									streaming;	// State of the CVFSArchiveWriter owning the end of the file
+		bool										bulk;		// Between BeginBulk and EndBulk
+		SCompactState								compact;	// Between BeginCompact and the last CompactStep
+		SBatchState									batch;		// Between BeginBatch and Commit
+		std::unordered_map <uint64_t, uint32_t>		contents;	// content hash -> entry holding that payload
+		std::unordered_map <uint32_t, std::vector <uint32_t>>	sharers;	// holder index -> entries sharing its payload
+		SStartupState								startup;	// Between RecordStartupSet and its deadline
+		uint64_t									loadedGeneration;	// Generation when loaded, written to when it moved on since
 	} SArchiveData;
 
+	static bool WriteStartupSet(const std::wstring& filename, const std::vector <uint32_t>& indexes)
+	{
+		if (indexes.empty())
+			return true;
+
+		SStartupSetHeader header;
+		header.magic = STARTUP_SET_MAGIC;
+		header.count = static_cast<uint32_t>(indexes.size());
+		header.hash = XXH32(indexes.data(), indexes.size() * sizeof(uint32_t), 0);
 
-	CVFSArchive::CVFSArchive()
+		CVFSFile file;
+		return file.Create(filename + STARTUP_SET_EXTENSION) && file.Write(&header, sizeof(SStartupSetHeader)) == sizeof(SStartupSetHeader) &&
+			file.Write(indexes.data(), header.count * sizeof(uint32_t)) == header.count * sizeof(uint32_t);
+	}
+
+	static uint32_t GetLayoutVersion(const SArchiveHeader& header)
 	{
-//		assert(!m_archiveData);
-		m_archiveData = new SArchiveData();
+		return header.magic >> 16;
 	}
-	CVFSArchive::~CVFSArchive()
+
+	// Of this layout or the first one, anything else needs a newer library
+	static bool IsKnownLayout(const SArchiveHeader& header)
 	{
-//		assert(m_archiveData == this);
+		return (header.magic & 0xffff) == ARCHIVE_MAGIC && (GetLayoutVersion(header) == 0 || GetLayoutVersion(header) == ARCHIVE_VERSION);
+	}
 
-		if (m_archiveData)
+	// Entry header of the first layout as one of this layout, the payload behind it is coded the same way
+	static bool ReadLegacyEntry(CVFSFile* file, SFileEntry& entry)
+	{
+		SLegacyFileEntry legacy;
+		if (file->Read(&legacy, sizeof(SLegacyFileEntry)) != sizeof(SLegacyFileEntry))
+			return false;
+
+		memset(&entry, 0, sizeof(SFileEntry));
+		entry.info.index = legacy.index;
+		entry.info.hash = legacy.hash;
+		entry.info.version = legacy.version;
+		entry.info.flags = legacy.flags & (FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256);
+		entry.info.rawsize = legacy.rawsize;
+		entry.info.compressedsize = legacy.compressedsize;
+		entry.info.cryptedsize = legacy.cryptedsize;
+		entry.info.level = (entry.info.flags & FLAG_COMPRESSED_LZ4) ? LZ4HC_CLEVEL_MAX : 0;
+		memcpy(entry.info.filename, legacy.filename, sizeof(entry.info.filename));
+		entry.info.filename[254] = L'\0';
+		entry.finalSize = legacy.finalSize;
+		entry.numBlocks = legacy.numBlocks;
+		entry.offset = legacy.offset;
+		return true;
+	}
+
+	static bool GetArchiveStamp(const std::wstring& filename, uint64_t& size, int64_t& time)
+	{
+		std::error_code error;
+		size = std::filesystem::file_size(filename, error);
+		if (error)
+			return false;
+
+		time = static_cast<int64_t>(std::filesystem::last_write_time(filename, error).time_since_epoch().count());
+		return !error;
+	}
+
+	static bool LoadNameTable(const std::wstring& filename, std::vector <uint32_t>& indexes)
+	{
+		std::error_code error;
+		if (!std::filesystem::exists(filename + NAME_TABLE_EXTENSION, error))
+			return false;
+
+		SNameTableHeader stamp;
+		if (!GetArchiveStamp(filename, stamp.size, stamp.time))
+			return false;
+
+		CVFSFile file;
+		SNameTableHeader header;
+		if (!file.Open(filename + NAME_TABLE_EXTENSION) || file.Read(&header, sizeof(SNameTableHeader)) != sizeof(SNameTableHeader) ||
+			header.magic != NAME_TABLE_MAGIC || header.size != stamp.size || header.time != stamp.time ||
+			file.GetSize() != sizeof(SNameTableHeader) + static_cast<uint64_t>(header.count) * sizeof(uint32_t))
 		{
-			Unload();
+			return false;
+		}
 
-			delete static_cast<SArchiveData*>(m_archiveData);
-			m_archiveData = nullptr;
+		indexes.resize(header.count);
+		if (file.Read(indexes.data(), header.count * sizeof(uint32_t)) != header.count * sizeof(uint32_t) ||
+			XXH32(indexes.data(), indexes.size() * sizeof(uint32_t), 0) != header.hash)
+		{
+			indexes.clear();
+			return false;
 		}
+		return true;
 	}
 
-	bool CVFSArchive::Load(std::shared_ptr <CVFSFile> file, const uint8_t* key)
+	// Opens past the deadline are not recorded, reads never write the set themselves
+	static void RecordStartupEntry(SArchiveData* archive, uint32_t index)
 	{
-		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+		auto& startup = archive->startup;
+		if (std::chrono::steady_clock::now() < startup.deadline && startup.seen.insert(index).second)
+			startup.indexes.push_back(index);
+	}
 
-		Unload();
+	// Free extents are headed by an index 0 entry spanning all of their blocks
+	static void WriteFreeEntry(CVFSFile* file, const SFreeExtent& extent)
+	{
+		SFileEntry entry;
+		memset(&entry, 0, sizeof(SFileEntry));
+		entry.numBlocks = extent.blocks;
+		entry.offset = extent.start + sizeof(SFileEntry);
 
-		if (!file || !file.get())
+		file->SetPosition(extent.start, false);
+		file->Write(&entry, sizeof(SFileEntry));
+	}
+
+	// Places size bytes, header included, in free space or at the end of the file. Appended entries return where their blocks end.
+	static uint64_t PlaceEntry(SArchiveData* archive, CVFSFile* file, uint64_t size, SFileEntry& entry)
+	{
+		auto bytesperblock = archive->header.bytesPerBlock;
+		auto blocks = static_cast<uint32_t>(ALIGNTO(size, bytesperblock) / bytesperblock);
+
+		// Bulk builds only append, the layout stays one sequential run
+		SFreeExtent extent{}, remainder{};
+		if (!archive->bulk && archive->freeSpace.Allocate(blocks, extent, remainder))
 		{
-	//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Null VFS file ptr");
+			if (remainder.blocks)
+				WriteFreeEntry(file, remainder);
+
+			entry.numBlocks = extent.blocks;
+			entry.offset = extent.start + sizeof(SFileEntry);
+			return 0;
+		}
+
+		// Appended entries are written once, header and payload in sequence and the padding left to the file system
+		auto entrystart = file->GetSize();
+		entry.numBlocks = blocks;
+		entry.offset = entrystart + sizeof(SFileEntry);
+		return entrystart + static_cast<uint64_t>(blocks) * bytesperblock;
+	}
+
+	// Plain entries with a known content can share their payload, reserved, solid and streamed ones never do
+	static bool IsShareable(const SArchiveData* archive, const SFileInformation& info)
+	{
+		return info.contenthash && info.rawsize && !(info.flags & (FLAG_STREAMED | FLAG_SOLID_GROUP | FLAG_SOLID_INDEX | FLAG_SOLID_MEMBER)) &&
+			archive->dictionaryIndexes.find(info.index) == archive->dictionaryIndexes.end();
+	}
+
+	static void RegisterPayload(SArchiveData* archive, const SFileEntry& entry)
+	{
+		if (!entry.info.owner && IsShareable(archive, entry.info))
+			archive->contents.emplace(entry.info.contenthash, entry.info.index);
+	}
+
+	// The holder of the same content, a crypted entry only shares a crypted payload
+	static const SFileEntry* FindSharedPayload(const SArchiveData* archive, const SFileInformation& info)
+	{
+		if (!IsShareable(archive, info))
+			return nullptr;
+
+		auto content = archive->contents.find(info.contenthash);
+		if (content == archive->contents.end() || content->second == info.index)
+			return nullptr;
+
+		auto holder = archive->files.find(content->second);
+		if (holder == archive->files.end() || holder->second.info.rawsize != info.rawsize || holder->second.info.hash != info.hash ||
+			(holder->second.info.flags & FLAG_CRYPTED_AES256) != (info.flags & FLAG_CRYPTED_AES256))
+			return nullptr;
+		return &holder->second;
+	}
+
+	// A sharer decodes the bytes of its holder with its own fields, both have to describe the same payload
+	static bool IsSamePayload(const SFileInformation& holder, const SFileInformation& sharer)
+	{
+		return holder.flags == sharer.flags && holder.level == sharer.level && holder.dictionary == sharer.dictionary && holder.hash == sharer.hash &&
+			holder.contenthash == sharer.contenthash && holder.rawsize == sharer.rawsize && holder.compressedsize == sharer.compressedsize &&
+			holder.cryptedsize == sharer.cryptedsize;
+	}
+
+	// Sharers keep a header block of their own, the payload fields mirror the holder
+	static bool WriteSharedEntry(SArchiveData* archive, CVFSFile* file, const SFileEntry& holder, const SFileInformation& info)
+	{
+		SFileEntry entry = holder;
+		entry.info.index = info.index;
+		entry.info.version = info.version;
+		entry.info.owner = holder.info.index;
+		memcpy(entry.info.filename, info.filename, sizeof(entry.info.filename));
+		entry.finalSize = 0;
+
+		auto entryend = PlaceEntry(archive, file, sizeof(SFileEntry), entry);
+
+		if (!file->SetPosition(entry.offset - sizeof(SFileEntry), false) || file->Write(&entry, sizeof(SFileEntry)) != sizeof(SFileEntry) || (entryend && !file->Extend(entryend)))
 			return false;
+
+		archive->files.emplace(entry.info.index, entry);
+		archive->sharers[holder.info.index].push_back(entry.info.index);
+		return true;
+	}
+
+	// A freed extent takes the place of every header write inside it
+	static void AddFreeHeader(THeaderWrites& headers, const SFreeExtent& extent, uint32_t bytesperblock)
+	{
+		headers.erase(headers.lower_bound(extent.start), headers.lower_bound(extent.start + static_cast<uint64_t>(extent.blocks) * bytesperblock));
+
+		SFileEntry entry;
+		memset(&entry, 0, sizeof(SFileEntry));
+		entry.numBlocks = extent.blocks;
+		entry.offset = extent.start + sizeof(SFileEntry);
+		headers.emplace(extent.start, entry);
+	}
+
+	static bool WriteHeaders(CVFSFile* file, const THeaderWrites& headers)
+	{
+		for (const auto& header : headers)
+		{
+			if (!file->SetPosition(header.first, false) || file->Write(&header.second, sizeof(SFileEntry)) != sizeof(SFileEntry))
+				return false;
 		}
+		return true;
+	}
 
-		if (!file->IsReadable())
+	// Takes the entry out of the archive and returns the blocks it freed. A payload other entries still share
+	// is handed to the first of them, which takes over the header in front of it and gives up its own block.
+	static SFreeExtent ReleaseEntry(SArchiveData* archive, uint32_t index, THeaderWrites& headers)
+	{
+		auto iter = archive->files.find(index);
+		SFileEntry entry = iter->second;
+		archive->files.erase(iter);
+
+		if (entry.info.owner)
 		{
-//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "VFS archive not readable");
-			file.reset();
-			return false;
+			auto holder = archive->sharers.find(entry.info.owner);
+			if (holder != archive->sharers.end())
+			{
+				holder->second.erase(std::remove(holder->second.begin(), holder->second.end(), index), holder->second.end());
+				if (holder->second.empty())
+					archive->sharers.erase(holder);
+			}
+			return archive->freeSpace.Release(entry.offset - sizeof(SFileEntry), entry.numBlocks);
+		}
+
+		auto sharers = archive->sharers.find(index);
+		if (sharers == archive->sharers.end())
+		{
+			auto content = archive->contents.find(entry.info.contenthash);
+			if (content != archive->contents.end() && content->second == index)
+				archive->contents.erase(content);
+			return archive->freeSpace.Release(entry.offset - sizeof(SFileEntry), entry.numBlocks);
+		}
+
+		auto remaining = std::move(sharers->second);
+		archive->sharers.erase(sharers);
+
+		auto heir = remaining.front();
+		remaining.erase(remaining.begin());
+
+		auto& shared = archive->files[heir];
+		auto extent = archive->freeSpace.Release(shared.offset - sizeof(SFileEntry), shared.numBlocks);
+
+		SFileEntry promoted = entry;
+		promoted.info.index = heir;
+		promoted.info.version = shared.info.version;
+		memcpy(promoted.info.filename, shared.info.filename, sizeof(promoted.info.filename));
+		shared = promoted;
+		headers[entry.offset - sizeof(SFileEntry)] = shared;
+
+		// Load follows the owner fields, a sharer whose header was not rewritten yet finds the heir by its payload
+		for (auto other : remaining)
+		{
+			auto& sharer = archive->files[other];
+			sharer.info.owner = heir;
+			headers[sharer.offset - sizeof(SFileEntry)] = sharer;
+		}
+		if (!remaining.empty())
+			archive->sharers.emplace(heir, std::move(remaining));
+
+		auto content = archive->contents.find(entry.info.contenthash);
+		if (content != archive->contents.end() && content->second == index)
+			content->second = heir;
+
+		return extent;
+	}
+
+	// Staged entries replace their committed copy only at Commit. A solid member has no blocks of its own to release,
+	// it leaves its group only with a batch that replaces the member table too, a patch does so.
+	static bool StageBatchEntry(SArchiveData* archive, const SFileEntry& entry, const void* payload)
+	{
+		auto& batch = archive->batch;
+
+		auto existing = archive->files.find(entry.info.index);
+		auto member = existing != archive->files.end() && (existing->second.info.flags & FLAG_SOLID_MEMBER);
+		if (member)
+		{
+			auto location = archive->solidMembers.find(entry.info.index);
+			auto table = location != archive->solidMembers.end() ? CVFSArchive::GenerateNameIndex(GetSolidIndexName(location->second.group)) : 0;
+			if (!table || (batch.positions.find(table) == batch.positions.end() && batch.releases.find(table) == batch.releases.end()))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Solid member %p can not written inside a batch", entry.info.index);
+				return false;
+			}
+		}
+
+		SBatchEntry staged{ entry, DataBuffer(payload, static_cast<uint32_t>(entry.finalSize)) };
+
+		auto iter = batch.positions.find(entry.info.index);
+		if (iter != batch.positions.end())
+		{
+			batch.writes[iter->second] = std::move(staged);
 		}
+		else
+		{
+			batch.positions.emplace(entry.info.index, batch.writes.size());
+			batch.writes.push_back(std::move(staged));
+		}
+
+		if (existing != archive->files.end() && !member)
+			batch.releases.insert(entry.info.index);
+		return true;
+	}
+
+	static bool StageBatchDelete(SArchiveData* archive, uint32_t index)
+	{
+		auto& batch = archive->batch;
+
+		auto iter = archive->files.find(index);
+		if (iter != archive->files.end() && (iter->second.info.flags & FLAG_SOLID_MEMBER))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Solid member %p can not deleted inside a batch", index);
+			return false;
+		}
+
+		auto staged = batch.positions.find(index);
+		auto found = staged != batch.positions.end();
+		if (found)
+		{
+			batch.writes.erase(batch.writes.begin() + staged->second);
+			batch.positions.clear();
+			for (std::size_t i = 0; i < batch.writes.size(); ++i)
+			{
+				batch.positions.emplace(batch.writes[i].entry.info.index, i);
+			}
+		}
+
+		if (iter != archive->files.end())
+		{
+			batch.releases.insert(index);
+			found = true;
+		}
+		return found;
+	}
+
+	static uint32_t HashBatchJournal(const DataBuffer& record)
+	{
+		SBatchJournal journal;
+		memcpy(&journal, record.get_data(), sizeof(SBatchJournal));
+		journal.hash = 0;
+
+		auto state = XXH32_createState();
+		XXH32_reset(state, 0);
+		XXH32_update(state, &journal, sizeof(SBatchJournal));
+		XXH32_update(state, record.get_data() + sizeof(SBatchJournal), record.get_size() - sizeof(SBatchJournal));
+		auto hash = XXH32_digest(state);
+		XXH32_freeState(state);
+		return hash;
+	}
+
+	// A missing, torn or foreign journal means the batch never committed. One the archive moved on from since is left over
+	// from a commit that completed, replaying it would undo the later changes.
+	static bool ReadBatchJournal(CVFSFile* archivefile, const std::wstring& filename, THeaderWrites& headers)
+	{
+		std::error_code error;
+		if (!std::filesystem::exists(filename, error))
+			return false;
+
+		CVFSFile file;
+		if (!file.Open(filename) || file.GetSize() < sizeof(SBatchJournal))
+			return false;
+
+		DataBuffer record(static_cast<uint32_t>(file.GetSize()));
+		if (file.Read(record.get_data(), record.get_size()) != record.get_size())
+			return false;
+
+		SBatchJournal journal;
+		memcpy(&journal, record.get_data(), sizeof(SBatchJournal));
+		if (journal.magic != BATCH_JOURNAL_MAGIC || record.get_size() != sizeof(SBatchJournal) + static_cast<uint64_t>(journal.count) * sizeof(SJournalHeader) ||
+			journal.hash != HashBatchJournal(record))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Incomplete batch journal %ls ignored", filename.c_str());
+			return false;
+		}
+
+		auto records = reinterpret_cast<const SJournalHeader*>(record.get_data() + sizeof(SBatchJournal));
+		auto stale = journal.size != archivefile->GetSize();
+		for (uint32_t i = 0; !stale && i < journal.count; ++i)
+		{
+			SFileEntry current;
+			archivefile->SetPosition(records[i].position, false);
+			stale = archivefile->Read(&current, sizeof(SFileEntry)) != sizeof(SFileEntry) ||
+				(memcmp(&current, &records[i].entry, sizeof(SFileEntry)) && memcmp(&current, &records[i].previous, sizeof(SFileEntry)));
+		}
+		if (stale)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Stale batch journal %ls ignored", filename.c_str());
+			return false;
+		}
+
+		for (uint32_t i = 0; i < journal.count; ++i)
+		{
+			headers[records[i].position] = records[i].entry;
+		}
+		return true;
+	}
+
+	static bool WriteBatchJournal(CVFSFile* archivefile, const std::wstring& filename, const THeaderWrites& headers)
+	{
+		DataBuffer record(static_cast<uint32_t>(sizeof(SBatchJournal) + headers.size() * sizeof(SJournalHeader)));
+
+		auto journal = record.get_data<SBatchJournal>();
+		journal->magic = BATCH_JOURNAL_MAGIC;
+		journal->count = static_cast<uint32_t>(headers.size());
+		journal->hash = 0;
+		journal->size = archivefile->GetSize();
+
+		auto records = reinterpret_cast<SJournalHeader*>(record.get_data() + sizeof(SBatchJournal));
+		for (const auto& header : headers)
+		{
+			records->position = header.first;
+			records->entry = header.second;
+
+			if (!archivefile->SetPosition(header.first, false) || archivefile->Read(&records->previous, sizeof(SFileEntry)) != sizeof(SFileEntry))
+				return false;
+			++records;
+		}
+		journal->hash = HashBatchJournal(record);
+
+		CVFSFile file;
+		return file.Create(filename) && file.Write(record.get_data(), record.get_size()) == record.get_size() && file.Sync();
+	}
+
+	// Writers are turned away while a streamed write or a compaction owns the layout
+	static bool IsLayoutLocked(const SArchiveData* archive)
+	{
+		return archive->streaming || archive->compact.active;
+	}
+
+	// Live entries own their blocks, solid members only point into their group
+	static std::vector <uint32_t> GetEntriesByOffset(const SArchiveData* archive)
+	{
+		std::vector <std::pair <uint64_t, uint32_t>> entries;
+		entries.reserve(archive->files.size());
+		for (const auto& it : archive->files)
+		{
+			if (!(it.second.info.flags & FLAG_SOLID_MEMBER))
+				entries.emplace_back(it.second.offset, it.first);
+		}
+		std::sort(entries.begin(), entries.end());
+
+		std::vector <uint32_t> result;
+		result.reserve(entries.size());
+		for (const auto& entry : entries)
+		{
+			result.push_back(entry.second);
+		}
+		return result;
+	}
+
+	// Front to back in bounded chunks, a lower target may overlap the source
+	static bool CopyRange(CVFSFile* file, uint64_t from, uint64_t to, uint64_t size, DataBuffer& scratch)
+	{
+		for (uint64_t done = 0; done < size;)
+		{
+			auto length = static_cast<uint32_t>(std::min<uint64_t>(size - done, scratch.get_size()));
+			if (!file->SetPosition(from + done, false) || file->Read(scratch.get_data(), length) != length)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "%u bytes at %llu can not read", length, from + done);
+				return false;
+			}
+			if (!file->SetPosition(to + done, false) || file->Write(scratch.get_data(), length) != length)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "%u bytes at %llu can not written", length, to + done);
+				return false;
+			}
+			done += length;
+		}
+		return true;
+	}
+
+	// Copies an entry behind the end of the file. The copy is claimed as free space before anything lands there
+	// and the old blocks are freed only once the new header is written, a cut at any point leaves one valid entry.
+	static bool RelocateEntry(CVFSFile* file, SFileEntry& entry, uint64_t bytesperblock, DataBuffer& scratch)
+	{
+		auto start = entry.offset - sizeof(SFileEntry);
+		auto blocks = static_cast<uint32_t>((entry.finalSize + sizeof(SFileEntry) + bytesperblock - 1) / bytesperblock);
+		auto target = file->GetSize();
+
+		WriteFreeEntry(file, { target, blocks });
+		if (!CopyRange(file, start + sizeof(SFileEntry), target + sizeof(SFileEntry), entry.finalSize, scratch))
+			return false;
+		file->Extend(target + static_cast<uint64_t>(blocks) * bytesperblock);
+
+		SFreeExtent extent{ start, entry.numBlocks };
+		entry.numBlocks = blocks;
+		entry.offset = target + sizeof(SFileEntry);
+
+		// Each write reaches the disk before the next one relies on it
+		if (!file->Sync() || !file->SetPosition(target, false) || file->Write(&entry, sizeof(SFileEntry)) != sizeof(SFileEntry) || !file->Sync())
+			return false;
+
+		WriteFreeEntry(file, extent);
+		return true;
+	}
+
+	// The gaps between the live entries, used when a compaction stops half way
+	static void RebuildFreeSpace(SArchiveData* archive, uint64_t fileend)
+	{
+		auto bytesperblock = archive->header.bytesPerBlock;
+		archive->freeSpace.Reset(bytesperblock);
+
+		uint64_t position = archive->header.firstEntry;
+		for (auto index : GetEntriesByOffset(archive))
+		{
+			const auto& entry = archive->files[index];
+			auto start = entry.offset - sizeof(SFileEntry);
+			if (start > position)
+				archive->freeSpace.Release(position, static_cast<uint32_t>((start - position) / bytesperblock));
+			position = start + static_cast<uint64_t>(entry.numBlocks) * bytesperblock;
+		}
+		if (fileend > position)
+			archive->freeSpace.Release(position, static_cast<uint32_t>((fileend - position) / bytesperblock));
+	}
+
+
+	CVFSArchive::CVFSArchive() :
+		m_compressionProfile(DEFAULT_COMPRESSION_PROFILE), m_generation(0)
+	{
+//		assert(!m_archiveData);
+		m_archiveData = new SArchiveData();
+
+		for (uint8_t id = 1; id <= MAX_DICTIONARY_ID; ++id)
+		{
+			static_cast<SArchiveData*>(m_archiveData)->dictionaryIndexes.emplace(GenerateNameIndex(GetDictionaryName(id)), id);
+		}
+	}
+	CVFSArchive::~CVFSArchive()
+	{
+//		assert(m_archiveData == this);
+
+		if (m_archiveData)
+		{
+			Unload();
+
+			delete static_cast<SArchiveData*>(m_archiveData);
+			m_archiveData = nullptr;
+		}
+	}
+
+	bool CVFSArchive::Load(std::shared_ptr <CVFSFile> file, const uint8_t* key)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		Unload();
+
+		if (!file || !file.get())
+		{
+	//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Null VFS file ptr");
+			return false;
+		}
+
+		if (!file->IsReadable())
+		{
+//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "VFS archive not readable");
+			file.reset();
+			return false;
+		}
+
+		if (!key)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Null key data");
+			file.reset();
+			return false;
+		}
+
+		m_vfsFile = file;
+		memcpy(m_archiveKey, key, VFS::KEY_LENGTH);
+
+		m_vfsFile->SetPosition(0, false);
+		if (m_vfsFile->Read(&static_cast<SArchiveData*>(m_archiveData)->header, sizeof(SArchiveHeader)) != sizeof(SArchiveHeader))
+		{
+//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "VFS archive: %ls header can not read", file->GetFileNameA().c_str());
+			file.reset();
+			memset(m_archiveKey, 0, VFS::KEY_LENGTH);
+			return false;
+		}
+
+		if ((static_cast<SArchiveData*>(m_archiveData)->header.magic & 0xffff) != ARCHIVE_MAGIC)
+		{
+//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "VFS archive: %ls Wrong magic", file->GetFileNameA().c_str());
+			m_vfsFile.reset();
+			memset(m_archiveKey, 0, VFS::KEY_LENGTH);
+			return false;
+		}
+
+		if (!IsKnownLayout(static_cast<SArchiveData*>(m_archiveData)->header))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "VFS archive: %ls unsupported version: %u expected: %u",
+				file->GetFileName().c_str(), GetLayoutVersion(static_cast<SArchiveData*>(m_archiveData)->header), ARCHIVE_VERSION);
+			m_vfsFile.reset();
+			memset(m_archiveKey, 0, VFS::KEY_LENGTH);
+			return false;
+		}
+
+		// Archives of the first layout are only read, Merge or CopyArchive into a new archive upgrades them
+		auto legacy = GetLayoutVersion(static_cast<SArchiveData*>(m_archiveData)->header) == 0;
+		if (legacy && m_vfsFile->IsWriteable())
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "VFS archive: %ls has the first layout and can not be written, copy it into a new archive",
+				file->GetFileName().c_str());
+			m_vfsFile.reset();
+			memset(m_archiveKey, 0, VFS::KEY_LENGTH);
+			return false;
+		}
+		auto headersize = legacy ? sizeof(SLegacyFileEntry) : sizeof(SFileEntry);
+
+		static_cast<SArchiveData*>(m_archiveData)->freeSpace.Reset(static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock);
+
+		// A committed batch whose journal was not applied yet is read as if it was
+		THeaderWrites journal;
+		auto journalfile = file->GetFileName() + BATCH_JOURNAL_EXTENSION;
+		auto replay = !legacy && ReadBatchJournal(m_vfsFile.get(), journalfile, journal);
+
+		// Second copies of an entry, their blocks are handed back once the walk is done
+		THeaderWrites stale;
+
+		m_vfsFile->SetPosition(static_cast<SArchiveData*>(m_archiveData)->header.firstEntry, false);
+		while (m_vfsFile->GetPosition() < m_vfsFile->GetSize())
+		{
+			auto position = m_vfsFile->GetPosition();
+
+			SFileEntry entry;
+			auto read = legacy ? ReadLegacyEntry(m_vfsFile.get(), entry) : m_vfsFile->Read(&entry, sizeof(SFileEntry)) == sizeof(SFileEntry);
+			auto overlay = journal.find(position);
+			if (overlay != journal.end())
+				entry = overlay->second;
+
+			// A header pointing anywhere but behind itself would send the walk back or across other entries
+			if (!read || entry.numBlocks == 0 || entry.offset != position + headersize ||
+				entry.finalSize + headersize > static_cast<uint64_t>(entry.numBlocks) * static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Corrupted entry at: %llu", m_vfsFile->GetPosition());
+				Unload();
+				return false;
+			}
+
+			if (entry.info.index == 0)
+			{
+				static_cast<SArchiveData*>(m_archiveData)->freeSpace.Release(entry.offset - sizeof(SFileEntry), entry.numBlocks);
+
+				// A streamed write cut short claims its blocks ahead of the data, the free space has to exist before it is handed out
+				auto end = entry.offset - sizeof(SFileEntry) + static_cast<uint64_t>(entry.numBlocks) * static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock;
+				if (end > m_vfsFile->GetSize() && m_vfsFile->IsWriteable())
+					m_vfsFile->Extend(end);
+			}
+			else
+			{
+				// A sharer promoted to holder may still find its old block, the holder wins. Two copies of the same kind are left by
+				// a cut compaction step or rewrite, the higher version wins and then the later one in the file. The other one is free.
+				auto inserted = static_cast<SArchiveData*>(m_archiveData)->files.insert({ entry.info.index, entry });
+				auto& existing = inserted.first->second;
+				if (!inserted.second)
+				{
+					auto replace = !existing.info.owner != !entry.info.owner ? !entry.info.owner : entry.info.version >= existing.info.version;
+					const auto& copy = replace ? existing : entry;
+					SFreeExtent extent{ copy.offset - headersize, copy.numBlocks };
+
+					gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Second copy of: %p at: %llu is freed", entry.info.index, extent.start);
+					static_cast<SArchiveData*>(m_archiveData)->freeSpace.Release(extent.start, extent.blocks);
+					AddFreeHeader(stale, extent, static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock);
+					if (replace)
+						existing = entry;
+				}
+			}
+
+			m_vfsFile->SetPosition(entry.offset - headersize + (static_cast<uint64_t>(entry.numBlocks) * static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock), false);
+		}
+
+		// Applied or never committed, either way the journal is done with
+		if (m_vfsFile->IsWriteable())
+		{
+			auto done = true;
+			if (replay)
+				done = WriteHeaders(m_vfsFile.get(), journal) && m_vfsFile->Sync();
+			if (done)
+				DeleteFileW(journalfile.c_str());
+
+			// Not found again on the next load
+			if (!legacy && !stale.empty() && !(WriteHeaders(m_vfsFile.get(), stale) && m_vfsFile->Sync()))
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Second copies in: %ls can not freed", file->GetFileName().c_str());
+		}
+
+		// Sharers stay with the holder written in their header. One left behind by a cut delete takes any holder
+		// of the very same payload, content alone is not enough as the same content may be coded differently.
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		for (const auto& it : archive->files)
+		{
+			RegisterPayload(archive, it.second);
+		}
+		for (auto& it : archive->files)
+		{
+			if (!it.second.info.owner)
+				continue;
+
+			auto holder = archive->files.find(it.second.info.owner);
+			if (holder == archive->files.end() || holder->second.info.owner || !IsSamePayload(holder->second.info, it.second.info))
+			{
+				auto content = archive->contents.find(it.second.info.contenthash);
+				holder = content != archive->contents.end() ? archive->files.find(content->second) : archive->files.end();
+				if (holder == archive->files.end() || !IsSamePayload(holder->second.info, it.second.info))
+				{
+					holder = std::find_if(archive->files.begin(), archive->files.end(), [&it](const std::pair <const uint32_t, SFileEntry>& candidate) {
+						return !candidate.second.info.owner && IsSamePayload(candidate.second.info, it.second.info);
+					});
+				}
+			}
+			if (holder == archive->files.end())
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Shared payload of: %p is missing", it.first);
+				Unload();
+				return false;
+			}
+			it.second.info.owner = holder->first;
+			archive->sharers[holder->first].push_back(it.first);
+		}
+
+		std::vector <uint32_t> solidindexes;
+		for (const auto& it : static_cast<SArchiveData*>(m_archiveData)->files)
+		{
+			if (it.second.info.flags & FLAG_SOLID_INDEX)
+				solidindexes.push_back(it.first);
+		}
+		for (auto index : solidindexes)
+		{
+			if (!LoadSolidIndex(index))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Corrupted solid index: %p", index);
+				Unload();
+				return false;
+			}
+		}
+
+//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "VFS archive: %ls loaded", file->GetFileNameA().c_str());
+		return true;
+	}
+
+	bool CVFSArchive::Create(std::shared_ptr <CVFSFile> file, const uint8_t* keydata)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		if (!file || !file.get())
+		{
+//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Null VFS file ptr");
+			return false;
+		}
+
+		if (!file->IsWriteable())
+		{
+//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "VFS archive not writeable");
+			return false;
+		}
+
+		if (!Load(file, keydata))
+		{
+			// An archive of another layout is not written over
+			SArchiveHeader existing;
+			file->SetPosition(0, false);
+			if (file->Read(&existing, sizeof(SArchiveHeader)) == sizeof(SArchiveHeader) && (existing.magic & 0xffff) == ARCHIVE_MAGIC &&
+				GetLayoutVersion(existing) != ARCHIVE_VERSION)
+			{
+				return false;
+			}
+
+			m_vfsFile = file;
+			memcpy(m_archiveKey, keydata, VFS::KEY_LENGTH);
+
+			auto header = &static_cast<SArchiveData*>(m_archiveData)->header;
+			header->magic = ARCHIVE_MAGIC | (ARCHIVE_VERSION << 16);
+
+			SYSTEM_INFO sysInfo{};
+			GetSystemInfo(&sysInfo);
+
+			if (!sysInfo.dwPageSize)
+				header->bytesPerBlock = 4096;
+			else
+				header->bytesPerBlock = sysInfo.dwPageSize;
+
+			header->firstEntry = ALIGNTO(sizeof(SArchiveHeader), header->bytesPerBlock);
+
+			m_vfsFile->SetPosition(0, false);
+			m_vfsFile->Write(header, sizeof(SArchiveHeader));
+
+			// The padding up to the first entry is left to the file system
+			m_vfsFile->Extend(header->firstEntry);
+		}
+		return true;
+	}
+
+	bool CVFSArchive::Reload()
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		auto file = m_vfsFile;
+		if (!file || !file.get())
+			return false;
+
+		uint8_t key[VFS::KEY_LENGTH];
+		memcpy(key, m_archiveKey, VFS::KEY_LENGTH);
+
+		auto result = Load(file, key);
+		memset(key, 0, VFS::KEY_LENGTH);
+		return result;
+	}
+
+	bool CVFSArchive::Probe(const std::wstring& filename, bool* startup, std::vector <uint32_t>* names)
+	{
+		CVFSFile file;
+		SArchiveHeader header;
+		if (!file.Open(filename) || file.Read(&header, sizeof(SArchiveHeader)) != sizeof(SArchiveHeader))
+		{
+			return false;
+		}
+
+		if (!IsKnownLayout(header))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "VFS archive: %ls is not a valid archive of version: %u", filename.c_str(), ARCHIVE_VERSION);
+			return false;
+		}
+
+		if (startup)
+		{
+			std::error_code error;
+			*startup = std::filesystem::exists(filename + STARTUP_SET_EXTENSION, error);
+		}
+		if (names && !LoadNameTable(filename, *names))
+		{
+			names->clear();
+		}
+		return true;
+	}
+
+	bool CVFSArchive::SaveNameTable() const
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		if (!m_vfsFile || !m_vfsFile.get())
+			return false;
+
+		std::vector <uint32_t> indexes;
+		indexes.reserve(static_cast<SArchiveData*>(m_archiveData)->files.size());
+		for (const auto& it : static_cast<SArchiveData*>(m_archiveData)->files)
+		{
+			if (!IsReserved(it.first))
+				indexes.push_back(it.first);
+		}
+		std::sort(indexes.begin(), indexes.end());
+
+		auto filename = m_vfsFile->GetFileName();
+
+		SNameTableHeader header;
+		header.magic = NAME_TABLE_MAGIC;
+		header.count = static_cast<uint32_t>(indexes.size());
+		header.hash = XXH32(indexes.data(), indexes.size() * sizeof(uint32_t), 0);
+		if (!GetArchiveStamp(filename, header.size, header.time))
+			return false;
+
+		CVFSFile file;
+		return file.Create(filename + NAME_TABLE_EXTENSION) && file.Write(&header, sizeof(SNameTableHeader)) == sizeof(SNameTableHeader) &&
+			file.Write(indexes.data(), header.count * sizeof(uint32_t)) == header.count * sizeof(uint32_t);
+	}
+
+	void CVFSArchive::Unload()
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		// Written to, the name table is saved with the archive rather than on the first run reading it
+		auto changed = m_generation != static_cast<SArchiveData*>(m_archiveData)->loadedGeneration;
+		if (changed && m_vfsFile && m_vfsFile->IsWriteable() && m_vfsFile->Flush())
+			SaveNameTable();
+
+		m_generation = ++gs_archiveGenerations;
+		static_cast<SArchiveData*>(m_archiveData)->loadedGeneration = m_generation;
+
+		memset(m_archiveKey, 0, VFS::KEY_LENGTH);
+
+		// Cut short, what was recorded so far is still the start of the next run. Not at exit, the log is gone by then.
+		auto& startup = static_cast<SArchiveData*>(m_archiveData)->startup;
+		if (startup.active && m_vfsFile && gs_pVFSLogInstance)
+			WriteStartupSet(m_vfsFile->GetFileName(), startup.indexes);
+
+		static_cast<SArchiveData*>(m_archiveData)->freeSpace.Reset(0);
+		static_cast<SArchiveData*>(m_archiveData)->files.clear();
+		static_cast<SArchiveData*>(m_archiveData)->dictionaries.clear();
+		static_cast<SArchiveData*>(m_archiveData)->solidGroups.clear();
+		static_cast<SArchiveData*>(m_archiveData)->solidMembers.clear();
+		static_cast<SArchiveData*>(m_archiveData)->solidCache.clear();
+		static_cast<SArchiveData*>(m_archiveData)->solidCacheSize = 0;
+		static_cast<SArchiveData*>(m_archiveData)->streaming = nullptr;
+		static_cast<SArchiveData*>(m_archiveData)->bulk = false;
+		static_cast<SArchiveData*>(m_archiveData)->compact = SCompactState();
+		static_cast<SArchiveData*>(m_archiveData)->batch = SBatchState();
+		static_cast<SArchiveData*>(m_archiveData)->contents.clear();
+		static_cast<SArchiveData*>(m_archiveData)->sharers.clear();
+		static_cast<SArchiveData*>(m_archiveData)->startup = SStartupState();
+
+		memset(&static_cast<SArchiveData*>(m_archiveData)->header, 0, sizeof(SArchiveHeader));
+		m_vfsFile.reset();
+	}
+
+	std::shared_ptr <CVFSFile> CVFSArchive::GetFileStream() const
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+		
+		return m_vfsFile;
+	}
+
+	void CVFSArchive::SetCompressionProfile(const SCompressionProfile& profile)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		m_compressionProfile = profile;
+	}
+	const SCompressionProfile& CVFSArchive::GetCompressionProfile() const
+	{
+		return m_compressionProfile;
+	}
+
+	uint64_t CVFSArchive::GetGeneration() const
+	{
+		return m_generation;
+	}
+
+	std::wstring CVFSArchive::GetDictionaryName(uint8_t id)
+	{
+		return L"$vfs/dictionary/" + std::to_wstring(id);
+	}
+
+	bool CVFSArchive::IsReserved(uint32_t index) const
+	{
+		const auto& indexes = static_cast<SArchiveData*>(m_archiveData)->dictionaryIndexes;
+		if (indexes.find(index) != indexes.end())
+			return true;
+
+		auto iter = static_cast<SArchiveData*>(m_archiveData)->files.find(index);
+		return iter != static_cast<SArchiveData*>(m_archiveData)->files.end() && (iter->second.info.flags & (FLAG_SOLID_GROUP | FLAG_SOLID_INDEX));
+	}
+
+	bool CVFSArchive::HasDictionary(uint8_t id) const
+	{
+		if (id == 0 || id > MAX_DICTIONARY_ID)
+			return false;
+
+		return Exists(GetDictionaryName(id));
+	}
+
+	bool CVFSArchive::SetDictionary(uint8_t id, const void* data, uint32_t size, uint8_t flags)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		if (id == 0 || id > MAX_DICTIONARY_ID || !data || size == 0 || size > MAX_DICTIONARY_SIZE)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Invalid dictionary: %u size: %u", id, size);
+			return false;
+		}
+
+		// Entries compressed against the current content would no longer decode
+		auto index = GenerateNameIndex(GetDictionaryName(id));
+		auto iter = static_cast<SArchiveData*>(m_archiveData)->files.find(index);
+		if (iter != static_cast<SArchiveData*>(m_archiveData)->files.end() && iter->second.info.hash != XXH32(data, size, 0))
+		{
+			for (const auto& file : static_cast<SArchiveData*>(m_archiveData)->files)
+			{
+				if (file.second.info.dictionary == id)
+				{
+					gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Dictionary: %u is in use and can not be replaced", id);
+					return false;
+				}
+			}
+		}
+
+		static const SCompressionProfile storeprofile = { 0, 1.0f, 0, 0 };
+		if (!Write(GetDictionaryName(id), data, size, flags & FLAG_CRYPTED_AES256, 0, &storeprofile))
+			return false;
+
+		static_cast<SArchiveData*>(m_archiveData)->dictionaries.erase(id);
+		return true;
+	}
+
+	const DataBuffer* CVFSArchive::GetDictionary(uint8_t id) const
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		auto& dictionaries = static_cast<SArchiveData*>(m_archiveData)->dictionaries;
+		auto iter = dictionaries.find(id);
+		if (iter != dictionaries.end())
+			return &iter->second;
+
+		auto file = Open(GetDictionaryName(id));
+		if (!file || !file.get())
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Dictionary: %u not found", id);
+			return nullptr;
+		}
+
+		// LZ4HC reads up to a word past the end of an external dictionary while matching against it
+		auto& dictionary = dictionaries[id];
+		dictionary.set_capacity(static_cast<uint32_t>(file->GetSize()) + sizeof(uint32_t));
+		dictionary.set_size(static_cast<uint32_t>(file->GetSize()));
+		memcpy(dictionary.get_data(), file->GetData(), dictionary.get_size());
+		return &dictionary;
+	}
+
+	uint32_t CVFSArchive::GenerateNameIndex(std::wstring filename)
+	{
+		for (size_t i = 0; i < filename.size(); ++i)
+		{
+			if (filename[i] == L'\\')
+			{
+				filename[i] = L'/';
+			}
+		}
+
+		std::transform(filename.begin(), filename.end(), filename.begin(), towlower);
+
+		auto hash = XXH32(filename.c_str(), filename.size() * sizeof(wchar_t), 0);
+//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "%ls(%u) : %p", filename.c_str(), filename.size() * sizeof(wchar_t), hash);
+
+		return hash;
+	}
+
+	bool CVFSArchive::Exists(uint32_t index) const
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+	//	gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "coming idx: %u", index);			
+
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		if (archive)
+		{
+			/*
+			for (const auto& file : archive->files)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "filename %ls, index %u",
+					file.second.info.filename, file.second.info.index);			
+			}
+			*/
+
+			return archive->files.find(index) != archive->files.end();
+		}
+
+		return false;
+	}
+
+	bool CVFSArchive::Exists(const std::wstring& filename) const
+	{
+		return Exists(GenerateNameIndex(filename));
+	}
+	bool CVFSArchive::Exists(const std::string& filename) const
+	{
+		auto wstfilename = std::wstring(filename.begin(), filename.end());
+		return Exists(GenerateNameIndex(wstfilename));
+	}
+
+	std::shared_ptr<CVFSFile> CVFSArchive::Open(uint32_t index, const std::wstring& filename) const
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		std::shared_ptr <CVFSFile> output;
+
+		auto iter = static_cast<SArchiveData*>(m_archiveData)->files.find(index);
+		if (iter == static_cast<SArchiveData*>(m_archiveData)->files.end())
+		{
+//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "File not found for: %p(%ls)", index, filename.c_str());
+			return output;
+		}
+//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "%u %ls %u", index, iter->second.info.filename, iter->second.finalSize);
+
+		if (static_cast<SArchiveData*>(m_archiveData)->startup.active)
+			RecordStartupEntry(static_cast<SArchiveData*>(m_archiveData), index);
+
+		// Entries are read through their own handles, buffered bulk writes have to reach the file first
+		if (m_vfsFile)
+			m_vfsFile->Flush();
+
+		if (iter->second.info.flags & FLAG_SOLID_MEMBER)
+			return OpenSolidMember(iter->second.info);
+
+		// Sharers carry the coding of the payload they point at, its bytes are read from the holder
+		auto entry = iter->second;
+		if (entry.info.owner)
+		{
+			auto holder = static_cast<SArchiveData*>(m_archiveData)->files.find(entry.info.owner);
+			if (holder == static_cast<SArchiveData*>(m_archiveData)->files.end())
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Shared payload of: %p is missing", index);
+				return output;
+			}
+			entry.offset = holder->second.offset;
+			entry.finalSize = holder->second.finalSize;
+		}
+
+		if (entry.info.flags & FLAG_STREAMED)
+		{
+			auto source = std::make_shared<CVFSArchiveFrameSource>();
+			if (!source->Initialize(m_vfsFile->GetFileName(), entry, m_archiveKey))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Stream of: %ls can NOT opened", entry.info.filename);
+				return output;
+			}
+
+			output = std::make_shared<CVFSFile>();
+			if (!output || !output.get() || !output->AssignStream(entry.info.filename, source))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Output file can NOT created!");
+				output.reset();
+			}
+			return output;
+		}
+
+		if (entry.info.flags & FLAG_CHUNKED)
+		{
+			const DataBuffer* dictionary = nullptr;
+			if (entry.info.dictionary && !(dictionary = GetDictionary(entry.info.dictionary)))
+				return output;
+
+			auto source = std::make_shared<CVFSArchiveChunkSource>();
+			if (!source->Initialize(m_vfsFile->GetFileName(), entry, m_archiveKey, dictionary))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Chunk table of: %ls is corrupted", entry.info.filename);
+				return output;
+			}
+
+			output = std::make_shared<CVFSFile>();
+			if (!output || !output.get() || !output->AssignStream(entry.info.filename, source))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Output file can NOT created!");
+				output.reset();
+			}
+			return output;
+		}
+
+		output = std::make_shared<CVFSFile>();
+		if (!output || !output.get() || !output->Open(m_vfsFile->GetFileName()))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Output file can NOT created!");
+			output.reset();
+			return output;
+		}
+		output->SetPosition(entry.offset);
+
+		// Whole entry decoding is bound to 32-bit buffers, larger entries are always chunked or streamed
+		if (entry.finalSize > 0xffffffff || entry.info.rawsize > 0xffffffff)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Entry too large to decode at once: %llu", entry.info.rawsize);
+			output.reset();
+			return output;
+		}
+		auto finalsize = static_cast<uint32_t>(entry.finalSize);
+		auto rawsize = static_cast<uint32_t>(entry.info.rawsize);
+
+		CVFSScratchScope scratch;
+
+		DataBuffer decompressed;
+		if (!(entry.info.flags & (FLAG_CRYPTED_AES256 | FLAG_COMPRESSED_LZ4)))
+		{
+			// Stored as raw, read straight into the buffer handed over to the output file
+			decompressed.set_size(finalsize);
+			auto readsize = output->Read(decompressed.get_data(), finalsize);
+			if (readsize != finalsize)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Read size mismatch: %u-%u", readsize, finalsize);
+				output.reset();
+				return output;
+			}
+		}
+		else
+		{
+			auto rawdata = scratch.Arena().AllocateArray<char>(finalsize);
+			auto readsize = output->Read(rawdata, finalsize);
+			if (readsize != finalsize)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Read size mismatch: %u-%u", readsize, finalsize);
+				output.reset();
+				return output;
+			}
+
+			const char* source = rawdata;
+			uint32_t sourcesize = finalsize;
+			DataBuffer decrypted;
+			if (entry.info.flags & FLAG_CRYPTED_AES256)
+			{
+				CAes256 aeshelper;
+				decrypted = aeshelper.Decrypt(reinterpret_cast<const uint8_t*>(rawdata), finalsize, ARCHIVE_IV, &m_archiveKey[0]);
+				source = decrypted.get_data();
+				sourcesize = decrypted.get_size();
+			}
+
+			if (entry.info.flags & FLAG_COMPRESSED_LZ4)
+			{
+				if (sourcesize != entry.info.compressedsize)
+				{
+					gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Compressed size mismatch: %u-%llu", sourcesize, entry.info.compressedsize);
+					output.reset();
+					return output;
+				}
+
+				const DataBuffer* dictionary = nullptr;
+				if (entry.info.dictionary && !(dictionary = GetDictionary(entry.info.dictionary)))
+				{
+					output.reset();
+					return output;
+				}
+
+				decompressed.set_size(rawsize);
+				auto decompressedsize = CVFSCompressionContext::Decompress(source, decompressed.get_data(), sourcesize, rawsize,
+					dictionary ? dictionary->get_data() : nullptr, dictionary ? dictionary->get_size() : 0);
+				if (decompressedsize < 0 || static_cast<uint32_t>(decompressedsize) != rawsize)
+				{
+					gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Decomperssed size mismatch: %d-%u", decompressedsize, rawsize);
+					output.reset();
+					return output;
+				}
+			}
+			else
+			{
+				decompressed = std::move(decrypted);
+			}
+		}
+
+		auto currenthash = XXH32(decompressed.get_data(), decompressed.get_size(), 0);
+		if (currenthash != entry.info.hash)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Hash mismatch: %p-%p", currenthash, entry.info.hash);
+			output.reset();
+			return output;
+		}
+
+		output->Assign(entry.info.filename, std::move(decompressed));
+
+		return output;
+	}
+
+	std::shared_ptr <CVFSFile> CVFSArchive::Open(const std::wstring & filename) const
+	{
+		return Open(GenerateNameIndex(filename), filename);
+	}
+
+
+	bool CVFSArchive::Write(const std::wstring& filename, const void* data, uint32_t length, uint8_t flags, uint32_t version, const SCompressionProfile* profile)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		if (!m_vfsFile || !m_vfsFile.get() || !m_vfsFile->IsWriteable())
+		{
+			return false;
+		}
+
+		if (IsLayoutLocked(static_cast<SArchiveData*>(m_archiveData)))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Streamed write or compaction in progress, %ls can not written", filename.c_str());
+			return false;
+		}
+
+		SPreparedEntry prepared;
+		if (!Prepare(filename, data, length, flags, version, profile, prepared))
+		{
+			return false;
+		}
+		return WritePrepared(prepared);
+	}
+
+	bool CVFSArchive::Prepare(const std::wstring& filename, const void* data, uint32_t length, uint8_t flags, uint32_t version, const SCompressionProfile* profile, SPreparedEntry& output) const
+	{
+		std::uint32_t index = GenerateNameIndex(filename);
+		std::uint32_t hash = XXH32(reinterpret_cast<const char*>(data), length, 0);
+
+		output.filename = filename;
+		output.unchanged = false;
+		output.buffer.clear();
+		output.data = nullptr;
+		output.size = 0;
+		memset(&output.info, 0, sizeof(SFileInformation));
+		output.info.index = index;
+		output.info.hash = hash;
+		output.info.version = version;
+		output.info.contenthash = XXH64(data, length, 0);
+
+		// Only the lookups take the archive, the coding below runs unlocked
+		SCompressionProfile compression;
+		DataBuffer dictionaryCopy;
+		const DataBuffer* dictionary = nullptr;
+		uint8_t key[VFS::KEY_LENGTH];
+		{
+			std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+			// An entry the open batch replaces or deletes has to be staged again
+			auto archive = static_cast<SArchiveData*>(m_archiveData);
+			auto iter = archive->files.find(index);
+			if (iter != archive->files.end() && !archive->batch.releases.count(index) && !archive->batch.positions.count(index))
+			{
+				if (iter->second.info.hash == hash)
+				{
+					output.unchanged = true;
+					return true;
+				}
+			}
+
+			// Stored under another name already, nothing to code. A batch stages whole entries and codes it anyway.
+			if (!archive->batch.active)
+			{
+				SFileInformation probe = output.info;
+				probe.flags = flags;
+				probe.rawsize = length;
+				auto holder = FindSharedPayload(archive, probe);
+				if (holder)
+				{
+					output.info.owner = holder->info.index;
+					output.info.flags = flags;
+					output.info.rawsize = length;
+#ifdef SHOW_FILE_NAMES
+					wcscpy_s(output.info.filename, filename.c_str());
+#endif
+					return true;
+				}
+			}
+
+			compression = profile ? *profile : m_compressionProfile;
+
+			if ((flags & FLAG_COMPRESSED_LZ4) && compression.level != 0 && compression.dictionary)
+			{
+				if (IsReserved(index) || !(dictionary = GetDictionary(compression.dictionary)))
+				{
+					gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Dictionary: %u not usable for: %ls, compressed without", compression.dictionary, filename.c_str());
+					dictionary = nullptr;
+				}
+			}
+
+			// The archive's dictionary and key may be replaced or cleared once the lock is released, the coding works on copies.
+			// The word LZ4HC reads past the end of the dictionary goes along.
+			if (dictionary)
+			{
+				dictionaryCopy.set_capacity(dictionary->get_size() + sizeof(uint32_t));
+				dictionaryCopy.append(dictionary->get_data(), dictionary->get_size());
+				dictionary = &dictionaryCopy;
+			}
+			memcpy(key, m_archiveKey, VFS::KEY_LENGTH);
+		}
+//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, 
+//			"Target file: %ls(%u) Data: %p(%u) Hash: %p Flags: %u Version: %u",  filename.c_str(), index, data, length, hash, flags, version);
+
+		CVFSScratchScope scratch;
+
+		// Large coded entries are split so readers only decode the chunks they touch
+		DataBuffer chunked;
+		uint64_t chunkedcodedsize = 0;
+		if ((flags & (FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256)) && compression.chunksize && length >= static_cast<uint64_t>(compression.chunksize) * CHUNKED_MIN_CHUNKS)
+		{
+			auto chunksize = compression.chunksize;
+			auto count = static_cast<uint32_t>((static_cast<uint64_t>(length) + chunksize - 1) / chunksize);
+
+			std::vector <DataBuffer> chunks(count);
+			std::vector <SChunkRecord> records(count);
+			std::atomic <uint32_t> compressedchunks(0);
+			std::atomic <uint64_t> codedbytes(0);
+			std::atomic <bool> failed(false);
+			concurrency::parallel_for(static_cast<uint32_t>(0), count, [&](uint32_t chunk) {
+				CVFSScratchScope chunkscratch;
+
+				auto source = reinterpret_cast<const char*>(data) + static_cast<uint64_t>(chunk) * chunksize;
+				auto rawsize = std::min<uint32_t>(chunksize, length - chunk * chunksize);
+				records[chunk].hash = XXH32(source, rawsize, 0);
+
+				const char* coded = source;
+				uint32_t codedsize = rawsize;
+				if ((flags & FLAG_COMPRESSED_LZ4) && compression.level != 0)
+				{
+					auto bound = LZ4_compressBound(rawsize);
+					auto compressbuffer = chunkscratch.Arena().AllocateArray<char>(bound);
+					auto size = CVFSCompressionPool::ThreadContext().Compress(source, compressbuffer, rawsize, bound, compression.level,
+						dictionary ? dictionary->get_data() : nullptr, dictionary ? dictionary->get_size() : 0);
+					if (size > 0 && static_cast<uint32_t>(size) < rawsize && static_cast<double>(size) <= static_cast<double>(rawsize) * compression.storeratio)
+					{
+						coded = compressbuffer;
+						codedsize = size;
+						++compressedchunks;
+					}
+				}
+				codedbytes += codedsize;
+
+				if (flags & FLAG_CRYPTED_AES256)
+				{
+					CAes256 aeshelper;
+					chunks[chunk] = aeshelper.Encrypt(reinterpret_cast<const uint8_t*>(coded), codedsize, ARCHIVE_IV, key);
+					if (chunks[chunk].is_null())
+						failed = true;
+				}
+				else
+				{
+					chunks[chunk] = DataBuffer(coded, codedsize);
+				}
+			});
+			memset(key, 0, VFS::KEY_LENGTH);
+
+			if (failed)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Chunk coding fail! File: %ls", filename.c_str());
+				return false;
+			}
+
+			SChunkTableHeader header{ chunksize, count };
+			uint64_t offset = sizeof(SChunkTableHeader) + count * sizeof(SChunkRecord);
+			for (uint32_t chunk = 0; chunk < count; ++chunk)
+			{
+				records[chunk].offset = offset;
+				records[chunk].size = chunks[chunk].get_size();
+				offset += chunks[chunk].get_size();
+			}
+			if (offset > 0xffffffff - sizeof(SFileEntry))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Chunked entry too large! File: %ls", filename.c_str());
+				return false;
+			}
+
+			chunked.set_capacity(static_cast<uint32_t>(offset));
+			chunked.append(&header, sizeof(SChunkTableHeader));
+			chunked.append(records.data(), count * sizeof(SChunkRecord));
+			for (const auto& chunk : chunks)
+			{
+				chunked.append(chunk.get_data(), chunk.get_size());
+			}
+
+			chunkedcodedsize = codedbytes;
+			flags |= FLAG_CHUNKED;
+			if (compressedchunks == 0)
+				flags &= ~FLAG_COMPRESSED_LZ4;
+		}
+
+		int32_t compressedsize = 0;
+		const char* compressed = reinterpret_cast<const char*>(data);
+		if (flags & FLAG_CHUNKED)
+		{
+			compressedsize = static_cast<int32_t>(chunkedcodedsize);
+		}
+		else if ((flags & FLAG_COMPRESSED_LZ4) && compression.level != 0)
+		{
+			auto bound = LZ4_compressBound(length);
+			auto compressbuffer = scratch.Arena().AllocateArray<char>(bound);
+			compressedsize = CVFSCompressionPool::ThreadContext().Compress(reinterpret_cast<const char*>(data), compressbuffer, length, bound, compression.level,
+				dictionary ? dictionary->get_data() : nullptr, dictionary ? dictionary->get_size() : 0);
+
+			if (compressedsize >= bound || compressedsize == 0)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Compression fail! File: %ls Raw: %u Compressed: %u Cap: %u", filename.c_str(), length, compressedsize, bound);
+
+				compressedsize = 0;
+			}
+			else if (static_cast<double>(compressedsize) > static_cast<double>(length) * compression.storeratio)
+			{
+//				gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Compression ratio too low, stored as raw. File: %ls Raw: %u Compressed: %u", filename.c_str(), length, compressedsize);
+
+				compressedsize = 0;
+			}
+			else
+			{
+				compressed = compressbuffer;
+			}
+		}
+		if (compressedsize == 0)
+		{
+//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Compression fail! Raw data moved to compressed buffer");
+
+			flags &= ~FLAG_COMPRESSED_LZ4;
+			compressedsize = length;
+		}
+		const auto compressedlength = static_cast<uint32_t>(compressedsize);
+
+//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Compression completed! Data: %p Size: %u", compressed, compressedlength);
+
+		if (flags & FLAG_CHUNKED)
+		{
+			// Chunks are already crypted one by one
+			output.buffer = std::move(chunked);
+		}
+		else if (flags & FLAG_CRYPTED_AES256)
+		{
+			CAes256 aeshelper;
+			output.buffer = aeshelper.Encrypt(reinterpret_cast<const uint8_t*>(compressed), compressedlength, ARCHIVE_IV, key);
+		}
+		else if (compressed != reinterpret_cast<const char*>(data))
+		{
+			// Compressed into scratch memory, which ends with this call
+			output.buffer = DataBuffer(compressed, compressedlength);
+		}
+		memset(key, 0, VFS::KEY_LENGTH);
+
+		if (output.buffer.is_null())
+		{
+			output.data = compressed;
+			output.size = compressedlength;
+		}
+		else
+		{
+			output.data = output.buffer.get_data();
+			output.size = output.buffer.get_size();
+		}
+
+		output.info.flags = flags;
+		output.info.rawsize = length;
+		output.info.compressedsize = compressedlength;
+		output.info.cryptedsize = output.size;
+		output.info.level = (flags & FLAG_COMPRESSED_LZ4) ? compression.level : 0;
+		output.info.dictionary = (flags & FLAG_COMPRESSED_LZ4) && dictionary ? compression.dictionary : 0;
+#ifdef SHOW_FILE_NAMES
+		wcscpy_s(output.info.filename, filename.c_str());
+#endif
+		return true;
+	}
+
+	bool CVFSArchive::WritePrepared(const SPreparedEntry& prepared)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+		m_generation = ++gs_archiveGenerations;
+
+		if (!m_vfsFile || !m_vfsFile.get() || !m_vfsFile->IsWriteable())
+		{
+			return false;
+		}
+
+		if (IsLayoutLocked(static_cast<SArchiveData*>(m_archiveData)))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Streamed write or compaction in progress, %ls can not written", prepared.filename.c_str());
+			return false;
+		}
+
+		if (prepared.unchanged)
+		{
+			return true;
+		}
+
+		const auto index = prepared.info.index;
+		const auto finalsize = prepared.size;
+
+		SFileEntry entry;
+		memset(&entry, 0, sizeof(SFileEntry));
+		entry.info = prepared.info;
+		entry.finalSize = finalsize;
+
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		if (archive->batch.active)
+		{
+			if (prepared.info.owner)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "%ls was prepared as shared before the batch, prepare it again", prepared.filename.c_str());
+				return false;
+			}
+			return StageBatchEntry(archive, entry, prepared.data);
+		}
+
+		Delete(index);
+
+		// The holder found by Prepare may be gone or replaced meanwhile, the content decides
+		auto holder = FindSharedPayload(archive, prepared.info);
+		if (holder)
+		{
+			if (!WriteSharedEntry(archive, m_vfsFile.get(), *holder, prepared.info))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Shared entry %ls can not written", prepared.filename.c_str());
+				return false;
+			}
+
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Write shared %u-%ls-%u", index, prepared.filename.c_str(), holder->info.index);
+			return true;
+		}
+		if (prepared.info.owner)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Shared payload of %ls is gone, prepare it again", prepared.filename.c_str());
+			return false;
+		}
+
+		auto entryend = PlaceEntry(archive, m_vfsFile.get(), finalsize + sizeof(SFileEntry), entry);
+
+		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Write completed %u-%ls-%llu-%u-%p-%u-%u", index, prepared.filename.c_str(), entry.info.rawsize, finalsize, entry.info.hash, entry.info.flags, entry.info.version);
+
+		// A bulk build flushes its buffer here when the entry does not follow it
+		if (!m_vfsFile->SetPosition(entry.offset - sizeof(SFileEntry), false))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "%ls can not placed", prepared.filename.c_str());
+			return false;
+		}
+		m_vfsFile->Write(&entry, sizeof(SFileEntry));
+		m_vfsFile->Write(prepared.data, finalsize);
+		if (entryend)
+			m_vfsFile->Extend(entryend);
+
+//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Entry writed to archive new size: %u", static_cast<SArchiveData*>(m_archiveData)->files.size() + 1);
+		archive->files.emplace(index, entry);
+		RegisterPayload(archive, entry);
+		return true;
+	}
+
+	bool CVFSArchive::BeginBulk(uint64_t expectedsize)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		if (!m_vfsFile || !m_vfsFile.get() || !m_vfsFile->IsWriteable())
+		{
+			return false;
+		}
+
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		if (archive->bulk)
+		{
+			return true;
+		}
+		if (archive->batch.active)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Bulk builds can not run inside a batch");
+			return false;
+		}
+
+		// Only a hint, file systems without preallocation still take the build
+		if (expectedsize && !m_vfsFile->Reserve(m_vfsFile->GetSize() + expectedsize))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Space for %llu bytes can not reserved", expectedsize);
+		}
+
+		if (!m_vfsFile->SetWriteBuffer(BULK_WRITE_BUFFER_SIZE))
+		{
+			return false;
+		}
+
+		archive->bulk = true;
+		return true;
+	}
+
+	bool CVFSArchive::EndBulk()
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		if (!archive->bulk)
+		{
+			return true;
+		}
+
+		archive->bulk = false;
+		return m_vfsFile && m_vfsFile->SetWriteBuffer(0);
+	}
+
+	bool CVFSArchive::BeginBatch()
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		if (!m_vfsFile || !m_vfsFile.get() || !m_vfsFile->IsWriteable())
+		{
+			return false;
+		}
+
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		if (IsLayoutLocked(archive) || archive->bulk)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Archive %ls is busy, batch can not started", m_vfsFile->GetFileName().c_str());
+			return false;
+		}
+		if (archive->batch.active)
+		{
+			return true;
+		}
+
+		archive->batch = SBatchState();
+		archive->batch.active = true;
+		return true;
+	}
+
+	bool CVFSArchive::Commit()
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+		m_generation = ++gs_archiveGenerations;
+
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		if (!m_vfsFile || !m_vfsFile.get() || !archive->batch.active)
+		{
+			return false;
+		}
+
+		auto batch = std::move(archive->batch);
+		archive->batch = SBatchState();
+		if (batch.writes.empty() && batch.releases.empty())
+		{
+			return true;
+		}
+
+		auto bytesperblock = archive->header.bytesPerBlock;
+		auto journalfile = m_vfsFile->GetFileName() + BATCH_JOURNAL_EXTENSION;
+
+		// The staged entries are laid out as one run at the end of the file
+		auto runstart = m_vfsFile->GetSize();
+		auto runend = runstart;
+		for (auto& staged : batch.writes)
+		{
+			staged.entry.numBlocks = static_cast<uint32_t>(ALIGNTO(staged.entry.finalSize + sizeof(SFileEntry), bytesperblock) / bytesperblock);
+			staged.entry.offset = runend + sizeof(SFileEntry);
+			runend += static_cast<uint64_t>(staged.entry.numBlocks) * bytesperblock;
+		}
+
+		// The run opens with a free header over all of it, only the journal makes it live
+		if (!batch.writes.empty())
+		{
+			auto written = m_vfsFile->SetWriteBuffer(BULK_WRITE_BUFFER_SIZE);
+
+			WriteFreeEntry(m_vfsFile.get(), { runstart, static_cast<uint32_t>((runend - runstart) / bytesperblock) });
+			for (std::size_t i = 0; written && i < batch.writes.size(); ++i)
+			{
+				const auto& staged = batch.writes[i];
+				if (i != 0)
+					written = m_vfsFile->Write(&staged.entry, sizeof(SFileEntry)) == sizeof(SFileEntry);
+
+				written = written && m_vfsFile->Write(staged.payload.get_data(), staged.payload.get_size()) == staged.payload.get_size() &&
+					m_vfsFile->Extend(staged.entry.offset - sizeof(SFileEntry) + static_cast<uint64_t>(staged.entry.numBlocks) * bytesperblock);
+			}
+
+			if (!m_vfsFile->SetWriteBuffer(0) || !written || !m_vfsFile->Sync())
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Batch of %u entries can not written to %ls", static_cast<uint32_t>(batch.writes.size()), m_vfsFile->GetFileName().c_str());
+				m_vfsFile->Truncate(runstart);
+				return false;
+			}
+		}
+
+		// The releases are planned on the loaded state, a journal that can not be written puts it back
+		auto files = archive->files;
+		auto freespace = archive->freeSpace;
+		auto contents = archive->contents;
+		auto sharers = archive->sharers;
+
+		THeaderWrites headers;
+		if (!batch.writes.empty())
+			headers.emplace(runstart, batch.writes.front().entry);
+
+		uint32_t released = 0;
+		for (auto index : batch.releases)
+		{
+			if (archive->files.find(index) == archive->files.end())
+				continue;
+
+			// Released extents are merged first, each resulting extent gets one header
+			AddFreeHeader(headers, ReleaseEntry(archive, index, headers), bytesperblock);
+			++released;
+		}
+
+		if (!WriteBatchJournal(m_vfsFile.get(), journalfile, headers))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Batch journal %ls can not written", journalfile.c_str());
+			DeleteFileW(journalfile.c_str());
+			m_vfsFile->Truncate(runstart);
+
+			archive->files.swap(files);
+			archive->freeSpace = freespace;
+			archive->contents.swap(contents);
+			archive->sharers.swap(sharers);
+			return false;
+		}
+
+		// Committed, from here on a reload replays the journal
+		auto applied = WriteHeaders(m_vfsFile.get(), headers);
+
+		for (const auto& staged : batch.writes)
+		{
+			archive->files[staged.entry.info.index] = staged.entry;
+			RegisterPayload(archive, staged.entry);
+		}
+
+		// Dictionaries and solid tables the batch touched are read again
+		for (const auto& it : archive->dictionaryIndexes)
+		{
+			if (batch.releases.count(it.first) || batch.positions.count(it.first))
+				archive->dictionaries.erase(it.second);
+		}
+		for (const auto& staged : batch.writes)
+		{
+			if ((staged.entry.info.flags & FLAG_SOLID_INDEX) && !LoadSolidIndex(staged.entry.info.index))
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Solid index %p can not loaded", staged.entry.info.index);
+		}
+
+		// Headers that did not make it to the disk are left to the journal
+		if (applied && m_vfsFile->Sync())
+			DeleteFileW(journalfile.c_str());
+		else
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Batch headers can not written to %ls, the journal is kept", m_vfsFile->GetFileName().c_str());
+
+		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Batch committed to %ls, written: %u released: %u",
+			m_vfsFile->GetFileName().c_str(), static_cast<uint32_t>(batch.writes.size()), released);
+		return true;
+	}
+
+	void CVFSArchive::AbortBatch()
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		static_cast<SArchiveData*>(m_archiveData)->batch = SBatchState();
+	}
+
+	bool CVFSArchive::BeginCompact(const std::vector <uint32_t>& order)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		if (!m_vfsFile || !m_vfsFile.get() || !m_vfsFile->IsWriteable())
+		{
+			return false;
+		}
+
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		if (archive->streaming || archive->bulk || archive->compact.active || archive->batch.active)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Archive %ls is busy, compaction can not started", m_vfsFile->GetFileName().c_str());
+			return false;
+		}
+
+		auto& state = archive->compact;
+		state = SCompactState();
+		state.active = true;
+		state.cursor = archive->header.firstEntry;
+		state.pending = GetEntriesByOffset(archive);
+
+		if (!order.empty())
+		{
+			// The ordered entries go to the end of the file first, then the rest, and the slide brings them all down
+			std::unordered_set <uint32_t> placed;
+			std::vector <uint32_t> relocation;
+			relocation.reserve(state.pending.size());
+			for (auto index : order)
+			{
+				auto iter = archive->files.find(index);
+				if (iter == archive->files.end())
+					continue;
+
+				// Members are placed with their group, sharers behind the entry holding their payload
+				if (iter->second.info.flags & FLAG_SOLID_MEMBER)
+				{
+					auto location = archive->solidMembers.find(index);
+					if (location == archive->solidMembers.end())
+						continue;
+
+					index = GenerateNameIndex(GetSolidGroupName(location->second.group));
+					if (archive->files.find(index) == archive->files.end())
+						continue;
+				}
+				else if (iter->second.info.owner && archive->files.find(iter->second.info.owner) != archive->files.end() && placed.insert(iter->second.info.owner).second)
+				{
+					relocation.push_back(iter->second.info.owner);
+				}
+
+				if (placed.insert(index).second)
+					relocation.push_back(index);
+			}
+			for (auto index : state.pending)
+			{
+				if (placed.find(index) == placed.end())
+					relocation.push_back(index);
+			}
+
+			// Entries already leading the file in order stay where they are, the slide closes the gaps between them
+			std::size_t inplace = 0;
+			while (inplace < relocation.size() && relocation[inplace] == state.pending[inplace])
+				++inplace;
+			relocation.erase(relocation.begin(), relocation.begin() + inplace);
+
+			state.pending.swap(relocation);
+			state.relocating = !state.pending.empty();
+			if (!state.relocating)
+				state.pending = GetEntriesByOffset(archive);
+		}
+
+		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Compaction of %ls started, %u entries %llu free blocks",
+			m_vfsFile->GetFileName().c_str(), static_cast<uint32_t>(state.pending.size()), archive->freeSpace.GetFreeBlocks());
+		return true;
+	}
+
+	bool CVFSArchive::CompactStep(uint64_t budget, bool& completed)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		completed = false;
+
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		if (!m_vfsFile || !m_vfsFile.get() || !archive->compact.active)
+		{
+			return false;
+		}
+
+		auto& state = archive->compact;
+		auto bytesperblock = static_cast<uint64_t>(archive->header.bytesPerBlock);
+
+		DataBuffer scratch(COMPACT_COPY_SIZE);
+		uint64_t copied = 0;
+		while (copied == 0 || copied < budget)
+		{
+			if (state.next == state.pending.size())
+			{
+				if (!state.relocating)
+					break;
+
+				state.relocating = false;
+				state.pending = GetEntriesByOffset(archive);
+				state.next = 0;
+				continue;
+			}
+
+			auto iter = archive->files.find(state.pending[state.next++]);
+			if (iter == archive->files.end())
+				continue;
+
+			auto& entry = iter->second;
+			auto start = entry.offset - sizeof(SFileEntry);
+			auto size = entry.finalSize + sizeof(SFileEntry);
+			auto blocks = static_cast<uint32_t>((size + bytesperblock - 1) / bytesperblock);
+
+			// Sliding down over its own header would leave nothing valid there if the copy is cut short, such entries go to the end
+			// once and come down with a later step. One that still overlaps then stays where it is.
+			auto overlaps = start != state.cursor && state.cursor + static_cast<uint64_t>(blocks) * bytesperblock > start;
+			if (state.relocating || (overlaps && state.moved.insert(iter->first).second))
+			{
+				if (!RelocateEntry(m_vfsFile.get(), entry, bytesperblock, scratch))
+				{
+					AbortCompact();
+					return false;
+				}
+				copied += size;
+
+				if (state.relocating)
+					continue;
+
+				// What was in its place is free until the next entry slides down
+				state.pending.push_back(iter->first);
+
+				auto following = archive->files.find(state.pending[state.next]);
+				auto end = following != archive->files.end() ? following->second.offset - sizeof(SFileEntry) : m_vfsFile->GetSize();
+				if (end > state.cursor)
+					WriteFreeEntry(m_vfsFile.get(), { state.cursor, static_cast<uint32_t>((end - state.cursor) / bytesperblock) });
+				continue;
+			}
+			if (overlaps)
+			{
+				state.cursor = start;
+			}
+
+			if (start != state.cursor || blocks != entry.numBlocks)
+			{
+				auto newend = state.cursor + static_cast<uint64_t>(blocks) * bytesperblock;
+				auto oldend = start + static_cast<uint64_t>(entry.numBlocks) * bytesperblock;
+
+				// The copy runs over whatever free entries chain the gap, one entry spanning it keeps the walk intact until the header lands
+				if (start != state.cursor)
+					WriteFreeEntry(m_vfsFile.get(), { state.cursor, static_cast<uint32_t>((start - state.cursor) / bytesperblock) });
+
+				// Payload first, into free space below the entry
+				if (start != state.cursor && !CopyRange(m_vfsFile.get(), start + sizeof(SFileEntry), state.cursor + sizeof(SFileEntry), entry.finalSize, scratch))
+				{
+					AbortCompact();
+					return false;
+				}
+
+				// Bridge from the new end to what the old layout reaches next, so the new header never points into stale bytes
+				auto bridge = start != state.cursor ? start : oldend;
+				if (newend < bridge)
+					WriteFreeEntry(m_vfsFile.get(), { newend, static_cast<uint32_t>((bridge - newend) / bytesperblock) });
+
+				// The payload and the bridge have to be on disk before the header makes them reachable, and the header before the
+				// free entry behind it covers the old one
+				entry.numBlocks = blocks;
+				entry.offset = state.cursor + sizeof(SFileEntry);
+
+				if (!m_vfsFile->Sync() || !m_vfsFile->SetPosition(state.cursor, false) || m_vfsFile->Write(&entry, sizeof(SFileEntry)) != sizeof(SFileEntry) ||
+					!m_vfsFile->Sync())
+				{
+					AbortCompact();
+					return false;
+				}
+				copied += start != state.cursor ? size : 0;
+			}
+			state.cursor += static_cast<uint64_t>(blocks) * bytesperblock;
+
+			// Whatever lies between this entry and the next one is free until the next one slides down
+			auto end = m_vfsFile->GetSize();
+			auto following = state.next < state.pending.size() ? archive->files.find(state.pending[state.next]) : archive->files.end();
+			if (following != archive->files.end())
+				end = following->second.offset - sizeof(SFileEntry);
+			if (end > state.cursor)
+				WriteFreeEntry(m_vfsFile.get(), { state.cursor, static_cast<uint32_t>((end - state.cursor) / bytesperblock) });
+		}
+
+		if (state.relocating || state.next < state.pending.size())
+		{
+			return true;
+		}
+
+		auto before = m_vfsFile->GetSize();
+		if (!m_vfsFile->Truncate(state.cursor))
+		{
+			AbortCompact();
+			return false;
+		}
+
+		archive->freeSpace.Reset(archive->header.bytesPerBlock);
+		state = SCompactState();
+		completed = true;
+
+		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Compaction of %ls completed, %llu -> %llu bytes",
+			m_vfsFile->GetFileName().c_str(), before, m_vfsFile->GetSize());
+		return true;
+	}
+
+	void CVFSArchive::AbortCompact()
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		if (!archive->compact.active)
+		{
+			return;
+		}
+
+		// Every finished move left valid headers behind, only the free map has to follow the new layout
+		archive->compact = SCompactState();
+		if (m_vfsFile)
+			RebuildFreeSpace(archive, m_vfsFile->GetSize());
+	}
+
+	bool CVFSArchive::Compact(const std::vector <uint32_t>& order)
+	{
+		if (!BeginCompact(order))
+		{
+			return false;
+		}
+
+		bool completed = false;
+		while (!completed)
+		{
+			if (!CompactStep(UINT64_MAX, completed))
+				return false;
+		}
+		return true;
+	}
+
+	// The free entry heading a stream is widened before each segment is written, a stream cut short loads as free space
+	static bool ClaimStreamBlocks(SArchiveData* archive, CVFSFile* file, SStreamWriteState* state, uint64_t end)
+	{
+		auto bytesperblock = archive->header.bytesPerBlock;
+		auto blocks = ALIGNTO(end - state->entryPosition, bytesperblock) / bytesperblock;
+		if (blocks > 0xffffffff)
+			return false;
+
+		if (blocks > state->claimedBlocks)
+		{
+			state->claimedBlocks = static_cast<uint32_t>(blocks);
+			WriteFreeEntry(file, { state->entryPosition, state->claimedBlocks });
+		}
+		return true;
+	}
+
+	std::shared_ptr <CVFSArchiveWriter> CVFSArchive::BeginWrite(const std::wstring& filename, uint8_t flags, uint32_t version, const SCompressionProfile* profile)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
 
-		if (!key)
+		std::shared_ptr <CVFSArchiveWriter> writer;
+		if (!m_vfsFile || !m_vfsFile.get() || !m_vfsFile->IsWriteable())
 		{
-			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Null key data");
-			file.reset();
-			return false;
+			return writer;
 		}
 
-		m_vfsFile = file;
-		memcpy(m_archiveKey, key, VFS::KEY_LENGTH);
-
-		m_vfsFile->SetPosition(0, false);
-		if (m_vfsFile->Read(&static_cast<SArchiveData*>(m_archiveData)->header, sizeof(SArchiveHeader)) != sizeof(SArchiveHeader))
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		if (IsLayoutLocked(archive) || archive->batch.active)
 		{
-//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "VFS archive: %ls header can not read", file->GetFileNameA().c_str());
-			file.reset();
-			memset(m_archiveKey, 0, VFS::KEY_LENGTH);
-			return false;
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Streamed write, compaction or batch already in progress");
+			return writer;
 		}
 
-		if (static_cast<SArchiveData*>(m_archiveData)->header.magic != ARCHIVE_MAGIC)
+		auto self = weak_from_this().lock();
+		if (!self)
 		{
-//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "VFS archive: %ls Wrong magic", file->GetFileNameA().c_str());
-			m_vfsFile.reset();
-			memset(m_archiveKey, 0, VFS::KEY_LENGTH);
-			return false;
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Streamed writes need a shared archive");
+			return writer;
 		}
 
-		m_vfsFile->SetPosition(static_cast<SArchiveData*>(m_archiveData)->header.firstEntry, false);
-		while (m_vfsFile->GetPosition() < m_vfsFile->GetSize())
+		const auto& compression = profile ? *profile : m_compressionProfile;
+
+		auto state = std::make_unique<SStreamWriteState>();
+		state->filename = filename;
+		state->index = GenerateNameIndex(filename);
+		state->flags = (flags & (FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256)) | FLAG_STREAMED;
+		state->version = version;
+		state->level = compression.level;
+		state->rawSize = 0;
+		state->codedSize = 0;
+		state->finalSize = 0;
+		state->claimedBlocks = 0;
+		state->context = nullptr;
+		if (compression.level == 0)
+			state->flags &= ~FLAG_COMPRESSED_LZ4;
+
+		state->hash = XXH32_createState();
+		if (!state->hash)
+			return writer;
+		XXH32_reset(state->hash, 0);
+
+		if (state->flags & FLAG_COMPRESSED_LZ4)
 		{
-			SFileEntry entry;
-			m_vfsFile->Read(&entry, sizeof(SFileEntry));
+			if (LZ4F_isError(LZ4F_createCompressionContext(&state->context, LZ4F_VERSION)))
+			{
+				XXH32_freeState(state->hash);
+				return writer;
+			}
 
-			if (entry.info.index == 0)
-				static_cast<SArchiveData*>(m_archiveData)->entries.emplace_back(entry);
-			else
-				static_cast<SArchiveData*>(m_archiveData)->files.insert({ entry.info.index, entry });
+			memset(&state->preferences, 0, sizeof(state->preferences));
+			state->preferences.frameInfo.blockSizeID = LZ4F_max64KB;
+			state->preferences.frameInfo.blockMode = LZ4F_blockLinked;
+			state->preferences.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+			// lz4frame maps negative levels to acceleration -level + 1
+			state->preferences.compressionLevel = compression.level > 0 ? compression.level : compression.level + 1;
 
-			m_vfsFile->SetPosition(entry.offset - sizeof(SFileEntry) + (entry.numBlocks * static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock), false);
+			state->pending.set_size(LZ4F_HEADER_SIZE_MAX);
+			auto headersize = LZ4F_compressBegin(state->context, state->pending.get_data(), LZ4F_HEADER_SIZE_MAX, &state->preferences);
+			if (LZ4F_isError(headersize))
+			{
+				LZ4F_freeCompressionContext(state->context);
+				XXH32_freeState(state->hash);
+				return writer;
+			}
+			state->pending.set_size(static_cast<uint32_t>(headersize));
 		}
 
-//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "VFS archive: %ls loaded", file->GetFileNameA().c_str());
-		return true;
+		// The entry header is written on commit, until then a free entry heads the stream
+		state->entryPosition = m_vfsFile->GetSize();
+		ClaimStreamBlocks(archive, m_vfsFile.get(), state.get(), state->entryPosition + sizeof(SFileEntry) + sizeof(uint32_t));
+
+		archive->streaming = state.get();
+
+		writer.reset(new CVFSArchiveWriter(self, state.release()));
+		return writer;
 	}
 
-	bool CVFSArchive::Create(std::shared_ptr <CVFSFile> file, const uint8_t* keydata)
+	CVFSArchiveWriter::CVFSArchiveWriter(std::shared_ptr <CVFSArchive> archive, void* state) :
+		m_archive(archive), m_writeState(state)
 	{
-		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+	}
+	CVFSArchiveWriter::~CVFSArchiveWriter()
+	{
+		Abort();
+	}
 
-		if (!file || !file.get())
-		{
-//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Null VFS file ptr");
+	// Writers take the archive lock per call, readers go on between them. An archive unloaded meanwhile ends the stream.
+	bool CVFSArchiveWriter::IsOwner()
+	{
+		auto state = static_cast<SStreamWriteState*>(m_writeState);
+		if (!state)
 			return false;
-		}
 
-		if (!file->IsWriteable())
+		if (static_cast<SArchiveData*>(m_archive->m_archiveData)->streaming != state || !m_archive->m_vfsFile)
 		{
-//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "VFS archive not writeable");
+			Release();
 			return false;
 		}
+		return true;
+	}
 
-		if (!Load(file, keydata))
-		{
-			m_vfsFile = file;
-			memcpy(m_archiveKey, keydata, VFS::KEY_LENGTH);
+	uint64_t CVFSArchiveWriter::GetRawSize() const
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archive->m_archiveMutex);
 
-			auto header = &static_cast<SArchiveData*>(m_archiveData)->header;
-			header->magic = ARCHIVE_MAGIC;
+		auto state = static_cast<SStreamWriteState*>(m_writeState);
+		return state ? state->rawSize : 0;
+	}
 
-			SYSTEM_INFO sysInfo{};
-			GetSystemInfo(&sysInfo);
+	bool CVFSArchiveWriter::Append(const void* data, uint32_t size)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archive->m_archiveMutex);
 
-			if (!sysInfo.dwPageSize)
-				header->bytesPerBlock = 4096;
-			else
-				header->bytesPerBlock = sysInfo.dwPageSize;
+		auto state = static_cast<SStreamWriteState*>(m_writeState);
+		if (!IsOwner() || (!data && size))
+			return false;
 
-			header->firstEntry = ALIGNTO(sizeof(SArchiveHeader), header->bytesPerBlock);
+		XXH32_update(state->hash, data, size);
+		state->rawSize += size;
 
-			m_vfsFile->SetPosition(0, false);
-			m_vfsFile->Write(header, sizeof(SArchiveHeader));
+		auto source = static_cast<const char*>(data);
+		while (size)
+		{
+			auto part = std::min<uint32_t>(size, STREAM_SLICE_SIZE);
+			if (state->flags & FLAG_COMPRESSED_LZ4)
+			{
+				auto used = state->pending.get_size();
+				auto bound = static_cast<uint32_t>(LZ4F_compressBound(part, &state->preferences));
+				state->pending.set_size(used + bound);
 
-			if (header->firstEntry - sizeof(SArchiveHeader) > 0)
+				auto coded = LZ4F_compressUpdate(state->context, state->pending.get_data() + used, bound, source, part, nullptr);
+				if (LZ4F_isError(coded))
+				{
+					gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Compression fail! File: %ls Error: %s", state->filename.c_str(), LZ4F_getErrorName(coded));
+					state->pending.set_size(used);
+					return false;
+				}
+				state->pending.set_size(used + static_cast<uint32_t>(coded));
+			}
+			else
 			{
-				auto diff = static_cast<uint8_t*>(malloc(header->firstEntry - sizeof(SArchiveHeader)));
-				m_vfsFile->Write(diff, header->firstEntry - sizeof(SArchiveHeader));
-				free(diff);
+				state->pending.append(source, part);
 			}
+
+			source += part;
+			size -= part;
+
+			if (state->pending.get_size() >= STREAM_SEGMENT_SIZE && !Flush())
+				return false;
 		}
 		return true;
 	}
 
-	void CVFSArchive::Unload()
+	bool CVFSArchiveWriter::Flush()
 	{
-		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+		auto state = static_cast<SStreamWriteState*>(m_writeState);
+		if (!state || state->pending.is_null())
+			return true;
 
-		memset(m_archiveKey, 0, VFS::KEY_LENGTH);
+		state->codedSize += state->pending.get_size();
 
-		static_cast<SArchiveData*>(m_archiveData)->entries.clear();
-		static_cast<SArchiveData*>(m_archiveData)->files.clear();
+		const char* segment = state->pending.get_data();
+		uint32_t segmentsize = state->pending.get_size();
+		DataBuffer crypted;
+		if (state->flags & FLAG_CRYPTED_AES256)
+		{
+			CAes256 aeshelper;
+			crypted = aeshelper.Encrypt(reinterpret_cast<const uint8_t*>(segment), segmentsize, ARCHIVE_IV, &m_archive->m_archiveKey[0]);
+			segment = crypted.get_data();
+			segmentsize = crypted.get_size();
+		}
 
-		memset(&static_cast<SArchiveData*>(m_archiveData)->header, 0, sizeof(SArchiveHeader));
-		m_vfsFile.reset();
-	}
+		auto& file = m_archive->m_vfsFile;
+		auto position = state->entryPosition + sizeof(SFileEntry) + state->finalSize;
+		// Room for the terminator is claimed along, Commit writes it before the entry header
+		if (!ClaimStreamBlocks(static_cast<SArchiveData*>(m_archive->m_archiveData), file.get(), state, position + sizeof(segmentsize) + segmentsize + sizeof(uint32_t)))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Streamed entry too large! File: %ls", state->filename.c_str());
+			return false;
+		}
 
-	std::shared_ptr <CVFSFile> CVFSArchive::GetFileStream() const
-	{
-		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
-		
-		return m_vfsFile;
+		if (!file->SetPosition(position, false) || file->Write(&segmentsize, sizeof(segmentsize)) != sizeof(segmentsize) || file->Write(segment, segmentsize) != segmentsize)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Segment write fail! File: %ls", state->filename.c_str());
+			return false;
+		}
+
+		state->finalSize += sizeof(segmentsize) + segmentsize;
+		state->pending.set_size(0);
+		return true;
 	}
 
-	uint32_t CVFSArchive::GenerateNameIndex(std::wstring filename) const
+	bool CVFSArchiveWriter::Commit()
 	{
-		for (size_t i = 0; i < filename.size(); ++i)
+		std::lock_guard <std::recursive_mutex> __lock(m_archive->m_archiveMutex);
+		m_archive->m_generation = ++gs_archiveGenerations;
+
+		auto state = static_cast<SStreamWriteState*>(m_writeState);
+		if (!IsOwner())
+			return false;
+
+		if (state->flags & FLAG_COMPRESSED_LZ4)
 		{
-			if (filename[i] == L'\\')
+			auto used = state->pending.get_size();
+			auto bound = static_cast<uint32_t>(LZ4F_compressBound(0, &state->preferences));
+			state->pending.set_size(used + bound);
+
+			auto coded = LZ4F_compressEnd(state->context, state->pending.get_data() + used, bound, nullptr);
+			if (LZ4F_isError(coded))
 			{
-				filename[i] = L'/';
+				state->pending.set_size(used);
+				Abort();
+				return false;
 			}
+			state->pending.set_size(used + static_cast<uint32_t>(coded));
 		}
 
-		std::transform(filename.begin(), filename.end(), filename.begin(), towlower);
+		uint32_t terminator = 0;
+		auto& file = m_archive->m_vfsFile;
+		if (!Flush())
+		{
+			Abort();
+			return false;
+		}
 
-		auto hash = XXH32(filename.c_str(), filename.size() * sizeof(wchar_t), 0);
-//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "%ls(%u) : %p", filename.c_str(), filename.size() * sizeof(wchar_t), hash);
+		if (!file->SetPosition(state->entryPosition + sizeof(SFileEntry) + state->finalSize, false) || file->Write(&terminator, sizeof(terminator)) != sizeof(terminator))
+		{
+			Abort();
+			return false;
+		}
+		state->finalSize += sizeof(terminator);
 
-		return hash;
-	}
+		auto archive = static_cast<SArchiveData*>(m_archive->m_archiveData);
+		auto bytesperblock = archive->header.bytesPerBlock;
 
-	bool CVFSArchive::Exists(uint32_t index) const
-	{
-		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+		SFileEntry entry;
+		memset(&entry, 0, sizeof(SFileEntry));
+		entry.numBlocks = static_cast<uint32_t>(ALIGNTO(sizeof(SFileEntry) + state->finalSize, bytesperblock) / bytesperblock);
+		entry.offset = state->entryPosition + sizeof(SFileEntry);
+		entry.finalSize = state->finalSize;
+		entry.info.index = state->index;
+		entry.info.hash = XXH32_digest(state->hash);
+		entry.info.flags = state->flags;
+		entry.info.version = state->version;
+		entry.info.rawsize = state->rawSize;
+		entry.info.compressedsize = state->codedSize;
+		entry.info.cryptedsize = state->finalSize;
+		entry.info.level = (state->flags & FLAG_COMPRESSED_LZ4) ? state->level : 0;
+#ifdef SHOW_FILE_NAMES
+		wcscpy_s(entry.info.filename, state->filename.c_str());
+#endif
 
-	//	gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "coming idx: %u", index);			
+		// Pad the tail so the next entry starts on a block boundary
+		file->Extend(state->entryPosition + static_cast<uint64_t>(entry.numBlocks) * bytesperblock);
 
-		auto archive = static_cast<SArchiveData*>(m_archiveData);
-		if (archive)
-		{
-			/*
-			for (const auto& file : archive->files)
-			{
-				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "filename %ls, index %u",
-					file.second.info.filename, file.second.info.index);			
-			}
-			*/
+		archive->streaming = nullptr;
+		m_archive->Delete(state->index);
 
-			return archive->files.find(index) != archive->files.end();
-		}
+		file->SetPosition(state->entryPosition, false);
+		file->Write(&entry, sizeof(SFileEntry));
+		archive->files.emplace(entry.info.index, entry);
 
-		return false;
+		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Streamed write completed %u-%ls-%llu-%llu-%p-%u-%u",
+			entry.info.index, state->filename.c_str(), entry.info.rawsize, entry.finalSize, entry.info.hash, entry.info.flags, entry.info.version);
+
+		Release();
+		return true;
 	}
 
-	bool CVFSArchive::Exists(const std::wstring& filename) const
+	void CVFSArchiveWriter::Abort()
 	{
-		return Exists(GenerateNameIndex(filename));
+		std::lock_guard <std::recursive_mutex> __lock(m_archive->m_archiveMutex);
+
+		auto state = static_cast<SStreamWriteState*>(m_writeState);
+		if (!IsOwner())
+			return;
+
+		// Whatever was claimed becomes free space
+		auto archive = static_cast<SArchiveData*>(m_archive->m_archiveData);
+		auto bytesperblock = archive->header.bytesPerBlock;
+		auto& file = m_archive->m_vfsFile;
+
+		file->Extend(state->entryPosition + static_cast<uint64_t>(state->claimedBlocks) * bytesperblock);
+
+		WriteFreeEntry(file.get(), archive->freeSpace.Release(state->entryPosition, state->claimedBlocks));
+		archive->streaming = nullptr;
+
+		gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Streamed write of: %ls aborted", state->filename.c_str());
+		Release();
 	}
-	bool CVFSArchive::Exists(const std::string& filename) const
+
+	void CVFSArchiveWriter::Release()
 	{
-		auto wstfilename = std::wstring(filename.begin(), filename.end());
-		return Exists(GenerateNameIndex(wstfilename));
+		auto state = static_cast<SStreamWriteState*>(m_writeState);
+		if (!state)
+			return;
+
+		if (state->context)
+			LZ4F_freeCompressionContext(state->context);
+		if (state->hash)
+			XXH32_freeState(state->hash);
+
+		m_writeState = nullptr;
+		delete state;
 	}
 
-	std::shared_ptr<CVFSFile> CVFSArchive::Open(uint32_t index, const std::wstring& filename) const
+	bool CVFSArchive::WriteSolid(const std::vector <SSolidInput>& files, uint8_t flags, uint32_t version, const SCompressionProfile* profile)
 	{
 		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+		m_generation = ++gs_archiveGenerations;
 
-		std::shared_ptr <CVFSFile> output;
-
-		auto iter = static_cast<SArchiveData*>(m_archiveData)->files.find(index);
-		if (iter == static_cast<SArchiveData*>(m_archiveData)->files.end())
+		if (!m_vfsFile || !m_vfsFile.get() || !m_vfsFile->IsWriteable())
 		{
-//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "File not found for: %p(%ls)", index, filename.c_str());
-			return output;
+			return false;
 		}
-//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "%u %ls %u", index, iter->second.info.filename, iter->second.finalSize);
 
-		output = std::make_shared<CVFSFile>();
-		if (!output || !output.get() || !output->Open(m_vfsFile->GetFileName()))
-		{
-			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Output file can NOT created!");
-			output.reset();
-			return output;
-		}
-		output->SetPosition(iter->second.offset);
+		if (files.empty())
+			return true;
 
-		std::vector <uint8_t> rawdata(iter->second.finalSize);
-		auto readsize = output->Read(&rawdata[0], iter->second.finalSize);
-		if (readsize != iter->second.finalSize)
+		// The member table is rewritten in place, that can not wait for a commit
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		if (archive->batch.active)
 		{
-			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Read size mismatch: %u-%u", readsize, iter->second.finalSize);
-			output.reset();
-			return output;
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Solid groups can not written inside a batch");
+			return false;
 		}
 
-		auto decrypted = DataBuffer(iter->second.finalSize);
-		if (iter->second.info.flags & FLAG_CRYPTED_AES256)
+		uint64_t totalsize = 0;
+		std::unordered_set <uint32_t> indexes;
+		for (const auto& file : files)
 		{
-			auto aeshelper = std::make_shared<CAes256>();
-			decrypted = aeshelper->Decrypt(reinterpret_cast<const uint8_t*>(rawdata.data()), rawdata.size(), ARCHIVE_IV, &m_archiveKey[0]);
+			totalsize += file.length;
+			if (!file.data || !indexes.emplace(GenerateNameIndex(file.filename)).second)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Invalid or duplicate solid member: %ls", file.filename.c_str());
+				return false;
+			}
 		}
-		else
+		if (totalsize == 0 || totalsize > MAX_SOLID_GROUP_SIZE)
 		{
-			decrypted = DataBuffer(rawdata.data(), rawdata.size());
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Unallowed solid group size: %llu", totalsize);
+			return false;
 		}
 
-		auto decompressed = DataBuffer(iter->second.info.rawsize);
-		if (iter->second.info.flags & FLAG_COMPRESSED_LZ4)
+		auto group = archive->solidGroups.empty() ? 1 : archive->solidGroups.rbegin()->first + 1;
+
+		CVFSScratchScope scratch;
+
+		auto blob = scratch.Arena().AllocateArray<char>(static_cast<std::size_t>(totalsize));
+		std::vector <SSolidMember> members(files.size());
+		uint32_t offset = 0;
+		for (size_t i = 0; i < files.size(); ++i)
 		{
-			std::vector <uint8_t> decompresseddata(iter->second.info.rawsize);
-			auto decompressedsize = LZ4_decompress_fast(decrypted.get_data(), reinterpret_cast<char*>(&decompresseddata[0]), iter->second.info.rawsize);
-			if (decompressedsize != iter->second.info.compressedsize)
-			{
-				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Decomperssed size mismatch: %d-%u", decompressedsize, iter->second.info.compressedsize);
-				output.reset();
-				return output;
-			}
-			decompressed = DataBuffer(&decompresseddata[0], iter->second.info.rawsize);
+			auto& member = members[i];
+			member.index = GenerateNameIndex(files[i].filename);
+			member.hash = XXH32(files[i].data, files[i].length, 0);
+			member.rawsize = files[i].length;
+			member.offset = offset;
+
+			memcpy(blob + offset, files[i].data, files[i].length);
+			offset += files[i].length;
 		}
-		else
+
+		auto groupname = GetSolidGroupName(group);
+		if (!Write(groupname, blob, offset, (flags & (FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256)) | FLAG_SOLID_GROUP, version, profile))
+			return false;
+
+		// Previous copies may live in other groups or as plain entries
+		for (const auto& member : members)
 		{
-			decompressed = decrypted;
+			Delete(member.index);
 		}
 
-		auto currenthash = XXH32(decompressed.get_data(), decompressed.get_size(), 0);
-		if (currenthash != iter->second.info.hash)
+		const auto& groupinfo = archive->files[GenerateNameIndex(groupname)].info;
+		for (size_t i = 0; i < files.size(); ++i)
 		{
-			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Hash mismatch: %p-%p", currenthash, iter->second.info.hash);
-			output.reset();
-			return output;
+			auto entry = GetSolidMemberEntry(groupinfo, members[i]);
+#ifdef SHOW_FILE_NAMES
+			wcscpy_s(entry.info.filename, files[i].filename.c_str());
+#endif
+			archive->files[members[i].index] = entry;
+			archive->solidMembers[members[i].index] = { group, members[i].offset };
 		}
 
-		output->Assign(iter->second.info.filename, decompressed.get_data(), decompressed.get_size(), true);
-
-		return output;
-	}
+		archive->solidGroups[group] = members;
+		if (!WriteSolidIndex(group))
+			return false;
 
-	std::shared_ptr <CVFSFile> CVFSArchive::Open(const std::wstring & filename) const
-	{
-		return Open(GenerateNameIndex(filename), filename);
+		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Solid group: %u written, members: %u size: %u", group, members.size(), offset);
+		return true;
 	}
 
-
-	bool CVFSArchive::Write(const std::wstring& filename, const void* data, uint32_t length, uint8_t flags, uint32_t version)
+	bool CVFSArchive::WriteSolidIndex(uint32_t group)
 	{
 		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
 
-		if (!m_vfsFile || !m_vfsFile.get() || !m_vfsFile->IsWriteable())
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+
+		auto iter = archive->solidGroups.find(group);
+		if (iter == archive->solidGroups.end() || iter->second.empty())
 		{
-			return false;
+			// Last member gone, release the group blocks
+			if (iter != archive->solidGroups.end())
+				archive->solidGroups.erase(iter);
+
+			archive->solidCache.remove_if([&](const std::pair <uint32_t, std::shared_ptr <CVFSFile>>& cached) {
+				if (cached.first != group)
+					return false;
+
+				archive->solidCacheSize -= cached.second->GetSize();
+				return true;
+			});
+
+			Delete(GetSolidIndexName(group));
+			Delete(GetSolidGroupName(group));
+			return true;
 		}
 
-		std::uint32_t index = GenerateNameIndex(filename);
-		std::uint32_t hash = XXH32(reinterpret_cast<const char*>(data), length, 0);
+		SSolidIndexHeader header{ group, static_cast<uint32_t>(iter->second.size()) };
 
-		auto iter = static_cast<SArchiveData*>(m_archiveData)->files.find(index);
-		if (iter != static_cast<SArchiveData*>(m_archiveData)->files.end())
+		DataBuffer table;
+		table.set_capacity(sizeof(SSolidIndexHeader) + header.count * sizeof(SSolidMember));
+		table.append(&header, sizeof(SSolidIndexHeader));
+		table.append(iter->second.data(), header.count * sizeof(SSolidMember));
+#ifdef SHOW_FILE_NAMES
+		for (const auto& member : iter->second)
 		{
-			if (iter->second.info.hash == hash)
-			{
-				return true;
-			}
+			auto file = archive->files.find(member.index);
+			auto length = file != archive->files.end() ? static_cast<uint16_t>(wcsnlen(file->second.info.filename, 254)) : static_cast<uint16_t>(0);
+			table.append(&length, sizeof(uint16_t));
+			if (length)
+				table.append(file->second.info.filename, length * sizeof(wchar_t));
 		}
-//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, 
-//			"Target file: %ls(%u) Data: %p(%u) Hash: %p Flags: %u Version: %u",  filename.c_str(), index, data, length, hash, flags, version);
+#endif
 
-		int32_t compressedsize = 0;
-		auto compressedbuffer = DataBuffer(LZ4_compressBound(length));
-		if (flags & FLAG_COMPRESSED_LZ4)
+		static const SCompressionProfile storeprofile = { 0, 1.0f, 0, 0 };
+		return Write(GetSolidIndexName(group), table.get_data(), table.get_size(), FLAG_SOLID_INDEX, 0, &storeprofile);
+	}
+
+	bool CVFSArchive::LoadSolidIndex(uint32_t index)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+
+		auto file = Open(index);
+		if (!file || !file.get() || file->GetSize() < sizeof(SSolidIndexHeader))
+			return false;
+
+		SSolidIndexHeader header;
+		memcpy(&header, file->GetData(), sizeof(SSolidIndexHeader));
+		auto namesoffset = sizeof(SSolidIndexHeader) + static_cast<uint64_t>(header.count) * sizeof(SSolidMember);
+		if (file->GetSize() < namesoffset)
+			return false;
+
+		auto groupentry = archive->files.find(GenerateNameIndex(GetSolidGroupName(header.group)));
+		if (groupentry == archive->files.end() || !(groupentry->second.info.flags & FLAG_SOLID_GROUP))
+			return false;
+
+		// A group written again replaces the members and the decoded blob of the previous one
+		auto previous = archive->solidGroups.find(header.group);
+		if (previous != archive->solidGroups.end())
 		{
-			std::vector <uint8_t> compressed(compressedbuffer.get_size());
-			compressedsize = LZ4_compress_HC(reinterpret_cast<const char*>(data), reinterpret_cast<char*>(&compressed[0]), length, compressed.size(), LZ4HC_CLEVEL_MAX);
-			if (static_cast<uint32_t>(compressedsize) >= compressedbuffer.get_size() || compressedsize == 0)
+			for (const auto& member : previous->second)
 			{
-				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Compression fail! File: %ls Raw: %u Compressed: %u Cap: %u", filename.c_str(), length, compressedsize, compressedbuffer.get_size());
+				auto location = archive->solidMembers.find(member.index);
+				if (location != archive->solidMembers.end() && location->second.group == header.group)
+				{
+					archive->solidMembers.erase(location);
 
-				compressedbuffer = DataBuffer(data, length);
-				flags &= ~FLAG_COMPRESSED_LZ4;
+					// A member written as a plain entry by the same batch stays
+					auto iter = archive->files.find(member.index);
+					if (iter != archive->files.end() && (iter->second.info.flags & FLAG_SOLID_MEMBER))
+						archive->files.erase(iter);
+				}
 			}
-			else
+		}
+		for (auto it = archive->solidCache.begin(); it != archive->solidCache.end(); ++it)
+		{
+			if (it->first == header.group)
 			{
-				compressedbuffer = DataBuffer(&compressed[0], compressedsize);
+				archive->solidCacheSize -= it->second->GetSize();
+				archive->solidCache.erase(it);
+				break;
 			}
 		}
-		if (compressedsize == 0)
+
+		auto& members = archive->solidGroups[header.group];
+		members.resize(header.count);
+		memcpy(members.data(), file->GetData() + sizeof(SSolidIndexHeader), header.count * sizeof(SSolidMember));
+
+		auto names = file->GetData() + namesoffset;
+		auto namesend = file->GetData() + file->GetSize();
+		for (const auto& member : members)
 		{
-//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Compression fail! Raw data moved to compressed buffer");
+			if (static_cast<uint64_t>(member.offset) + member.rawsize > groupentry->second.info.rawsize)
+				return false;
 
-			flags &= ~FLAG_COMPRESSED_LZ4;
-			compressedbuffer = DataBuffer(data, length);
-		}
+			auto entry = GetSolidMemberEntry(groupentry->second.info, member);
 
-//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Compression completed! Data: %p Size: %u - %u", compressedbuffer.get_data(), compressedbuffer.get_size(), compressedsize);
+			// Only archives written with names keep them
+			uint16_t length = 0;
+			if (names + sizeof(uint16_t) <= namesend)
+			{
+				memcpy(&length, names, sizeof(uint16_t));
+				names += sizeof(uint16_t);
+				if (length > 254 || names + length * sizeof(wchar_t) > namesend)
+					return false;
 
-		auto crypted = DataBuffer(compressedbuffer.get_size());
-		if (flags & FLAG_CRYPTED_AES256)
-		{
-			auto aeshelper = std::make_shared<CAes256>();
-			crypted = aeshelper->Encrypt(reinterpret_cast<const uint8_t*>(compressedbuffer.get_data()), compressedbuffer.get_size(), ARCHIVE_IV, &m_archiveKey[0]);
-		}
-		else
-		{
-			crypted = compressedbuffer;
-		}		
+				memcpy(entry.info.filename, names, length * sizeof(wchar_t));
+				names += length * sizeof(wchar_t);
+			}
 
-//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Cryption completed! Data: %p Size: %u", crypted.get_data(), crypted.get_size());
+			archive->files[member.index] = entry;
+			archive->solidMembers[member.index] = { header.group, member.offset };
+		}
+		return true;
+	}
 
-		Delete(index);
+	std::shared_ptr <CVFSFile> CVFSArchive::OpenSolidGroup(uint32_t group) const
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
 
-		SFileEntry entry;
-		memset(&entry, 0, sizeof(SFileEntry));
-		entry.numBlocks = 0xffffffff;
-		auto idx = static_cast<SArchiveData*>(m_archiveData)->entries.end();
-		auto it = static_cast<SArchiveData*>(m_archiveData)->entries.begin();
-		while (it != static_cast<SArchiveData*>(m_archiveData)->entries.end())
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		for (auto it = archive->solidCache.begin(); it != archive->solidCache.end(); ++it)
 		{
-			if ((*it).numBlocks < entry.numBlocks && (*it).numBlocks * static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock >= crypted.get_size() + sizeof(SFileEntry))
+			if (it->first == group)
 			{
-				entry = (*it);
-				idx = it;
+				archive->solidCache.splice(archive->solidCache.begin(), archive->solidCache, it);
+				return archive->solidCache.front().second;
 			}
-			++it;
 		}
 
-		if (entry.numBlocks == 0xffffffff)
+		auto file = Open(GetSolidGroupName(group));
+		if (!file || !file.get())
+			return file;
+
+		archive->solidCache.emplace_front(group, file);
+		archive->solidCacheSize += file->GetSize();
+		while (archive->solidCacheSize > SOLID_CACHE_SIZE && archive->solidCache.size() > 1)
 		{
-			m_vfsFile->SetPosition(m_vfsFile->GetSize(), false);
-			entry.numBlocks = ALIGNTO(crypted.get_size() + sizeof(SFileEntry), static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock) / static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock;
-			entry.offset = m_vfsFile->GetPosition() + sizeof(SFileEntry);
-			std::uint8_t* mem = static_cast<std::uint8_t*>(malloc(entry.numBlocks * static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock));
-			m_vfsFile->Write(mem, entry.numBlocks * static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock);
-			free(mem);
+			archive->solidCacheSize -= archive->solidCache.back().second->GetSize();
+			archive->solidCache.pop_back();
 		}
+		return file;
+	}
 
-		entry.info.index = index;
-		entry.info.hash = hash;
-		entry.info.flags = flags;
-		entry.info.version = version;
-		entry.info.rawsize = length;
-		entry.info.compressedsize = compressedbuffer.get_size();
-		entry.info.cryptedsize = crypted.get_size();
-#ifdef SHOW_FILE_NAMES
-		wcscpy_s(entry.info.filename, filename.c_str());
-#endif
-		entry.finalSize = crypted.get_size();
+	std::shared_ptr <CVFSFile> CVFSArchive::OpenSolidMember(const SFileInformation& info) const
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
 
-		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Write completed %u-%ls-%u-%u-%p-%u-%u", index, filename.c_str(), length, crypted.get_size(), hash, flags, version);
+		std::shared_ptr <CVFSFile> output;
 
-		m_vfsFile->SetPosition(entry.offset - sizeof(SFileEntry), false);
-		m_vfsFile->Write(&entry, sizeof(SFileEntry));
-		m_vfsFile->Write(crypted.get_data(), crypted.get_size());
+		auto location = static_cast<SArchiveData*>(m_archiveData)->solidMembers.find(info.index);
+		if (location == static_cast<SArchiveData*>(m_archiveData)->solidMembers.end())
+			return output;
 
-		if (idx != static_cast<SArchiveData*>(m_archiveData)->entries.end())
+		auto group = OpenSolidGroup(location->second.group);
+		if (!group || !group.get() || static_cast<uint64_t>(location->second.offset) + info.rawsize > group->GetSize())
 		{
-			gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Entry removed");
-			static_cast<SArchiveData*>(m_archiveData)->entries.erase(idx);
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Solid group: %u can NOT decoded", location->second.group);
+			return output;
 		}
 
-//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Entry writed to archive new size: %u", static_cast<SArchiveData*>(m_archiveData)->files.size() + 1);
-		static_cast<SArchiveData*>(m_archiveData)->files.emplace(index, entry);
-		return true;
+		auto data = group->GetData() + location->second.offset;
+		auto currenthash = XXH32(data, info.rawsize, 0);
+		if (currenthash != info.hash)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Hash mismatch: %p-%p", currenthash, info.hash);
+			return output;
+		}
+
+		output = std::make_shared<CVFSFile>();
+		if (!output || !output.get() || !output->Assign(info.filename, DataBuffer(data, info.rawsize)))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Output file can NOT created!");
+			output.reset();
+		}
+		return output;
 	}
 
 	bool CVFSArchive::Delete(uint32_t index)
 	{
 		std::lock_guard<std::recursive_mutex> __lock(m_archiveMutex);
+		m_generation = ++gs_archiveGenerations;
 
-		if (!m_vfsFile || !m_vfsFile.get() || !m_vfsFile->IsWriteable())
+		if (!m_vfsFile || !m_vfsFile.get() || !m_vfsFile->IsWriteable() || IsLayoutLocked(static_cast<SArchiveData*>(m_archiveData)))
 		{
 			return false;
 		}
 
+		if (static_cast<SArchiveData*>(m_archiveData)->batch.active)
+		{
+			return StageBatchDelete(static_cast<SArchiveData*>(m_archiveData), index);
+		}
+
 		auto iter = static_cast<SArchiveData*>(m_archiveData)->files.find(index);
 		if (iter == static_cast<SArchiveData*>(m_archiveData)->files.end())
 		{
 			return false;
 		}
 
-		SFileEntry entry = iter->second;
-		static_cast<SArchiveData*>(m_archiveData)->files.erase(iter);
-
-		entry.info.index = 0;
-		entry.info.hash = 0;
-		entry.info.version = 0;
-		entry.info.flags = 0;
-		entry.info.rawsize = 0;
-		entry.info.compressedsize = 0;
-		entry.info.cryptedsize = 0;
-#ifdef SHOW_FILE_NAMES
-		wcscpy_s(entry.info.filename, L"");
-#endif
-		entry.finalSize = 0;
-
-		m_vfsFile->SetPosition(entry.offset - sizeof(SFileEntry), false);
-		m_vfsFile->Write(&entry, sizeof(SFileEntry));
+		if (iter->second.info.flags & FLAG_SOLID_MEMBER)
+		{
+			// The group blob stays as is, only its member table is rewritten
+			auto archive = static_cast<SArchiveData*>(m_archiveData);
+			auto location = archive->solidMembers.find(index);
+			auto group = location != archive->solidMembers.end() ? location->second.group : 0;
+
+			archive->files.erase(iter);
+			if (location != archive->solidMembers.end())
+				archive->solidMembers.erase(location);
+
+			auto& members = archive->solidGroups[group];
+			members.erase(std::remove_if(members.begin(), members.end(), [index](const SSolidMember& member) {
+				return member.index == index;
+			}), members.end());
+			return WriteSolidIndex(group);
+		}
 
-		static_cast<SArchiveData*>(m_archiveData)->entries.push_back(entry);
-		return true;
+		// Merged with free neighbours, the header of the whole extent is rewritten
+		THeaderWrites headers;
+		AddFreeHeader(headers, ReleaseEntry(static_cast<SArchiveData*>(m_archiveData), index, headers), static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock);
+		return WriteHeaders(m_vfsFile.get(), headers);
 	}
 
 	bool CVFSArchive::Delete(const std::wstring & filename)
@@ -486,13 +3273,16 @@ namespace VFS
 
 	std::vector <SFileInformation> CVFSArchive::EnumerateFiles() const
 	{
-		std::vector <SFileInformation> result(static_cast<SArchiveData*>(m_archiveData)->files.size());
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		std::vector <SFileInformation> result;
+		result.reserve(static_cast<SArchiveData*>(m_archiveData)->files.size());
 //		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Archived file size: %u", static_cast<SArchiveData*>(m_archiveData)->files.size());
 
-		uint32_t index = 0;
 		for (const auto & it : static_cast<SArchiveData*>(m_archiveData)->files)
 		{
-			result[index++] = it.second.info;
+			if (!IsReserved(it.first))
+				result.emplace_back(it.second.info);
 		}
 		return result;
 	}
@@ -504,6 +3294,9 @@ namespace VFS
 
 		for (const auto& it : static_cast<SArchiveData*>(m_archiveData)->files)
 		{
+			if (IsReserved(it.first))
+				continue;
+
 			if (pfnEnumFiles(Open(it.second.info.index), it.second.info, pvUserContext) == false)
 				return false;
 		}
@@ -511,6 +3304,124 @@ namespace VFS
 		return true;
 	}
 
+	void CVFSArchive::RecordStartupSet(uint32_t seconds)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		auto& startup = static_cast<SArchiveData*>(m_archiveData)->startup;
+		startup = SStartupState();
+		startup.active = seconds != 0;
+		startup.deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+	}
+
+	bool CVFSArchive::SaveStartupSet()
+	{
+		std::wstring filename;
+		std::vector <uint32_t> indexes;
+		{
+			std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+			auto& startup = static_cast<SArchiveData*>(m_archiveData)->startup;
+			if (!startup.active || !m_vfsFile)
+				return true;
+
+			filename = m_vfsFile->GetFileName();
+			indexes = std::move(startup.indexes);
+			startup = SStartupState();
+		}
+
+		// Written without the archive lock, reads go on meanwhile
+		if (!WriteStartupSet(filename, indexes))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Startup set of %ls can not saved", filename.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	std::vector <uint32_t> CVFSArchive::LoadStartupSet() const
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		std::vector <uint32_t> indexes;
+
+		std::error_code error;
+		auto filename = (m_vfsFile ? m_vfsFile->GetFileName() : std::wstring()) + STARTUP_SET_EXTENSION;
+		if (!m_vfsFile || !std::filesystem::exists(filename, error))
+			return indexes;
+
+		CVFSFile file;
+		SStartupSetHeader header;
+		if (!file.Open(filename) || file.Read(&header, sizeof(SStartupSetHeader)) != sizeof(SStartupSetHeader) || header.magic != STARTUP_SET_MAGIC ||
+			file.GetSize() != sizeof(SStartupSetHeader) + static_cast<uint64_t>(header.count) * sizeof(uint32_t))
+		{
+			return indexes;
+		}
+
+		indexes.resize(header.count);
+		if (file.Read(indexes.data(), header.count * sizeof(uint32_t)) != header.count * sizeof(uint32_t) ||
+			XXH32(indexes.data(), indexes.size() * sizeof(uint32_t), 0) != header.hash)
+		{
+			indexes.clear();
+		}
+		return indexes;
+	}
+
+	std::vector <std::pair <uint64_t, uint64_t>> CVFSArchive::GetEntryRanges(const std::vector <uint32_t>& indexes, uint64_t gap) const
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+
+		// Members are read from their group, sharers from their holder
+		std::vector <std::pair <uint64_t, uint64_t>> ranges;
+		ranges.reserve(indexes.size());
+		for (auto index : indexes)
+		{
+			auto iter = archive->files.find(index);
+			if (iter != archive->files.end() && (iter->second.info.flags & FLAG_SOLID_MEMBER))
+			{
+				auto location = archive->solidMembers.find(index);
+				iter = location != archive->solidMembers.end() ? archive->files.find(GenerateNameIndex(GetSolidGroupName(location->second.group))) : archive->files.end();
+			}
+			else if (iter != archive->files.end() && iter->second.info.owner)
+			{
+				iter = archive->files.find(iter->second.info.owner);
+			}
+			if (iter == archive->files.end())
+				continue;
+
+			ranges.emplace_back(iter->second.offset - sizeof(SFileEntry), iter->second.offset + iter->second.finalSize);
+		}
+		std::sort(ranges.begin(), ranges.end());
+
+		std::vector <std::pair <uint64_t, uint64_t>> merged;
+		for (const auto& range : ranges)
+		{
+			if (!merged.empty() && range.first <= merged.back().second + gap)
+				merged.back().second = std::max(merged.back().second, range.second);
+			else
+				merged.push_back(range);
+		}
+		return merged;
+	}
+
+	std::vector <SFileInformation> CVFSArchive::EnumerateRawEntries() const
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+
+		std::vector <SFileInformation> result;
+		result.reserve(static_cast<SArchiveData*>(m_archiveData)->files.size());
+
+		for (const auto& it : static_cast<SArchiveData*>(m_archiveData)->files)
+		{
+			// Members travel inside their group
+			if (!(it.second.info.flags & FLAG_SOLID_MEMBER))
+				result.emplace_back(it.second.info);
+		}
+		return result;
+	}
+
 	uint32_t CVFSArchive::ReadRawData(uint32_t index, void* buffer, uint32_t maxlength) const
 	{
 		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
@@ -521,26 +3432,36 @@ namespace VFS
 		}
 
 		auto iter = static_cast<SArchiveData*>(m_archiveData)->files.find(index);
-		if (iter == static_cast<SArchiveData*>(m_archiveData)->files.end())
+		if (iter == static_cast<SArchiveData*>(m_archiveData)->files.end() || (iter->second.info.flags & FLAG_SOLID_MEMBER) ||
+			iter->second.finalSize > 0xffffffff - sizeof(SFileEntry))
 		{
 			return 0;
 		}
 
-		uint32_t blocksize = sizeof(SFileEntry) + iter->second.finalSize;
+		// Sharers are handed out as whole entries, the receiving archive shares them again on its own
+		auto entry = iter->second;
+		if (entry.info.owner)
+		{
+			auto holder = static_cast<SArchiveData*>(m_archiveData)->files.find(entry.info.owner);
+			if (holder == static_cast<SArchiveData*>(m_archiveData)->files.end() || holder->second.finalSize > 0xffffffff - sizeof(SFileEntry))
+				return 0;
+
+			entry.offset = holder->second.offset;
+			entry.finalSize = holder->second.finalSize;
+			entry.info.owner = 0;
+		}
+
+		uint32_t blocksize = static_cast<uint32_t>(sizeof(SFileEntry) + entry.finalSize);
 		if (maxlength > sizeof(SFileEntry))
 		{
-			memcpy(buffer, &iter->second, sizeof(SFileEntry));
+			memcpy(buffer, &entry, sizeof(SFileEntry));
 
-			if (maxlength - sizeof(SFileEntry) > 0)
+			// Read straight into the caller buffer through the archive handle
+			auto length = static_cast<uint32_t>(std::min<uint64_t>(maxlength - sizeof(SFileEntry), entry.finalSize));
+			m_vfsFile->SetPosition(entry.offset, false);
+			if (m_vfsFile->Read(reinterpret_cast<uint8_t*>(buffer) + sizeof(SFileEntry), length) != length)
 			{
-				std::unique_ptr< CVFSFile> stream(new CVFSFile());
-				if (!stream || !stream.get() || !stream->Map(m_vfsFile->GetFileName(), iter->second.offset, iter->second.finalSize))
-				{
-					return 0;
-				}
-
-				blocksize = sizeof(SFileEntry) + static_cast<uint32_t>(stream->GetSize());
-				memcpy(reinterpret_cast<uint8_t*>(buffer) + sizeof(SFileEntry), stream->GetData(), std::min<uint32_t>(maxlength - sizeof(SFileEntry), static_cast<uint32_t>(stream->GetSize())));
+				return 0;
 			}
 		}
 
@@ -548,46 +3469,28 @@ namespace VFS
 	}
 	bool CVFSArchive::WriteRawData(const void* buffer, uint32_t length)
 	{
-		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
-
-		if (!m_vfsFile || !m_vfsFile .get()|| !m_vfsFile->IsWriteable())
+		if (!buffer || length < sizeof(SFileEntry) || length - sizeof(SFileEntry) < reinterpret_cast<const SFileEntry*>(buffer)->finalSize)
 		{
 			return false;
 		}
 
-		const SFileEntry* ent = reinterpret_cast<const SFileEntry*>(buffer);
+		return WriteRawEntry(buffer, reinterpret_cast<const uint8_t*>(buffer) + sizeof(SFileEntry));
+	}
 
-		auto iter = static_cast<SArchiveData*>(m_archiveData)->files.find(ent->info.index);
-		if (iter != static_cast<SArchiveData*>(m_archiveData)->files.end())
-		{
-			Delete(ent->info.index);
-		}
+	bool CVFSArchive::WriteRawEntry(const void* header, const void* payload)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex);
+		m_generation = ++gs_archiveGenerations;
 
-		SFileEntry entry;
-		memset(&entry, 0, sizeof(SFileEntry));
-		entry.numBlocks = 0xffffffff;
-		auto idx = static_cast<SArchiveData*>(m_archiveData)->entries.end();
-		auto it = static_cast<SArchiveData*>(m_archiveData)->entries.begin();
-		while (it != static_cast<SArchiveData*>(m_archiveData)->entries.end())
+		if (!m_vfsFile || !m_vfsFile .get()|| !m_vfsFile->IsWriteable() || IsLayoutLocked(static_cast<SArchiveData*>(m_archiveData)))
 		{
-			if ((*it).numBlocks < entry.numBlocks && (*it).numBlocks * static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock >= ent->finalSize + sizeof(SFileEntry))
-			{
-				entry = (*it);
-				idx = it;
-			}
-			++it;
+			return false;
 		}
 
-		if (entry.numBlocks == 0xffffffff)
-		{
-			m_vfsFile->SetPosition(m_vfsFile->GetSize(), false);
-			entry.numBlocks = ALIGNTO(ent->finalSize + sizeof(SFileEntry), static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock) / static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock;
-			entry.offset = m_vfsFile->GetPosition() + sizeof(SFileEntry);
-			uint8_t* mem = static_cast<uint8_t*>(malloc(entry.numBlocks * static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock));
-			m_vfsFile->Write(mem, entry.numBlocks * static_cast<SArchiveData*>(m_archiveData)->header.bytesPerBlock);
-			free(mem);
-		}
+		const SFileEntry* ent = reinterpret_cast<const SFileEntry*>(header);
 
+		SFileEntry entry;
+		memset(&entry, 0, sizeof(SFileEntry));
 		entry.info.index = ent->info.index;
 		entry.info.hash = ent->info.hash;
 		entry.info.flags = ent->info.flags;
@@ -595,58 +3498,371 @@ namespace VFS
 		entry.info.rawsize = ent->info.rawsize;
 		entry.info.compressedsize = ent->info.compressedsize;
 		entry.info.cryptedsize = ent->info.cryptedsize;
+		entry.info.level = ent->info.level;
+		entry.info.dictionary = ent->info.dictionary;
+		entry.info.contenthash = ent->info.contenthash;
 #ifdef SHOW_FILE_NAMES
 		wcscpy_s(entry.info.filename, ent->info.filename);
 #endif
 		entry.finalSize = ent->finalSize;
 
-		m_vfsFile->SetPosition(entry.offset - sizeof(SFileEntry), false);
-		m_vfsFile->Write(&entry, sizeof(SFileEntry));
-		m_vfsFile->Write(reinterpret_cast<const uint8_t*>(buffer) + sizeof(SFileEntry), entry.finalSize);
+		if (static_cast<SArchiveData*>(m_archiveData)->batch.active)
+		{
+			return StageBatchEntry(static_cast<SArchiveData*>(m_archiveData), entry, payload);
+		}
+
+		auto iter = static_cast<SArchiveData*>(m_archiveData)->files.find(ent->info.index);
+		if (iter != static_cast<SArchiveData*>(m_archiveData)->files.end())
+		{
+			Delete(ent->info.index);
+		}
 
-		if (idx != static_cast<SArchiveData*>(m_archiveData)->entries.end())
+		auto holder = FindSharedPayload(static_cast<SArchiveData*>(m_archiveData), entry.info);
+		if (holder)
 		{
-			static_cast<SArchiveData*>(m_archiveData)->entries.erase(idx);
+			return WriteSharedEntry(static_cast<SArchiveData*>(m_archiveData), m_vfsFile.get(), *holder, entry.info);
 		}
 
+		auto entryend = PlaceEntry(static_cast<SArchiveData*>(m_archiveData), m_vfsFile.get(), ent->finalSize + sizeof(SFileEntry), entry);
+
+		if (!m_vfsFile->SetPosition(entry.offset - sizeof(SFileEntry), false))
+			return false;
+		m_vfsFile->Write(&entry, sizeof(SFileEntry));
+		m_vfsFile->Write(payload, static_cast<uint32_t>(entry.finalSize));
+		if (entryend)
+			m_vfsFile->Extend(entryend);
+
 		static_cast<SArchiveData*>(m_archiveData)->files.insert({ entry.info.index, entry });
+		RegisterPayload(static_cast<SArchiveData*>(m_archiveData), entry);
 		return true;
 	}
 
-	bool CVFSArchive::CopyArchive(std::shared_ptr<CVFSArchive> in, std::shared_ptr<CVFSArchive> out)
+	// Source payloads are read through views of this size slid along the entries in file order
+	static const uint32_t MERGE_VIEW_SIZE = 64 * 1024 * 1024;
+
+	typedef struct _MERGE_ENTRY
+	{
+		SFileEntry	entry;	// Offset and size of the payload, the holder's one for sharers
+		bool		sharer;
+	} SMergeEntry;
+
+	// Reserved entries move between numbers as they are, their payload does not depend on the name
+	static void RenameEntry(SFileEntry& entry, const std::wstring& filename)
+	{
+		entry.info.index = CVFSArchive::GenerateNameIndex(filename);
+#ifdef SHOW_FILE_NAMES
+		wcscpy_s(entry.info.filename, filename.c_str());
+#endif
+	}
+
+	bool CVFSArchive::Merge(std::shared_ptr <CVFSArchive> from, const std::vector <uint32_t>& indexes)
 	{
-		if (!in || !in.get() || !out || !out.get())
+		if (!from || !from.get() || from.get() == this)
+		{
+			return false;
+		}
+
+		std::lock(m_archiveMutex, from->m_archiveMutex);
+		std::lock_guard <std::recursive_mutex> __lock(m_archiveMutex, std::adopt_lock);
+		std::lock_guard <std::recursive_mutex> __fromLock(from->m_archiveMutex, std::adopt_lock);
+		m_generation = ++gs_archiveGenerations;
+
+		auto archive = static_cast<SArchiveData*>(m_archiveData);
+		auto source = static_cast<SArchiveData*>(from->m_archiveData);
+		if (!m_vfsFile || !m_vfsFile->IsWriteable() || IsLayoutLocked(archive) || archive->batch.active ||
+			!from->m_vfsFile || !from->m_vfsFile->IsReadable())
 		{
 			return false;
 		}
 
-		for (const auto & file : out->EnumerateFiles())
+		std::unordered_set <uint32_t> selected;
+		if (indexes.empty())
 		{
-			out->Delete((file).index);
+			for (const auto& it : source->files)
+			{
+				if (!(it.second.info.flags & FLAG_SOLID_MEMBER))
+					selected.insert(it.first);
+			}
+		}
+		for (auto index : indexes)
+		{
+			auto iter = source->files.find(index);
+			if (iter == source->files.end())
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Entry: %u not found", index);
+				return false;
+			}
+
+			if (iter->second.info.flags & FLAG_SOLID_MEMBER)
+			{
+				auto location = source->solidMembers.find(index);
+				if (location == source->solidMembers.end())
+					return false;
+
+				selected.insert(GenerateNameIndex(GetSolidGroupName(location->second.group)));
+				selected.insert(GenerateNameIndex(GetSolidIndexName(location->second.group)));
+			}
+			else
+			{
+				selected.insert(index);
+			}
+
+			if (iter->second.info.dictionary)
+				selected.insert(GenerateNameIndex(GetDictionaryName(iter->second.info.dictionary)));
+		}
+
+		// Solid groups and dictionaries are numbered per archive, incoming ones whose number the target already uses are renumbered.
+		// A group gets its member table written again, entries coded against a dictionary follow it to its new id.
+		auto isfreegroup = [&](uint32_t group) {
+			return archive->solidGroups.find(group) == archive->solidGroups.end() &&
+				archive->files.find(GenerateNameIndex(GetSolidGroupName(group))) == archive->files.end() &&
+				archive->files.find(GenerateNameIndex(GetSolidIndexName(group))) == archive->files.end();
+		};
+
+		std::map <uint32_t, uint32_t> groups;
+		std::unordered_map <uint32_t, uint32_t> groupEntries;
+		auto nextgroup = std::max(archive->solidGroups.empty() ? 0 : archive->solidGroups.rbegin()->first, source->solidGroups.empty() ? 0 : source->solidGroups.rbegin()->first) + 1;
+		for (const auto& it : source->solidGroups)
+		{
+			auto groupindex = GenerateNameIndex(GetSolidGroupName(it.first));
+			if (selected.find(groupindex) == selected.end())
+				continue;
+
+			selected.erase(GenerateNameIndex(GetSolidIndexName(it.first)));
+
+			auto group = it.first;
+			if (!isfreegroup(group))
+			{
+				while (!isfreegroup(nextgroup))
+					++nextgroup;
+				group = nextgroup++;
+			}
+			groups.emplace(it.first, group);
+			groupEntries.emplace(groupindex, group);
 		}
 
-		for (const auto& file : out->EnumerateFiles())
+		std::map <uint8_t, uint8_t> dictionaryIds;
+		std::unordered_set <uint8_t> usedIds;
+		std::vector <uint8_t> movedIds;
+		for (const auto& it : source->dictionaryIndexes)
+		{
+			auto iter = source->files.find(it.first);
+			if (iter == source->files.end() || selected.find(it.first) == selected.end())
+				continue;
+
+			// The same dictionary is used as it is
+			auto existing = archive->files.find(it.first);
+			if (existing != archive->files.end() && !IsSamePayload(existing->second.info, iter->second.info))
+			{
+				movedIds.push_back(it.second);
+				continue;
+			}
+			if (existing != archive->files.end())
+				selected.erase(it.first);
+
+			dictionaryIds.emplace(it.second, it.second);
+			usedIds.insert(it.second);
+		}
+		for (auto id : movedIds)
 		{
-			uint32_t blocksize = in->ReadRawData(file.index, nullptr, 0);
-			if (blocksize == 0)
+			uint8_t target = 0;
+			for (uint8_t candidate = 1; candidate <= MAX_DICTIONARY_ID && !target; ++candidate)
+			{
+				if (usedIds.find(candidate) == usedIds.end() && archive->files.find(GenerateNameIndex(GetDictionaryName(candidate))) == archive->files.end())
+					target = candidate;
+			}
+			if (!target)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "No dictionary id left for dictionary: %u of %ls", id, from->m_vfsFile->GetFileName().c_str());
 				return false;
+			}
 
-			uint8_t* ptr = static_cast<uint8_t*>(malloc(blocksize));
-			if ((blocksize = in->ReadRawData(file.index, ptr, blocksize)) == 0)
+			dictionaryIds.emplace(id, target);
+			usedIds.insert(target);
+		}
+
+		// In file order, sharers right behind their holder so the target shares the payload again
+		std::vector <SMergeEntry> transfers;
+		transfers.reserve(selected.size());
+		for (auto index : selected)
+		{
+			auto iter = source->files.find(index);
+			if (iter == source->files.end())
+				continue;
+
+			SMergeEntry transfer{ iter->second, iter->second.info.owner != 0 };
+			if (transfer.sharer)
 			{
-				free(ptr);
+				auto holder = source->files.find(transfer.entry.info.owner);
+				if (holder == source->files.end())
+					return false;
+
+				transfer.entry.offset = holder->second.offset;
+				transfer.entry.finalSize = holder->second.finalSize;
+				transfer.entry.info.owner = 0;
+			}
+			transfers.push_back(transfer);
+		}
+		std::sort(transfers.begin(), transfers.end(), [](const SMergeEntry& lhs, const SMergeEntry& rhs) {
+			return lhs.entry.offset != rhs.entry.offset ? lhs.entry.offset < rhs.entry.offset : lhs.sharer < rhs.sharer;
+		});
+
+		from->m_vfsFile->Flush();
+
+		// A source opened for writing may refuse a second handle, its payloads are read through its own one then
+		CVFSFile view;
+		auto mapped = true;
+		uint64_t viewStart = 0;
+		uint64_t viewSize = 0;
+		DataBuffer scratch;
+
+		for (const auto& transfer : transfers)
+		{
+			auto entry = transfer.entry;
+			if (entry.finalSize > 0xffffffff)
 				return false;
+
+			const void* payload = nullptr;
+			if (entry.finalSize && mapped && (entry.offset < viewStart || entry.offset + entry.finalSize > viewStart + viewSize))
+			{
+				viewStart = entry.offset;
+				viewSize = 0;
+				mapped = view.Map(from->m_vfsFile->GetFileName(), viewStart, static_cast<uint32_t>(std::max<uint64_t>(MERGE_VIEW_SIZE, entry.finalSize)));
+				if (mapped)
+					viewSize = view.GetSize();
+				if (mapped && viewSize < entry.finalSize)
+					return false;
+			}
+
+			if (entry.finalSize && mapped)
+			{
+				payload = view.GetData() + (entry.offset - viewStart);
 			}
+			else if (entry.finalSize)
+			{
+				scratch.set_size(static_cast<uint32_t>(entry.finalSize));
+				from->m_vfsFile->SetPosition(entry.offset, false);
+				if (from->m_vfsFile->Read(scratch.get_data(), scratch.get_size()) != scratch.get_size())
+					return false;
+				payload = scratch.get_data();
+			}
+
+			auto group = groupEntries.find(entry.info.index);
+			if (group != groupEntries.end())
+				RenameEntry(entry, GetSolidGroupName(group->second));
+
+			auto sourceDictionary = source->dictionaryIndexes.find(entry.info.index);
+			if (sourceDictionary != source->dictionaryIndexes.end())
+				RenameEntry(entry, GetDictionaryName(dictionaryIds[sourceDictionary->second]));
 
-			if (!out->WriteRawData(ptr, blocksize))
+			auto id = dictionaryIds.find(entry.info.dictionary);
+			if (entry.info.dictionary && id != dictionaryIds.end())
+				entry.info.dictionary = id->second;
+
+			if (!WriteRawEntry(&entry, payload))
 			{
-				free(ptr);
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Entry: %u can not written", entry.info.index);
 				return false;
 			}
 
-			free(ptr);
+			auto dictionary = archive->dictionaryIndexes.find(entry.info.index);
+			if (dictionary != archive->dictionaryIndexes.end())
+				archive->dictionaries.erase(dictionary->second);
 		}
 
+		// Members are listed once their group is in place, previous copies may live in other groups or as plain entries
+		for (const auto& it : groups)
+		{
+			const auto& members = source->solidGroups[it.first];
+			for (const auto& member : members)
+			{
+				Delete(member.index);
+			}
+
+			const auto& groupinfo = archive->files[GenerateNameIndex(GetSolidGroupName(it.second))].info;
+			for (const auto& member : members)
+			{
+				auto entry = GetSolidMemberEntry(groupinfo, member);
+				auto sourceEntry = source->files.find(member.index);
+				if (sourceEntry != source->files.end())
+					memcpy(entry.info.filename, sourceEntry->second.info.filename, sizeof(entry.info.filename));
+
+				archive->files[member.index] = entry;
+				archive->solidMembers[member.index] = { it.second, member.offset };
+			}
+
+			archive->solidGroups[it.second] = members;
+			if (!WriteSolidIndex(it.second))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Solid index: %u can not written", it.second);
+				return false;
+			}
+		}
 		return true;
 	}
+
+	bool CVFSArchive::CopyArchive(std::shared_ptr<CVFSArchive> in, std::shared_ptr<CVFSArchive> out)
+	{
+		if (!in || !in.get() || !out || !out.get() || in == out)
+		{
+			return false;
+		}
+
+		std::lock_guard <std::recursive_mutex> __lock(out->m_archiveMutex);
+
+		auto archive = static_cast<SArchiveData*>(out->m_archiveData);
+		if (!out->m_vfsFile || !out->m_vfsFile.get() || !out->m_vfsFile->IsWriteable() || archive->batch.active || IsLayoutLocked(archive))
+		{
+			return false;
+		}
+
+		auto filename = out->m_vfsFile->GetFileName();
+		auto copyname = filename + ARCHIVE_COPY_EXTENSION;
+
+		uint8_t key[VFS::KEY_LENGTH];
+		memcpy(key, out->m_archiveKey, VFS::KEY_LENGTH);
+
+		// Built aside, the output stays as it was until the rename
+		auto result = false;
+		{
+			auto file = std::make_shared<CVFSFile>();
+			auto copy = std::make_shared<CVFSArchive>();
+			result = file->Create(copyname) && copy->Create(file, key) && copy->Merge(in) && file->Sync();
+
+			copy->Unload();
+			file->Close();
+		}
+
+		std::error_code error;
+		std::filesystem::remove(copyname + NAME_TABLE_EXTENSION, error);
+		if (result)
+		{
+			auto file = out->m_vfsFile;
+			out->Unload();
+			file->Close();
+
+			std::filesystem::rename(copyname, filename, error);
+			if (error)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Copy can not renamed to: %ls, %s", filename.c_str(), error.message().c_str());
+				result = false;
+			}
+
+			// The new content, or the old one when the rename failed
+			if (!file->Create(filename, true) || !out->Load(file, key))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Archive: %ls can not reopened", filename.c_str());
+				result = false;
+			}
+			else if (result)
+			{
+				out->SaveNameTable();
+			}
+		}
+		memset(key, 0, VFS::KEY_LENGTH);
+
+		if (!result)
+			std::filesystem::remove(copyname, error);
+		return result;
+	}
 }
@@ -2,15 +2,43 @@
 #include "../include/VFSFile.h"
 #include "../include/LogHelper.h"
 
+#include <new>
+
 namespace VFS
 {
     extern CVFSLog* gs_pVFSLogInstance;
-    
+
+	static const uint32_t NO_CHUNK = 0xffffffff;
+	static const std::size_t WRITE_BUFFER_ALIGNMENT = 4096;
+
+	bool CVFSChunkSource::ReadAll(DataBuffer& output)
+	{
+		auto size = GetSize();
+		if (size > 0xffffffff)
+			return false;
+
+		output.set_size(static_cast<uint32_t>(size));
+
+		DataBuffer chunk;
+		uint64_t position = 0;
+		for (uint32_t i = 0; position < size; ++i)
+		{
+			if (!ReadChunk(i, chunk) || chunk.get_size() == 0 || position + chunk.get_size() > size)
+				return false;
+
+			memcpy(output.get_data() + position, chunk.get_data(), chunk.get_size());
+			position += chunk.get_size();
+		}
+		return true;
+	}
+
 	CVFSFile::CVFSFile() :
 		m_fileName(L""),
 		m_fileHandle(INVALID_HANDLE_VALUE),  m_mapHandle(nullptr),
 		m_mappedData(nullptr), m_mappedSize(0),
 		m_rawData(nullptr), m_rawSize(0),
+		m_chunkIndex(NO_CHUNK),
+		m_writeBuffer(nullptr), m_writeCapacity(0), m_writeUsed(0), m_writeStart(0), m_writeAppend(false),
 		m_currPos(0), m_memOwner(false),
 		m_fileType(FILE_TYPE_NONE)
 	{
@@ -74,6 +102,8 @@ namespace VFS
 
 //		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "%ls", m_fileName.c_str());
 
+		SetWriteBuffer(0);
+
 		if (m_rawData)
 		{
 			if (m_rawData != m_mappedData && m_memOwner)
@@ -82,6 +112,11 @@ namespace VFS
 			}
 			m_rawData = nullptr;
 		}
+		m_ownedBuffer.clear();
+
+		m_chunkSource.reset();
+		m_chunkBuffer.clear();
+		m_chunkIndex = NO_CHUNK;
 
 		if (m_mappedData)
 		{
@@ -137,20 +172,27 @@ namespace VFS
 		SYSTEM_INFO sys {};
 		GetSystemInfo(&sys);
 
-		offset -= offset % sys.dwAllocationGranularity;
-
-		m_mappedData = static_cast<uint8_t*>(MapViewOfFile(m_mapHandle, FILE_MAP_READ, offset >> 32, offset & 0xffffffff, size));
-		
 		LARGE_INTEGER s;
 		GetFileSizeEx(m_fileHandle, &s);
-		if (size == 0)
+		if (offset > static_cast<uint64_t>(s.QuadPart))
 		{
-			size = static_cast<uint32_t>(s.QuadPart);
+			Close();
+			return false;
 		}
-		m_mappedSize = size;
+		if (size == 0 || size > s.QuadPart - offset)
+		{
+			size = static_cast<uint32_t>(std::min<uint64_t>(s.QuadPart - offset, 0xffffffff));
+		}
+
+		// Views start on the allocation granularity, the bytes in front of the offset are mapped along and skipped
+		auto skip = offset % sys.dwAllocationGranularity;
+		auto start = offset - skip;
 
-		m_rawData = m_mappedData + (offset % sys.dwAllocationGranularity);
-		m_rawSize = std::min<uint64_t>(size, s.QuadPart);
+		m_mappedData = static_cast<uint8_t*>(MapViewOfFile(m_mapHandle, FILE_MAP_READ, start >> 32, start & 0xffffffff, static_cast<size_t>(skip + size)));
+		m_mappedSize = skip + size;
+
+		m_rawData = m_mappedData ? m_mappedData + skip : nullptr;
+		m_rawSize = size;
 		m_currPos = 0;
 	
 		if (m_rawData)
@@ -196,6 +238,42 @@ namespace VFS
 		return m_rawData;
 	}
 
+	bool CVFSFile::Assign(const std::wstring& filename, DataBuffer&& buffer)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_fileMutex);
+
+		Close();
+
+		m_ownedBuffer = std::move(buffer);
+		m_rawData = reinterpret_cast<uint8_t*>(m_ownedBuffer.get_data());
+		m_rawSize = m_ownedBuffer.get_size();
+		m_memOwner = false;
+
+		if (m_rawData)
+		{
+			m_fileType = FILE_TYPE_MEMORY;
+			m_fileName = filename;
+		}
+
+		return m_rawData;
+	}
+
+	bool CVFSFile::AssignStream(const std::wstring& filename, std::shared_ptr <CVFSChunkSource> source)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_fileMutex);
+
+		Close();
+
+		if (!source || !source.get() || source->GetChunkSize() == 0)
+			return false;
+
+		m_chunkSource = source;
+		m_rawSize = source->GetSize();
+		m_fileType = FILE_TYPE_STREAM;
+		m_fileName = filename;
+		return true;
+	}
+
 
 	uint32_t CVFSFile::Read(void* buffer, uint32_t size)
 	{
@@ -214,6 +292,9 @@ namespace VFS
 			case FILE_TYPE_OUTPUT:
 			case FILE_TYPE_INPUT:
 			{
+				if (!Flush())
+					return 0;
+
 				DWORD dwRead;
 				if (!ReadFile(m_fileHandle, buffer, size, &dwRead, nullptr))
 				{
@@ -231,6 +312,37 @@ namespace VFS
 				m_currPos += len;
 				return len;
 			} break;
+
+			case FILE_TYPE_STREAM:
+			{
+				auto chunksize = m_chunkSource->GetChunkSize();
+
+				uint32_t len = 0;
+				while (len < size && m_currPos < m_rawSize)
+				{
+					auto chunk = static_cast<uint32_t>(m_currPos / chunksize);
+					if (chunk != m_chunkIndex)
+					{
+						m_chunkIndex = NO_CHUNK;
+						if (!m_chunkSource->ReadChunk(chunk, m_chunkBuffer))
+						{
+							gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Chunk: %u of %ls can not decoded", chunk, m_fileName.c_str());
+							break;
+						}
+						m_chunkIndex = chunk;
+					}
+
+					auto chunkpos = static_cast<uint32_t>(m_currPos - static_cast<uint64_t>(chunk) * chunksize);
+					if (chunkpos >= m_chunkBuffer.get_size())
+						break;
+
+					auto part = std::min<uint32_t>(m_chunkBuffer.get_size() - chunkpos, size - len);
+					memcpy(reinterpret_cast<uint8_t*>(buffer) + len, m_chunkBuffer.get_data() + chunkpos, part);
+					m_currPos += part;
+					len += part;
+				}
+				return len;
+			} break;
 		}
 
 		return 0;
@@ -248,6 +360,31 @@ namespace VFS
 			return 0;
 		}
 
+		if (m_writeCapacity)
+		{
+			if (size > m_writeCapacity - m_writeUsed && !Flush())
+				return 0;
+
+			if (size < m_writeCapacity)
+			{
+				if (m_writeUsed == 0)
+				{
+					LARGE_INTEGER position{};
+					LARGE_INTEGER distance{};
+					LARGE_INTEGER filesize{};
+					SetFilePointerEx(m_fileHandle, distance, &position, FILE_CURRENT);
+					GetFileSizeEx(m_fileHandle, &filesize);
+
+					m_writeStart = position.QuadPart;
+					m_writeAppend = position.QuadPart >= filesize.QuadPart;
+				}
+
+				memcpy(m_writeBuffer + m_writeUsed, buffer, size);
+				m_writeUsed += size;
+				return size;
+			}
+		}
+
 		DWORD dwWritten;
 		if (!WriteFile(m_fileHandle, buffer, size, &dwWritten, nullptr))
 		{
@@ -258,8 +395,141 @@ namespace VFS
 		return dwWritten;
 	}
 
+	bool CVFSFile::SetWriteBuffer(uint32_t size)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_fileMutex);
+
+		if (!Flush())
+			return false;
 
-	void CVFSFile::SetPosition(int64_t offset, bool relative)
+		if (m_writeBuffer)
+		{
+			::operator delete(m_writeBuffer, std::align_val_t(WRITE_BUFFER_ALIGNMENT));
+			m_writeBuffer = nullptr;
+		}
+		m_writeCapacity = 0;
+
+		if (size && IsWriteable())
+		{
+			m_writeBuffer = static_cast<uint8_t*>(::operator new(size, std::align_val_t(WRITE_BUFFER_ALIGNMENT)));
+			m_writeCapacity = size;
+		}
+		return true;
+	}
+
+	bool CVFSFile::Flush()
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_fileMutex);
+
+		if (m_writeUsed == 0)
+			return true;
+
+		// The file pointer was left at the start of the buffered data
+		auto size = m_writeUsed;
+		m_writeUsed = 0;
+
+		DWORD dwWritten;
+		if (!WriteFile(m_fileHandle, m_writeBuffer, size, &dwWritten, nullptr) || dwWritten != size)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "WriteFile fail! Error: %u", GetLastError());
+			return false;
+		}
+		return true;
+	}
+
+	bool CVFSFile::Sync()
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_fileMutex);
+
+		if (!IsWriteable() || !Flush())
+			return false;
+
+		if (!FlushFileBuffers(m_fileHandle))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "FlushFileBuffers fail! Error: %u", GetLastError());
+			return false;
+		}
+		return true;
+	}
+
+	bool CVFSFile::Truncate(uint64_t size)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_fileMutex);
+
+		if (!IsWriteable() || !Flush())
+			return false;
+
+		LARGE_INTEGER m;
+		m.QuadPart = size;
+		if (!SetFilePointerEx(m_fileHandle, m, 0, FILE_BEGIN) || !SetEndOfFile(m_fileHandle))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "File can not truncated! Error: %u", GetLastError());
+			return false;
+		}
+		return true;
+	}
+
+	bool CVFSFile::Reserve(uint64_t size)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_fileMutex);
+
+		if (!IsWriteable())
+			return false;
+
+		FILE_ALLOCATION_INFO allocation{};
+		allocation.AllocationSize.QuadPart = size;
+		if (!SetFileInformationByHandle(m_fileHandle, FileAllocationInfo, &allocation, sizeof(allocation)))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "SetFileInformationByHandle fail! Error: %u", GetLastError());
+			return false;
+		}
+		return true;
+	}
+
+	bool CVFSFile::Extend(uint64_t size)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_fileMutex);
+
+		if (!IsWriteable())
+			return false;
+
+		// Short gaps behind appended data are cheaper as part of the buffered run
+		if (m_writeUsed && m_writeAppend)
+		{
+			auto end = m_writeStart + m_writeUsed;
+			if (size <= end)
+				return true;
+			if (size - end <= m_writeCapacity - m_writeUsed)
+			{
+				memset(m_writeBuffer + m_writeUsed, 0, static_cast<std::size_t>(size - end));
+				m_writeUsed += static_cast<uint32_t>(size - end);
+				return true;
+			}
+		}
+
+		if (!Flush())
+			return false;
+
+		LARGE_INTEGER filesize{};
+		GetFileSizeEx(m_fileHandle, &filesize);
+
+		LARGE_INTEGER m;
+		m.QuadPart = std::max<uint64_t>(size, filesize.QuadPart);
+		if (!SetFilePointerEx(m_fileHandle, m, 0, FILE_BEGIN))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "SetFilePointerEx fail! Error: %u", GetLastError());
+			return false;
+		}
+		if (static_cast<uint64_t>(filesize.QuadPart) < size && !SetEndOfFile(m_fileHandle))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "SetEndOfFile fail! Error: %u", GetLastError());
+			return false;
+		}
+		return true;
+	}
+
+
+	bool CVFSFile::SetPosition(int64_t offset, bool relative)
 	{
 		std::lock_guard <std::recursive_mutex> __lock(m_fileMutex);
 
@@ -268,7 +538,7 @@ namespace VFS
 		if (!IsValid())
 		{
 //			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Is not valid!"); 
-			return;
+			return false;
 		}
 
 		switch (m_fileType)
@@ -276,22 +546,44 @@ namespace VFS
 			case FILE_TYPE_OUTPUT:
 			case FILE_TYPE_INPUT:
 			{
+				if (m_writeUsed)
+				{
+					// Staying at the end of the buffered data keeps the run going
+					auto end = m_writeStart + m_writeUsed;
+					if ((relative ? static_cast<int64_t>(end) + offset : offset) == static_cast<int64_t>(end))
+						return true;
+
+					if (relative)
+					{
+						offset += end;
+						relative = false;
+					}
+					// The buffered data would be lost behind the new position
+					if (!Flush())
+					{
+						gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Buffered data of: %ls can NOT flushed", m_fileName.c_str());
+						return false;
+					}
+				}
+
 				LARGE_INTEGER m;
 				m.QuadPart = offset;
 
 				if (!SetFilePointerEx(m_fileHandle, m, 0, relative ? FILE_CURRENT : FILE_BEGIN))
 				{
 					gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "SetFilePointerEx fail! Error: %u", GetLastError());
-					return;
+					return false;
 				}
 			} break;
 
 			case FILE_TYPE_MAPPED:
 			case FILE_TYPE_MEMORY:
+			case FILE_TYPE_STREAM:
 			{
 				m_currPos = relative ? m_currPos + offset : offset;
 			} break;
 		}
+		return true;
 	}
 
 
@@ -313,6 +605,11 @@ namespace VFS
 			{
 				ret = m_rawData != nullptr;
 			} break;
+
+			case FILE_TYPE_STREAM:
+			{
+				ret = m_chunkSource != nullptr;
+			} break;
 		}
 
  //		gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "%ls %d %d", m_fileNameA.c_str(), m_fileType, ret);        
@@ -337,6 +634,20 @@ namespace VFS
 	
 	const uint8_t* CVFSFile::GetData() const
 	{
+		std::lock_guard <std::recursive_mutex> __lock(m_fileMutex);
+
+		// Streams are decoded as a whole on first use, for callers that need contiguous data
+		if (m_fileType == FILE_TYPE_STREAM && !m_rawData)
+		{
+			if (!m_chunkSource->ReadAll(m_ownedBuffer))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Stream: %ls can not decoded", m_fileName.c_str());
+				m_ownedBuffer.clear();
+				return nullptr;
+			}
+			m_rawData = reinterpret_cast<uint8_t*>(m_ownedBuffer.get_data());
+		}
+
 		return m_rawData;
 	}
 
@@ -363,11 +674,12 @@ namespace VFS
 			{
 				LARGE_INTEGER s;
 				GetFileSizeEx(m_fileHandle, &s);
-				size = s.QuadPart;
+				size = std::max<uint64_t>(s.QuadPart, m_writeUsed ? m_writeStart + m_writeUsed : 0);
 			} break;
 
 			case FILE_TYPE_MAPPED:
 			case FILE_TYPE_MEMORY:
+			case FILE_TYPE_STREAM:
 			{
 				size = m_rawSize;
 			} break;
@@ -388,6 +700,9 @@ namespace VFS
 			case FILE_TYPE_OUTPUT:
 			case FILE_TYPE_INPUT:
 			{
+				if (m_writeUsed)
+					return m_writeStart + m_writeUsed;
+
 				LARGE_INTEGER newptr{};
 				LARGE_INTEGER distance{};
 
@@ -397,6 +712,7 @@ namespace VFS
 
 			case FILE_TYPE_MAPPED:
 			case FILE_TYPE_MEMORY:
+			case FILE_TYPE_STREAM:
 			{
 				return m_currPos;
 			} break;
@@ -3,13 +3,50 @@
 #include "../include/CryptHelper.h"
 #include "../include/config.h"
 
-#include <ppl.h>
 
 namespace VFS
 {
 	CVFSPack* gs_pVFSInstance = nullptr;
 	CVFSLog* gs_pVFSLogInstance = nullptr;
 
+	static const uint32_t DEFAULT_STARTUP_WINDOW = 0;
+	// The prefetch thread waits for the end of the startup window in steps of this, to stop soon when asked to
+	static const auto STARTUP_SAVE_WAIT_STEP = std::chrono::milliseconds(100);
+	// Startup entries closer than this are read in one go, cheaper than a seek on a spinning disk
+	static const uint64_t STARTUP_PREFETCH_GAP = 256 * 1024;
+	static const uint32_t STARTUP_PREFETCH_READ_SIZE = 1024 * 1024;
+	// The missing file cache starts over when it grows past this
+	static const std::size_t MISSING_FILE_CACHE_SIZE = 16384;
+	// Idle archives are looked for by lookups at most this often
+	static const auto IDLE_CHECK_INTERVAL = std::chrono::seconds(1);
+
+	typedef std::vector <std::pair <std::wstring, std::vector <std::pair <uint64_t, uint64_t>>>> TPrefetchList;
+
+	// Reads the ranges through handles of its own so the system file cache holds them when the game asks
+	static void PrefetchStartupSets(const TPrefetchList& list, std::atomic <bool>* stop)
+	{
+		DataBuffer buffer(STARTUP_PREFETCH_READ_SIZE);
+		for (const auto& archive : list)
+		{
+			CVFSFile file;
+			if (!file.Open(archive.first))
+				continue;
+
+			for (const auto& range : archive.second)
+			{
+				file.SetPosition(range.first, false);
+				for (auto position = range.first; position < range.second && !*stop; position += STARTUP_PREFETCH_READ_SIZE)
+				{
+					auto size = static_cast<uint32_t>(std::min<uint64_t>(range.second - position, STARTUP_PREFETCH_READ_SIZE));
+					if (file.Read(buffer.get_data(), size) != size)
+						break;
+				}
+				if (*stop)
+					return;
+			}
+		}
+	}
+
 	CVFSPack* CVFSPack::InstancePtr()
 	{
 		return gs_pVFSInstance;
@@ -20,7 +57,8 @@ namespace VFS
 		return *gs_pVFSInstance;
 	}
 
-	CVFSPack::CVFSPack()
+	CVFSPack::CVFSPack() :
+		m_loadSequence(0), m_missingFileCache(false), m_lazyMounting(false), m_idleTimeout(0), m_startupWindow(DEFAULT_STARTUP_WINDOW), m_prefetchStop(false)
 	{
 		assert(!gs_pVFSInstance);
 		gs_pVFSInstance = this;
@@ -32,6 +70,8 @@ namespace VFS
 	}
 	CVFSPack::~CVFSPack()
 	{
+		StopPrefetch();
+
 		assert(gs_pVFSInstance == this);
 		gs_pVFSInstance = nullptr;
 
@@ -58,29 +98,164 @@ namespace VFS
 	bool CVFSPack::FinalizeVFSPack() const
 	{
 		assert(gs_pVFSLogInstance);
+
+		StopPrefetch();
 		
 		delete gs_pVFSLogInstance;
 		gs_pVFSLogInstance = nullptr;
 		return true;
 	}
 
+	void CVFSPack::StopPrefetch() const
+	{
+		m_prefetchStop = true;
+		if (m_prefetchThread.joinable())
+			m_prefetchThread.join();
+		m_prefetchStop = false;
+	}
+
+	void CVFSPack::SetStartupWindow(uint32_t seconds)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+		m_startupWindow = seconds;
+	}
+
+	void CVFSPack::SetLazyMounting(bool enable, uint32_t idleSeconds)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+		m_lazyMounting = enable;
+		m_idleTimeout = enable ? idleSeconds : 0;
+	}
+
     void CVFSPack::LoadRegistiredArchives()
     {
-		concurrency::parallel_for_each(m_archiveNames.rbegin(), m_archiveNames.rend(), [&](const std::wstring& archivename)
-		{ 
-			auto archive = LoadArchive(archivename);
-			if (!archive || !archive.get())
+		std::vector <std::wstring> archivenames;
+		// Loaded for want of a name table, saved for the next run once loaded
+		std::unordered_set <std::wstring> unnamed;
+		{
+			std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+			m_mountBegin = std::chrono::steady_clock::now();
+			m_idleCheck = m_mountBegin;
+
+			for (const auto& archivename : m_archiveNames)
 			{
-				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "%ls can not load", archivename.c_str());
+				if (m_archivesByName.find(archivename) != m_archivesByName.end())
+					continue;
+
+				if (!m_lazyMounting)
+				{
+					archivenames.push_back(archivename);
+					continue;
+				}
+
+				// Still fails on a missing or broken archive at startup rather than on the first lookup
+				bool startup = false;
+				std::vector <uint32_t> names;
+				if (!CVFSArchive::Probe(GetAbsolutePath(archivename), &startup, &names))
+				{
+					gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "%ls can not load", archivename.c_str());
+					abort();
+				}
+
+				// Without a current name table any name may be in it, it is not left pending for all of them
+				if (startup || names.empty())
+				{
+					archivenames.push_back(archivename);
+					if (names.empty())
+						unnamed.emplace(archivename);
+					continue;
+				}
+
+				AddPending(archivename);
+				auto& filter = m_pendingFilters[archivename];
+				filter.Reset(names.size());
+				for (auto index : names)
+					filter.Insert(index);
+			}
+		}
+
+		// Archives are read on all cores and published in registration order, the same override order every run
+		std::vector <std::shared_ptr <CVFSArchive>> archives(archivenames.size());
+		std::atomic <std::size_t> next(0);
+
+		auto reader = [&]() {
+			for (auto i = next++; i < archivenames.size(); i = next++)
+				archives[i] = ReadArchive(archivenames[i]);
+		};
+
+		auto threads = std::min<std::size_t>(std::max(std::thread::hardware_concurrency(), 1u), archivenames.size());
+		std::vector <std::thread> readers;
+		for (std::size_t i = 1; i < threads; ++i)
+			readers.emplace_back(reader);
+		reader();
+		for (auto& thread : readers)
+			thread.join();
+
+		for (std::size_t i = 0; i < archivenames.size(); ++i)
+		{
+			if (!PublishArchive(archivenames[i], archives[i]))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "%ls can not load", archivenames[i].c_str());
 				abort();
 			}
-           // else
-           // {
-           //     gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "%ls succesfully loaded", archivename.c_str());
-           // }
+
+			if (unnamed.find(archivenames[i]) != unnamed.end() && !archives[i]->SaveNameTable())
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Name table of %ls can not saved", archivenames[i].c_str());
+		}
+
+		// Joined before the pack lock is taken, the thread takes it to save the sets
+		StopPrefetch();
+
+		std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+		if (!m_startupWindow)
+			return;
+
+		// The last run's startup sets are read ahead while this run records its own, the same thread saves them once the window is over
+		TPrefetchList list;
+		for (const auto& archive : m_archives)
+		{
+			auto ranges = archive->GetEntryRanges(archive->LoadStartupSet(), STARTUP_PREFETCH_GAP);
+			if (!ranges.empty())
+				list.emplace_back(archive->GetFileStream()->GetFileName(), std::move(ranges));
+
+			archive->RecordStartupSet(m_startupWindow);
+		}
+
+		if (m_prefetchThread.joinable())
+			return;
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(m_startupWindow);
+		m_prefetchThread = std::thread([this, list = std::move(list), deadline]() {
+			PrefetchStartupSets(list, &m_prefetchStop);
+			SaveStartupSets(deadline);
 		});
     }
 
+	// Runs on the prefetch thread, holds the pack lock only to list the archives
+	void CVFSPack::SaveStartupSets(std::chrono::steady_clock::time_point deadline) const
+	{
+		while (!m_prefetchStop && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(STARTUP_SAVE_WAIT_STEP);
+
+		// Stopped early, archives save what they recorded on Unload
+		if (m_prefetchStop)
+			return;
+
+		std::vector <std::shared_ptr <CVFSArchive>> archives;
+		{
+			std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+			archives.assign(m_archives.begin(), m_archives.end());
+		}
+
+		for (const auto& archive : archives)
+			archive->SaveStartupSet();
+	}
+
 	void CVFSPack::RegisterArchive(std::wstring name, std::wstring path /* = "*" */)
 	{
 		std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
@@ -91,6 +266,15 @@ namespace VFS
 		m_registiredArchives.emplace(path, name);
 		m_archiveNames.emplace_back(name);
 
+		// Only plain prefixes route, "d:/ymir work/" and "d:/ymir work/*" alike
+		if (!path.empty() && path.back() == L'*')
+			path.pop_back();
+		if (!path.empty() && path.find_first_of(L"*?") == std::wstring::npos)
+		{
+			m_pathRoutes.Insert(path, name);
+			m_routedArchives.emplace(name);
+		}
+
 //		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Archive: %ls Path: %ls", name.c_str(), path.c_str());
 	}
 	void CVFSPack::UnregisterArchive(std::wstring name)
@@ -107,6 +291,9 @@ namespace VFS
 				break;
 			}
 		}
+		m_pathRoutes.Erase(name);
+		m_routedArchives.erase(name);
+		RemovePending(name);
 
 //		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "%ls", name.c_str());
 	}
@@ -119,67 +306,188 @@ namespace VFS
 
 		std::transform(filename.begin(), filename.end(), filename.begin(), tolower);
 
-		std::shared_ptr <CVFSArchive> result;
-		for (const auto& iter : m_archives)
+		auto iter = m_archivesByName.find(filename);
+		return iter != m_archivesByName.end() ? iter->second : std::shared_ptr <CVFSArchive>();
+	}
+	std::shared_ptr <CVFSArchive> CVFSPack::LoadArchive(std::wstring filename)
+	{
+		std::transform(filename.begin(), filename.end(), filename.begin(), ::tolower);
+
+//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "%ls", filename.c_str());
+
 		{
-			if (iter->GetFileStream()->GetFileName() == filename)
+			std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+			auto loaded = m_archivesByName.find(filename);
+			if (loaded != m_archivesByName.end())
 			{
-				result = iter;
-				break;
+				return loaded->second;
 			}
 		}
-		return result;
+
+		return PublishArchive(filename, ReadArchive(filename));
 	}
-	std::shared_ptr <CVFSArchive> CVFSPack::LoadArchive(std::wstring filename)
+
+	// Runs without the pack lock, archives of other names load alongside
+	std::shared_ptr <CVFSArchive> CVFSPack::ReadArchive(const std::wstring& filename)
 	{
-		std::lock_guard<std::recursive_mutex> __lock(m_packMutex);
+		std::vector <uint8_t> key;
+		{
+			std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
 
-		std::shared_ptr <CVFSArchive> result;
+			auto iter = m_archiveKeys.find(filename);
+			if (iter != m_archiveKeys.end())
+				key = iter->second;
+		}
 
-		std::transform(filename.begin(), filename.end(), filename.begin(), ::tolower);
+		auto result = std::make_shared<CVFSArchive>();
 
-//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "%ls", filename.c_str());
-		
-		for (const auto& iter : m_archives)
+		auto file = std::make_shared<CVFSFile>();
+		file->Open(GetAbsolutePath(filename));
+
+//		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "New file: %p for: %ls", file.get(), filename.c_str());
+
+		if (key.empty())
 		{
-			if (iter->GetFileStream()->GetFileName() == filename || iter->GetFileStream()->GetFileName() == filename)
-			{
-				result = iter;
-				break;
-			}
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Key not found for archive %ls", file->GetFileName().c_str());
+		}
+
+		if (!result->Load(file, key.empty() ? nullptr : key.data()))
+		{
+			result.reset();
+		}
+		std::fill(key.begin(), key.end(), 0);
+		return result;
+	}
+
+	std::shared_ptr <CVFSArchive> CVFSPack::PublishArchive(const std::wstring& filename, std::shared_ptr <CVFSArchive> archive)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+		// Loaded twice at once, the first one published stays
+		auto loaded = m_archivesByName.find(filename);
+		if (loaded != m_archivesByName.end())
+		{
+			return loaded->second;
 		}
 
-		if (!result)
+		if (!archive)
 		{
-			result = std::make_shared<CVFSArchive>();
+			return archive;
+		}
 
-			auto file = std::make_shared<CVFSFile>();
-			file->Open(GetAbsolutePath(filename));
+		auto rank = GetRegisteredRank(filename);
+		m_archiveRanks[archive.get()] = rank >= 0 ? rank : -(++m_loadSequence);
 
-//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "New file: %p for: %ls", file.get(), filename.c_str());
+		auto absolute = archive->GetFileStream()->GetFileName();
+		std::transform(absolute.begin(), absolute.end(), absolute.begin(), ::tolower);
 
-//			gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "Getting key for filename: %ls", filename.c_str());
+		m_archivesByName.emplace(filename, archive);
+		m_archivesByName.emplace(absolute, archive);
 
-			auto iter = m_archiveKeys.find(filename);
-			const uint8_t * keyArray = iter == m_archiveKeys.end() ? nullptr : iter->second.data();
+		m_archives.push_back(archive);
+		IndexArchive(archive);
 
-			if (keyArray == nullptr)
-			{
-				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Key not found for archive %ls", file->GetFileName().c_str());
-			}
+		return archive;
+	}
 
-			if (!result->Load(file, keyArray))
-			{
-				result.reset();
-			}
-			else
-			{
-				m_archives.push_back(result);
-			}
+	// Position of the first registration, -1 when not registered
+	int64_t CVFSPack::GetRegisteredRank(const std::wstring& filename) const
+	{
+		auto registered = std::find(m_archiveNames.begin(), m_archiveNames.end(), filename);
+		return registered != m_archiveNames.end() ? std::distance(m_archiveNames.begin(), registered) : -1;
+	}
+
+	// Indexed again after a change, only the names it gained or lost are patched
+	void CVFSPack::IndexArchive(const std::shared_ptr <CVFSArchive>& archive)
+	{
+		auto rank = m_archiveRanks[archive.get()];
+
+		// Taken first, a change made while enumerating is indexed again on the next lookup
+		auto& indexed = m_indexedArchives[archive.get()];
+		indexed.generation = archive->GetGeneration();
+
+		auto files = archive->EnumerateFiles();
+		std::vector <uint32_t> names;
+		names.reserve(files.size());
+		for (const auto& file : files)
+			names.push_back(file.index);
+		std::sort(names.begin(), names.end());
+
+		auto& filter = m_archiveFilters[archive.get()];
+		filter.Reset(names.size());
+		for (auto index : names)
+			filter.Insert(index);
+
+		std::vector <uint32_t> lost;
+		std::set_difference(indexed.names.begin(), indexed.names.end(), names.begin(), names.end(), std::back_inserter(lost));
+		for (auto index : lost)
+			ReleaseName(index, archive.get());
+
+		std::vector <uint32_t> gained;
+		std::set_difference(names.begin(), names.end(), indexed.names.begin(), indexed.names.end(), std::back_inserter(gained));
+
+		m_nameIndex.reserve(m_nameIndex.size() + gained.size());
+		for (auto index : gained)
+		{
+			auto iter = m_nameIndex.emplace(index, archive.get());
+			if (!iter.second && m_archiveRanks[iter.first->second] < rank)
+				iter.first->second = archive.get();
+		}
+
+		indexed.names = std::move(names);
+	}
+	void CVFSPack::UnindexArchive(const CVFSArchive* archive)
+	{
+		auto indexed = m_indexedArchives.find(archive);
+		if (indexed != m_indexedArchives.end())
+		{
+			for (auto index : indexed->second.names)
+				ReleaseName(index, archive);
 		}
 
+		m_archiveRanks.erase(archive);
+		m_archiveFilters.erase(archive);
+		m_indexedArchives.erase(archive);
+	}
+	// A name the archive no longer serves goes to the next ranked archive holding it
+	void CVFSPack::ReleaseName(uint32_t index, const CVFSArchive* archive)
+	{
+		auto iter = m_nameIndex.find(index);
+		if (iter == m_nameIndex.end() || iter->second != archive)
+			return;
+
+		auto next = FindHolder(index, archive);
+		if (next)
+			iter->second = next;
+		else
+			m_nameIndex.erase(iter);
+	}
+	// The next ranked archive holding the file takes it over
+	CVFSArchive* CVFSPack::FindHolder(uint32_t index, const CVFSArchive* except)
+	{
+		CVFSArchive* result = nullptr;
+		for (const auto& other : m_archives)
+		{
+			if (other.get() == except || (result && m_archiveRanks[other.get()] < m_archiveRanks[result]))
+				continue;
+
+			auto filter = m_archiveFilters.find(other.get());
+			if ((filter == m_archiveFilters.end() || filter->second.MayContain(index)) && other->Exists(index))
+				result = other.get();
+		}
 		return result;
 	}
+	// Archives written to, deleted from or reloaded since they were indexed, each checked on its own generation
+	void CVFSPack::RefreshIndex()
+	{
+		for (const auto& archive : m_archives)
+		{
+			auto indexed = m_indexedArchives.find(archive.get());
+			if (indexed != m_indexedArchives.end() && indexed->second.generation != archive->GetGeneration())
+				IndexArchive(archive);
+		}
+	}
 	void CVFSPack::UnloadArchive(std::shared_ptr<CVFSArchive> archive)
 	{
 		std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
@@ -191,9 +499,146 @@ namespace VFS
 			if (iter == archive)
 			{
 				m_archives.remove(iter);
+				UnindexArchive(archive.get());
+				m_lazyMounts.erase(archive.get());
+
+				for (auto name = m_archivesByName.begin(); name != m_archivesByName.end();)
+				{
+					if (name->second == archive)
+						name = m_archivesByName.erase(name);
+					else
+						++name;
+				}
+				break;
+			}
+		}
+	}
+
+	void CVFSPack::AddPending(const std::wstring& name)
+	{
+		auto rank = GetRegisteredRank(name);
+		if (rank >= 0)
+			m_pendingArchives[rank] = name;
+	}
+	void CVFSPack::RemovePending(const std::wstring& name)
+	{
+		for (auto iter = m_pendingArchives.begin(); iter != m_pendingArchives.end(); ++iter)
+		{
+			if (iter->second == name)
+			{
+				m_pendingArchives.erase(iter);
 				break;
 			}
 		}
+		m_pendingFilters.erase(name);
+	}
+
+	std::shared_ptr <CVFSArchive> CVFSPack::MountArchive(const std::wstring& name)
+	{
+		// Still pending meanwhile, a lookup of another thread loads it as well and the first one published stays
+		auto archive = LoadArchive(name);
+		{
+			std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+			RemovePending(name);
+			if (!archive)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "%ls can not load", name.c_str());
+				return archive;
+			}
+
+			auto now = std::chrono::steady_clock::now();
+			if (!m_lazyMounts.emplace(archive.get(), SLazyMount{ name, now }).second)
+				return archive;
+
+			// Loaded inside the startup window, records for the rest of it
+			auto elapsed = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(now - m_mountBegin).count());
+			if (elapsed < m_startupWindow)
+				archive->RecordStartupSet(m_startupWindow - elapsed);
+		}
+		return archive;
+	}
+
+	// Pending archives ranked above the holder whose names may hold the name are loaded from the highest down, until one of them has it.
+	// Those registered for a path only for names under it.
+	std::shared_ptr <CVFSArchive> CVFSPack::MountPending(uint32_t index, const std::wstring& filename, std::shared_ptr <CVFSArchive> holder)
+	{
+		for (;;)
+		{
+			std::wstring next;
+			{
+				std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+				auto owners = m_pathRoutes.Find(filename);
+				auto ranked = holder ? m_archiveRanks.find(holder.get()) : m_archiveRanks.end();
+				for (const auto& pending : m_pendingArchives)
+				{
+					if (ranked != m_archiveRanks.end() && pending.first <= ranked->second)
+						break;
+
+					if (m_routedArchives.find(pending.second) != m_routedArchives.end() && (!owners || std::find(owners->begin(), owners->end(), pending.second) == owners->end()))
+						continue;
+
+					auto filter = m_pendingFilters.find(pending.second);
+					if (filter == m_pendingFilters.end() || !filter->second.MayContain(index))
+						continue;
+
+					next = pending.second;
+					break;
+				}
+			}
+			if (next.empty())
+				return holder;
+
+			auto archive = MountArchive(next);
+			if (archive && archive->Exists(index))
+				return archive;
+		}
+	}
+
+	void CVFSPack::UnloadIdleArchives()
+	{
+		// Released after the pack lock, the last reference unloads the archive
+		std::vector <std::pair <std::shared_ptr <CVFSArchive>, std::wstring>> idle;
+
+		std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+		auto now = std::chrono::steady_clock::now();
+		m_idleCheck = now;
+
+		if (!m_idleTimeout)
+			return;
+
+		for (const auto& mount : m_lazyMounts)
+		{
+			if (now - mount.second.access < std::chrono::seconds(m_idleTimeout))
+				continue;
+
+			auto iter = m_archivesByName.find(mount.second.name);
+			if (iter == m_archivesByName.end())
+				continue;
+
+			// Archives somebody else holds stay loaded
+			long references = 1;
+			for (const auto& name : m_archivesByName)
+			{
+				if (name.second == iter->second)
+					++references;
+			}
+			if (iter->second.use_count() == references)
+				idle.emplace_back(iter->second, mount.second.name);
+		}
+
+		for (auto& archive : idle)
+		{
+			// Its names stay known, lookups load it again only for those
+			auto filter = m_archiveFilters.find(archive.first.get());
+			if (filter != m_archiveFilters.end())
+				m_pendingFilters[archive.second] = std::move(filter->second);
+
+			UnloadArchive(archive.first);
+			AddPending(archive.second);
+		}
 	}
 
 	std::shared_ptr <CVFSFile> CVFSPack::Create(const std::wstring& filename, bool append)
@@ -205,42 +650,132 @@ namespace VFS
 		{
 			result.reset();
 		}
+		else
+		{
+			ForgetMissingFiles(filename);
+		}
 
 		return result;
 	}
+	// The pack lock is held to look the name up and for the bookkeeping after, the entry, pending archives and the disk are read without it
 	std::shared_ptr <CVFSFile> CVFSPack::Open(std::wstring filename)
 	{
-		std::lock_guard<std::recursive_mutex> __lock(m_packMutex);
-
 //		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "%ls", filename.c_str());
 
 		std::transform(filename.begin(), filename.end(), filename.begin(), tolower);
 
 		std::shared_ptr <CVFSFile> result;
-		for (const auto & iter : m_archives)
+
+		auto index = CVFSArchive::GenerateNameIndex(filename);
+		std::shared_ptr <CVFSArchive> holder;
+		bool pending = false;
 		{
-			result = iter->Open(filename);
-			if (result)
-				break;
+			std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+			RefreshIndex();
+
+			auto iter = m_nameIndex.find(index);
+			if (iter != m_nameIndex.end())
+				holder = iter->second->shared_from_this();
+			pending = !m_pendingArchives.empty();
+		}
+
+		if (pending)
+		{
+			holder = MountPending(index, filename, holder);
+		}
+
+		if (holder)
+		{
+			result = holder->Open(index, filename);
+		}
+
+		if (result && m_accessTrace.IsActive())
+			m_accessTrace.Record(holder.get(), index);
+
+		auto idle = false;
+		auto missing = false;
+		{
+			std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+			if (!m_lazyMounts.empty())
+			{
+				auto now = std::chrono::steady_clock::now();
+
+				auto mount = result ? m_lazyMounts.find(holder.get()) : m_lazyMounts.end();
+				if (mount != m_lazyMounts.end())
+					mount->second.access = now;
+
+				idle = m_idleTimeout && now - m_idleCheck >= IDLE_CHECK_INTERVAL;
+				if (idle)
+					m_idleCheck = now;
+			}
+
+			missing = !result && m_missingFileCache && m_missingFiles.find(filename) != m_missingFiles.end();
 		}
 
-		if (!result)
+		holder.reset();
+		if (idle)
+			UnloadIdleArchives();
+
+		if (!result && !missing)
 		{
 			result = std::make_shared<CVFSFile>();
 			if (!result->Open(filename))
 			{
 				result.reset();
+
+				std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+				if (m_missingFileCache)
+				{
+					if (m_missingFiles.size() >= MISSING_FILE_CACHE_SIZE)
+						m_missingFiles.clear();
+					m_missingFiles.emplace(filename);
+				}
 			}
 		}
 
 		return result;
 	}
 
+	void CVFSPack::SetMissingFileCache(bool enable)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+		m_missingFileCache = enable;
+		m_missingFiles.clear();
+	}
+	void CVFSPack::ForgetMissingFiles(std::wstring name)
+	{
+		std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
+
+		if (name.empty())
+		{
+			m_missingFiles.clear();
+			return;
+		}
+
+		std::transform(name.begin(), name.end(), name.begin(), tolower);
+		m_missingFiles.erase(name);
+	}
+
+	bool CVFSPack::BeginAccessTrace(const std::wstring & filename)
+	{
+		return m_accessTrace.Begin(filename);
+	}
+	bool CVFSPack::EndAccessTrace()
+	{
+		return m_accessTrace.End();
+	}
+
 	void CVFSPack::SetWorkingDirectory(const std::wstring & dir)
 	{
 		std::lock_guard <std::recursive_mutex> __lock(m_packMutex);
 
 		SetCurrentDirectoryW(GetAbsolutePath(dir).c_str());
+		// Relative names resolve elsewhere now
+		m_missingFiles.clear();
 //		gs_pVFSLogInstance->Log(__FUNCTION__, LL_SYS, "%ls", dir.c_str());
 	}
 
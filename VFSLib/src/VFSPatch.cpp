@@ -0,0 +1,365 @@
+#include "../include/VFSPatch.h"
+#include "../include/VFSArchive.h"
+#include "../include/VFSFile.h"
+#include "../include/LogHelper.h"
+
+#include <xxhash.h>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <filesystem>
+
+namespace VFS
+{
+	extern CVFSLog* gs_pVFSLogInstance;
+
+#pragma pack(push, 1)
+	typedef struct _PATCH_HEADER
+	{
+		uint32_t	magic;
+		uint32_t	version;
+		uint64_t	source;		// Fingerprint of the entries the patch was made from
+		uint32_t	count;
+		uint32_t	tables;		// Leading records that change dictionaries or solid groups
+	} SPatchHeader;
+
+	typedef struct _PATCH_RECORD
+	{
+		uint32_t	index;
+		uint8_t		type;
+		uint32_t	size;		// Of the data following the record
+		uint32_t	hash;		// Of that data, the entry header included
+	} SPatchRecord;
+#pragma pack(pop)
+
+	static const uint32_t PATCH_MAGIC = 0x50534656; // VFSP
+	static const uint32_t PATCH_VERSION = 1;
+
+	enum EPatchRecordType
+	{
+		PATCH_RECORD_REMOVE,
+		PATCH_RECORD_ENTRY	// Whole raw entry
+	};
+
+	static bool ReadEntry(const std::shared_ptr <CVFSArchive>& archive, uint32_t index, DataBuffer& output)
+	{
+		auto size = archive->ReadRawData(index, nullptr, 0);
+		if (size <= RAW_ENTRY_HEADER_SIZE)
+			return false;
+
+		output = DataBuffer(size);
+		return archive->ReadRawData(index, output.get_data(), size) == size;
+	}
+
+	// Both the patch and the archive it is applied to are described by the entries they hold
+	static uint64_t GetSourceFingerprint(std::vector <SFileInformation> entries)
+	{
+		std::sort(entries.begin(), entries.end(), [](const SFileInformation& lhs, const SFileInformation& rhs) {
+			return lhs.index < rhs.index;
+		});
+
+		auto state = XXH64_createState();
+		XXH64_reset(state, 0);
+		for (const auto& info : entries)
+		{
+			XXH64_update(state, &info.index, sizeof(info.index));
+			XXH64_update(state, &info.hash, sizeof(info.hash));
+			XXH64_update(state, &info.version, sizeof(info.version));
+			XXH64_update(state, &info.flags, sizeof(info.flags));
+			XXH64_update(state, &info.cryptedsize, sizeof(info.cryptedsize));
+			XXH64_update(state, &info.contenthash, sizeof(info.contenthash));
+		}
+		auto hash = XXH64_digest(state);
+		XXH64_freeState(state);
+		return hash;
+	}
+
+	static bool IsSameEntry(const SFileInformation& lhs, const SFileInformation& rhs)
+	{
+		return lhs.hash == rhs.hash && lhs.version == rhs.version && lhs.flags == rhs.flags && lhs.rawsize == rhs.rawsize &&
+			lhs.compressedsize == rhs.compressedsize && lhs.cryptedsize == rhs.cryptedsize && lhs.level == rhs.level &&
+			lhs.dictionary == rhs.dictionary && lhs.contenthash == rhs.contenthash;
+	}
+
+	static bool WriteRecord(CVFSFile& file, const SPatchRecord& record, const void* data)
+	{
+		if (file.Write(&record, sizeof(SPatchRecord)) != sizeof(SPatchRecord))
+			return false;
+		return record.size == 0 || file.Write(data, record.size) == record.size;
+	}
+
+	// Dictionaries and solid groups are tables the archive keeps beside the entries, see CVFSArchive::Reload
+	static bool IsTableEntry(const SFileInformation& info, const std::unordered_set <uint32_t>& dictionaries)
+	{
+		return (info.flags & (FLAG_SOLID_GROUP | FLAG_SOLID_INDEX)) || dictionaries.find(info.index) != dictionaries.end();
+	}
+
+	static std::unordered_set <uint32_t> GetDictionaryIndexes(const std::shared_ptr <CVFSArchive>& archive)
+	{
+		std::unordered_set <uint32_t> indexes;
+		for (uint8_t id = 1; id <= MAX_DICTIONARY_ID; ++id)
+		{
+			indexes.insert(archive->GenerateNameIndex(CVFSArchive::GetDictionaryName(id)));
+		}
+		return indexes;
+	}
+
+	static bool CreatePatch(const std::shared_ptr <CVFSArchive>& from, const std::shared_ptr <CVFSArchive>& to, CVFSFile& file, SPatchStatistics& statistics)
+	{
+		auto sources = from->EnumerateRawEntries();
+
+		std::unordered_map <uint32_t, SFileInformation> previous;
+		previous.reserve(sources.size());
+		for (const auto& info : sources)
+		{
+			previous.emplace(info.index, info);
+		}
+
+		auto dictionaries = GetDictionaryIndexes(to);
+		auto targets = to->EnumerateRawEntries();
+		std::sort(targets.begin(), targets.end(), [](const SFileInformation& lhs, const SFileInformation& rhs) {
+			return lhs.index < rhs.index;
+		});
+
+		// Entries coded against a replaced dictionary change with it even when their own information does not
+		std::unordered_set <uint8_t> replaced;
+		for (uint8_t id = 1; id <= MAX_DICTIONARY_ID; ++id)
+		{
+			auto index = to->GenerateNameIndex(CVFSArchive::GetDictionaryName(id));
+			auto target = std::find_if(targets.begin(), targets.end(), [index](const SFileInformation& info) { return info.index == index; });
+			auto source = previous.find(index);
+
+			if ((target == targets.end()) != (source == previous.end()) ||
+				(target != targets.end() && !IsSameEntry(*target, source->second)))
+			{
+				replaced.insert(id);
+			}
+		}
+
+		std::vector <std::pair <uint32_t, uint8_t>> records;
+		std::unordered_set <uint32_t> present;
+		for (const auto& info : targets)
+		{
+			present.insert(info.index);
+
+			auto source = previous.find(info.index);
+			if (source != previous.end() && IsSameEntry(info, source->second) && replaced.find(info.dictionary) == replaced.end())
+				continue;
+
+			// Records and raw entries have 32 bit sizes
+			if (info.cryptedsize > 0xffffffff - RAW_ENTRY_HEADER_SIZE)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Entry: %u of %llu bytes is too large for a patch", info.index, info.cryptedsize);
+				return false;
+			}
+
+			records.emplace_back(info.index, PATCH_RECORD_ENTRY);
+			if (source == previous.end())
+				++statistics.added;
+			else
+				++statistics.changed;
+		}
+		// Members are not raw entries, a plain entry moved into a solid group is removed here and comes back with the group.
+		// Apply stages both against the old state, so the removal releases the old blocks and leaves the member alone.
+		for (const auto& info : sources)
+		{
+			if (present.find(info.index) == present.end())
+			{
+				records.emplace_back(info.index, PATCH_RECORD_REMOVE);
+				++statistics.removed;
+			}
+		}
+
+		// Table entries lead so the archive applying the patch can reload them before the files they describe are written
+		std::unordered_map <uint32_t, bool> tables;
+		for (const auto& info : sources)
+		{
+			tables[info.index] = IsTableEntry(info, dictionaries);
+		}
+		for (const auto& info : targets)
+		{
+			tables[info.index] = tables[info.index] || IsTableEntry(info, dictionaries);
+		}
+		std::stable_partition(records.begin(), records.end(), [&tables](const std::pair <uint32_t, uint8_t>& record) {
+			return tables[record.first];
+		});
+
+		SPatchHeader header;
+		header.magic = PATCH_MAGIC;
+		header.version = PATCH_VERSION;
+		header.source = GetSourceFingerprint(sources);
+		header.count = static_cast<uint32_t>(records.size());
+		header.tables = static_cast<uint32_t>(std::count_if(records.begin(), records.end(), [&tables](const std::pair <uint32_t, uint8_t>& record) {
+			return tables[record.first];
+		}));
+		if (file.Write(&header, sizeof(SPatchHeader)) != sizeof(SPatchHeader))
+			return false;
+
+		DataBuffer entry;
+		for (const auto& item : records)
+		{
+			SPatchRecord record;
+			memset(&record, 0, sizeof(SPatchRecord));
+			record.index = item.first;
+			record.type = item.second;
+
+			if (record.type == PATCH_RECORD_REMOVE)
+			{
+				if (!WriteRecord(file, record, nullptr))
+					return false;
+				continue;
+			}
+
+			if (!ReadEntry(to, record.index, entry))
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Entry: %u can not read", record.index);
+				return false;
+			}
+			record.size = entry.get_size();
+			record.hash = XXH32(entry.get_data(), entry.get_size(), 0);
+			if (!WriteRecord(file, record, entry.get_data()))
+				return false;
+		}
+
+		statistics.size = file.GetSize();
+		return true;
+	}
+
+	bool CVFSPatch::Create(std::shared_ptr <CVFSArchive> from, std::shared_ptr <CVFSArchive> to, const std::wstring& filename, SPatchStatistics* statistics)
+	{
+		if (!from || !from.get() || !to || !to.get())
+		{
+			return false;
+		}
+
+		SPatchStatistics stats;
+		memset(&stats, 0, sizeof(SPatchStatistics));
+
+		auto result = false;
+		{
+			CVFSFile file;
+			result = file.Create(filename) && CreatePatch(from, to, file, stats) && file.Flush();
+		}
+
+		if (!result)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Patch: %ls can not created", filename.c_str());
+
+			std::error_code error;
+			std::filesystem::remove(filename, error);
+			return false;
+		}
+
+		if (statistics)
+			*statistics = stats;
+		return true;
+	}
+
+	static bool ApplyRecords(const std::shared_ptr <CVFSArchive>& archive, CVFSFile& file, const SPatchHeader& header, const std::wstring& filename, SPatchStatistics& stats)
+	{
+		DataBuffer data;
+		for (uint32_t i = 0; i < header.count; ++i)
+		{
+			SPatchRecord record;
+			if (file.Read(&record, sizeof(SPatchRecord)) != sizeof(SPatchRecord) || record.size > file.GetSize() - file.GetPosition())
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Patch: %ls is truncated", filename.c_str());
+				return false;
+			}
+
+			data = DataBuffer(record.size);
+			if (record.size && file.Read(data.get_data(), record.size) != record.size)
+			{
+				gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Patch: %ls is truncated", filename.c_str());
+				return false;
+			}
+
+			switch (record.type)
+			{
+				case PATCH_RECORD_REMOVE:
+				{
+					if (!archive->Delete(record.index))
+						return false;
+					++stats.removed;
+				} break;
+
+				case PATCH_RECORD_ENTRY:
+				{
+					if (record.size <= RAW_ENTRY_HEADER_SIZE || XXH32(data.get_data(), data.get_size(), 0) != record.hash)
+					{
+						gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Entry: %u is corrupted", record.index);
+						return false;
+					}
+
+					if (archive->Exists(record.index))
+						++stats.changed;
+					else
+						++stats.added;
+
+					if (!archive->WriteRawData(data.get_data(), data.get_size()))
+						return false;
+				} break;
+
+				default:
+				{
+					gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Patch: %ls has an unknown record type: %u", filename.c_str(), record.type);
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	bool CVFSPatch::Apply(std::shared_ptr <CVFSArchive> archive, const std::wstring& filename, SPatchStatistics* statistics)
+	{
+		if (!archive || !archive.get())
+		{
+			return false;
+		}
+
+		CVFSFile file;
+		if (!file.Open(filename))
+		{
+			return false;
+		}
+
+		SPatchHeader header;
+		if (file.Read(&header, sizeof(SPatchHeader)) != sizeof(SPatchHeader) || header.magic != PATCH_MAGIC || header.version != PATCH_VERSION)
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Patch: %ls is not a valid patch", filename.c_str());
+			return false;
+		}
+
+		// Applied twice or to another version, the records would replace entries the patch did not see
+		if (header.source != GetSourceFingerprint(archive->EnumerateRawEntries()))
+		{
+			gs_pVFSLogInstance->Log(__FUNCTION__, LL_ERR, "Patch: %ls was not made for this archive", filename.c_str());
+			return false;
+		}
+
+		SPatchStatistics stats;
+		memset(&stats, 0, sizeof(SPatchStatistics));
+		stats.size = file.GetSize();
+
+		// Every record is staged and lands with one commit, a patch that fails half way leaves the archive as it was
+		if (!archive->BeginBatch())
+			return false;
+
+		if (!ApplyRecords(archive, file, header, filename, stats))
+		{
+			archive->AbortBatch();
+			return false;
+		}
+
+		if (!archive->Commit())
+			return false;
+
+		// Solid groups and dictionaries the patch replaced or removed are read again as a whole
+		if (header.tables != 0 && !archive->Reload())
+			return false;
+
+		if (statistics)
+			*statistics = stats;
+		return true;
+	}
+}
@@ -0,0 +1,1508 @@
+#include "RoundTripTests.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <random>
+#include <future>
+#include <thread>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
+
+#include <lz4.h>
+#include <lz4hc.h>
+#include <xxhash.h>
+
+#include "../../VFSCryptLib/include/DataBuffer.h"
+#include "../../VFSLib/include/config.h"
+#include "../../VFSLib/include/CompressionHelper.h"
+#include "../../VFSLib/include/CryptHelper.h"
+#include "../../VFSLib/include/FreeSpace.h"
+#include "../../VFSLib/include/ScratchArena.h"
+#include "../../VFSLib/include/VFSArchive.h"
+#include "../../VFSLib/include/VFSFile.h"
+#include "../../VFSLib/include/VFSPatch.h"
+using namespace VFS;
+
+#define TEST_CHECK(condition)																	\
+	if (!(condition))																			\
+	{																							\
+		vfs->Log(1, "%s:%d check failed: %s", __FUNCTION__, __LINE__, #condition);				\
+		return false;																			\
+	}
+
+typedef std::map <std::wstring, std::vector <uint8_t>> TEntries;
+
+static std::vector <uint8_t> MakeContent(uint32_t seed, uint32_t size, bool compressible)
+{
+	std::mt19937 generator(seed);
+	std::vector <uint8_t> content(size);
+	for (uint32_t i = 0; i < size; ++i)
+		content[i] = compressible ? static_cast<uint8_t>("abcdefgh"[(i / 64 + generator() % 2) % 8]) : static_cast<uint8_t>(generator());
+	return content;
+}
+
+static std::shared_ptr <CVFSArchive> CreateArchive(const std::wstring& filename, const uint8_t * key)
+{
+	std::error_code error;
+	std::filesystem::remove(filename, error);
+
+	auto file = std::make_shared<CVFSFile>();
+	auto archive = std::make_shared<CVFSArchive>();
+	if (!file->Create(filename) || !archive->Create(file, key))
+		archive.reset();
+	return archive;
+}
+
+static std::shared_ptr <CVFSArchive> OpenArchive(const std::wstring& filename, const uint8_t * key, bool writeable)
+{
+	auto file = std::make_shared<CVFSFile>();
+	auto archive = std::make_shared<CVFSArchive>();
+	if (!(writeable ? file->Create(filename, true) : file->Open(CVFSPack::GetAbsolutePath(filename))) || !archive->Load(file, key))
+		archive.reset();
+	return archive;
+}
+
+static bool WriteEntry(const std::shared_ptr <CVFSArchive>& archive, const std::wstring& filename, const std::vector <uint8_t>& content,
+	uint8_t flags = FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256, const SCompressionProfile* profile = nullptr)
+{
+	return archive->Write(filename, content.data(), static_cast<uint32_t>(content.size()), flags, 0, profile);
+}
+
+static std::vector <SSolidInput> GetSolidInputs(const TEntries& entries, const std::vector <std::wstring>& names)
+{
+	std::vector <SSolidInput> members;
+	for (const auto& name : names)
+		members.push_back({ name, entries.at(name).data(), static_cast<uint32_t>(entries.at(name).size()) });
+	return members;
+}
+
+static bool ReadStream(const std::shared_ptr <CVFSFile>& stream, std::vector <uint8_t>& content)
+{
+	if (!stream)
+		return false;
+
+	content.resize(static_cast<size_t>(stream->GetSize()));
+	for (size_t position = 0; position < content.size();)
+	{
+		auto size = static_cast<uint32_t>(std::min<size_t>(content.size() - position, 1024 * 1024));
+		if (stream->Read(content.data() + position, size) != size)
+			return false;
+		position += size;
+	}
+	return true;
+}
+
+static bool ReadEntry(const std::shared_ptr <CVFSArchive>& archive, const std::wstring& filename, std::vector <uint8_t>& content)
+{
+	return ReadStream(archive->Open(filename), content);
+}
+
+static bool HasPackEntry(CVFSPack * vfs, const std::wstring& filename, const std::vector <uint8_t>& expected)
+{
+	std::vector <uint8_t> content;
+	return ReadStream(vfs->Open(filename), content) && content == expected;
+}
+
+static bool HasEntry(const std::shared_ptr <CVFSArchive>& archive, const std::wstring& filename, const std::vector <uint8_t>& expected)
+{
+	std::vector <uint8_t> content;
+	return ReadEntry(archive, filename, content) && content == expected;
+}
+
+static bool HasEntries(const std::shared_ptr <CVFSArchive>& archive, const TEntries& entries)
+{
+	for (const auto& entry : entries)
+	{
+		if (!HasEntry(archive, entry.first, entry.second))
+			return false;
+	}
+	return archive->EnumerateFiles().size() == entries.size();
+}
+
+// Checks the entries, closes the archive and checks them once more as loaded again from disk
+static bool Reloads(std::shared_ptr <CVFSArchive>& archive, const std::wstring& filename, const uint8_t * key, const TEntries& entries, bool writeable = false)
+{
+	if (!archive || !HasEntries(archive, entries))
+		return false;
+
+	archive.reset();
+	archive = OpenArchive(filename, key, writeable);
+	return archive && HasEntries(archive, entries);
+}
+
+// Removes every rt_ file of the working directory, archives and their sidecars
+static void RemoveTestFiles()
+{
+	std::error_code error;
+	std::vector <std::filesystem::path> files;
+	for (std::filesystem::directory_iterator it(std::filesystem::current_path(), error), end; !error && it != end; it.increment(error))
+	{
+		if (it->path().filename().wstring().rfind(L"rt_", 0) == 0)
+			files.push_back(it->path());
+	}
+	for (const auto& file : files)
+		std::filesystem::remove(file, error);
+}
+
+static bool GetEntryInformation(const std::shared_ptr <CVFSArchive>& archive, const std::wstring& filename, SFileInformation& information)
+{
+	auto index = CVFSArchive::GenerateNameIndex(filename);
+	for (const auto& file : archive->EnumerateFiles())
+	{
+		if (file.index == index)
+		{
+			information = file;
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint64_t GetEntryOffset(const std::shared_ptr <CVFSArchive>& archive, const std::wstring& filename)
+{
+	auto ranges = archive->GetEntryRanges({ CVFSArchive::GenerateNameIndex(filename) });
+	return ranges.empty() ? 0 : ranges.front().first;
+}
+
+static uint64_t GetFileSize(const std::wstring& filename)
+{
+	std::error_code error;
+	auto size = std::filesystem::file_size(filename, error);
+	return error ? 0 : size;
+}
+
+// Released extents merge with the free neighbours on both sides, allocations take the smallest extent that fits, the lowest
+// one of equal size, and leave the tail of a larger one free
+static bool TestFreeSpace(CVFSPack * vfs, const uint8_t * key)
+{
+	static const uint64_t block = 4096;
+
+	CVFSFreeSpace space;
+	space.Reset(static_cast<uint32_t>(block));
+
+	auto extent = space.Release(0, 2);
+	TEST_CHECK(extent.start == 0 && extent.blocks == 2);
+	space.Release(4 * block, 3);
+	TEST_CHECK(space.GetCount() == 2 && space.GetFreeBlocks() == 5);
+
+	extent = space.Release(2 * block, 2);
+	TEST_CHECK(extent.start == 0 && extent.blocks == 7);
+	TEST_CHECK(space.GetCount() == 1 && space.GetFreeBlocks() == 7);
+
+	space.Release(20 * block, 1);
+	space.Release(30 * block, 5);
+	TEST_CHECK(space.GetCount() == 3 && space.GetFreeBlocks() == 13);
+
+	SFreeExtent output, remainder;
+	TEST_CHECK(space.Allocate(1, output, remainder));
+	TEST_CHECK(output.start == 20 * block && output.blocks == 1 && remainder.blocks == 0);
+	TEST_CHECK(space.GetCount() == 2 && space.GetFreeBlocks() == 12);
+
+	TEST_CHECK(space.Allocate(4, output, remainder));
+	TEST_CHECK(output.start == 30 * block && output.blocks == 4);
+	TEST_CHECK(remainder.start == 34 * block && remainder.blocks == 1);
+	TEST_CHECK(space.GetCount() == 2 && space.GetFreeBlocks() == 8);
+	TEST_CHECK(!space.Allocate(8, output, remainder) && space.GetFreeBlocks() == 8);
+
+	// Given back, it closes up with its own tail again
+	extent = space.Release(30 * block, 4);
+	TEST_CHECK(extent.start == 30 * block && extent.blocks == 5 && space.GetCount() == 2);
+
+	space.Release(50 * block, 5);
+	TEST_CHECK(space.Allocate(5, output, remainder) && output.start == 30 * block && remainder.blocks == 0);
+	TEST_CHECK(space.Allocate(7, output, remainder) && output.start == 0 && remainder.blocks == 0);
+	TEST_CHECK(space.GetCount() == 1 && space.GetFreeBlocks() == 5);
+
+	space.Reset(static_cast<uint32_t>(block));
+	TEST_CHECK(space.GetCount() == 0 && space.GetFreeBlocks() == 0 && !space.Allocate(1, output, remainder));
+	return true;
+}
+
+// Copies are deep, moves hand the storage over and a pooled block released serves the next buffer of its size class
+static bool TestDataBuffer(CVFSPack * vfs, const uint8_t * key)
+{
+	auto content = MakeContent(1400, 3000, false);
+	DataBuffer buffer(content.data(), static_cast<uint32_t>(content.size()));
+	TEST_CHECK(reinterpret_cast<uintptr_t>(buffer.get_data()) % DataBuffer::alignment == 0);
+
+	DataBuffer copy(buffer);
+	TEST_CHECK(copy.get_data() != buffer.get_data() && std::equal(content.begin(), content.end(), copy.get_data<uint8_t>()));
+
+	auto data = buffer.get_data();
+	DataBuffer moved(std::move(buffer));
+	TEST_CHECK(moved.get_data() == data && buffer.is_null() && !buffer.get_data());
+
+	moved.append(content.data(), 1000);
+	TEST_CHECK(moved.get_size() == content.size() + 1000);
+	TEST_CHECK(std::equal(content.begin(), content.end(), moved.get_data<uint8_t>()));
+	TEST_CHECK(std::equal(content.begin(), content.begin() + 1000, moved.get_data<uint8_t>() + content.size()));
+
+	// A block taken from the pool is handed back to it even once pooling was turned off
+	auto pooling = DataBuffer::is_pooling();
+	DataBuffer::set_pooling(true);
+	const char* released = nullptr;
+	auto rounded = false;
+	{
+		DataBuffer block(1000);
+		rounded = block.get_capacity() == 1024;
+		released = block.get_data();
+	}
+	DataBuffer reused(900);
+	auto hit = reused.get_data() == released;
+
+	DataBuffer::set_pooling(false);
+	DataBuffer unpooled(1000);
+	auto exact = unpooled.get_capacity() == 1000;
+	reused.clear();
+	DataBuffer::set_pooling(true);
+	DataBuffer again(1000);
+	auto returned = again.get_data() == released;
+	DataBuffer::set_pooling(pooling);
+
+	TEST_CHECK(rounded && hit && exact && returned);
+	return true;
+}
+
+// Scratch memory is aligned, a nested scope hands its memory back and a grown arena is merged to serve the next operation from one chunk
+static bool TestScratchArena(CVFSPack * vfs, const uint8_t * key)
+{
+	// On a thread of its own for an arena nothing else used yet
+	auto run = []() {
+		void* nested = nullptr;
+		{
+			CVFSScratchScope scope;
+			if (reinterpret_cast<uintptr_t>(scope.Arena().Allocate(100)) % 64)
+				return false;
+			{
+				CVFSScratchScope inner;
+				nested = inner.Arena().Allocate(100);
+			}
+			if (scope.Arena().Allocate(100) != nested)
+				return false;
+			scope.Arena().Allocate(1024 * 1024);
+		}
+
+		auto& arena = CVFSScratchArena::ThreadInstance();
+		auto reserved = arena.GetReservedSize();
+		CVFSScratchScope scope;
+		scope.Arena().Allocate(1024 * 1024 + 100);
+		return reserved > 1024 * 1024 && arena.GetReservedSize() == reserved;
+	};
+	TEST_CHECK(std::async(std::launch::async, run).get());
+	return true;
+}
+
+// A reused state codes like a fresh one, the dictionary of one call does not reach the next, malformed input fails to decode
+// and the context of a finished thread goes back to the pool
+static bool TestCompressionContext(CVFSPack * vfs, const uint8_t * key)
+{
+	auto content = MakeContent(1500, 20000, true);
+	auto dictionary = MakeContent(1501, 8192, true);
+	auto bound = LZ4_compressBound(static_cast<int>(content.size()));
+
+	auto compress = [&](CVFSCompressionContext& context, int32_t level, bool dictionaried) {
+		std::vector <char> output(bound);
+		auto size = context.Compress(reinterpret_cast<const char*>(content.data()), output.data(), static_cast<int32_t>(content.size()), bound, level,
+			dictionaried ? reinterpret_cast<const char*>(dictionary.data()) : nullptr, dictionaried ? static_cast<uint32_t>(dictionary.size()) : 0);
+		output.resize(std::max(size, 0));
+		return output;
+	};
+	auto decodes = [&](const std::vector <char>& coded, bool dictionaried) {
+		std::vector <uint8_t> output(content.size());
+		auto size = CVFSCompressionContext::Decompress(coded.data(), reinterpret_cast<char*>(output.data()), static_cast<int32_t>(coded.size()), static_cast<int32_t>(output.size()),
+			dictionaried ? reinterpret_cast<const char*>(dictionary.data()) : nullptr, dictionaried ? static_cast<uint32_t>(dictionary.size()) : 0);
+		return size == static_cast<int32_t>(content.size()) && output == content;
+	};
+
+	CVFSCompressionContext reused;
+	for (auto level : { 9, -1 })
+	{
+		CVFSCompressionContext fresh;
+		auto expected = compress(fresh, level, false);
+		TEST_CHECK(!expected.empty() && decodes(expected, false));
+
+		auto dictionaried = compress(reused, level, true);
+		TEST_CHECK(!dictionaried.empty() && decodes(dictionaried, true));
+		TEST_CHECK(compress(reused, level, false) == expected);
+	}
+
+	auto coded = compress(reused, 9, false);
+	std::vector <char> output(content.size());
+	TEST_CHECK(CVFSCompressionContext::Decompress(coded.data(), output.data(), static_cast<int32_t>(coded.size()) / 2, static_cast<int32_t>(output.size())) < 0);
+	TEST_CHECK(CVFSCompressionContext::Decompress(coded.data(), output.data(), static_cast<int32_t>(coded.size()), static_cast<int32_t>(output.size()) / 2) < 0);
+
+	CVFSCompressionPool::Instance().Trim();
+	auto context = std::async(std::launch::async, []() { return &CVFSCompressionPool::ThreadContext(); }).get();
+	auto pooled = CVFSCompressionPool::Instance().Acquire();
+	auto returned = pooled.get() == context;
+	CVFSCompressionPool::Instance().Release(std::move(pooled));
+	TEST_CHECK(returned);
+	return true;
+}
+
+// An archive of the first layout, written before the version was kept, reads as it did. It is not written to, nor
+// written over, and copies into a new archive.
+static bool TestLegacyArchive(CVFSPack * vfs, const uint8_t * key)
+{
+#pragma pack(push, 1)
+	struct SLegacyEntry
+	{
+		uint32_t	index, hash, version;
+		uint8_t		flags;
+		uint32_t	rawsize, compressedsize, cryptedsize;
+		wchar_t		filename[255];
+		uint32_t	finalSize, numBlocks;
+		uint64_t	offset;
+	};
+#pragma pack(pop)
+	const uint32_t blocksize = 4096;
+
+	TEntries entries;
+	entries[L"plain.bin"] = MakeContent(1600, 5000, false);
+	entries[L"coded.txt"] = MakeContent(1601, 20000, true);
+	{
+		CVFSFile file;
+		TEST_CHECK(file.Create(L"rt_legacy.vpf"));
+
+		// The first layout left the padding after its 12 byte header uninitialised
+		std::vector <uint8_t> head(blocksize, 0xcd);
+		uint32_t header[] = { ARCHIVE_MAGIC, blocksize, blocksize };
+		memcpy(head.data(), header, sizeof(header));
+		TEST_CHECK(file.Write(head.data(), blocksize) == blocksize);
+
+		auto append = [&file, key, blocksize](const std::wstring& name, const std::vector <uint8_t>& content, uint8_t flags) {
+			SLegacyEntry entry = {};
+			DataBuffer payload(content.data(), static_cast<uint32_t>(content.size()));
+			if (flags & FLAG_COMPRESSED_LZ4)
+			{
+				DataBuffer compressed(LZ4_compressBound(static_cast<int>(content.size())));
+				compressed.set_size(LZ4_compress_HC(reinterpret_cast<const char*>(content.data()), compressed.get_data(), static_cast<int>(content.size()),
+					static_cast<int>(compressed.get_size()), LZ4HC_CLEVEL_MAX));
+				payload = compressed;
+			}
+			entry.compressedsize = payload.get_size();
+			if (flags & FLAG_CRYPTED_AES256)
+				payload = CAes256().Encrypt(reinterpret_cast<const uint8_t*>(payload.get_data()), payload.get_size(), ARCHIVE_IV, key);
+
+			entry.index = name.empty() ? 0 : CVFSArchive::GenerateNameIndex(name);
+			entry.hash = XXH32(content.data(), content.size(), 0);
+			entry.flags = flags;
+			entry.rawsize = static_cast<uint32_t>(content.size());
+			entry.cryptedsize = entry.finalSize = payload.get_size();
+			entry.numBlocks = (payload.get_size() + sizeof(SLegacyEntry)) / blocksize + 1;
+			entry.offset = file.GetSize() + sizeof(SLegacyEntry);
+
+			std::vector <uint8_t> blocks(entry.numBlocks * blocksize, 0xcd);
+			memcpy(blocks.data(), &entry, sizeof(SLegacyEntry));
+			memcpy(blocks.data() + sizeof(SLegacyEntry), payload.get_data(), payload.get_size());
+			return file.Write(blocks.data(), static_cast<uint32_t>(blocks.size())) == blocks.size();
+		};
+		TEST_CHECK(append(L"plain.bin", entries[L"plain.bin"], FLAG_RAW_DATA));
+		TEST_CHECK(append(L"", MakeContent(1602, 3000, false), FLAG_RAW_DATA));
+		TEST_CHECK(append(L"coded.txt", entries[L"coded.txt"], FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256));
+	}
+	auto size = GetFileSize(L"rt_legacy.vpf");
+
+	TEST_CHECK(CVFSArchive::Probe(L"rt_legacy.vpf"));
+	auto legacy = OpenArchive(L"rt_legacy.vpf", key, false);
+	TEST_CHECK(legacy && HasEntries(legacy, entries));
+
+	TEST_CHECK(!OpenArchive(L"rt_legacy.vpf", key, true));
+	{
+		auto file = std::make_shared<CVFSFile>();
+		CVFSArchive archive;
+		TEST_CHECK(file->Create(L"rt_legacy.vpf", true) && !archive.Create(file, key));
+	}
+	TEST_CHECK(GetFileSize(L"rt_legacy.vpf") == size && HasEntries(legacy, entries));
+
+	auto upgraded = CreateArchive(L"rt_legacy_upgraded.vpf", key);
+	TEST_CHECK(upgraded && upgraded->Merge(legacy));
+	TEST_CHECK(Reloads(upgraded, L"rt_legacy_upgraded.vpf", key, entries, true));
+	TEST_CHECK(WriteEntry(upgraded, L"plain.bin", entries[L"coded.txt"]));
+	return true;
+}
+
+// The archive profile applies unless a write brings its own, the level used is kept with the entry and a level of 0 stores it raw
+static bool TestCompressionProfiles(CVFSPack * vfs, const uint8_t * key)
+{
+	auto archive = CreateArchive(L"rt_profile.vpf", key);
+	TEST_CHECK(archive);
+
+	SCompressionProfile fast = DEFAULT_COMPRESSION_PROFILE;
+	fast.level = -4;
+	SCompressionProfile high = DEFAULT_COMPRESSION_PROFILE;
+	high.level = 9;
+	SCompressionProfile store = DEFAULT_COMPRESSION_PROFILE;
+	store.level = 0;
+	archive->SetCompressionProfile(fast);
+
+	TEntries entries;
+	for (const auto& name : { L"fast.txt", L"high.txt", L"stored.txt" })
+		entries[name] = MakeContent(static_cast<uint32_t>(entries.size()) + 1700, 30000, true);
+	TEST_CHECK(WriteEntry(archive, L"fast.txt", entries[L"fast.txt"]));
+	TEST_CHECK(WriteEntry(archive, L"high.txt", entries[L"high.txt"], FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256, &high));
+	TEST_CHECK(WriteEntry(archive, L"stored.txt", entries[L"stored.txt"], FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256, &store));
+	TEST_CHECK(Reloads(archive, L"rt_profile.vpf", key, entries));
+
+	SFileInformation information;
+	TEST_CHECK(GetEntryInformation(archive, L"fast.txt", information) && (information.flags & FLAG_COMPRESSED_LZ4) && information.level == -4);
+	TEST_CHECK(GetEntryInformation(archive, L"high.txt", information) && (information.flags & FLAG_COMPRESSED_LZ4) && information.level == 9);
+	TEST_CHECK(GetEntryInformation(archive, L"stored.txt", information) && !(information.flags & FLAG_COMPRESSED_LZ4) && information.level == 0);
+	TEST_CHECK(information.compressedsize == information.rawsize && (information.flags & FLAG_CRYPTED_AES256));
+	return true;
+}
+
+// Content that does not compress is told apart from a few samples and stored raw once compressing it saves too little
+static bool TestIncompressibleContent(CVFSPack * vfs, const uint8_t * key)
+{
+	TEntries entries;
+	entries[L"random.bin"] = MakeContent(1800, 200000, false);
+	entries[L"text.txt"] = MakeContent(1801, 200000, true);
+
+	auto& context = CVFSCompressionPool::ThreadContext();
+	TEST_CHECK(context.EstimateRatio(reinterpret_cast<const char*>(entries[L"random.bin"].data()), 200000) > 0.9);
+	TEST_CHECK(context.EstimateRatio(reinterpret_cast<const char*>(entries[L"text.txt"].data()), 200000) < 0.5);
+
+	auto archive = CreateArchive(L"rt_incompressible.vpf", key);
+	TEST_CHECK(archive);
+	SCompressionProfile profile = DEFAULT_COMPRESSION_PROFILE;
+	profile.storeratio = 0.95f;
+	for (const auto& entry : entries)
+		TEST_CHECK(WriteEntry(archive, entry.first, entry.second, FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256, &profile));
+	TEST_CHECK(Reloads(archive, L"rt_incompressible.vpf", key, entries));
+
+	SFileInformation information;
+	TEST_CHECK(GetEntryInformation(archive, L"random.bin", information) && !(information.flags & FLAG_COMPRESSED_LZ4));
+	TEST_CHECK(GetEntryInformation(archive, L"text.txt", information) && (information.flags & FLAG_COMPRESSED_LZ4));
+	return true;
+}
+
+// Small entries coded against a trained dictionary read back after a reload and come out smaller than coded alone,
+// a dictionary entries were coded against can not be replaced
+static bool TestDictionary(CVFSPack * vfs, const uint8_t * key)
+{
+	// Small records sharing most of their text, as configs or scripts do
+	auto common = MakeContent(1900, 4096, false);
+	TEntries entries;
+	CVFSDictionaryTrainer trainer;
+	for (uint32_t i = 0; i < 64; ++i)
+	{
+		auto content = MakeContent(1901 + i, 600, false);
+		std::copy(common.begin() + (i % 8) * 256, common.begin() + (i % 8) * 256 + 400, content.begin());
+		entries[L"record" + std::to_wstring(i) + L".txt"] = content;
+		trainer.AddSample(content.data(), static_cast<uint32_t>(content.size()));
+	}
+	auto dictionary = trainer.Train(16 * 1024);
+	TEST_CHECK(!dictionary.empty());
+
+	auto archive = CreateArchive(L"rt_dictionary.vpf", key);
+	TEST_CHECK(archive && archive->SetDictionary(1, dictionary.data(), static_cast<uint32_t>(dictionary.size()), FLAG_CRYPTED_AES256));
+
+	SCompressionProfile profile = DEFAULT_COMPRESSION_PROFILE;
+	profile.dictionary = 1;
+	uint64_t plain = 0;
+	for (const auto& entry : entries)
+	{
+		TEST_CHECK(WriteEntry(archive, entry.first, entry.second, FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256, &profile));
+
+		std::vector <char> coded(LZ4_compressBound(static_cast<int>(entry.second.size())));
+		plain += CVFSCompressionPool::ThreadContext().Compress(reinterpret_cast<const char*>(entry.second.data()), coded.data(),
+			static_cast<int32_t>(entry.second.size()), static_cast<int32_t>(coded.size()), profile.level);
+	}
+	TEST_CHECK(Reloads(archive, L"rt_dictionary.vpf", key, entries, true));
+
+	uint64_t dictionaried = 0;
+	for (const auto& entry : entries)
+	{
+		SFileInformation information;
+		TEST_CHECK(GetEntryInformation(archive, entry.first, information) && information.dictionary == 1);
+		dictionaried += information.compressedsize;
+	}
+	TEST_CHECK(dictionaried < plain / 2);
+
+	TEST_CHECK(archive->HasDictionary(1) && !archive->HasDictionary(2));
+	TEST_CHECK(!archive->SetDictionary(1, common.data(), static_cast<uint32_t>(common.size())));
+	TEST_CHECK(Reloads(archive, L"rt_dictionary.vpf", key, entries));
+	return true;
+}
+
+// Solid members read back after a reload under their names, the member table of a group keeps only the index, size and place
+// of each beside the name. Deleting a member rewrites the table, deleting the last one frees the group.
+static bool TestSolidGroups(CVFSPack * vfs, const uint8_t * key)
+{
+	TEntries entries;
+	std::vector <std::wstring> names;
+	for (uint32_t i = 0; i < 32; ++i)
+	{
+		auto name = L"member" + std::to_wstring(i) + L".txt";
+		entries[name] = MakeContent(2101 + i, 200 + i * 37, i % 2 == 0);
+		names.push_back(name);
+	}
+
+	auto archive = CreateArchive(L"rt_solid.vpf", key);
+	TEST_CHECK(archive && archive->WriteSolid(GetSolidInputs(entries, names), FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256));
+	TEST_CHECK(Reloads(archive, L"rt_solid.vpf", key, entries, true));
+
+	auto tableSize = [](const std::shared_ptr <CVFSArchive>& archive, uint64_t& size) {
+		size = 0;
+		uint32_t groups = 0;
+		for (const auto& information : archive->EnumerateRawEntries())
+		{
+			if (information.flags & FLAG_SOLID_INDEX)
+				size += information.rawsize;
+			if (information.flags & FLAG_SOLID_GROUP)
+				++groups;
+		}
+		return groups;
+	};
+	auto expectedSize = [&entries]() {
+		uint64_t size = 2 * sizeof(uint32_t);
+		for (const auto& entry : entries)
+		{
+			size += 4 * sizeof(uint32_t);
+#ifdef SHOW_FILE_NAMES
+			size += sizeof(uint16_t) + entry.first.size() * sizeof(wchar_t);
+#endif
+		}
+		return size;
+	};
+
+	uint64_t size = 0;
+	TEST_CHECK(tableSize(archive, size) == 1 && size == expectedSize());
+#ifdef SHOW_FILE_NAMES
+	for (const auto& information : archive->EnumerateFiles())
+		TEST_CHECK(entries.count(information.filename) && (information.flags & FLAG_SOLID_MEMBER));
+#endif
+
+	for (uint32_t i = 0; i < 32; i += 3)
+	{
+		TEST_CHECK(archive->Delete(names[i]));
+		entries.erase(names[i]);
+	}
+	TEST_CHECK(Reloads(archive, L"rt_solid.vpf", key, entries, true));
+	TEST_CHECK(tableSize(archive, size) == 1 && size == expectedSize());
+
+	for (const auto& entry : TEntries(entries))
+	{
+		TEST_CHECK(archive->Delete(entry.first));
+		entries.erase(entry.first);
+	}
+	TEST_CHECK(Reloads(archive, L"rt_solid.vpf", key, entries));
+	TEST_CHECK(tableSize(archive, size) == 0 && size == 0);
+	return true;
+}
+
+// Entries of a chunk size profile are split from CHUNKED_MIN_CHUNKS chunks on, smaller ones stay in one piece. Reads decode
+// only the chunks they touch: with the last chunk damaged on disk every read ending before it still succeeds, reads across
+// chunk boundaries included, while a read reaching it fails.
+static bool TestChunkedEntry(CVFSPack * vfs, const uint8_t * key)
+{
+	TEntries entries;
+	entries[L"chunked.bin"] = MakeContent(2201, 10 * DEFAULT_CHUNK_SIZE + 1234, true);
+	entries[L"small.bin"] = MakeContent(2202, 2 * DEFAULT_CHUNK_SIZE, true);
+	const auto& content = entries[L"chunked.bin"];
+
+	SCompressionProfile profile = DEFAULT_COMPRESSION_PROFILE;
+	profile.chunksize = DEFAULT_CHUNK_SIZE;
+
+	auto archive = CreateArchive(L"rt_chunked.vpf", key);
+	TEST_CHECK(archive);
+	for (const auto& entry : entries)
+		TEST_CHECK(WriteEntry(archive, entry.first, entry.second, FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256, &profile));
+	TEST_CHECK(Reloads(archive, L"rt_chunked.vpf", key, entries));
+
+	SFileInformation information;
+	TEST_CHECK(GetEntryInformation(archive, L"chunked.bin", information) && (information.flags & FLAG_CHUNKED));
+	TEST_CHECK(GetEntryInformation(archive, L"small.bin", information) && !(information.flags & FLAG_CHUNKED));
+
+	auto end = archive->GetEntryRanges({ CVFSArchive::GenerateNameIndex(L"chunked.bin") }).front().second;
+	archive.reset();
+	{
+		auto file = std::make_shared<CVFSFile>();
+		std::vector <uint8_t> damage(16, 0xa5);
+		TEST_CHECK(file->Create(L"rt_chunked.vpf", true));
+		file->SetPosition(end - damage.size());
+		TEST_CHECK(file->Write(damage.data(), static_cast<uint32_t>(damage.size())) == damage.size());
+	}
+	archive = OpenArchive(L"rt_chunked.vpf", key, false);
+	TEST_CHECK(archive);
+
+	auto readsAt = [&archive, &content](uint64_t position, uint32_t size) {
+		auto stream = archive->Open(L"chunked.bin");
+		std::vector <uint8_t> output(size);
+		if (!stream)
+			return false;
+
+		stream->SetPosition(position);
+		return stream->Read(output.data(), size) == size && std::equal(output.begin(), output.end(), content.begin() + position);
+	};
+	TEST_CHECK(readsAt(0, 100));
+	TEST_CHECK(readsAt(3 * DEFAULT_CHUNK_SIZE - 100, 300));
+	TEST_CHECK(readsAt(DEFAULT_CHUNK_SIZE + 5, 4 * DEFAULT_CHUNK_SIZE));
+	TEST_CHECK(readsAt(9 * DEFAULT_CHUNK_SIZE, DEFAULT_CHUNK_SIZE));
+	TEST_CHECK(!readsAt(10 * DEFAULT_CHUNK_SIZE, 100));
+	TEST_CHECK(!readsAt(9 * DEFAULT_CHUNK_SIZE, DEFAULT_CHUNK_SIZE + 1));
+	TEST_CHECK(HasEntry(archive, L"small.bin", entries[L"small.bin"]));
+	return true;
+}
+
+// Prepare codes on many threads at once, against a dictionary the archive drops and loads again meanwhile, and WritePrepared
+// places the results in any order
+static bool TestPreparedEntries(CVFSPack * vfs, const uint8_t * key)
+{
+	auto common = MakeContent(2301, 8 * 1024, false);
+	TEntries entries;
+	for (uint32_t i = 0; i < 64; ++i)
+	{
+		auto content = MakeContent(2302 + i, 16 * 1024, i % 2 == 0);
+		std::copy(common.begin(), common.begin() + 4096, content.begin() + (i % 4) * 4096);
+		entries[L"prepared" + std::to_wstring(i) + L".bin"] = content;
+	}
+
+	auto archive = CreateArchive(L"rt_prepared.vpf", key);
+	TEST_CHECK(archive && archive->SetDictionary(1, common.data(), static_cast<uint32_t>(common.size())));
+
+	SCompressionProfile profile = DEFAULT_COMPRESSION_PROFILE;
+	profile.dictionary = 1;
+
+	std::vector <std::pair <std::wstring, const std::vector <uint8_t>*>> inputs;
+	for (const auto& entry : entries)
+		inputs.emplace_back(entry.first, &entry.second);
+
+	std::vector <SPreparedEntry> prepared(inputs.size());
+	std::atomic <uint32_t> next(0);
+	std::atomic <bool> failed(false);
+	std::vector <std::thread> workers;
+	for (uint32_t i = 0; i < 4; ++i)
+	{
+		workers.emplace_back([&]() {
+			for (uint32_t item; (item = next++) < inputs.size();)
+			{
+				const auto& content = *inputs[item].second;
+				if (!archive->Prepare(inputs[item].first, content.data(), static_cast<uint32_t>(content.size()), FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256, 0, &profile, prepared[item]))
+					failed = true;
+			}
+		});
+	}
+	while (next < inputs.size())
+		archive->Reload();
+	for (auto& worker : workers)
+		worker.join();
+	TEST_CHECK(!failed);
+
+	for (size_t i = prepared.size(); i > 0; --i)
+		TEST_CHECK(archive->WritePrepared(prepared[i - 1]));
+	TEST_CHECK(Reloads(archive, L"rt_prepared.vpf", key, entries));
+
+	for (const auto& entry : entries)
+	{
+		SFileInformation information;
+		TEST_CHECK(GetEntryInformation(archive, entry.first, information) && information.dictionary == 1);
+	}
+	return true;
+}
+
+// A bulk build appends the entries in call order behind everything there was, the blocks freed meanwhile stay free until it
+// ends. Reads in the middle of the build see the buffered entries, a buffered file moved away from its data flushes it first.
+static bool TestBulkBuild(CVFSPack * vfs, const uint8_t * key)
+{
+	auto archive = CreateArchive(L"rt_bulk.vpf", key);
+	TEST_CHECK(archive);
+
+	TEntries entries;
+	entries[L"old.bin"] = MakeContent(2401, 64 * 1024, false);
+	entries[L"kept.bin"] = MakeContent(2402, 1000, true);
+	for (const auto& entry : entries)
+		TEST_CHECK(WriteEntry(archive, entry.first, entry.second));
+	auto end = GetFileSize(L"rt_bulk.vpf");
+
+	TEST_CHECK(archive->BeginBulk(1024 * 1024));
+	TEST_CHECK(archive->Delete(L"old.bin"));
+	entries.erase(L"old.bin");
+
+	std::vector <std::wstring> names;
+	for (uint32_t i = 0; i < 40; ++i)
+	{
+		auto name = L"bulk" + std::to_wstring(i) + L".bin";
+		entries[name] = MakeContent(2403 + i, 500 + i * 700, i % 3 != 0);
+		TEST_CHECK(WriteEntry(archive, name, entries[name], i % 4 == 0 ? FLAG_RAW_DATA : FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256));
+		names.push_back(name);
+
+		if (i == 20)
+			TEST_CHECK(HasEntry(archive, names[10], entries[names[10]]));
+	}
+	TEST_CHECK(archive->EndBulk());
+
+	for (size_t i = 0; i < names.size(); ++i)
+		TEST_CHECK(GetEntryOffset(archive, names[i]) >= end && (!i || GetEntryOffset(archive, names[i]) > GetEntryOffset(archive, names[i - 1])));
+	TEST_CHECK(Reloads(archive, L"rt_bulk.vpf", key, entries, true));
+
+	// Freed again after the build
+	auto size = GetFileSize(L"rt_bulk.vpf");
+	TEST_CHECK(WriteEntry(archive, L"after.bin", MakeContent(2450, 32 * 1024, false)));
+	TEST_CHECK(GetFileSize(L"rt_bulk.vpf") == size && GetEntryOffset(archive, L"after.bin") < end);
+
+	auto file = std::make_shared<CVFSFile>();
+	auto content = MakeContent(2451, 3000, false);
+	std::vector <uint8_t> read(content.size());
+	TEST_CHECK(file->Create(L"rt_bulk.bin") && file->SetWriteBuffer(64 * 1024));
+	TEST_CHECK(file->Write(content.data(), static_cast<uint32_t>(content.size())) == content.size());
+	TEST_CHECK(file->SetPosition(0) && file->Read(read.data(), static_cast<uint32_t>(read.size())) == read.size() && read == content);
+	return true;
+}
+
+// Two copies of an entry, as a cut compaction step leaves them, load as one: the higher version wins, then the later one in the
+// file. The blocks of the other one are free again, also for the next load.
+static bool TestDuplicateEntries(CVFSPack * vfs, const uint8_t * key)
+{
+	TEntries entries;
+	entries[L"before.bin"] = MakeContent(2501, 3000, true);
+	entries[L"copied.bin"] = MakeContent(2502, 20000, false);
+
+	for (auto newer : { false, true })
+	{
+		auto archive = CreateArchive(L"rt_duplicate.vpf", key);
+		TEST_CHECK(archive && WriteEntry(archive, L"before.bin", entries[L"before.bin"]) && WriteEntry(archive, L"copied.bin", entries[L"copied.bin"]));
+
+		auto start = GetEntryOffset(archive, L"copied.bin");
+		auto end = GetFileSize(L"rt_duplicate.vpf");
+		archive.reset();
+		{
+			// The last entry copied behind itself, the first copy of a higher version when it is to win
+			std::vector <uint8_t> blocks(static_cast<size_t>(end - start));
+			auto file = std::make_shared<CVFSFile>();
+			TEST_CHECK(file->Create(L"rt_duplicate.vpf", true) && file->SetPosition(start));
+			TEST_CHECK(file->Read(blocks.data(), static_cast<uint32_t>(blocks.size())) == blocks.size());
+			uint64_t offset = end + RAW_ENTRY_HEADER_SIZE;
+			memcpy(blocks.data() + RAW_ENTRY_HEADER_SIZE - sizeof(offset), &offset, sizeof(offset));
+			TEST_CHECK(file->SetPosition(end) && file->Write(blocks.data(), static_cast<uint32_t>(blocks.size())) == blocks.size());
+			if (newer)
+			{
+				uint32_t version = 5;
+				TEST_CHECK(file->SetPosition(start + offsetof(SFileInformation, version)) && file->Write(&version, sizeof(version)) == sizeof(version));
+			}
+		}
+
+		archive = OpenArchive(L"rt_duplicate.vpf", key, true);
+		SFileInformation information;
+		TEST_CHECK(archive && HasEntries(archive, entries));
+		TEST_CHECK(GetEntryOffset(archive, L"copied.bin") == (newer ? start : end));
+		TEST_CHECK(GetEntryInformation(archive, L"copied.bin", information) && information.version == (newer ? 5 : 0));
+
+		// Written over the copy that lost
+		auto size = GetFileSize(L"rt_duplicate.vpf");
+		auto content = MakeContent(2503, 10000, false);
+		TEST_CHECK(WriteEntry(archive, L"after.bin", content));
+		TEST_CHECK(GetEntryOffset(archive, L"after.bin") == (newer ? end : start) && GetFileSize(L"rt_duplicate.vpf") == size);
+
+		auto expected = entries;
+		expected[L"after.bin"] = content;
+		TEST_CHECK(Reloads(archive, L"rt_duplicate.vpf", key, expected));
+		TEST_CHECK(GetEntryOffset(archive, L"copied.bin") == (newer ? start : end));
+	}
+	return true;
+}
+
+// A stream cut short leaves a loadable archive, and readers on other threads are not held up by an open stream
+static bool TestStreamedEntry(CVFSPack * vfs, const uint8_t * key)
+{
+	auto small = MakeContent(1, 1000, true);
+	auto large = MakeContent(2, 3 * 1024 * 1024, false);
+
+	auto archive = CreateArchive(L"rt_stream.vpf", key);
+	TEST_CHECK(archive);
+	TEST_CHECK(WriteEntry(archive, L"small.txt", small));
+
+	auto writer = archive->BeginWrite(L"large.bin", FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256);
+	TEST_CHECK(writer);
+	for (size_t position = 0; position < large.size() / 2; position += 256 * 1024)
+		TEST_CHECK(writer->Append(large.data() + position, 256 * 1024));
+
+	// Detached so a reader blocked by the stream fails the test instead of hanging it
+	auto result = std::make_shared<std::promise <bool>>();
+	auto reader = result->get_future();
+	std::thread([archive, small, result]() { result->set_value(HasEntry(archive, L"small.txt", small)); }).detach();
+	TEST_CHECK(reader.wait_for(std::chrono::seconds(10)) == std::future_status::ready && reader.get());
+
+	// What a crash in the middle of the stream leaves on disk
+	std::error_code error;
+	std::filesystem::copy_file(L"rt_stream.vpf", L"rt_stream_cut.vpf", std::filesystem::copy_options::overwrite_existing, error);
+	TEST_CHECK(!error);
+
+	for (size_t position = large.size() / 2; position < large.size(); position += 256 * 1024)
+		TEST_CHECK(writer->Append(large.data() + position, 256 * 1024));
+	TEST_CHECK(writer->Commit());
+	writer.reset();
+	archive.reset();
+
+	auto reloaded = OpenArchive(L"rt_stream.vpf", key, false);
+	TEST_CHECK(reloaded);
+	TEST_CHECK(HasEntry(reloaded, L"small.txt", small));
+	TEST_CHECK(HasEntry(reloaded, L"large.bin", large));
+
+	auto cut = OpenArchive(L"rt_stream_cut.vpf", key, true);
+	TEST_CHECK(cut);
+	TEST_CHECK(HasEntry(cut, L"small.txt", small));
+	TEST_CHECK(!cut->Exists(CVFSArchive::GenerateNameIndex(L"large.bin")));
+
+	// The blocks of the cut stream are free space again
+	TEST_CHECK(cut->Write(L"after.bin", large.data(), 512 * 1024, FLAG_COMPRESSED_LZ4));
+	cut.reset();
+
+	cut = OpenArchive(L"rt_stream_cut.vpf", key, false);
+	TEST_CHECK(cut);
+	TEST_CHECK(HasEntry(cut, L"small.txt", small));
+	TEST_CHECK(HasEntry(cut, L"after.bin", std::vector <uint8_t>(large.begin(), large.begin() + 512 * 1024)));
+	return true;
+}
+
+// Large entries behind small holes slide down without ever overlapping their old header, a copy of the file taken
+// after any step loads with every entry intact. An order already met moves nothing, another one is followed.
+static bool TestCompaction(CVFSPack * vfs, const uint8_t * key)
+{
+	auto archive = CreateArchive(L"rt_compact.vpf", key);
+	TEST_CHECK(archive);
+
+	TEntries entries;
+	for (uint32_t i = 0; i < 24; ++i)
+	{
+		auto name = L"entry" + std::to_wstring(i) + L".bin";
+		auto content = MakeContent(100 + i, i % 2 ? 3000 + i * 5000 : 100 + i, i % 3 == 0);
+		TEST_CHECK(WriteEntry(archive, name, content, i % 4 == 0 ? FLAG_RAW_DATA : FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256));
+		entries[name] = content;
+	}
+	for (uint32_t i = 0; i < 24; i += 2)
+	{
+		auto name = L"entry" + std::to_wstring(i) + L".bin";
+		TEST_CHECK(archive->Delete(name));
+		entries.erase(name);
+	}
+
+	auto before = GetFileSize(L"rt_compact.vpf");
+	TEST_CHECK(archive->BeginCompact());
+
+	std::error_code error;
+	bool completed = false;
+	while (!completed)
+	{
+		TEST_CHECK(archive->CompactStep(4096, completed));
+
+		std::filesystem::copy_file(L"rt_compact.vpf", L"rt_compact_cut.vpf", std::filesystem::copy_options::overwrite_existing, error);
+		TEST_CHECK(!error);
+		auto cut = OpenArchive(L"rt_compact_cut.vpf", key, false);
+		TEST_CHECK(cut);
+		TEST_CHECK(HasEntries(cut, entries));
+	}
+	TEST_CHECK(HasEntries(archive, entries));
+	TEST_CHECK(GetFileSize(L"rt_compact.vpf") < before);
+
+	// In order already, nothing moves and the file does not grow
+	std::vector <std::pair <uint64_t, std::wstring>> layout;
+	for (const auto& entry : entries)
+		layout.emplace_back(GetEntryOffset(archive, entry.first), entry.first);
+	std::sort(layout.begin(), layout.end());
+
+	std::vector <uint32_t> order;
+	for (const auto& entry : layout)
+		order.push_back(CVFSArchive::GenerateNameIndex(entry.second));
+
+	auto compacted = GetFileSize(L"rt_compact.vpf");
+	TEST_CHECK(archive->BeginCompact(order));
+	for (completed = false; !completed;)
+	{
+		TEST_CHECK(archive->CompactStep(4096, completed));
+		TEST_CHECK(GetFileSize(L"rt_compact.vpf") == compacted);
+	}
+	for (const auto& entry : layout)
+		TEST_CHECK(GetEntryOffset(archive, entry.second) == entry.first);
+
+	// Reversed, the entries come out in the new order
+	std::reverse(order.begin(), order.end());
+	std::reverse(layout.begin(), layout.end());
+	TEST_CHECK(archive->Compact(order));
+	for (size_t i = 1; i < layout.size(); ++i)
+		TEST_CHECK(GetEntryOffset(archive, layout[i - 1].second) < GetEntryOffset(archive, layout[i].second));
+	TEST_CHECK(GetFileSize(L"rt_compact.vpf") == compacted);
+	TEST_CHECK(Reloads(archive, L"rt_compact.vpf", key, entries));
+	return true;
+}
+
+// Staged writes and deletes land together at Commit, a solid member can not be replaced from inside a batch
+static bool TestBatch(CVFSPack * vfs, const uint8_t * key)
+{
+	auto archive = CreateArchive(L"rt_batch.vpf", key);
+	TEST_CHECK(archive);
+
+	TEntries entries;
+	for (uint32_t i = 0; i < 6; ++i)
+	{
+		auto name = L"entry" + std::to_wstring(i) + L".bin";
+		entries[name] = MakeContent(200 + i, 2000 + i * 3000, i % 2 == 0);
+		TEST_CHECK(WriteEntry(archive, name, entries[name]));
+	}
+
+	for (uint32_t i = 0; i < 3; ++i)
+		entries[L"member" + std::to_wstring(i) + L".txt"] = MakeContent(300 + i, 1500, true);
+	TEST_CHECK(archive->WriteSolid(GetSolidInputs(entries, { L"member0.txt", L"member1.txt", L"member2.txt" }), FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256));
+
+	TEST_CHECK(archive->BeginBatch());
+	auto replaced = MakeContent(400, 7000, false);
+	TEST_CHECK(WriteEntry(archive, L"entry1.bin", replaced, FLAG_COMPRESSED_LZ4));
+	auto added = MakeContent(401, 9000, true);
+	TEST_CHECK(WriteEntry(archive, L"added.bin", added, FLAG_RAW_DATA));
+	TEST_CHECK(archive->Delete(L"entry4.bin"));
+	TEST_CHECK(!WriteEntry(archive, L"member1.txt", added, FLAG_RAW_DATA));
+
+	// Reads see the committed entries until Commit
+	TEST_CHECK(HasEntry(archive, L"entry1.bin", entries[L"entry1.bin"]));
+	TEST_CHECK(!archive->Exists(L"added.bin"));
+	TEST_CHECK(archive->Commit());
+
+	entries[L"entry1.bin"] = replaced;
+	entries[L"added.bin"] = added;
+	entries.erase(L"entry4.bin");
+	TEST_CHECK(!std::filesystem::exists(L"rt_batch.vpf.journal"));
+	TEST_CHECK(Reloads(archive, L"rt_batch.vpf", key, entries, true));
+
+	// Aborted, nothing of the batch is left
+	TEST_CHECK(archive->BeginBatch());
+	TEST_CHECK(archive->Delete(L"entry0.bin"));
+	archive->AbortBatch();
+	TEST_CHECK(Reloads(archive, L"rt_batch.vpf", key, entries));
+	return true;
+}
+
+// Sharers read the payload of the holder they were written with, not of another entry holding the same content coded differently
+static bool TestSharedPayloads(CVFSPack * vfs, const uint8_t * key)
+{
+	auto archive = CreateArchive(L"rt_shared.vpf", key);
+	TEST_CHECK(archive);
+
+	TEntries entries;
+	for (uint32_t i = 0; i < 8; ++i)
+	{
+		auto content = MakeContent(500 + i, 20000, true);
+		for (const auto& name : { L"held" + std::to_wstring(i), L"shared" + std::to_wstring(i) })
+		{
+			TEST_CHECK(WriteEntry(archive, name, content));
+			entries[name] = content;
+		}
+
+		// Not crypted, so not shared, but the same content
+		auto name = L"plain" + std::to_wstring(i);
+		TEST_CHECK(WriteEntry(archive, name, content, FLAG_COMPRESSED_LZ4));
+		entries[name] = content;
+	}
+	TEST_CHECK(Reloads(archive, L"rt_shared.vpf", key, entries, true));
+
+	// Deleted holders hand their payload on
+	for (uint32_t i = 0; i < 4; ++i)
+	{
+		auto name = L"held" + std::to_wstring(i);
+		TEST_CHECK(archive->Delete(name));
+		entries.erase(name);
+	}
+	TEST_CHECK(Reloads(archive, L"rt_shared.vpf", key, entries));
+	return true;
+}
+
+// A patch brings an archive to the new version in one commit, entries moving in and out of solid groups included,
+// and one that breaks off half way leaves the archive as it was
+static bool TestPatch(CVFSPack * vfs, const uint8_t * key)
+{
+	TEntries entries;
+	{
+		auto archive = CreateArchive(L"rt_patch_from.vpf", key);
+		TEST_CHECK(archive);
+
+		for (const auto& name : { L"a.bin", L"b.bin", L"c.bin", L"x.txt" })
+		{
+			entries[name] = MakeContent(static_cast<uint32_t>(entries.size()) + 600, 30000, true);
+			TEST_CHECK(WriteEntry(archive, name, entries[name]));
+		}
+
+		for (const auto& name : { L"m1.txt", L"m2.txt" })
+			entries[name] = MakeContent(static_cast<uint32_t>(entries.size()) + 600, 2000, true);
+		TEST_CHECK(archive->WriteSolid(GetSolidInputs(entries, { L"m1.txt", L"m2.txt" }), FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256));
+	}
+
+	std::error_code error;
+	std::filesystem::copy_file(L"rt_patch_from.vpf", L"rt_patch_to.vpf", std::filesystem::copy_options::overwrite_existing, error);
+	TEST_CHECK(!error);
+
+	auto updated = entries;
+	{
+		auto archive = OpenArchive(L"rt_patch_to.vpf", key, true);
+		TEST_CHECK(archive);
+
+		updated[L"a.bin"][100] ^= 0xff;
+		updated[L"g.bin"] = MakeContent(700, 5000, false);
+		updated[L"m1.txt"] = MakeContent(701, 3000, true);
+		for (const auto& name : { L"a.bin", L"g.bin", L"m1.txt" })
+			TEST_CHECK(WriteEntry(archive, name, updated[name]));
+
+		TEST_CHECK(archive->Delete(L"b.bin"));
+		updated.erase(L"b.bin");
+
+		// A plain entry moves into a new group
+		updated[L"y.txt"] = MakeContent(702, 1000, true);
+		TEST_CHECK(archive->WriteSolid(GetSolidInputs(updated, { L"x.txt", L"y.txt" }), FLAG_COMPRESSED_LZ4));
+		TEST_CHECK(HasEntries(archive, updated));
+	}
+
+	{
+		auto from = OpenArchive(L"rt_patch_from.vpf", key, false);
+		auto to = OpenArchive(L"rt_patch_to.vpf", key, false);
+		TEST_CHECK(from && to);
+		TEST_CHECK(CVFSPatch::Create(from, to, L"rt_patch.vfp"));
+	}
+
+	// Cut short, nothing of it is applied
+	std::filesystem::copy_file(L"rt_patch_from.vpf", L"rt_patch_apply.vpf", std::filesystem::copy_options::overwrite_existing, error);
+	std::filesystem::copy_file(L"rt_patch.vfp", L"rt_patch_cut.vfp", std::filesystem::copy_options::overwrite_existing, error);
+	std::filesystem::resize_file(L"rt_patch_cut.vfp", GetFileSize(L"rt_patch.vfp") - 16, error);
+	TEST_CHECK(!error);
+	{
+		auto archive = OpenArchive(L"rt_patch_apply.vpf", key, true);
+		TEST_CHECK(archive);
+		TEST_CHECK(!CVFSPatch::Apply(archive, L"rt_patch_cut.vfp"));
+		TEST_CHECK(HasEntries(archive, entries));
+	}
+
+	// An entry header changed on the way, here its name, fails the record hash like a changed payload does
+	{
+		std::vector <uint8_t> patch(static_cast<size_t>(GetFileSize(L"rt_patch.vfp")));
+		auto file = std::make_shared<CVFSFile>();
+		TEST_CHECK(file->Open(CVFSPack::GetAbsolutePath(L"rt_patch.vfp")) && file->Read(patch.data(), static_cast<uint32_t>(patch.size())) == patch.size());
+		file.reset();
+
+		std::wstring name = L"g.bin";
+		auto bytes = reinterpret_cast<const uint8_t*>(name.c_str());
+		auto position = std::search(patch.begin(), patch.end(), bytes, bytes + name.size() * sizeof(wchar_t));
+		TEST_CHECK(position != patch.end());
+		*position ^= 0x01;
+
+		file = std::make_shared<CVFSFile>();
+		TEST_CHECK(file->Create(L"rt_patch_name.vfp") && file->Write(patch.data(), static_cast<uint32_t>(patch.size())) == patch.size());
+		file.reset();
+
+		auto archive = OpenArchive(L"rt_patch_apply.vpf", key, true);
+		TEST_CHECK(archive);
+		TEST_CHECK(!CVFSPatch::Apply(archive, L"rt_patch_name.vfp"));
+		TEST_CHECK(HasEntries(archive, entries));
+	}
+
+	auto archive = OpenArchive(L"rt_patch_apply.vpf", key, true);
+	TEST_CHECK(archive);
+	TEST_CHECK(HasEntries(archive, entries));
+	TEST_CHECK(CVFSPatch::Apply(archive, L"rt_patch.vfp"));
+	TEST_CHECK(Reloads(archive, L"rt_patch_apply.vpf", key, updated));
+	return true;
+}
+
+// Solid groups and dictionaries of a merged archive keep their own tables even when the target uses the same numbers,
+// a copy over the target replaces it as a whole or not at all
+static bool TestMerge(CVFSPack * vfs, const uint8_t * key)
+{
+	auto build = [key](const std::wstring& filename, uint32_t seed, const std::wstring& prefix, TEntries& entries) {
+		auto archive = CreateArchive(filename, key);
+		if (!archive)
+			return false;
+
+		auto dictionary = MakeContent(seed, 16 * 1024, true);
+		if (!archive->SetDictionary(1, dictionary.data(), static_cast<uint32_t>(dictionary.size())))
+			return false;
+
+		SCompressionProfile profile = DEFAULT_COMPRESSION_PROFILE;
+		profile.dictionary = 1;
+		auto name = prefix + L"coded.bin";
+		entries[name] = MakeContent(seed + 1, 20000, true);
+		if (!WriteEntry(archive, name, entries[name], FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256, &profile))
+			return false;
+
+		std::vector <std::wstring> members;
+		for (uint32_t i = 0; i < 3; ++i)
+		{
+			members.push_back(prefix + L"member" + std::to_wstring(i) + L".txt");
+			entries[members.back()] = MakeContent(seed + 2 + i, 1000 + i * 100, true);
+		}
+		return archive->WriteSolid(GetSolidInputs(entries, members), FLAG_COMPRESSED_LZ4 | FLAG_CRYPTED_AES256);
+	};
+
+	TEntries entries;
+	TEntries incoming;
+	TEST_CHECK(build(L"rt_merge_target.vpf", 800, L"target/", entries));
+	TEST_CHECK(build(L"rt_merge_source.vpf", 900, L"source/", incoming));
+	entries.insert(incoming.begin(), incoming.end());
+
+	auto target = OpenArchive(L"rt_merge_target.vpf", key, true);
+	auto source = OpenArchive(L"rt_merge_source.vpf", key, false);
+	TEST_CHECK(target && source);
+	TEST_CHECK(target->Merge(source));
+	TEST_CHECK(HasEntries(target, entries));
+
+	// A single member brings its group along, numbered once more
+	TEST_CHECK(target->Merge(source, { CVFSArchive::GenerateNameIndex(L"source/member1.txt") }));
+	TEST_CHECK(Reloads(target, L"rt_merge_target.vpf", key, entries));
+
+	// A copy replaces every entry, one that fails half way leaves the target as it was
+	TEntries copied;
+	TEST_CHECK(build(L"rt_merge_copy.vpf", 1000, L"copy/", copied));
+	auto copy = OpenArchive(L"rt_merge_copy.vpf", key, false);
+	target = OpenArchive(L"rt_merge_target.vpf", key, true);
+	TEST_CHECK(copy && target);
+
+	source->GetFileStream()->Close();
+	TEST_CHECK(!CVFSArchive::CopyArchive(source, target));
+	TEST_CHECK(HasEntries(target, entries) && GetFileSize(L"rt_merge_target.vpf.copy") == 0);
+
+	TEST_CHECK(CVFSArchive::CopyArchive(copy, target));
+	TEST_CHECK(GetFileSize(L"rt_merge_target.vpf.copy") == 0);
+	TEST_CHECK(Reloads(target, L"rt_merge_target.vpf", key, copied));
+	return true;
+}
+
+// Names an archive gains or loses after it was mounted reach the pack index, a lost name falls back to the next archive
+static bool TestPackIndex(CVFSPack * vfs, const uint8_t * key)
+{
+	auto shared = MakeContent(1000, 3000, true);
+	auto older = MakeContent(1001, 3000, true);
+	auto added = MakeContent(1002, 3000, true);
+	{
+		auto high = CreateArchive(L"rt_index_high.vpf", key);
+		auto low = CreateArchive(L"rt_index_low.vpf", key);
+		TEST_CHECK(high && low);
+		TEST_CHECK(WriteEntry(high, L"rt_index/shared.txt", shared, FLAG_RAW_DATA));
+		TEST_CHECK(WriteEntry(low, L"rt_index/shared.txt", older, FLAG_RAW_DATA));
+	}
+
+	// Unregistered archives rank in load order, the first one above
+	vfs->SetArchiveKey(L"rt_index_high.vpf", key);
+	vfs->SetArchiveKey(L"rt_index_low.vpf", key);
+	auto high = vfs->LoadArchive(L"rt_index_high.vpf");
+	auto low = vfs->LoadArchive(L"rt_index_low.vpf");
+	TEST_CHECK(high && low);
+
+	auto passed = HasPackEntry(vfs, L"rt_index/shared.txt", shared) && !vfs->Open(L"rt_index/added.txt");
+	if (passed)
+	{
+		auto patched = OpenArchive(L"rt_index_high.vpf", key, true);
+		passed = patched && patched->Delete(L"rt_index/shared.txt") &&
+			WriteEntry(patched, L"rt_index/added.txt", added, FLAG_RAW_DATA);
+		patched.reset();
+
+		passed = passed && high->Reload() &&
+			HasPackEntry(vfs, L"rt_index/shared.txt", older) && HasPackEntry(vfs, L"rt_index/added.txt", added);
+	}
+
+	vfs->UnloadArchive(high);
+	vfs->UnloadArchive(low);
+	TEST_CHECK(passed);
+	TEST_CHECK(!vfs->Open(L"rt_index/added.txt"));
+	return true;
+}
+
+// Archives read on all cores are published in registration order, the last registered one serves a name all of them have
+// however long each of them took to read
+static bool TestPackLoadOrder(CVFSPack * vfs, const uint8_t * key)
+{
+	static const uint32_t ARCHIVES = 6;
+
+	std::vector <std::wstring> names;
+	std::vector <std::vector <uint8_t>> contents;
+	for (uint32_t i = 0; i < ARCHIVES; ++i)
+	{
+		names.push_back(L"rt_order_" + std::to_wstring(i) + L".vpf");
+		contents.push_back(MakeContent(1600 + i, 3000, true));
+
+		// Earlier registered archives are larger and take longer to read
+		auto archive = CreateArchive(names.back(), key);
+		TEST_CHECK(archive);
+		TEST_CHECK(WriteEntry(archive, L"rt_order/shared.txt", contents.back(), FLAG_RAW_DATA));
+		for (uint32_t j = 0; j < (ARCHIVES - i) * 50; ++j)
+			TEST_CHECK(WriteEntry(archive, L"rt_order/" + std::to_wstring(i) + L"/" + std::to_wstring(j) + L".txt", MakeContent(j, 64, true), FLAG_RAW_DATA));
+	}
+
+	for (const auto& name : names)
+	{
+		vfs->SetArchiveKey(name, key);
+		vfs->RegisterArchive(name);
+	}
+
+	auto passed = true;
+	for (auto run = 0; run < 4 && passed; ++run)
+	{
+		vfs->LoadRegistiredArchives();
+
+		std::vector <std::wstring> loaded;
+		for (const auto& archive : vfs->GetArchives())
+		{
+			auto filename = std::filesystem::path(archive->GetFileStream()->GetFileName()).filename().wstring();
+			std::transform(filename.begin(), filename.end(), filename.begin(), ::tolower);
+			loaded.push_back(filename);
+		}
+
+		passed = loaded == names && HasPackEntry(vfs, L"rt_order/shared.txt", contents.back()) &&
+			HasPackEntry(vfs, L"rt_order/0/0.txt", MakeContent(0, 64, true));
+
+		for (const auto& name : names)
+			vfs->UnloadArchive(vfs->FindArchive(name));
+	}
+
+	for (const auto& name : names)
+		vfs->UnregisterArchive(name);
+	TEST_CHECK(passed);
+	return true;
+}
+
+// A pending archive registered above the loaded one holding a name is loaded for it. The name table saved when it was written,
+// or the names it had when unloaded idle, keep it pending for names it does not have. Without a current table it is loaded right away.
+static bool TestPackLazyMount(CVFSPack * vfs, const uint8_t * key)
+{
+	auto base = MakeContent(1300, 3000, true);
+	auto patch = MakeContent(1301, 3000, true);
+	auto other = MakeContent(1302, 3000, true);
+	{
+		auto based = CreateArchive(L"rt_lazy_base.vpf", key);
+		auto patched = CreateArchive(L"rt_lazy_patch.vpf", key);
+		TEST_CHECK(based && patched);
+		TEST_CHECK(WriteEntry(based, L"rt_lazy/shared.txt", base, FLAG_RAW_DATA));
+		TEST_CHECK(WriteEntry(based, L"rt_lazy/other.txt", other, FLAG_RAW_DATA));
+		TEST_CHECK(WriteEntry(patched, L"rt_lazy/shared.txt", patch, FLAG_RAW_DATA));
+	}
+
+	vfs->SetArchiveKey(L"rt_lazy_base.vpf", key);
+	vfs->SetArchiveKey(L"rt_lazy_patch.vpf", key);
+	vfs->RegisterArchive(L"rt_lazy_base.vpf");
+	vfs->RegisterArchive(L"rt_lazy_patch.vpf");
+	vfs->SetLazyMounting(true, 1);
+
+	auto loaded = [vfs]() {
+		return !!vfs->FindArchive(L"rt_lazy_patch.vpf");
+	};
+	auto reload = [vfs]() {
+		vfs->UnloadArchive(vfs->FindArchive(L"rt_lazy_patch.vpf"));
+		vfs->UnloadArchive(vfs->FindArchive(L"rt_lazy_base.vpf"));
+		vfs->LoadArchive(L"rt_lazy_base.vpf");
+		vfs->LoadRegistiredArchives();
+	};
+
+	// From the name table saved when it was written
+	vfs->LoadArchive(L"rt_lazy_base.vpf");
+	vfs->LoadRegistiredArchives();
+	auto passed = !loaded() && HasPackEntry(vfs, L"rt_lazy/other.txt", other) && !loaded() &&
+		HasPackEntry(vfs, L"rt_lazy/shared.txt", patch) && loaded();
+
+	// Unloaded idle, it keeps its names
+	std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+	vfs->UnloadIdleArchives();
+	passed = passed && !loaded() && HasPackEntry(vfs, L"rt_lazy/other.txt", other) && !loaded() &&
+		HasPackEntry(vfs, L"rt_lazy/shared.txt", patch) && loaded();
+
+	// No name table, loaded right away and the table saved for the next run
+	std::error_code error;
+	std::filesystem::remove(L"rt_lazy_patch.vpf.names", error);
+	reload();
+	passed = passed && loaded() && std::filesystem::exists(L"rt_lazy_patch.vpf.names", error);
+
+	reload();
+	passed = passed && !loaded() && HasPackEntry(vfs, L"rt_lazy/other.txt", other) && !loaded() &&
+		HasPackEntry(vfs, L"rt_lazy/shared.txt", patch) && loaded();
+
+	vfs->UnloadArchive(vfs->FindArchive(L"rt_lazy_patch.vpf"));
+	vfs->UnloadArchive(vfs->FindArchive(L"rt_lazy_base.vpf"));
+	vfs->UnregisterArchive(L"rt_lazy_base.vpf");
+	vfs->UnregisterArchive(L"rt_lazy_patch.vpf");
+	vfs->SetLazyMounting(false);
+	TEST_CHECK(passed);
+	return true;
+}
+
+// Startup sets are only recorded once enabled, saved by the pack when the window is over and not by the reads
+static bool TestStartupSet(CVFSPack * vfs, const uint8_t * key)
+{
+	auto first = MakeContent(1500, 3000, true);
+	auto later = MakeContent(1501, 3000, true);
+	{
+		auto archive = CreateArchive(L"rt_startup.vpf", key);
+		TEST_CHECK(archive);
+		TEST_CHECK(WriteEntry(archive, L"rt_startup/first.txt", first));
+		TEST_CHECK(WriteEntry(archive, L"rt_startup/later.txt", later));
+	}
+
+	std::error_code error;
+	std::filesystem::remove(L"rt_startup.vpf.startup", error);
+	auto saved = []() {
+		std::error_code error;
+		return std::filesystem::exists(L"rt_startup.vpf.startup", error);
+	};
+
+	vfs->SetArchiveKey(L"rt_startup.vpf", key);
+	vfs->RegisterArchive(L"rt_startup.vpf");
+
+	// Off by default, not even Unload saves one
+	vfs->LoadRegistiredArchives();
+	auto passed = HasPackEntry(vfs, L"rt_startup/first.txt", first);
+	vfs->UnloadArchive(vfs->FindArchive(L"rt_startup.vpf"));
+	passed = passed && !saved();
+
+	vfs->SetStartupWindow(1);
+	vfs->LoadRegistiredArchives();
+	passed = passed && HasPackEntry(vfs, L"rt_startup/first.txt", first) && !saved();
+
+	// Saved with no read after the window
+	std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+	auto archive = vfs->FindArchive(L"rt_startup.vpf");
+	passed = passed && archive && saved() && HasPackEntry(vfs, L"rt_startup/later.txt", later) &&
+		archive->LoadStartupSet() == std::vector <uint32_t>{ CVFSArchive::GenerateNameIndex(L"rt_startup/first.txt") };
+
+	vfs->UnloadArchive(archive);
+	vfs->UnregisterArchive(L"rt_startup.vpf");
+	vfs->SetStartupWindow(0);
+	TEST_CHECK(passed);
+	return true;
+}
+
+// A name under a routed path still goes to the archive of the highest rank, a later "*" registration overrides the routed one
+static bool TestPackRoutes(CVFSPack * vfs, const uint8_t * key)
+{
+	auto base = MakeContent(1100, 3000, true);
+	auto patch = MakeContent(1101, 3000, true);
+	auto other = MakeContent(1102, 3000, true);
+	{
+		auto routed = CreateArchive(L"rt_route_base.vpf", key);
+		auto patched = CreateArchive(L"rt_route_patch.vpf", key);
+		TEST_CHECK(routed && patched);
+		TEST_CHECK(WriteEntry(routed, L"rt_route/shared.txt", base, FLAG_RAW_DATA));
+		TEST_CHECK(WriteEntry(routed, L"rt_route/other.txt", other, FLAG_RAW_DATA));
+		TEST_CHECK(WriteEntry(patched, L"rt_route/shared.txt", patch, FLAG_RAW_DATA));
+	}
+
+	vfs->SetArchiveKey(L"rt_route_base.vpf", key);
+	vfs->SetArchiveKey(L"rt_route_patch.vpf", key);
+	vfs->RegisterArchive(L"rt_route_base.vpf", L"rt_route/");
+	vfs->RegisterArchive(L"rt_route_patch.vpf");
+	auto routed = vfs->LoadArchive(L"rt_route_base.vpf");
+	auto patched = vfs->LoadArchive(L"rt_route_patch.vpf");
+
+	auto passed = routed && patched && HasPackEntry(vfs, L"rt_route/shared.txt", patch) && HasPackEntry(vfs, L"rt_route/other.txt", other);
+
+	vfs->UnloadArchive(routed);
+	vfs->UnloadArchive(patched);
+	vfs->UnregisterArchive(L"rt_route_base.vpf");
+	vfs->UnregisterArchive(L"rt_route_patch.vpf");
+	TEST_CHECK(passed);
+	return true;
+}
+
+// A file written to disk after a lookup missed it is found, the missing file cache only remembers misses once asked to
+static bool TestMissingFiles(CVFSPack * vfs, const uint8_t * key)
+{
+	auto content = MakeContent(1200, 1000, true);
+
+	TEST_CHECK(!vfs->Open(L"rt_missing.txt"));
+
+	auto write = [&content]() {
+		CVFSFile file;
+		return file.Create(L"rt_missing.txt") && file.Write(content.data(), static_cast<uint32_t>(content.size())) == content.size();
+	};
+	TEST_CHECK(write());
+	TEST_CHECK(HasPackEntry(vfs, L"rt_missing.txt", content));
+
+	vfs->SetMissingFileCache(true);
+	std::error_code error;
+	std::filesystem::remove(L"rt_missing.txt", error);
+	auto missed = !vfs->Open(L"rt_missing.txt");
+	auto cached = write() && !vfs->Open(L"rt_missing.txt");
+	vfs->ForgetMissingFiles(L"rt_missing.txt");
+	auto forgotten = HasPackEntry(vfs, L"rt_missing.txt", content);
+	vfs->SetMissingFileCache(false);
+
+	TEST_CHECK(missed && cached && forgotten);
+	return true;
+}
+
+// An archive object loaded from another file, as one loaded at the address of an unloaded one, is traced as another archive
+static bool TestAccessTrace(CVFSPack * vfs, const uint8_t * key)
+{
+	auto content = MakeContent(1400, 1000, true);
+	{
+		auto first = CreateArchive(L"rt_trace_first.vpf", key);
+		auto second = CreateArchive(L"rt_trace_second.vpf", key);
+		TEST_CHECK(first && second);
+		TEST_CHECK(WriteEntry(first, L"rt_trace/first.txt", content));
+		TEST_CHECK(WriteEntry(second, L"rt_trace/second.txt", content));
+	}
+
+	auto archive = OpenArchive(L"rt_trace_first.vpf", key, false);
+	TEST_CHECK(archive);
+
+	CVFSAccessTrace trace;
+	TEST_CHECK(trace.Begin(L"rt_trace.bin"));
+	trace.Record(archive.get(), CVFSArchive::GenerateNameIndex(L"rt_trace/first.txt"));
+
+	auto file = std::make_shared<CVFSFile>();
+	archive->Unload();
+	TEST_CHECK(file->Open(CVFSPack::GetAbsolutePath(L"rt_trace_second.vpf")) && archive->Load(file, key));
+	trace.Record(archive.get(), CVFSArchive::GenerateNameIndex(L"rt_trace/second.txt"));
+	trace.Record(archive.get(), CVFSArchive::GenerateNameIndex(L"rt_trace/second.txt"));
+	TEST_CHECK(trace.End());
+
+	std::vector <std::wstring> archives;
+	std::vector <STraceAccess> accesses;
+	TEST_CHECK(CVFSAccessTrace::Load(L"rt_trace.bin", archives, accesses));
+	TEST_CHECK(archives.size() == 2 && accesses.size() == 3);
+	TEST_CHECK(archives[0].find(L"rt_trace_first.vpf") != std::wstring::npos && archives[1].find(L"rt_trace_second.vpf") != std::wstring::npos);
+	TEST_CHECK(accesses[0].archive == 0 && accesses[1].archive == 1 && accesses[2].archive == 1);
+	TEST_CHECK(accesses[1].entry == CVFSArchive::GenerateNameIndex(L"rt_trace/second.txt"));
+	return true;
+}
+
+bool RunRoundTripTests(CVFSPack * vfs, const uint8_t * key)
+{
+	typedef bool (*TTest)(CVFSPack * vfs, const uint8_t * key);
+	static const std::vector <std::pair <const char*, TTest>> tests = {
+		{ "Data buffer", TestDataBuffer },
+		{ "Free space", TestFreeSpace },
+		{ "Scratch arena", TestScratchArena },
+		{ "Compression context", TestCompressionContext },
+		{ "Legacy archive", TestLegacyArchive },
+		{ "Compression profiles", TestCompressionProfiles },
+		{ "Incompressible content", TestIncompressibleContent },
+		{ "Dictionary", TestDictionary },
+		{ "Solid groups", TestSolidGroups },
+		{ "Chunked entry", TestChunkedEntry },
+		{ "Prepared entries", TestPreparedEntries },
+		{ "Bulk build", TestBulkBuild },
+		{ "Duplicate entries", TestDuplicateEntries },
+		{ "Streamed entry", TestStreamedEntry },
+		{ "Compaction", TestCompaction },
+		{ "Batch", TestBatch },
+		{ "Shared payloads", TestSharedPayloads },
+		{ "Patch", TestPatch },
+		{ "Merge", TestMerge },
+		{ "Pack index", TestPackIndex },
+		{ "Pack load order", TestPackLoadOrder },
+		{ "Pack lazy mount", TestPackLazyMount },
+		{ "Pack routes", TestPackRoutes },
+		{ "Startup set", TestStartupSet },
+		{ "Missing files", TestMissingFiles },
+		{ "Access trace", TestAccessTrace },
+	};
+
+	auto passed = true;
+	for (const auto& test : tests)
+	{
+		RemoveTestFiles();
+		auto result = test.second(vfs, key);
+		vfs->Log(result ? 0 : 1, "Round trip test: %s %s", test.first, result ? "passed" : "FAILED");
+		passed &= result;
+	}
+
+	// The files of a failed test are kept for inspection
+	if (passed)
+		RemoveTestFiles();
+	return passed;
+}
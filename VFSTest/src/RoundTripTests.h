@@ -0,0 +1,8 @@
+#pragma once
+#include <cstdint>
+
+#include "../../VFSLib/include/VFSPack.h"
+
+// Writes archives of generated content, reloads them and checks every entry reads back as written.
+// Archive files are created in the working directory as rt_*, removed again unless a test failed.
+bool RunRoundTripTests(VFS::CVFSPack * vfs, const uint8_t * key);
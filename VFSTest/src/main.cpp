@@ -20,9 +20,11 @@ using json = nlohmann::json;
 #include "../../VFSLib/include/VFSPack.h"
 using namespace VFS;
 
+#include "RoundTripTests.h"
+
 void CheckSpecificFileIntegrity(CVFSPack * vfs, std::shared_ptr <CVFSArchive> archive, const SFileInformation& file, const std::wstring& targetdir)
 {
-    vfs->Log(0, "PACKED | %ls - %p - %u - %u -- Raw: %u Compressed: %u Crypted(Final): %u",
+    vfs->Log(0, "PACKED | %ls - %p - %u - %u -- Raw: %llu Compressed: %llu Crypted(Final): %llu",
         file.filename, file.hash, file.version, file.flags, file.rawsize, file.compressedsize, file.cryptedsize);
 
 	auto target = targetdir + L"\\" + file.filename;
@@ -205,6 +207,12 @@ int main(int argc, char* argv[])
 	auto targetunpackdir = L"test_unpacked";
 	auto key = vfs->ConvertKeyFromAscii("0000000000000000000000000000000000000000000000000000000000000001");
 
+	if (RunRoundTripTests(vfs, key.data()) == false)
+	{
+		vfs->Log(1, "Round trip tests failed!");
+		return EXIT_FAILURE;
+	}
+
 	if (CreateTestArchive(vfs, targetpack, key.data(), targetdir, L"", 1, 3) == false)
 	{
 		vfs->Log(1, "Target archive can NOT created!");